@@ -20,8 +20,6 @@
 #ifndef MK_CACHE_TLS_H
 #define MK_CACHE_TLS_H
 
-__thread mk_ptr_t *mk_tls_cache_header_cl;
-__thread mk_ptr_t *mk_tls_cache_header_lm;
 __thread struct tm *mk_tls_cache_gmtime;
 __thread struct mk_gmt_cache *mk_tls_cache_gmtext;
 
@@ -23,24 +23,57 @@
 #define MK_CLOCK_H
 
 #include <time.h>
+#include <stdint.h>
 #include <monkey/mk_core.h>
 
-extern time_t log_current_utime;
-extern time_t monkey_init_time;
-
-extern mk_ptr_t log_current_time;
-extern mk_ptr_t headers_preset;
-
-pthread_t mk_clock_tid;
-
 #define MK_CLOCK_GMT_DATEFORMAT "Date: %a, %d %b %Y %H:%M:%S GMT\r\n"
 #define HEADER_PRESET_SIZE 128
 #define HEADER_TIME_BUFFER_SIZE 64
 #define LOG_TIME_BUFFER_SIZE 30
 
-void *mk_clock_worker_init(void *args);
-void mk_clock_set_time(void);
+/*
+ * Clock
+ * -----
+ * There is no clock thread: each worker reads the clock once per event
+ * loop wakeup and keeps the result in its own cache, along with the
+ * Server/Date header rows and the log time string, rendered once per
+ * second. Hot paths get the time from that cache without any call.
+ *
+ * The last time read by a worker is also published through a seqlock,
+ * threads that are not workers (plugins, logger) read that copy. When all
+ * the workers are idle it's refreshed at least once per Timeout interval.
+ *
+ * By default the coarse system clocks are used, they are read without a
+ * system call and have a resolution of a few milliseconds. ClockMsec
+ * switches to the precise ones for latency logging and timeouts.
+ */
+
+struct mk_clock_time {
+    time_t   wall;                 /* wall clock, seconds      */
+    uint64_t wall_ms;              /* wall clock, milliseconds */
+    uint64_t mono_ms;              /* monotonic, milliseconds  */
+};
+
+struct mk_clock_cache {
+    struct mk_clock_time now;
+    int idx;                       /* buffers in use, flipped every second */
+    mk_ptr_t headers_preset;       /* Server and Date rows */
+    mk_ptr_t log_time;
+    char preset_buf[2][HEADER_PRESET_SIZE];
+    char log_buf[2][LOG_TIME_BUFFER_SIZE];
+};
+
+extern time_t monkey_init_time;
+
 void mk_clock_sequential_init();
-void mk_clock_exit();
+void mk_clock_worker_init();
+void mk_clock_worker_exit();
+void mk_clock_update();
+
+void mk_clock_get(struct mk_clock_time *t);
+time_t mk_clock_utime();
+uint64_t mk_clock_msec();
+mk_ptr_t *mk_clock_headers_preset();
+mk_ptr_t *mk_clock_log_time();
 
 #endif
@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_COMPRESS_H
+#define MK_COMPRESS_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_file_cache.h>
+
+/*
+ * Content compression
+ * -------------------
+ * Compressible files (text, javascript, json, xml) are served with the
+ * encoding negotiated through the Accept-Encoding header. A precompressed
+ * 'file.gz' sidecar is used when it exists and is not older than the
+ * original file; otherwise each worker compresses the file once and keeps
+ * the result in a bounded cache keyed by path, modification time and
+ * encoding.
+ *
+ * On-the-fly compression requires zlib (HAVE_ZLIB), sidecars are tracked
+ * through the file cache.
+ */
+
+#define MK_COMPRESS_NONE            0
+#define MK_COMPRESS_GZIP            1
+#define MK_COMPRESS_DEFLATE         2
+
+#define MK_COMPRESS_CACHE        1024     /* default cache per worker, KB */
+#define MK_COMPRESS_LEVEL           6     /* zlib compression level       */
+#define MK_COMPRESS_MIN_SIZE      256     /* smaller files are sent as is */
+#define MK_COMPRESS_MAX_SIZE   131072     /* larger files are sent as is  */
+#define MK_COMPRESS_BUCKETS       128     /* hash table size, power of 2  */
+
+struct mk_compress_entry {
+    unsigned int hash;
+    int refs;                      /* requests using the entry          */
+    int stale;                     /* unlinked, free once refs hit zero */
+    int encoding;
+
+    time_t mtime;                  /* original file modification time */
+    size_t size;                   /* original file size              */
+
+    char *data;                    /* NULL if the file does not shrink */
+    size_t len;
+
+    struct mk_list _head;          /* link to hash bucket */
+    struct mk_list _lru;           /* link to LRU list    */
+
+    int path_len;
+    char path[];
+};
+
+struct mk_compress_cache {
+    size_t size;                   /* max bytes of compressed data */
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+    struct mk_list lru;            /* least recently used first */
+    struct mk_list table[MK_COMPRESS_BUCKETS];
+};
+
+/* Content-Encoding values, indexed by MK_COMPRESS_* */
+extern const mk_ptr_t mk_compress_names[];
+
+void mk_compress_worker_init();
+void mk_compress_worker_exit();
+
+int mk_compress_mime(const char *type);
+int mk_compress_accept(mk_ptr_t *accept_encoding);
+int mk_compress_etag(char *buf, struct file_info *info, int encoding);
+
+struct mk_file_cache_entry *mk_compress_static(struct mk_file_cache_entry *fc);
+
+struct mk_compress_entry *mk_compress_get(mk_ptr_t *path,
+                                          struct file_info *info,
+                                          int encoding);
+struct mk_compress_entry *mk_compress_add(mk_ptr_t *path,
+                                          struct file_info *info,
+                                          int encoding, char *content);
+void mk_compress_put(struct mk_compress_entry *ce);
+
+#endif
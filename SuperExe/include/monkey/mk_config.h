@@ -62,9 +62,11 @@ struct mk_server_config
     short int manual_tcp_cork;    /* If enabled it will handle TCP_CORK */
 
     int8_t fdt;                   /* is FDT enabled ? */
+    int fdt_capacity;             /* max open files on each worker FDT */
     int8_t is_daemon;
     int8_t is_seteuid;
     int8_t scheduler_mode;        /* Scheduler balancing mode */
+    int8_t clock_msec;            /* precise clock sources */
 
     char *serverconf;             /* path to configuration files */
     mk_ptr_t server_software;
@@ -91,6 +93,15 @@ struct mk_server_config
     int8_t resume;                /* Resume (on/off) */
     int8_t symlink;               /* symbolic links */
 
+    /* file cache */
+    int file_cache;             /* max entries per worker, 0 = off */
+    int file_cache_ttl;         /* seconds before revalidation */
+
+    /* content compression */
+    int8_t compression;           /* compress files on the fly */
+    int8_t compression_static;    /* serve precompressed .gz files */
+    int compression_cache;      /* KB of compressed data per worker */
+
     /* keep alive */
     int8_t keep_alive;            /* it's a persisten connection ? */
     int max_keep_alive_request; /* max persistent connections to allow */
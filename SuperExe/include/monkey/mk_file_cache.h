@@ -0,0 +1,93 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FILE_CACHE_H
+#define MK_FILE_CACHE_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_mimetype.h>
+#include <monkey/mk_http_internal.h>
+
+/*
+ * File cache
+ * ----------
+ * Each worker keeps the metadata of the most requested static files: the
+ * stat(2) result, an open file descriptor, the mimetype and the ETag and
+ * Last-Modified values already rendered. Files up to
+ * MK_FILE_CACHE_CONTENT_MAX bytes also keep their content in memory so
+ * they can be served without touching the file system; for them the
+ * static part of a 200 response (Last-Modified, Content-Type, ETag,
+ * Content-Length and the final CRLF) is also serialized once, so the
+ * headers only need the status, Date and Connection lines per request.
+ *
+ * Entries are revalidated with a stat(2) once their TTL expires; if the
+ * size or modification time changed the entry is dropped.
+ */
+
+#define MK_FILE_CACHE_ENTRIES       256     /* default entries per worker  */
+#define MK_FILE_CACHE_TTL             5     /* default TTL in seconds      */
+#define MK_FILE_CACHE_BUCKETS       512     /* hash table size, power of 2 */
+#define MK_FILE_CACHE_CONTENT_MAX  16384    /* max in-memory file content  */
+#define MK_FILE_CACHE_LM_SIZE        32     /* Last-Modified text buffer   */
+
+struct mk_file_cache_entry {
+    unsigned int hash;
+    int refs;                      /* requests using the entry          */
+    int stale;                     /* unlinked, free once refs hit zero */
+    int fd;                        /* open fd or -1 if content is set   */
+    time_t expire;                 /* revalidate after this time        */
+
+    struct file_info info;
+    struct mimetype *mime;
+
+    int etag_len;
+    char etag[MK_HEADER_ETAG_SIZE];
+    int lm_len;
+    char lm[MK_FILE_CACHE_LM_SIZE];
+
+    char *content;                 /* small files only */
+    mk_ptr_t rows;                 /* prebuilt 200 header rows, idem */
+    int gz_static;                 /* .gz sidecar: -1 unknown, 0/1 */
+
+    struct mk_list _head;          /* link to hash bucket */
+    struct mk_list _lru;           /* link to LRU list    */
+
+    int path_len;
+    char path[];
+};
+
+struct mk_file_cache {
+    int size;                      /* max number of entries */
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+    struct mk_list lru;            /* least recently used first */
+    struct mk_list table[MK_FILE_CACHE_BUCKETS];
+};
+
+void mk_file_cache_worker_init();
+void mk_file_cache_worker_exit();
+
+struct mk_file_cache_entry *mk_file_cache_get(mk_ptr_t *path);
+struct mk_file_cache_entry *mk_file_cache_add(mk_ptr_t *path,
+                                              struct file_info *info,
+                                              struct mimetype *mime);
+void mk_file_cache_put(struct mk_file_cache_entry *fc);
+
+#endif
@@ -88,6 +88,48 @@ struct header_status_response {
 
 #define MK_HEADER_TE_TYPE_CHUNKED 0
 
+/*
+ * Header templates
+ * ----------------
+ * The rows of a response that only depend on the status, the connection
+ * mode, the content type and the encodings are serialized once per worker
+ * in a contiguous block:
+ *
+ *   status line, Connection, Content-Type, Transfer-Encoding,
+ *   Content-Encoding, Vary and the "Content-Length: " prefix
+ *
+ * so a response is sent with the template, the length value, the preset
+ * Server/Date rows and whatever few fields are specific to the request.
+ * Templates are never evicted: a response may still reference one in the
+ * channel. Once the table is full, new combinations are serialized per
+ * request.
+ */
+#define MK_HEADER_TPL_BUCKETS     64    /* hash table size, power of 2 */
+#define MK_HEADER_TPL_MAX        256    /* max templates per worker    */
+
+/* Template flags */
+#define MK_HEADER_TPL_CONN_KA      1
+#define MK_HEADER_TPL_CONN_CLOSE   2
+#define MK_HEADER_TPL_CHUNKED      4
+#define MK_HEADER_TPL_VARY         8
+#define MK_HEADER_TPL_LENGTH      16
+
+struct mk_header_tpl {
+    unsigned int hash;
+    int status;
+    int flags;
+    mk_ptr_t content_type;         /* key, points into 'block'     */
+    mk_ptr_t content_encoding;     /* idem                         */
+    mk_ptr_t block;                /* serialized rows              */
+    struct mk_list _head;          /* link to hash bucket          */
+    char buf[];
+};
+
+struct mk_header_tpl_cache {
+    int count;
+    struct mk_list table[MK_HEADER_TPL_BUCKETS];
+};
+
 extern const mk_ptr_t mk_header_short_date;
 extern const mk_ptr_t mk_header_short_location;
 extern const mk_ptr_t mk_header_short_ct;
@@ -101,6 +143,9 @@ extern const mk_ptr_t mk_header_accept_ranges;
 extern const mk_ptr_t mk_header_te_chunked;
 extern const mk_ptr_t mk_header_last_modified;
 
+void mk_header_worker_init();
+void mk_header_worker_exit();
+
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr);
 void mk_header_response_reset(struct response_headers *header);
 void mk_header_set_http_status(struct mk_http_request *sr, int status);
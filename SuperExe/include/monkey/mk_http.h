@@ -65,6 +65,7 @@
 #define MK_EXIT_ERROR       -1
 #define MK_EXIT_ABORT       -2
 #define MK_EXIT_PCONNECTION 24
+#define MK_EXIT_BODY_PENDING 25   /* handler needs the whole request body */
 
 /* Available methods */
 #define MK_HTTP_METHOD_AVAILABLE   \
@@ -124,6 +125,10 @@ struct mk_http_session
 
     unsigned int body_size;
     unsigned int body_length;
+    unsigned int body_offset;   /* start of the data not parsed yet */
+    int body_chained;           /* request body goes to the body_chain */
+    int body_paused;            /* no reads until the handler takes data */
+    struct mk_http_chunked chunked;  /* chunked request body decoder */
 
     /* red-black tree head */
     struct rb_node _rb_head;
@@ -141,13 +146,9 @@ struct mk_http_session
     char body_fixed[MK_REQUEST_CHUNK];
 
     /*
-     * FIXME: in previous versions of Monkey we used to parse the complete request
-     * for pipelined requests and generate a linked lists of request. With the new
-     * parser we are taking the approach to parse one request and process it before
-     * parsing others, from that point of view we should not need a linked list
-     * of requests.
-     *
-     * Still testing...
+     * First request of the session. Pipelined requests found in the same
+     * buffer are allocated and linked after it in request_list, their
+     * responses are enqueued in order and flushed together.
      */
     struct mk_http_request sr_fixed;
 
@@ -206,6 +207,10 @@ void mk_http_request_init(struct mk_http_session *session,
 struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
                                           const char *key, unsigned int len);
 int mk_http_request_end(struct mk_http_session *cs);
+int mk_http_request_done(struct mk_http_session *cs);
+void mk_http_body_release(struct mk_http_session *cs,
+                          struct mk_http_request *sr,
+                          struct mk_http_body_segment *seg);
 
 #define mk_http_session_get(conn)               \
     (struct mk_http_session *)                  \
@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP_BUFFER_H
+#define MK_HTTP_BUFFER_H
+
+#include <monkey/mk_core.h>
+
+/*
+ * Request buffers
+ * ---------------
+ * A session starts receiving data in its fixed buffer, when a request does
+ * not fit, a bigger buffer is taken from the worker pool. Buffers are
+ * grouped in size classes of MK_HTTP_BUFFER_MIN << class bytes, each worker
+ * keeps a few idle buffers per class so keep-alive and pipelined sessions
+ * do not hit the allocator for every request.
+ *
+ * Request bodies bigger than MK_HTTP_BODY_CHAIN are not appended to the
+ * session buffer, they are received into a chain of fixed size segments
+ * linked to the request (sr->body_chain). In that case sr->data.data is
+ * NULL and sr->data.len is the body length. Chunked request bodies are
+ * always decoded into a chain.
+ */
+
+#define MK_HTTP_BUFFER_MIN       8192     /* smallest size class          */
+#define MK_HTTP_BUFFER_CLASSES      6     /* 8K, 16K, 32K, 64K, 128K, 256K */
+#define MK_HTTP_BUFFER_POOL         8     /* idle buffers per class       */
+
+#define MK_HTTP_BODY_CHAIN      16384     /* chain bodies bigger than this */
+#define MK_HTTP_BODY_SEGMENT    32768     /* segment size class            */
+#define MK_HTTP_BODY_WINDOW    131072     /* streamed bytes not released   */
+
+/* Chunked transfer coding decoder states */
+enum {
+    MK_HTTP_CHUNKED_SIZE = 0,             /* chunk size digits             */
+    MK_HTTP_CHUNKED_EXT,                  /* chunk extension, up to LF     */
+    MK_HTTP_CHUNKED_DATA,                 /* chunk data                    */
+    MK_HTTP_CHUNKED_DATA_CR,              /* CRLF after the chunk data     */
+    MK_HTTP_CHUNKED_DATA_LF,
+    MK_HTTP_CHUNKED_TRAILER,              /* start of a trailer line       */
+    MK_HTTP_CHUNKED_TRAILER_LINE,
+    MK_HTTP_CHUNKED_END_LF,               /* LF of the last empty line     */
+    MK_HTTP_CHUNKED_DONE
+};
+
+struct mk_http_chunked {
+    int state;
+    int digits;                           /* size digits found             */
+    long left;                            /* bytes left of the chunk       */
+};
+
+struct mk_http_buffer_pool {
+    int count[MK_HTTP_BUFFER_CLASSES];
+    struct mk_list idle[MK_HTTP_BUFFER_CLASSES];
+};
+
+/* A piece of a request body, allocated from a pool size class */
+struct mk_http_body_segment {
+    unsigned int size;             /* room for data   */
+    unsigned int length;           /* bytes received  */
+    struct mk_list _head;          /* sr->body_chain  */
+    char data[];
+};
+
+void mk_http_buffer_worker_init();
+void mk_http_buffer_worker_exit();
+
+char *mk_http_buffer_get(unsigned int *size);
+void mk_http_buffer_put(char *buf, unsigned int size);
+
+struct mk_http_body_segment *mk_http_body_segment_get();
+void mk_http_body_segment_put(struct mk_http_body_segment *seg);
+int mk_http_body_append(struct mk_list *chain, char *data, int len);
+void mk_http_body_free(struct mk_list *chain);
+
+int mk_http_body_dechunk(struct mk_http_chunked *ck, char *buf, int len,
+                         struct mk_list *chain, unsigned long *out);
+
+#endif
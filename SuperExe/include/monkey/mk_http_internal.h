@@ -21,9 +21,16 @@
 #define MK_HTTP_INTERNAL_H
 
 #include <monkey/mk_stream.h>
+#include <monkey/mk_http_buffer.h>
 
 #define MK_HEADER_IOV         32
-#define MK_HEADER_ETAG_SIZE   32
+#define MK_HEADER_ETAG_SIZE   48
+#define MK_HEADER_LENGTH_SIZE 24    /* 20 digits, CRLF and NUL */
+#define MK_HEADER_DATE_SIZE   32
+
+struct mk_file_cache_entry;
+struct vhost_fdt_file;
+struct mk_compress_entry;
 
 struct response_headers
 {
@@ -53,14 +60,24 @@ struct response_headers
     int ranges[2];
 
     time_t last_modified;
+    mk_ptr_t last_modified_str;    /* pre-rendered value, if any */
+    mk_ptr_t static_rows;          /* prebuilt rows from the file cache */
     mk_ptr_t allow_methods;
     mk_ptr_t content_type;
     mk_ptr_t content_encoding;
+    int vary_encoding;             /* send 'Vary: Accept-Encoding' */
     char *location;
 
     int  etag_len;
     char etag_buf[MK_HEADER_ETAG_SIZE];
 
+    /*
+     * Rendered values, the IOV points to them until the response is sent
+     * and pipelined responses may wait together in the channel.
+     */
+    char length_buf[MK_HEADER_LENGTH_SIZE];
+    char last_modified_buf[MK_HEADER_DATE_SIZE];
+
     /*
      * This field allow plugins to add their own response
      * headers
@@ -81,6 +98,9 @@ struct mk_http_request
     int status;
     int protocol;
 
+    /* arrival time, monotonic msec (mk_clock.c) */
+    uint64_t init_msec;
+
     /* is it serving a user's home directory ? */
     int user_home;
 
@@ -118,11 +138,25 @@ struct mk_http_request
     mk_ptr_t if_modified_since;
     mk_ptr_t last_modified_since;
     mk_ptr_t range;
+    mk_ptr_t accept_encoding;
 
     /*---------------------*/
 
     /* POST/PUT data */
     mk_ptr_t data;
+
+    /* Large bodies: segments of mk_http_body_segment, data.data is NULL */
+    struct mk_list body_chain;
+
+    /*
+     * The request was prepared once its headers arrived, the body is still
+     * being received. If body_stream is set the stage30 handler takes the
+     * segments as they arrive (stage30_body), body_queued is the amount of
+     * bytes in the chain it did not release yet.
+     */
+    int body_pending;
+    int body_stream;
+    unsigned long body_queued;
     /*-----------------*/
 
     /*-Internal-*/
@@ -157,13 +191,19 @@ struct mk_http_request
      */
     void *stage30_handler;
 
+    /* The stage30_handler still serves the request (MK_PLUGIN_RET_CONTINUE) */
+    int stage30_pending;
+
     /* Static file information */
     struct file_info file_info;
+    struct mk_file_cache_entry *file_cache;
+
+    /* Encoded representation: precompressed sidecar or compressed copy */
+    struct mk_file_cache_entry *file_cache_gz;
+    struct mk_compress_entry *compress;
 
     /* Vhost */
-    int vhost_fdt_id;
-    unsigned int vhost_fdt_hash;
-    int vhost_fdt_enabled;
+    struct vhost_fdt_file *vhost_fdt;
 
     struct host       *host_conf;     /* root vhost config */
     struct host_alias *host_alias;    /* specific vhost matched */
@@ -111,6 +111,7 @@ enum mk_request_headers {
     MK_HEADER_LAST_MODIFIED_SINCE   ,
     MK_HEADER_RANGE                 ,
     MK_HEADER_REFERER               ,
+    MK_HEADER_TRANSFER_ENCODING     ,
     MK_HEADER_UPGRADE               ,
     MK_HEADER_USER_AGENT            ,
     MK_HEADER_SIZEOF                ,
@@ -126,6 +127,7 @@ enum mk_request_headers {
 #define MK_CONN_KEEP_ALIVE     "keep-alive"
 #define MK_CONN_CLOSE          "close"
 #define MK_CONN_UPGRADE        "upgrade"
+#define MK_TE_CHUNKED          "chunked"
 
 struct mk_http_header {
     /* The header type/name, e.g: MK_HEADER_CONTENT_LENGTH */
@@ -164,6 +166,9 @@ struct mk_http_parser {
     long int                   body_received;
     long int                   header_content_length;
 
+    /* Transfer-Encoding: chunked request body */
+    int                        header_chunked;
+
     /*
      * connection header value discovered: it can be set with
      * values:
@@ -179,8 +184,6 @@ struct mk_http_parser {
     int                        header_key;
     int                        header_sep;
     int                        header_val;
-    int                        header_min;
-    int                        header_max;
     int                        headers_extra_count;
 
     /* Known headers */
@@ -306,8 +309,6 @@ static inline void mk_http_parser_init(struct mk_http_parser *p)
     p->header_key = -1;
     p->header_sep = -1;
     p->header_val = -1;
-    p->header_min = -1;
-    p->header_max = -1;
     p->header_content_length = -1;
 
     /* init list header */
@@ -327,5 +328,6 @@ static inline int mk_http_parser_more(struct mk_http_parser *p, int len)
 
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int len);
+int mk_http_parser_header_type(char *key, int len);
 
 #endif /* MK_HTTP_H */
@@ -30,6 +30,7 @@ struct mimetype
     char *name;
     mk_ptr_t type;
     mk_ptr_t header_type;
+    int compress;               /* worth compressing, see mk_compress.c */
     struct mk_list _head;
     struct rb_node _rb_head;
 };
@@ -108,6 +108,8 @@ struct plugin_api
     /* HTTP request function */
     int   (*http_request_end) (struct mk_http_session *cs, int close);
     int   (*http_request_error) (int, struct mk_http_session *, struct mk_http_request *);
+    void  (*http_body_release) (struct mk_http_session *, struct mk_http_request *,
+                                struct mk_http_body_segment *);
 
     /* memory functions */
     void *(*mem_alloc) (const size_t size);
@@ -118,6 +120,15 @@ struct plugin_api
     void  (*pointer_print) (mk_ptr_t);
     char *(*pointer_to_buf) (mk_ptr_t);
 
+    /* object pools */
+    struct mk_pool *(*pool_create) (size_t, int);
+    void  (*pool_destroy) (struct mk_pool *);
+    void *(*pool_get) (struct mk_pool *);
+    void *(*pool_alloc) (size_t);
+    void  (*pool_put) (void *);
+    void  (*pool_stats) (struct mk_pool *, struct mk_pool_stats *);
+    int   (*worker_pool_stats) (int, struct mk_pool_stats *);
+
     /* string functions */
     int   (*str_itop) (uint64_t, mk_ptr_t *);
     int   (*str_search) (const char *, const char *, int);
@@ -148,15 +159,17 @@ struct plugin_api
                                 void (*) (struct mk_stream *),
                                 void (*) (struct mk_stream *, long),
                                 void (*) (struct mk_stream *, int));
+    void (*stream_free) (struct mk_stream *);
     struct mk_channel *(*channel_new) (int, int);
+    void (*channel_free) (struct mk_channel *);
     int (*channel_flush) (struct mk_channel *);
     int (*channel_write) (struct mk_channel *, size_t *);
     void (*channel_append_stream) (struct mk_channel *, struct mk_stream *stream);
-    void (*stream_set) (struct mk_stream *, int, struct mk_channel *, void *, size_t,
-                        void *,
-                        void (*) (struct mk_stream *),
-                        void (*) (struct mk_stream *, long),
-                        void (*) (struct mk_stream *, int));
+    int (*stream_set) (struct mk_stream *, int, struct mk_channel *, void *, size_t,
+                       void *,
+                       void (*) (struct mk_stream *),
+                       void (*) (struct mk_stream *, long),
+                       void (*) (struct mk_stream *, int));
 
     /* iov functions */
     struct mk_iov *(*iov_create) (int, int);
@@ -170,6 +183,8 @@ struct plugin_api
 
     /* plugin functions */
     void *(*plugin_load_symbol) (void *, const char *);
+    struct mk_plugin *(*plugin_lookup) (char *);
+    struct mk_plugin *(*plugin_cap) (char, struct mk_server_config *);
 
     /* core events mechanism */
     struct mk_event_loop *(*ev_loop_create) (int);
@@ -219,6 +234,7 @@ struct plugin_api
     int (*time_unix) ();
     int (*time_to_gmt) (char **, time_t);
     mk_ptr_t *(*time_human) ();
+    uint64_t (*time_msec) ();
 
 #ifdef TRACE
     void (*trace)(const char *, int, const char *, char *, int, const char *, ...);
@@ -288,6 +304,15 @@ struct mk_plugin_stage {
                     struct mk_http_request *, int, struct mk_list *);
     int (*stage30_hangup) (struct mk_plugin *, struct mk_http_session *,
                            struct mk_http_request *);
+
+    /*
+     * Optional: the handler accepts requests whose body is still being
+     * received (sr->body_pending). It's invoked every time new data is
+     * linked to sr->body_chain and once the body is complete, segments
+     * must be given back through http_body_release().
+     */
+    int (*stage30_body) (struct mk_plugin *, struct mk_http_session *,
+                         struct mk_http_request *);
     int (*stage40) (struct mk_http_session *, struct mk_http_request *);
     int (*stage50) (int);
 
@@ -350,6 +375,7 @@ int mk_plugin_header_get(struct mk_http_request *sr,
 struct mk_sched_worker *mk_plugin_sched_get_thread_conf();
 struct mk_plugin *mk_plugin_cap(char cap, struct mk_server_config *config);
 struct mk_plugin *mk_plugin_lookup(char *shortname);
+void mk_plugin_registry_init();
 
 void mk_plugin_load_static();
 struct mk_handler_param *mk_handler_param_get(int id, struct mk_list *params);
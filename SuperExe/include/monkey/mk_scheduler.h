@@ -107,6 +107,7 @@ struct mk_sched_conn
     uint32_t properties;
     char is_timeout_on;                /* registered to timeout queue? */
     time_t arrive_time;                /* arrive time                  */
+    union mk_sockaddr peer;            /* remote address               */
     struct mk_sched_handler *protocol; /* protocol handler             */
     struct mk_server_listen *server_listen;
     struct mk_plugin_network *net;     /* I/O network layer            */
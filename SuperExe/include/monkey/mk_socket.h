@@ -73,18 +73,23 @@ int mk_socket_server(char *port, char *listen_addr,
 int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len);
 
 
-static inline int mk_socket_accept(int server_fd)
+/* Remote address of a connection */
+union mk_sockaddr {
+    struct sockaddr     sa;
+    struct sockaddr_in  in4;
+    struct sockaddr_in6 in6;
+};
+
+static inline int mk_socket_accept(int server_fd, union mk_sockaddr *addr)
 {
     int remote_fd;
-
-    struct sockaddr sock_addr;
-    socklen_t socket_size = sizeof(struct sockaddr);
+    socklen_t socket_size = sizeof(union mk_sockaddr);
 
 #ifdef WITH_ACCEPT4
-    remote_fd = accept4(server_fd, &sock_addr, &socket_size,
+    remote_fd = accept4(server_fd, &addr->sa, &socket_size,
                         SOCK_NONBLOCK | SOCK_CLOEXEC);
 #else
-    remote_fd = accept(server_fd, &sock_addr, &socket_size);
+    remote_fd = accept(server_fd, &addr->sa, &socket_size);
     mk_socket_set_nonblocking(remote_fd);
 #endif
 
@@ -20,6 +20,7 @@
 #ifndef MK_STREAM_H
 #define MK_STREAM_H
 
+#include <limits.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_plugin_net.h>
 
@@ -28,13 +29,44 @@
  * source of information and for hence it handler
  * may need to be different for each cases.
  */
-#define MK_STREAM_RAW       0  /* raw data from buffer */
+#define MK_STREAM_RAW       0  /* raw data from buffer, no copy */
 #define MK_STREAM_IOV       1  /* mk_iov struct        */
 #define MK_STREAM_FILE      2  /* opened file          */
 #define MK_STREAM_SOCKET    3  /* socket, scared..     */
-#define MK_STREAM_COPYBUF   4  /* raw data, copy data into a dynamic buffer */
+#define MK_STREAM_COPYBUF   4  /* raw data, copy data into a buffer segment */
 #define MK_STREAM_EOF       5  /* end of stream, trigger callback */
 
+/*
+ * Stream encoding: OR'ed with the stream type, the data is sent as one
+ * chunk of a 'Transfer-Encoding: chunked' response body. The chunk header
+ * and trailer are linked around the stream so they are written together
+ * with the data, a stream with no data is the last chunk, e.g:
+ *
+ *   stream_set(NULL, MK_STREAM_COPYBUF | MK_STREAM_CHUNKED, ...);
+ *   stream_set(NULL, MK_STREAM_RAW | MK_STREAM_CHUNKED, ch, NULL, 0, ...);
+ */
+#define MK_STREAM_CHUNKED   256
+
+/*
+ * COPYBUF buffer segments: the data of a COPYBUF stream is copied into a
+ * segment. Segments of the default size are recycled through a per-worker
+ * pool, bigger payloads get a segment of their own size that is released
+ * once the stream is consumed.
+ */
+#define MK_STREAM_SEGMENT_SIZE  4096  /* default segment size        */
+#define MK_STREAM_SEGMENT_POOL    64  /* idle segments kept per worker */
+
+/*
+ * Object pools: dynamic streams, channels and small IOVs are taken from
+ * per-worker slab pools (see mk_core/mk_pool.h), IOVs requesting more than
+ * MK_STREAM_IOV_ENTRIES entries are allocated from the heap.
+ */
+#define MK_STREAM_POOL_STREAM    0
+#define MK_STREAM_POOL_CHANNEL   1
+#define MK_STREAM_POOL_IOV       2
+#define MK_STREAM_POOL_SLAB     32    /* objects per slab           */
+#define MK_STREAM_IOV_ENTRIES   64    /* entries of a pooled IOV    */
+
 /* Channel return values for write event */
 #define MK_CHANNEL_DONE     1  /* channel consumed all streams */
 #define MK_CHANNEL_ERROR    2  /* exception when flusing data  */
@@ -47,6 +79,16 @@
 #define MK_CHANNEL_DISABLED 0 /* channel is sleeping */
 #define MK_CHANNEL_ENABLED  1 /* channel enabled, have some data */
 
+/*
+ * Max number of iovec entries a channel can gather from consecutive
+ * buffer streams (IOV, RAW and COPYBUF) into a single writev(2) call.
+ */
+#ifdef IOV_MAX
+#define MK_CHANNEL_IOV_MAX  IOV_MAX
+#else
+#define MK_CHANNEL_IOV_MAX  1024
+#endif
+
 /*
  * Channel types: by default the only channel supported
  * is a direct write to the network layer.
@@ -67,6 +109,28 @@ struct mk_channel {
     struct mk_list streams;
 };
 
+/*
+ * A buffer segment holding the data of a COPYBUF stream. The pending data
+ * lives at (data + stream->bytes_offset) and new data can be appended at
+ * (data + length) while there is room, so partial writes never move memory.
+ */
+struct mk_stream_segment {
+    size_t size;                   /* segment capacity        */
+    size_t length;                 /* bytes stored            */
+    struct mk_list _head;          /* link to the worker pool */
+    char data[];
+};
+
+/* Per-worker pools: idle COPYBUF segments and object slabs */
+struct mk_stream_pool {
+    int count;
+    struct mk_list segments;
+
+    struct mk_pool *streams;
+    struct mk_pool *channels;
+    struct mk_pool *iovs;
+};
+
 /*
  * A stream represents an Input of data that can be consumed
  * from a specific resource given it's type.
@@ -86,8 +150,8 @@ struct mk_stream {
     struct mk_channel *channel;
 
     /*
-     * Based on the stream type, 'data' could reference a RAW buffer
-     * or a mk_iov struct.
+     * Based on the stream type, 'buffer' could reference a RAW buffer,
+     * a mk_iov struct or a struct mk_stream_segment (COPYBUF).
      */
     void *buffer;
 
@@ -97,7 +161,7 @@ struct mk_stream {
     /* callbacks */
     void (*cb_finished) (struct mk_stream *);
     void (*cb_bytes_consumed) (struct mk_stream *, long);
-    void (*cb_exception) (struct mk_stream *, int);
+    void (*cb_exception) (struct mk_stream *, int);  /* dropped, errno */
 
     /* Link to the Channel parent */
     struct mk_list _head;
@@ -115,61 +179,6 @@ static inline void mk_channel_append_stream(struct mk_channel *channel,
     mk_list_add(&stream->_head, &channel->streams);
 }
 
-static inline void mk_stream_set(struct mk_stream *stream,
-                                 int type,
-                                 struct mk_channel *channel,
-                                 void *buffer,
-                                 size_t size,
-                                 void *data,
-                                 void (*cb_finished) (struct mk_stream *),
-                                 void (*cb_bytes_consumed) (struct mk_stream *, long),
-                                 void (*cb_exception) (struct mk_stream *, int))
-{
-    struct mk_iov *iov;
-
-    /*
-     * The copybuf stream type it's a lazy stream mechanism on which the
-     * stream it self and the buffer are allocated dynamically. It just
-     * exists as an optional interface that do not care too much about
-     * performance and aim to make things easier. The COPYBUF type is not
-     * used by Monkey core, at the moment the only caller is the CGI plugin.
-     */
-    if (!stream) {
-        stream = mk_mem_malloc(sizeof(struct mk_stream));
-        stream->dynamic = MK_TRUE;
-    }
-    else {
-        stream->dynamic = MK_FALSE;
-    }
-
-    stream->type         = type;
-    stream->channel      = channel;
-    stream->bytes_offset = 0;
-    stream->buffer       = buffer;
-    stream->data         = data;
-    stream->preserve     = MK_FALSE;
-
-    if (type == MK_STREAM_IOV) {
-        iov = buffer;
-        stream->bytes_total = iov->total_len;
-    }
-    else if (type == MK_STREAM_COPYBUF) {
-        stream->buffer = mk_mem_malloc(size);
-        stream->bytes_total = size;
-        memcpy(stream->buffer, buffer, size);
-    }
-    else {
-        stream->bytes_total = size;
-    }
-
-    /* callbacks */
-    stream->cb_finished       = cb_finished;
-    stream->cb_bytes_consumed = cb_bytes_consumed;
-    stream->cb_exception      = cb_exception;
-
-    mk_list_add(&stream->_head, &channel->streams);
-}
-
 static inline void mk_stream_unlink(struct mk_stream *stream)
 {
     mk_list_del(&stream->_head);
@@ -245,7 +254,21 @@ struct mk_stream *mk_stream_new(int type, struct mk_channel *channel,
                                 void (*cb_finished) (struct mk_stream *),
                                 void (*cb_bytes_consumed) (struct mk_stream *, long),
                                 void (*cb_exception) (struct mk_stream *, int));
+void mk_stream_free(struct mk_stream *stream);
 struct mk_channel *mk_channel_new(int type, int fd);
+void mk_channel_free(struct mk_channel *channel);
+struct mk_iov *mk_stream_iov_create(int n, int offset);
+int mk_stream_pool_stats(int type, struct mk_pool_stats *stats);
+int mk_stream_set(struct mk_stream *stream, int type,
+                  struct mk_channel *channel,
+                  void *buffer, size_t size, void *data,
+                  void (*cb_finished) (struct mk_stream *),
+                  void (*cb_bytes_consumed) (struct mk_stream *, long),
+                  void (*cb_exception) (struct mk_stream *, int));
+int mk_stream_release(struct mk_stream *stream);
+
+void mk_stream_worker_init();
+void mk_stream_worker_exit();
 
 int mk_channel_flush(struct mk_channel *channel);
 int mk_channel_write(struct mk_channel *channel, size_t *count);
@@ -24,13 +24,30 @@
 
 /* mk_cache.c */
 extern __thread struct mk_iov *mk_tls_cache_iov_header;
-extern __thread mk_ptr_t *mk_tls_cache_header_cl;
-extern __thread mk_ptr_t *mk_tls_cache_header_lm;
 extern __thread struct tm *mk_tls_cache_gmtime;
 extern __thread struct mk_gmt_cache *mk_tls_cache_gmtext;
 
 /* mk_vhost.c */
-extern __thread struct mk_list *mk_tls_vhost_fdt;
+extern __thread struct vhost_fdt *mk_tls_vhost_fdt;
+extern __thread struct mk_handler_cache *mk_tls_vhost_handlers;
+
+/* mk_stream.c */
+extern __thread struct mk_stream_pool *mk_tls_stream_pool;
+
+/* mk_http_buffer.c */
+extern __thread struct mk_http_buffer_pool *mk_tls_http_buffers;
+
+/* mk_file_cache.c */
+extern __thread struct mk_file_cache *mk_tls_file_cache;
+
+/* mk_header.c */
+extern __thread struct mk_header_tpl_cache *mk_tls_header_tpl;
+
+/* mk_clock.c */
+extern __thread struct mk_clock_cache *mk_tls_clock;
+
+/* mk_compress.c */
+extern __thread struct mk_compress_cache *mk_tls_compress_cache;
 
 /* mk_scheduler.c */
 extern __thread struct rb_root *mk_tls_sched_cs;
@@ -53,13 +70,30 @@ extern __thread struct mk_server_timeout *mk_tls_server_timeout;
 
 /* mk_cache.c */
 pthread_key_t mk_tls_cache_iov_header;
-pthread_key_t mk_tls_cache_header_cl;
-pthread_key_t mk_tls_cache_header_lm;
 pthread_key_t mk_tls_cache_gmtime;
 pthread_key_t mk_tls_cache_gmtext;
 
 /* mk_vhost.c */
 pthread_key_t mk_tls_vhost_fdt;
+pthread_key_t mk_tls_vhost_handlers;
+
+/* mk_stream.c */
+pthread_key_t mk_tls_stream_pool;
+
+/* mk_http_buffer.c */
+pthread_key_t mk_tls_http_buffers;
+
+/* mk_file_cache.c */
+pthread_key_t mk_tls_file_cache;
+
+/* mk_header.c */
+pthread_key_t mk_tls_header_tpl;
+
+/* mk_clock.c */
+pthread_key_t mk_tls_clock;
+
+/* mk_compress.c */
+pthread_key_t mk_tls_compress_cache;
 
 /* mk_scheduler.c */
 pthread_key_t mk_tls_sched_cs;
@@ -76,13 +110,30 @@ pthread_key_t mk_tls_server_timeout;
 #define MK_TLS_INIT()                                           \
     /* mk_cache.c */                                            \
     pthread_key_create(&mk_tls_cache_iov_header, NULL);         \
-    pthread_key_create(&mk_tls_cache_header_cl, NULL);          \
-    pthread_key_create(&mk_tls_cache_header_lm, NULL);          \
     pthread_key_create(&mk_tls_cache_gmtime, NULL);             \
     pthread_key_create(&mk_tls_cache_gmtext, NULL);             \
                                                                 \
     /* mk_vhost.c */                                            \
     pthread_key_create(&mk_tls_vhost_fdt, NULL);                \
+    pthread_key_create(&mk_tls_vhost_handlers, NULL);           \
+                                                                \
+    /* mk_stream.c */                                           \
+    pthread_key_create(&mk_tls_stream_pool, NULL);              \
+                                                                \
+    /* mk_http_buffer.c */                                      \
+    pthread_key_create(&mk_tls_http_buffers, NULL);             \
+                                                                \
+    /* mk_file_cache.c */                                       \
+    pthread_key_create(&mk_tls_file_cache, NULL);               \
+                                                                \
+    /* mk_header.c */                                           \
+    pthread_key_create(&mk_tls_header_tpl, NULL);               \
+                                                                \
+    /* mk_clock.c */                                            \
+    pthread_key_create(&mk_tls_clock, NULL);                    \
+                                                                \
+    /* mk_compress.c */                                         \
+    pthread_key_create(&mk_tls_compress_cache, NULL);           \
                                                                 \
     /* mk_scheduler.c */                                        \
     pthread_key_create(&mk_tls_sched_cs, NULL);                 \
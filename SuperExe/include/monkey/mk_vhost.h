@@ -39,10 +39,29 @@ struct mk_handler_param {
     struct mk_list _head;
 };
 
+/*
+ * Handler match: patterns made of literal text with at most one '.*' in
+ * the middle and optional '^' and '$' anchors (e.g: '/cgi-bin/.*\.cgi')
+ * are compiled to plain case insensitive string tests, anything else is
+ * evaluated by regexec(3).
+ */
+#define MK_HANDLER_REGEX       0
+#define MK_HANDLER_LITERAL     1
+
 struct mk_host_handler {
-    /* we only support a regex match for now */
+    int type;                     /* MK_HANDLER_REGEX or _LITERAL */
+    int index;                    /* priority inside the virtual host */
+
+    /* MK_HANDLER_REGEX */
     regex_t match;
 
+    /* MK_HANDLER_LITERAL: [^]head[.*tail][$] */
+    int anchor_start;
+    int anchor_end;
+    int gap;
+    mk_ptr_t head;
+    mk_ptr_t tail;
+
     /* plugin handler */
     char *name;
 
@@ -54,6 +73,7 @@ struct mk_host_handler {
 
 struct host
 {
+    int id;                       /* index, used by per-worker tables */
     char *file;                   /* configuration file */
     struct mk_list server_names;  /* host names (a b c...) */
 
@@ -68,6 +88,8 @@ struct host
 
     /* content handlers */
     struct mk_list handlers;
+    int n_handlers;
+    struct mk_host_handler **handler_table;   /* by priority */
 
     /* link node */
     struct mk_list _head;
@@ -78,28 +100,91 @@ struct host_alias
     char *name;
     unsigned int len;
 
+    /* virtual host index */
+    unsigned int hash;
+    struct host *host;
+    struct mk_list _index;
+
     struct mk_list _head;
 };
 
+/*
+ * Virtual host index: server names are hashed case insensitive once all
+ * hosts are loaded. Names like '*.example.com' are kept in a second table
+ * keyed by the domain suffix, a lookup tries the suffixes of the requested
+ * name starting from the longest one. The index is rebuilt every time the
+ * hosts list is read.
+ */
+struct mk_vhost_index {
+    int size;                     /* buckets, power of 2 */
+    int wildcards;                /* number of '*.' names */
+    struct mk_list *table;        /* exact names */
+    struct mk_list *wild;         /* wildcard names by suffix */
+};
+
+
+/*
+ * Handler cache: each worker remembers which handler matched the most
+ * recent URIs of every virtual host, index -1 means none.
+ */
+#define MK_HANDLER_CACHE_SIZE    256      /* slots, power of 2  */
+#define MK_HANDLER_CACHE_URI     128      /* max URI length     */
+
+struct mk_handler_cache_slot {
+    struct host *host;
+    unsigned int hash;
+    int index;
+    int len;
+    char uri[MK_HANDLER_CACHE_URI];
+};
+
+struct mk_handler_cache {
+    unsigned long hits;
+    unsigned long misses;
+    struct mk_handler_cache_slot slots[MK_HANDLER_CACHE_SIZE];
+};
 
+/*
+ * File Descriptor Table (FDT): each worker shares the file descriptors of
+ * the files being served. Files are looked up by their full path, every
+ * virtual host has its own hash table indexed by the host id. When a file
+ * has no readers its descriptor is kept open in an idle list, once the
+ * table reach its capacity the least recently used idle file is reused.
+ */
 #define VHOST_FDT_HASHTABLE_SIZE   64
-#define VHOST_FDT_HASHTABLE_CHAINS  8
+#define VHOST_FDT_CAPACITY        128
 
-struct vhost_fdt_hash_chain {
+struct vhost_fdt_file {
     int fd;
     int readers;
+    int stale;                  /* changed on disk, unlinked */
     unsigned int hash;
-};
 
-struct vhost_fdt_hash_table {
-    int av_slots;
-    struct vhost_fdt_hash_chain chain[VHOST_FDT_HASHTABLE_CHAINS];
+    /* stat at open time */
+    size_t size;
+    time_t mtime;
+
+    int path_len;
+    char *path;
+
+    struct mk_list _head;       /* link to host hash table */
+    struct mk_list _lru;        /* link to idle list       */
 };
 
 struct vhost_fdt_host {
     struct host *host;
-    struct vhost_fdt_hash_table hash_table[VHOST_FDT_HASHTABLE_SIZE];
-    struct mk_list _head;
+    struct mk_list table[VHOST_FDT_HASHTABLE_SIZE];
+};
+
+struct vhost_fdt {
+    int capacity;               /* max number of open files */
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+    struct mk_list idle;        /* files without readers, LRU first */
+
+    int n_hosts;
+    struct vhost_fdt_host hosts[];
 };
 
 //pthread_key_t mk_vhost_fdt_key;
@@ -114,6 +199,12 @@ int mk_vhost_fdt_worker_exit();
 int mk_vhost_open(struct mk_http_request *sr);
 int mk_vhost_close(struct mk_http_request *sr);
 void mk_vhost_free_all();
+void mk_vhost_index_build();
 int mk_vhost_map_handlers();
+void mk_vhost_handler_worker_init();
+void mk_vhost_handler_worker_exit();
+struct mk_host_handler *mk_vhost_handler_match(struct host *host,
+                                               char *uri, int len,
+                                               struct mk_host_handler *prev);
 
 #endif
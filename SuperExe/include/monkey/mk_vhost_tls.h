@@ -22,7 +22,8 @@
 #ifndef MK_VHOST_TLS_H
 #define MK_VHOST_TLS_H
 
-__thread struct mk_list *mk_tls_vhost_fdt;
+__thread struct vhost_fdt *mk_tls_vhost_fdt;
+__thread struct mk_handler_cache *mk_tls_vhost_handlers;
 
 #endif
 #endif
@@ -0,0 +1,300 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * mklogcat: print the binary log files written by the logger plugin
+ * ('Format binary') as text lines or JSON objects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "binary.h"
+
+#define MKLOGCAT_TEXT   0
+#define MKLOGCAT_JSON   1
+
+struct mklogcat_file {
+    uint64_t wall_ms;
+    uint64_t mono_ms;
+    uint32_t hosts;
+    char **names;
+};
+
+static void mklogcat_help(int rc)
+{
+    printf("Usage : mklogcat [-j] [FILE]...\n\n");
+    printf("Print binary log files written by the logger plugin, the\n");
+    printf("standard input is read when no file is given.\n\n");
+    printf("  -j, --json\t\tone JSON object per record\n");
+    printf("  -h, --help\t\tprint this help\n\n");
+    exit(rc);
+}
+
+static void mklogcat_names_free(struct mklogcat_file *f)
+{
+    uint32_t i;
+
+    for (i = 0; i < f->hosts; i++) {
+        free(f->names[i]);
+    }
+    free(f->names);
+    f->names = NULL;
+    f->hosts = 0;
+}
+
+/* Read the header of a log file, the magic was already consumed */
+static int mklogcat_header(FILE *fp, struct mklogcat_file *f)
+{
+    uint32_t i;
+    struct mk_logger_bin_host name;
+    struct mk_logger_bin_header header;
+    size_t rest = sizeof(header) - sizeof(header.magic);
+
+    if (fread((char *) &header + sizeof(header.magic), 1, rest, fp) != rest) {
+        return -1;
+    }
+
+    mklogcat_names_free(f);
+    f->wall_ms = header.wall_ms;
+    f->mono_ms = header.mono_ms;
+    f->names   = calloc(header.hosts + 1, sizeof(char *));
+    if (!f->names) {
+        return -1;
+    }
+
+    for (i = 0; i < header.hosts; i++) {
+        if (fread(&name, sizeof(name), 1, fp) != 1) {
+            return -1;
+        }
+        f->names[i] = calloc(1, name.len + 1);
+        f->hosts++;
+        if (!f->names[i] || fread(f->names[i], 1, name.len, fp) != name.len) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void mklogcat_json_str(const char *s, size_t len)
+{
+    size_t i;
+    unsigned char c;
+
+    putchar('"');
+    for (i = 0; i < len; i++) {
+        c = s[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20) {
+            printf("\\u%04x", c);
+        }
+        else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void mklogcat_print(struct mklogcat_file *f,
+                           struct mk_logger_bin_record *rec,
+                           char *data, int format)
+{
+    time_t t;
+    uint64_t ms;
+    char date[64];
+    char ip[INET6_ADDRSTRLEN];
+    char *host = "";
+    char *method = data;
+    char *uri = data + rec->method_len;
+    const char *protocol = "-";
+    struct tm tm;
+
+    ms = f->wall_ms + (rec->mono_ms - f->mono_ms);
+    t = ms / 1000;
+    localtime_r(&t, &tm);
+
+    if (rec->family == AF_INET || rec->family == AF_INET6) {
+        inet_ntop(rec->family, rec->addr, ip, sizeof(ip));
+    }
+    else {
+        strcpy(ip, "-");
+    }
+
+    if (rec->protocol == 10) {
+        protocol = "HTTP/1.0";
+    }
+    else if (rec->protocol == 11) {
+        protocol = "HTTP/1.1";
+    }
+
+    if (rec->host < f->hosts) {
+        host = f->names[rec->host];
+    }
+
+    if (format == MKLOGCAT_JSON) {
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        printf("{\"time\": \"%s.%03u", date, (unsigned) (ms % 1000));
+        strftime(date, sizeof(date), "%z", &tm);
+        printf("%s\", \"host\": ", date);
+        mklogcat_json_str(host, strlen(host));
+        printf(", \"remote\": \"%s\", \"port\": %u, \"method\": ",
+               ip, ntohs(rec->port));
+        mklogcat_json_str(method, rec->method_len);
+        printf(", \"uri\": ");
+        mklogcat_json_str(uri, rec->uri_len);
+        printf(", \"protocol\": \"%s\", \"status\": %u, \"bytes\": %llu, "
+               "\"latency_ms\": %u}\n",
+               protocol, rec->status,
+               (unsigned long long) rec->bytes, rec->latency_ms);
+        return;
+    }
+
+    /* Same layout as the text access log */
+    strftime(date, sizeof(date), "[%d/%b/%G %T %z]", &tm);
+    printf("%s - %s %.*s %.*s %s %u ",
+           ip, date,
+           (int) rec->method_len, method,
+           (int) rec->uri_len, uri,
+           protocol, rec->status);
+    if (rec->method_len == 4 && strncmp(method, "HEAD", 4) == 0) {
+        printf("-\n");
+    }
+    else {
+        printf("%llu\n", (unsigned long long) rec->bytes);
+    }
+}
+
+static int mklogcat_file(FILE *fp, const char *path, int format)
+{
+    int ret = 0;
+    size_t len;
+    size_t size = 0;
+    char *data = NULL;
+    char *tmp;
+    struct mklogcat_file f;
+    struct mk_logger_bin_record rec;
+
+    memset(&f, 0, sizeof(f));
+
+    /*
+     * Records and headers are read by their first 8 bytes, a header can
+     * show up in the middle when rotated files are concatenated.
+     */
+    while (fread(&rec, 8, 1, fp) == 1) {
+        if (memcmp(&rec, MK_LOGGER_BIN_MAGIC, 8) == 0) {
+            if (mklogcat_header(fp, &f) == -1) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (!f.names || rec.size < sizeof(rec)) {
+            ret = -1;
+            break;
+        }
+
+        len = sizeof(rec) - 8;
+        if (fread((char *) &rec + 8, 1, len, fp) != len) {
+            ret = -1;
+            break;
+        }
+
+        len = rec.size - sizeof(rec);
+        if (len > size) {
+            tmp = realloc(data, len);
+            if (!tmp) {
+                ret = -1;
+                break;
+            }
+            data = tmp;
+            size = len;
+        }
+        if (len > 0 && fread(data, 1, len, fp) != len) {
+            ret = -1;
+            break;
+        }
+
+        mklogcat_print(&f, &rec, data, format);
+    }
+
+    if (ret == -1) {
+        fprintf(stderr, "mklogcat: %s: invalid or truncated log\n", path);
+    }
+
+    mklogcat_names_free(&f);
+    free(data);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int opt;
+    int ret = 0;
+    int format = MKLOGCAT_TEXT;
+    FILE *fp;
+
+    static const struct option long_opts[] = {
+        { "json", no_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "jh", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            format = MKLOGCAT_JSON;
+            break;
+        case 'h':
+            mklogcat_help(EXIT_SUCCESS);
+            break;
+        default:
+            mklogcat_help(EXIT_FAILURE);
+        }
+    }
+
+    if (optind == argc) {
+        return mklogcat_file(stdin, "stdin", format) == 0 ? 0 : 1;
+    }
+
+    for (i = optind; i < argc; i++) {
+        fp = fopen(argv[i], "r");
+        if (!fp) {
+            perror(argv[i]);
+            ret = 1;
+            continue;
+        }
+        if (mklogcat_file(fp, argv[i], format) != 0) {
+            ret = 1;
+        }
+        fclose(fp);
+    }
+
+    return ret;
+}
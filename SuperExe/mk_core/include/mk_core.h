@@ -27,6 +27,7 @@ extern gid_t EGID;
 extern gid_t EUID;
 
 #include <mk_core/mk_iov.h>
+#include <mk_core/mk_pool.h>
 #include <mk_core/mk_file.h>
 #include <mk_core/mk_event.h>
 #include <mk_core/mk_rbtree.h>
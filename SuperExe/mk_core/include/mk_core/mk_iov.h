@@ -37,6 +37,7 @@
 #define MK_IOV_EQUAL "="
 
 #include "mk_memory.h"
+#include "mk_pool.h"
 
 extern const mk_ptr_t mk_iov_crlf;
 extern const mk_ptr_t mk_iov_lf;
@@ -54,7 +55,13 @@ struct mk_iov {
     void **buf_to_free;
 };
 
+/* Size of an IOV block with 'n' entries */
+#define MK_IOV_SIZE(n)                                          \
+    (sizeof(struct mk_iov) + ((n) * sizeof(struct iovec)) +     \
+     ((n) * sizeof(void *)))
+
 struct mk_iov *mk_iov_create(int n, int offset);
+struct mk_iov *mk_iov_create_pool(struct mk_pool *pool, int offset);
 struct mk_iov *mk_iov_realloc(struct mk_iov *mk_io, int new_size);
 
 int mk_iov_add_separator(struct mk_iov *mk_io, mk_ptr_t sep);
@@ -0,0 +1,90 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_POOL_H
+#define MK_POOL_H
+
+#include <stdio.h>
+#include "mk_list.h"
+
+/*
+ * Object pool
+ * -----------
+ * A pool hands out fixed size objects carved from slabs. Released objects
+ * are kept in a free list and reused by the next request, slabs are only
+ * returned to the system when the pool is destroyed.
+ *
+ * A pool is not thread safe: it's meant to be owned by one worker and an
+ * object must be released from the same thread that got it.
+ */
+
+#define MK_POOL_SLAB_OBJS    32     /* default objects per slab */
+#define MK_POOL_ALIGN        16
+
+struct mk_pool {
+    size_t size;                /* object size requested by the owner */
+    size_t stride;              /* object size + header, aligned      */
+    int slab_objs;              /* objects allocated per slab         */
+
+    int used;                   /* objects handed out                 */
+    int available;              /* objects ready in the free list     */
+    int slabs;                  /* number of slabs                    */
+
+    unsigned long hits;         /* requests served from the free list */
+    unsigned long misses;       /* requests that required a new slab  */
+
+    struct mk_pool_obj *free;
+    struct mk_list slab_list;
+};
+
+/* Hidden header in front of every object */
+struct mk_pool_obj {
+    struct mk_pool *pool;       /* owner, NULL for heap objects */
+    struct mk_pool_obj *next;   /* next free object             */
+};
+
+#define MK_POOL_ROUND(n)    (((n) + MK_POOL_ALIGN - 1) & ~(MK_POOL_ALIGN - 1))
+#define MK_POOL_HDR_SIZE    MK_POOL_ROUND(sizeof(struct mk_pool_obj))
+
+struct mk_pool_stats {
+    int used;
+    int available;
+    int slabs;
+    unsigned long hits;
+    unsigned long misses;
+    int hit_rate;               /* percentage, 0 - 100 */
+};
+
+struct mk_pool *mk_pool_create(size_t size, int slab_objs);
+void mk_pool_destroy(struct mk_pool *pool);
+void *mk_pool_get(struct mk_pool *pool);
+void *mk_pool_alloc(size_t size);
+void mk_pool_put(void *obj);
+void mk_pool_stats(struct mk_pool *pool, struct mk_pool_stats *stats);
+
+/* Return the pool that owns the object, NULL if it came from the heap */
+static inline struct mk_pool *mk_pool_owner(void *obj)
+{
+    struct mk_pool_obj *h;
+
+    h = (struct mk_pool_obj *) ((char *) obj - MK_POOL_HDR_SIZE);
+    return h->pool;
+}
+
+#endif
@@ -86,7 +86,7 @@ int mk_event_add(struct mk_event_loop *loop, int fd,
 
     event = (struct mk_event *) data;
 
-    if ((event->status & MK_EVENT_NONE) == 0) {
+    if ((event->status & (MK_EVENT_NONE | MK_EVENT_REGISTERED)) == 0) {
         return -1;
     }
 
@@ -96,6 +96,7 @@ int mk_event_add(struct mk_event_loop *loop, int fd,
         return -1;
     }
 
+    event->status = MK_EVENT_REGISTERED;
     return 0;
 }
 
@@ -117,6 +118,8 @@ int mk_event_del(struct mk_event_loop *loop, struct mk_event *event)
         return -1;
     }
 
+    /* a later add registers the file descriptor again */
+    event->mask   = MK_EVENT_EMPTY;
     event->status = MK_EVENT_NONE;
     return 0;
 }
@@ -37,30 +37,54 @@ const mk_ptr_t mk_iov_slash = mk_ptr_init(MK_IOV_SLASH);
 const mk_ptr_t mk_iov_none = mk_ptr_init(MK_IOV_NONE);
 const mk_ptr_t mk_iov_equal = mk_ptr_init(MK_IOV_EQUAL);
 
+/* Set the internal references of an IOV allocated as a single block */
+static inline struct mk_iov *mk_iov_setup(void *p, int n, int offset)
+{
+    struct mk_iov *iov;
+
+    iov     = p;
+    iov->io = p + sizeof(struct mk_iov);
+    iov->buf_to_free = (void *) (p + sizeof(struct mk_iov) +
+                                 (n * sizeof(struct iovec)));
+
+    mk_iov_init(iov, n, offset);
+    return iov;
+}
+
 struct mk_iov *mk_iov_create(int n, int offset)
 {
     int s_all;
-    int s_iovec;
-    int s_free_buf;
     void *p;
-    struct mk_iov *iov;
-
-    s_all      = sizeof(struct mk_iov);       /* main mk_iov structure */
-    s_iovec    = (n * sizeof(struct iovec));  /* iovec array size      */
-    s_free_buf = (n * sizeof(void *));        /* free buf array        */
 
-    p = mk_mem_malloc_z(s_all + s_iovec + s_free_buf);
+    /*
+     * The block holds the main mk_iov structure, the iovec array and the
+     * free buf array. It's allocated with the layout of a pool object so
+     * mk_iov_free() can release heap and pooled instances.
+     */
+    s_all = MK_IOV_SIZE(n);
+    p = mk_pool_alloc(s_all);
     if (!p) {
         return NULL;
     }
+    memset(p, '\0', s_all);
 
-    /* Set pointer address */
-    iov     = p;
-    iov->io = p + sizeof(struct mk_iov);
-    iov->buf_to_free = (void *) (p + sizeof(struct mk_iov) + s_iovec);
+    return mk_iov_setup(p, n, offset);
+}
 
-    mk_iov_init(iov, n, offset);
-    return iov;
+/* Get an IOV from a pool created with MK_IOV_SIZE(n) objects */
+struct mk_iov *mk_iov_create_pool(struct mk_pool *pool, int offset)
+{
+    int n;
+    void *p;
+
+    p = mk_pool_get(pool);
+    if (!p) {
+        return NULL;
+    }
+
+    n = (pool->size - sizeof(struct mk_iov)) /
+        (sizeof(struct iovec) + sizeof(void *));
+    return mk_iov_setup(p, n, offset);
 }
 
 struct mk_iov *mk_iov_realloc(struct mk_iov *mk_io, int new_size)
@@ -124,7 +148,7 @@ ssize_t mk_iov_send(int fd, struct mk_iov *mk_io)
 void mk_iov_free(struct mk_iov *mk_io)
 {
     mk_iov_free_marked(mk_io);
-    mk_mem_free(mk_io);
+    mk_pool_put(mk_io);
 }
 
 void mk_iov_free_marked(struct mk_iov *mk_io)
@@ -172,6 +196,7 @@ int mk_iov_consume(struct mk_iov *mk_io, size_t bytes)
 {
     int idx;
     size_t len;
+    size_t total = bytes;
 
     if (mk_io->total_len == bytes) {
         mk_io->total_len = 0;
@@ -198,6 +223,6 @@ int mk_iov_consume(struct mk_iov *mk_io, size_t bytes)
         }
     }
 
-    mk_io->total_len -= bytes;
+    mk_io->total_len -= total;
     return 0;
 }
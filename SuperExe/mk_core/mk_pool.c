@@ -0,0 +1,184 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <mk_core/mk_memory.h>
+#include <mk_core/mk_macros.h>
+#include <mk_core/mk_list.h>
+#include <mk_core/mk_pool.h>
+#include <mk_core/mk_utils.h>
+
+struct mk_pool_slab {
+    struct mk_list _head;
+};
+
+#define MK_POOL_SLAB_HDR   MK_POOL_ROUND(sizeof(struct mk_pool_slab))
+
+/* Create a pool for objects of 'size' bytes */
+struct mk_pool *mk_pool_create(size_t size, int slab_objs)
+{
+    struct mk_pool *pool;
+
+    pool = mk_mem_malloc_z(sizeof(struct mk_pool));
+    if (!pool) {
+        return NULL;
+    }
+
+    if (slab_objs <= 0) {
+        slab_objs = MK_POOL_SLAB_OBJS;
+    }
+
+    pool->size      = size;
+    pool->stride    = MK_POOL_HDR_SIZE + MK_POOL_ROUND(size);
+    pool->slab_objs = slab_objs;
+    pool->free      = NULL;
+    mk_list_init(&pool->slab_list);
+
+    return pool;
+}
+
+/* Release every slab, objects still in use become invalid */
+void mk_pool_destroy(struct mk_pool *pool)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_pool_slab *slab;
+
+    if (!pool) {
+        return;
+    }
+
+    MK_TRACE("[pool %p] size=%lu used=%i hits=%lu misses=%lu",
+             pool, pool->size, pool->used, pool->hits, pool->misses);
+
+    mk_list_foreach_safe(head, tmp, &pool->slab_list) {
+        slab = mk_list_entry(head, struct mk_pool_slab, _head);
+        mk_list_del(&slab->_head);
+        mk_mem_free(slab);
+    }
+    mk_mem_free(pool);
+}
+
+/* Allocate a new slab and link its objects to the free list */
+static int mk_pool_grow(struct mk_pool *pool)
+{
+    int i;
+    char *p;
+    struct mk_pool_obj *obj;
+    struct mk_pool_slab *slab;
+
+    slab = mk_mem_malloc(MK_POOL_SLAB_HDR + (pool->stride * pool->slab_objs));
+    if (!slab) {
+        return -1;
+    }
+    mk_list_add(&slab->_head, &pool->slab_list);
+
+    p = (char *) slab + MK_POOL_SLAB_HDR;
+    for (i = 0; i < pool->slab_objs; i++) {
+        obj = (struct mk_pool_obj *) p;
+        obj->pool = pool;
+        obj->next = pool->free;
+        pool->free = obj;
+        p += pool->stride;
+    }
+
+    pool->slabs++;
+    pool->available += pool->slab_objs;
+
+    return 0;
+}
+
+void *mk_pool_get(struct mk_pool *pool)
+{
+    struct mk_pool_obj *obj;
+
+    if (mk_likely(pool->free != NULL)) {
+        pool->hits++;
+    }
+    else {
+        pool->misses++;
+        if (mk_pool_grow(pool) != 0) {
+            return NULL;
+        }
+    }
+
+    obj = pool->free;
+    pool->free = obj->next;
+    pool->available--;
+    pool->used++;
+
+    return (char *) obj + MK_POOL_HDR_SIZE;
+}
+
+/*
+ * Allocate an object from the heap with the same layout of a pooled one,
+ * it's used as a fallback by callers that may run out of a worker context,
+ * mk_pool_put() takes care of both.
+ */
+void *mk_pool_alloc(size_t size)
+{
+    struct mk_pool_obj *obj;
+
+    obj = mk_mem_malloc(MK_POOL_HDR_SIZE + size);
+    if (!obj) {
+        return NULL;
+    }
+    obj->pool = NULL;
+    obj->next = NULL;
+
+    return (char *) obj + MK_POOL_HDR_SIZE;
+}
+
+void mk_pool_put(void *ptr)
+{
+    struct mk_pool *pool;
+    struct mk_pool_obj *obj;
+
+    obj = (struct mk_pool_obj *) ((char *) ptr - MK_POOL_HDR_SIZE);
+    pool = obj->pool;
+    if (!pool) {
+        mk_mem_free(obj);
+        return;
+    }
+
+    obj->next = pool->free;
+    pool->free = obj;
+    pool->available++;
+    pool->used--;
+}
+
+void mk_pool_stats(struct mk_pool *pool, struct mk_pool_stats *stats)
+{
+    unsigned long total;
+
+    stats->used      = pool->used;
+    stats->available = pool->available;
+    stats->slabs     = pool->slabs;
+    stats->hits      = pool->hits;
+    stats->misses    = pool->misses;
+
+    total = pool->hits + pool->misses;
+    if (total > 0) {
+        stats->hit_rate = (int) ((pool->hits * 100) / total);
+    }
+    else {
+        stats->hit_rate = 0;
+    }
+}
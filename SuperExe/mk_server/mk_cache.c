@@ -24,6 +24,9 @@
 #include <monkey/mk_config.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_compress.h>
 #include <monkey/mk_tls.h>
 
 #ifndef PTHREAD_TLS
@@ -37,19 +40,6 @@ pthread_key_t mk_utils_error_key;
 void mk_cache_worker_init()
 {
     char *cache_error;
-    mk_ptr_t *p_tmp;
-
-    /* Cache header request -> last modified */
-    p_tmp = mk_mem_malloc_z(sizeof(mk_ptr_t));
-    p_tmp->data = mk_mem_malloc_z(32);
-    p_tmp->len = -1;
-    MK_TLS_SET(mk_tls_cache_header_lm, p_tmp);
-
-    /* Cache header request -> content length */
-    p_tmp = mk_mem_malloc_z(sizeof(mk_ptr_t));
-    p_tmp->data = mk_mem_malloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
-    p_tmp->len = -1;
-    MK_TLS_SET(mk_tls_cache_header_cl, p_tmp);
 
     /* Cache gmtime buffer */
     MK_TLS_SET(mk_tls_cache_gmtime, mk_mem_malloc(sizeof(struct tm)));
@@ -64,20 +54,22 @@ void mk_cache_worker_init()
 
     /* Virtual hosts: initialize per thread-vhost data */
     mk_vhost_fdt_worker_init();
+    mk_vhost_handler_worker_init();
+
+    /* Static files metadata */
+    mk_file_cache_worker_init();
+
+    /* Response header templates */
+    mk_header_worker_init();
+
+    /* Compressed copies of static files */
+    mk_compress_worker_init();
 }
 
 void mk_cache_worker_exit()
 {
     char *cache_error;
 
-    /* Cache header request -> last modified */
-    mk_ptr_free(MK_TLS_GET(mk_tls_cache_header_lm));
-    mk_mem_free(MK_TLS_GET(mk_tls_cache_header_lm));
-
-    /* Cache header request -> content length */
-    mk_ptr_free(MK_TLS_GET(mk_tls_cache_header_cl));
-    mk_mem_free(MK_TLS_GET(mk_tls_cache_header_cl));
-
     /* Cache gmtime buffer */
     mk_mem_free(MK_TLS_GET(mk_tls_cache_gmtime));
 
@@ -87,4 +79,16 @@ void mk_cache_worker_exit()
     /* Cache buffer for strerror_r(2) */
     cache_error = pthread_getspecific(mk_utils_error_key);
     mk_mem_free(cache_error);
+
+    /* Virtual hosts: handlers lookup cache */
+    mk_vhost_handler_worker_exit();
+
+    /* Static files metadata */
+    mk_file_cache_worker_exit();
+
+    /* Response header templates */
+    mk_header_worker_exit();
+
+    /* Compressed copies of static files */
+    mk_compress_worker_exit();
 }
@@ -27,120 +27,258 @@
 #include <monkey/mk_config.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_utils.h>
+#include <monkey/mk_tls.h>
 
-time_t log_current_utime;
-time_t monkey_init_time;
+#ifndef PTHREAD_TLS
+#include <monkey/mk_clock_tls.h>
+#endif
 
-mk_ptr_t log_current_time = { NULL, LOG_TIME_BUFFER_SIZE - 2 };
-mk_ptr_t headers_preset = { NULL, HEADER_PRESET_SIZE - 1 };
+#ifdef CLOCK_REALTIME_COARSE
+#define MK_CLOCK_WALL_COARSE   CLOCK_REALTIME_COARSE
+#define MK_CLOCK_MONO_COARSE   CLOCK_MONOTONIC_COARSE
+#else
+#define MK_CLOCK_WALL_COARSE   CLOCK_REALTIME
+#define MK_CLOCK_MONO_COARSE   CLOCK_MONOTONIC
+#endif
 
-static char *log_time_buffers[2];
-static char *header_time_buffers[2];
+time_t monkey_init_time;
 
-/* The mk_ptr_ts have two buffers for avoid in half-way access from
- * another thread while a buffer is being modified. The function below returns
- * one of two buffers to work with.
+/*
+ * The clock published by the workers. Writers serialize on 'lock' and
+ * skip the update if some other worker is doing it, readers retry while
+ * 'seq' is odd or changed during the copy.
  */
-static inline char *_next_buffer(mk_ptr_t *pointer, char **buffers)
+static struct {
+    unsigned int seq;
+    int lock;
+    struct mk_clock_time now;
+    mk_ptr_t log_time;
+    char log_buf[2][LOG_TIME_BUFFER_SIZE];
+} mk_clock_source;
+
+static inline void mk_clock_read(struct mk_clock_time *t)
 {
-    if(pointer->data == buffers[0]) {
-        return buffers[1];
-    } else {
-        return buffers[0];
+    struct timespec ts;
+    clockid_t wall = MK_CLOCK_WALL_COARSE;
+    clockid_t mono = MK_CLOCK_MONO_COARSE;
+
+    if (mk_config->clock_msec == MK_TRUE) {
+        wall = CLOCK_REALTIME;
+        mono = CLOCK_MONOTONIC;
     }
+
+    clock_gettime(wall, &ts);
+    t->wall    = ts.tv_sec;
+    t->wall_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    clock_gettime(mono, &ts);
+    t->mono_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void mk_clock_log_set_time(time_t utime)
+static void mk_clock_log_time_set(char *buf, time_t utime)
 {
-    char *time_string;
     struct tm result;
 
-    time_string = _next_buffer(&log_current_time, log_time_buffers);
-    log_current_utime = utime;
-
-    strftime(time_string, LOG_TIME_BUFFER_SIZE, "[%d/%b/%G %T %z]",
+    strftime(buf, LOG_TIME_BUFFER_SIZE, "[%d/%b/%G %T %z]",
              localtime_r(&utime, &result));
-
-    log_current_time.data = time_string;
 }
 
-static void mk_clock_headers_preset(time_t utime)
+static int mk_clock_headers_preset_set(char *buf, time_t utime)
 {
     int len1;
     int len2;
     struct tm *gmt_tm;
     struct tm result;
-    char *buffer;
-
-    buffer = _next_buffer(&headers_preset, header_time_buffers);
 
     gmt_tm = gmtime_r(&utime, &result);
 
-    len1 = snprintf(buffer,
+    len1 = snprintf(buf,
                     HEADER_TIME_BUFFER_SIZE,
                     "%s",
                     mk_config->server_signature_header);
 
-    len2 = strftime(buffer + len1,
+    len2 = strftime(buf + len1,
                     HEADER_PRESET_SIZE - len1,
                     MK_CLOCK_GMT_DATEFORMAT,
                     gmt_tm);
 
-    headers_preset.data = buffer;
-    headers_preset.len  = len1 + len2;
+    return len1 + len2;
 }
 
-void *mk_clock_worker_init(void *args UNUSED_PARAM)
+/* Publish the time read by a worker if it's newer than the current one */
+static void mk_clock_publish(struct mk_clock_time *t)
 {
-    time_t cur_time;
+    int idx;
+    unsigned int seq;
+
+    if (__atomic_load_n(&mk_clock_source.now.mono_ms, __ATOMIC_RELAXED) >=
+        t->mono_ms) {
+        return;
+    }
+
+    if (__atomic_exchange_n(&mk_clock_source.lock, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    /*
+     * The buffer not referenced by the log time can be written out of
+     * the sequence, readers only take the pointer.
+     */
+    idx = -1;
+    if (t->wall != mk_clock_source.now.wall) {
+        idx = (mk_clock_source.log_time.data == mk_clock_source.log_buf[0]);
+        mk_clock_log_time_set(mk_clock_source.log_buf[idx], t->wall);
+    }
+
+    seq = mk_clock_source.seq;
+    __atomic_store_n(&mk_clock_source.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-    mk_utils_worker_rename("monkey: clock");
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    mk_clock_source.now = *t;
+    if (idx >= 0) {
+        mk_clock_source.log_time.data = mk_clock_source.log_buf[idx];
+    }
+
+    __atomic_store_n(&mk_clock_source.seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&mk_clock_source.lock, 0, __ATOMIC_RELEASE);
+}
 
-    mk_clock_tid = pthread_self();
+/* Read the published clock */
+void mk_clock_get(struct mk_clock_time *t)
+{
+    unsigned int seq;
 
     while (1) {
-        cur_time = time(NULL);
+        seq = __atomic_load_n(&mk_clock_source.seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+
+        *t = mk_clock_source.now;
 
-        if(cur_time != ((time_t)-1)) {
-            mk_clock_log_set_time(cur_time);
-            mk_clock_headers_preset(cur_time);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&mk_clock_source.seq, __ATOMIC_RELAXED) == seq) {
+            break;
         }
-        sleep(1);
+    }
+}
+
+/*
+ * Refresh the clock of the calling worker, it's invoked once per event
+ * loop wakeup.
+ */
+void mk_clock_update()
+{
+    time_t prev;
+    struct mk_clock_cache *cache;
+
+    cache = MK_TLS_GET(mk_tls_clock);
+    if (!cache) {
+        return;
+    }
+
+    prev = cache->now.wall;
+    mk_clock_read(&cache->now);
+
+    /* New second: render the text representations on the other buffers */
+    if (cache->now.wall != prev) {
+        cache->idx ^= 1;
+        cache->headers_preset.data = cache->preset_buf[cache->idx];
+        cache->headers_preset.len  =
+            mk_clock_headers_preset_set(cache->preset_buf[cache->idx],
+                                        cache->now.wall);
+
+        mk_clock_log_time_set(cache->log_buf[cache->idx], cache->now.wall);
+        cache->log_time.data = cache->log_buf[cache->idx];
     }
 
-    return NULL;
+    mk_clock_publish(&cache->now);
 }
 
-void mk_clock_exit()
+/* Current time in seconds */
+time_t mk_clock_utime()
 {
-    pthread_cancel(mk_clock_tid);
-    pthread_join(mk_clock_tid, NULL);
+    struct mk_clock_time t;
+    struct mk_clock_cache *cache;
 
-    mk_mem_free(header_time_buffers[0]);
-    mk_mem_free(header_time_buffers[1]);
-    mk_mem_free(log_time_buffers[0]);
-    mk_mem_free(log_time_buffers[1]);
+    cache = MK_TLS_GET(mk_tls_clock);
+    if (cache) {
+        return cache->now.wall;
+    }
+
+    mk_clock_get(&t);
+    return t.wall;
 }
 
-/* This function must be called before any threads are created */
-void mk_clock_sequential_init()
+/* Monotonic time in milliseconds */
+uint64_t mk_clock_msec()
 {
-    /* Time when monkey was started */
-    monkey_init_time = time(NULL);
+    struct mk_clock_time t;
+    struct mk_clock_cache *cache;
+
+    cache = MK_TLS_GET(mk_tls_clock);
+    if (cache) {
+        return cache->now.mono_ms;
+    }
 
-    header_time_buffers[0] = mk_mem_malloc_z(HEADER_PRESET_SIZE);
-    header_time_buffers[1] = mk_mem_malloc_z(HEADER_PRESET_SIZE);
+    mk_clock_get(&t);
+    return t.mono_ms;
+}
+
+/* Server and Date header rows, only available from a worker */
+mk_ptr_t *mk_clock_headers_preset()
+{
+    struct mk_clock_cache *cache;
+
+    cache = MK_TLS_GET(mk_tls_clock);
+    return &cache->headers_preset;
+}
+
+/* Time string for log entries */
+mk_ptr_t *mk_clock_log_time()
+{
+    struct mk_clock_cache *cache;
 
-    log_time_buffers[0] = mk_mem_malloc_z(LOG_TIME_BUFFER_SIZE);
-    log_time_buffers[1] = mk_mem_malloc_z(LOG_TIME_BUFFER_SIZE);
+    cache = MK_TLS_GET(mk_tls_clock);
+    if (cache) {
+        return &cache->log_time;
+    }
 
+    return &mk_clock_source.log_time;
+}
 
-    /* Set the time once */
-    time_t cur_time = time(NULL);
+/* This function is called when a worker thread is created */
+void mk_clock_worker_init()
+{
+    struct mk_clock_cache *cache;
 
-    if (cur_time != ((time_t)-1)) {
-        mk_clock_log_set_time(cur_time);
-        mk_clock_headers_preset(cur_time);
+    cache = mk_mem_malloc_z(sizeof(struct mk_clock_cache));
+    if (!cache) {
+        mk_err("[clock] could not allocate worker cache");
+        exit(EXIT_FAILURE);
     }
+
+    cache->log_time.len = LOG_TIME_BUFFER_SIZE - 2;
+    MK_TLS_SET(mk_tls_clock, cache);
+
+    mk_clock_update();
+}
+
+void mk_clock_worker_exit()
+{
+    mk_mem_free(MK_TLS_GET(mk_tls_clock));
+    MK_TLS_SET(mk_tls_clock, NULL);
+}
+
+/* This function must be called before any threads are created */
+void mk_clock_sequential_init()
+{
+    struct mk_clock_time t;
+
+    /* Time when monkey was started */
+    monkey_init_time = time(NULL);
+
+    mk_clock_read(&t);
+    mk_clock_source.log_time.len = LOG_TIME_BUFFER_SIZE - 2;
+    mk_clock_publish(&t);
 }
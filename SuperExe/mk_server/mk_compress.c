@@ -0,0 +1,516 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_compress.h>
+#include <monkey/mk_tls.h>
+
+#ifndef PTHREAD_TLS
+#include <monkey/mk_compress_tls.h>
+#endif
+
+const mk_ptr_t mk_compress_names[] = {
+    mk_ptr_init(""),
+    mk_ptr_init("gzip\r\n"),
+    mk_ptr_init("deflate\r\n")
+};
+
+/* This function is called when a worker thread is created */
+void mk_compress_worker_init()
+{
+    int i;
+    struct mk_compress_cache *cache;
+
+    if (mk_config->compression == MK_FALSE || mk_config->compression_cache <= 0) {
+        return;
+    }
+
+    cache = mk_mem_malloc_z(sizeof(struct mk_compress_cache));
+    if (!cache) {
+        return;
+    }
+
+    cache->size = (size_t) mk_config->compression_cache * 1024;
+    mk_list_init(&cache->lru);
+    for (i = 0; i < MK_COMPRESS_BUCKETS; i++) {
+        mk_list_init(&cache->table[i]);
+    }
+
+    MK_TLS_SET(mk_tls_compress_cache, cache);
+}
+
+/* Memory used by an entry, it's what counts against the cache size */
+static inline size_t mk_compress_footprint(struct mk_compress_entry *ce)
+{
+    return sizeof(struct mk_compress_entry) + ce->path_len + 1 + ce->len;
+}
+
+static void mk_compress_entry_free(struct mk_compress_entry *ce)
+{
+    if (ce->data) {
+        mk_mem_free(ce->data);
+    }
+    mk_mem_free(ce);
+}
+
+/*
+ * Remove an entry from the table, if some request is still using it the
+ * memory is released later by mk_compress_put().
+ */
+static void mk_compress_unlink(struct mk_compress_cache *cache,
+                               struct mk_compress_entry *ce)
+{
+    mk_list_del(&ce->_head);
+    mk_list_del(&ce->_lru);
+    cache->bytes -= mk_compress_footprint(ce);
+
+    if (ce->refs > 0) {
+        ce->stale = MK_TRUE;
+        return;
+    }
+    mk_compress_entry_free(ce);
+}
+
+void mk_compress_worker_exit()
+{
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_compress_cache *cache;
+    struct mk_compress_entry *ce;
+
+    cache = MK_TLS_GET(mk_tls_compress_cache);
+    if (!cache) {
+        return;
+    }
+
+    MK_TRACE("[compress] bytes=%lu hits=%lu misses=%lu",
+             cache->bytes, cache->hits, cache->misses);
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        ce = mk_list_entry(head, struct mk_compress_entry, _lru);
+        mk_compress_unlink(cache, ce);
+    }
+
+    mk_mem_free(cache);
+    MK_TLS_SET(mk_tls_compress_cache, NULL);
+}
+
+/* Check if a mime type (e.g: 'text/html') is worth compressing */
+int mk_compress_mime(const char *type)
+{
+    if (strncasecmp(type, "text/", 5) == 0) {
+        return MK_TRUE;
+    }
+
+    if (strcasestr(type, "javascript") || strcasestr(type, "json") ||
+        strcasestr(type, "xml")) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/* A quality value of zero means 'not acceptable' */
+static int mk_compress_qzero(char *p, char *end)
+{
+    if (p >= end || *p != '0') {
+        return MK_FALSE;
+    }
+
+    for (p++; p < end && *p != ',' && *p != ';' && *p != ' '; p++) {
+        if (*p != '.' && *p != '0') {
+            return MK_FALSE;
+        }
+    }
+
+    return MK_TRUE;
+}
+
+/*
+ * Parse the Accept-Encoding header value, returns a mask of the supported
+ * encodings the client accepts. The '*' token only covers the encodings
+ * not named in the header (RFC 9110 12.5.3), so 'gzip;q=0, *' never
+ * enables gzip.
+ */
+int mk_compress_accept(mk_ptr_t *accept_encoding)
+{
+    int len;
+    int mask = 0;
+    int listed = 0;
+    int any = MK_FALSE;
+    int wildcard;
+    int refused;
+    int encoding;
+    char *p;
+    char *end;
+    char *token;
+
+    p = accept_encoding->data;
+    end = p + accept_encoding->len;
+
+    while (p < end) {
+        /* Token */
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        len = p - token;
+
+        wildcard = MK_FALSE;
+        if (len == 4 && strncasecmp(token, "gzip", 4) == 0) {
+            encoding = (1 << MK_COMPRESS_GZIP);
+        }
+        else if (len == 7 && strncasecmp(token, "deflate", 7) == 0) {
+            encoding = (1 << MK_COMPRESS_DEFLATE);
+        }
+        else if (len == 1 && *token == '*') {
+            encoding = 0;
+            wildcard = MK_TRUE;
+        }
+        else {
+            encoding = 0;
+        }
+
+        /* Parameters, only the quality value matters */
+        refused = MK_FALSE;
+        while (p < end && *p != ',') {
+            if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=' &&
+                (p[-1] == ';' || p[-1] == ' ' || p[-1] == '\t')) {
+                if (mk_compress_qzero(p + 2, end) == MK_TRUE) {
+                    refused = MK_TRUE;
+                }
+            }
+            p++;
+        }
+
+        /* A named encoding is listed whatever its quality value */
+        listed |= encoding;
+        if (refused == MK_FALSE) {
+            mask |= encoding;
+            if (wildcard == MK_TRUE) {
+                any = MK_TRUE;
+            }
+        }
+    }
+
+    if (any == MK_TRUE) {
+        mask |= ((1 << MK_COMPRESS_GZIP) | (1 << MK_COMPRESS_DEFLATE)) &
+                ~listed;
+    }
+
+    return mask;
+}
+
+/* ETag of an encoded representation, it must differ from the plain one */
+int mk_compress_etag(char *buf, struct file_info *info, int encoding)
+{
+    return snprintf(buf, MK_HEADER_ETAG_SIZE,
+                    "ETag: \"%x-%zx-%.*s\"\r\n",
+                    (unsigned int) info->last_modification,
+                    info->size,
+                    (int) mk_compress_names[encoding].len - 2,
+                    mk_compress_names[encoding].data);
+}
+
+/*
+ * Lookup the precompressed 'file.gz' sidecar of a cached file. Once it's
+ * known that there is no sidecar it's not checked again until the file
+ * entry is revalidated. The returned entry is referenced by the caller.
+ */
+struct mk_file_cache_entry *mk_compress_static(struct mk_file_cache_entry *fc)
+{
+    int ret;
+    char buf[MK_MAX_PATH];
+    mk_ptr_t path;
+    struct file_info info;
+    struct mk_file_cache_entry *gz;
+
+    if (fc->gz_static == MK_FALSE || fc->path_len + 4 > MK_MAX_PATH) {
+        return NULL;
+    }
+
+    memcpy(buf, fc->path, fc->path_len);
+    memcpy(buf + fc->path_len, ".gz", 4);
+    path.data = buf;
+    path.len  = fc->path_len + 3;
+
+    gz = mk_file_cache_get(&path);
+    if (gz) {
+        if (gz->info.last_modification >= fc->info.last_modification) {
+            return gz;
+        }
+        mk_file_cache_put(gz);
+        fc->gz_static = MK_FALSE;
+        return NULL;
+    }
+
+    ret = mk_file_get_info(path.data, &info, MK_FILE_READ);
+    if (ret != 0 || info.is_file == MK_FALSE ||
+        info.read_access == MK_FALSE || info.size == 0 ||
+        info.last_modification < fc->info.last_modification) {
+        fc->gz_static = MK_FALSE;
+        return NULL;
+    }
+
+    gz = mk_file_cache_add(&path, &info, fc->mime);
+    if (gz) {
+        fc->gz_static = MK_TRUE;
+    }
+    return gz;
+}
+
+/*
+ * Lookup the compressed copy of a file, entries created for an older
+ * version of the file are dropped. On success the entry is referenced by
+ * the caller until it calls mk_compress_put().
+ */
+struct mk_compress_entry *mk_compress_get(mk_ptr_t *path,
+                                          struct file_info *info,
+                                          int encoding)
+{
+    unsigned int hash;
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_compress_cache *cache;
+    struct mk_compress_entry *ce;
+
+    cache = MK_TLS_GET(mk_tls_compress_cache);
+    if (!cache) {
+        return NULL;
+    }
+
+    hash = mk_utils_gen_hash(path->data, path->len);
+    bucket = &cache->table[hash & (MK_COMPRESS_BUCKETS - 1)];
+
+    mk_list_foreach(head, bucket) {
+        ce = mk_list_entry(head, struct mk_compress_entry, _head);
+        if (ce->hash != hash || ce->encoding != encoding ||
+            ce->path_len != (int) path->len ||
+            memcmp(ce->path, path->data, path->len) != 0) {
+            continue;
+        }
+
+        if (ce->mtime != info->last_modification || ce->size != info->size) {
+            MK_TRACE("[compress] '%s' changed", ce->path);
+            mk_compress_unlink(cache, ce);
+            break;
+        }
+
+        /* Move it to the tail of the LRU list */
+        mk_list_del(&ce->_lru);
+        mk_list_add(&ce->_lru, &cache->lru);
+
+        ce->refs++;
+        cache->hits++;
+        return ce;
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+#ifdef HAVE_ZLIB
+/* Read the whole file, used when its content is not in the file cache */
+static char *mk_compress_read(char *path, size_t size)
+{
+    int fd;
+    ssize_t bytes;
+    size_t total = 0;
+    char *buf;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    buf = mk_mem_malloc(size);
+    if (!buf) {
+        close(fd);
+        return NULL;
+    }
+
+    while (total < size) {
+        bytes = pread(fd, buf + total, size - total, total);
+        if (bytes <= 0) {
+            mk_mem_free(buf);
+            close(fd);
+            return NULL;
+        }
+        total += bytes;
+    }
+
+    close(fd);
+    return buf;
+}
+
+/*
+ * Compress a buffer with zlib, gzip and deflate only differ in the stream
+ * wrapper. Returns NULL if the output is not smaller than the input.
+ */
+static char *mk_compress_deflate(char *in, size_t size, int encoding,
+                                 size_t *out_len)
+{
+    int ret;
+    int bits;
+    char *out;
+    z_stream z;
+
+    memset(&z, '\0', sizeof(z));
+    bits = (encoding == MK_COMPRESS_GZIP) ? MAX_WBITS + 16 : MAX_WBITS;
+    ret = deflateInit2(&z, MK_COMPRESS_LEVEL, Z_DEFLATED, bits, 8,
+                       Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return NULL;
+    }
+
+    out = mk_mem_malloc(size);
+    if (!out) {
+        deflateEnd(&z);
+        return NULL;
+    }
+
+    z.next_in   = (Bytef *) in;
+    z.avail_in  = size;
+    z.next_out  = (Bytef *) out;
+    z.avail_out = size;
+
+    ret = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+
+    /* Z_OK or Z_BUF_ERROR means it did not fit in 'size' bytes */
+    if (ret != Z_STREAM_END) {
+        mk_mem_free(out);
+        return NULL;
+    }
+
+    *out_len = z.total_out;
+    return out;
+}
+#endif
+
+/*
+ * Compress a file and register the result. If the file does not shrink
+ * the entry is kept without data, so next requests just skip it. The
+ * returned entry is referenced as in mk_compress_get().
+ */
+struct mk_compress_entry *mk_compress_add(mk_ptr_t *path,
+                                          struct file_info *info,
+                                          int encoding, char *content)
+{
+#ifdef HAVE_ZLIB
+    size_t len = 0;
+    char *data;
+    char *buf = NULL;
+    struct mk_compress_cache *cache;
+    struct mk_compress_entry *ce;
+
+    cache = MK_TLS_GET(mk_tls_compress_cache);
+    if (!cache || info->size > MK_COMPRESS_MAX_SIZE) {
+        return NULL;
+    }
+
+    if (!content) {
+        buf = mk_compress_read(path->data, info->size);
+        if (!buf) {
+            return NULL;
+        }
+        content = buf;
+    }
+
+    data = mk_compress_deflate(content, info->size, encoding, &len);
+    if (buf) {
+        mk_mem_free(buf);
+    }
+
+    ce = mk_mem_malloc(sizeof(struct mk_compress_entry) + path->len + 1);
+    if (!ce) {
+        if (data) {
+            mk_mem_free(data);
+        }
+        return NULL;
+    }
+
+    ce->hash     = mk_utils_gen_hash(path->data, path->len);
+    ce->refs     = 1;
+    ce->stale    = MK_FALSE;
+    ce->encoding = encoding;
+    ce->mtime    = info->last_modification;
+    ce->size     = info->size;
+    ce->data     = data;
+    ce->len      = data ? len : 0;
+    ce->path_len = path->len;
+    memcpy(ce->path, path->data, path->len);
+    ce->path[path->len] = '\0';
+
+    MK_TRACE("[compress] '%s' %lu -> %lu bytes", ce->path, info->size, ce->len);
+
+    /* Larger than the whole cache: serve it once and drop it */
+    if (mk_compress_footprint(ce) > cache->size) {
+        ce->stale = MK_TRUE;
+        return ce;
+    }
+
+    /* Make room for the new entry */
+    while (cache->bytes + mk_compress_footprint(ce) > cache->size) {
+        mk_compress_unlink(cache,
+                           mk_list_entry_first(&cache->lru,
+                                               struct mk_compress_entry,
+                                               _lru));
+    }
+
+    mk_list_add(&ce->_head,
+                &cache->table[ce->hash & (MK_COMPRESS_BUCKETS - 1)]);
+    mk_list_add(&ce->_lru, &cache->lru);
+    cache->bytes += mk_compress_footprint(ce);
+
+    return ce;
+#else
+    (void) path;
+    (void) info;
+    (void) encoding;
+    (void) content;
+    return NULL;
+#endif
+}
+
+/* Release a reference obtained from mk_compress_get() or _add() */
+void mk_compress_put(struct mk_compress_entry *ce)
+{
+    ce->refs--;
+    if (ce->refs == 0 && ce->stale == MK_TRUE) {
+        mk_compress_entry_free(ce);
+    }
+}
@@ -27,6 +27,8 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_compress.h>
 #include <monkey/mk_mimetype.h>
 
 #include <ctype.h>
@@ -274,6 +276,7 @@ static void mk_config_read_files(char *path_conf, char *file_conf)
 {
     unsigned long len;
     char *tmp = NULL;
+    char *file_cache;
     struct stat checkdir;
     struct mk_rconf *cnf;
     struct mk_rconf_section *section;
@@ -430,6 +433,66 @@ static void mk_config_read_files(char *path_conf, char *file_conf)
     mk_config->fdt = (size_t) mk_rconf_section_get_key(section,
                                                     "FDT",
                                                     MK_RCONF_BOOL);
+    mk_config->fdt_capacity = (size_t) mk_rconf_section_get_key(section,
+                                                             "FDTCapacity",
+                                                             MK_RCONF_NUM);
+    if (mk_config->fdt_capacity <= 0) {
+        mk_config->fdt_capacity = VHOST_FDT_CAPACITY;
+    }
+
+    /*
+     * File cache: zero is a valid value (cache disabled), so a missing
+     * key must be told apart from an explicit 'FileCache 0' and keep the
+     * default size.
+     */
+    file_cache = mk_rconf_section_get_key(section, "FileCache", MK_RCONF_STR);
+    if (!file_cache) {
+        mk_config->file_cache = MK_FILE_CACHE_ENTRIES;
+    }
+    else {
+        mk_config->file_cache = (int) strtol(file_cache, NULL, 10);
+        mk_mem_free(file_cache);
+        if (mk_config->file_cache < 0) {
+            mk_config_print_error_msg("FileCache", tmp);
+        }
+    }
+
+    mk_config->file_cache_ttl = (size_t) mk_rconf_section_get_key(section,
+                                                               "FileCacheTTL",
+                                                               MK_RCONF_NUM);
+    if (mk_config->file_cache_ttl <= 0) {
+        mk_config->file_cache_ttl = MK_FILE_CACHE_TTL;
+    }
+
+    /* Content compression */
+    mk_config->compression = (size_t) mk_rconf_section_get_key(section,
+                                                            "Compression",
+                                                            MK_RCONF_BOOL);
+    if (mk_config->compression == MK_ERROR) {
+        mk_config_print_error_msg("Compression", tmp);
+    }
+
+    mk_config->compression_static = (size_t) mk_rconf_section_get_key(section,
+                                                                   "CompressionStatic",
+                                                                   MK_RCONF_BOOL);
+    if (mk_config->compression_static == MK_ERROR) {
+        mk_config_print_error_msg("CompressionStatic", tmp);
+    }
+
+    mk_config->compression_cache = (size_t) mk_rconf_section_get_key(section,
+                                                                  "CompressionCache",
+                                                                  MK_RCONF_NUM);
+    if (mk_config->compression_cache <= 0) {
+        mk_config->compression_cache = MK_COMPRESS_CACHE;
+    }
+
+    /* Millisecond clock */
+    mk_config->clock_msec = (size_t) mk_rconf_section_get_key(section,
+                                                           "ClockMsec",
+                                                           MK_RCONF_BOOL);
+    if (mk_config->clock_msec == MK_ERROR) {
+        mk_config_print_error_msg("ClockMsec", tmp);
+    }
 
     /* FIXME: Overcapacity not ready */
     mk_config->fd_limit = (size_t) mk_rconf_section_get_key(section,
@@ -552,6 +615,11 @@ void mk_config_set_init_values(void)
     mk_config->resume = MK_TRUE;
     mk_config->standard_port = 80;
     mk_config->symlink = MK_FALSE;
+    mk_config->file_cache = MK_FILE_CACHE_ENTRIES;
+    mk_config->file_cache_ttl = MK_FILE_CACHE_TTL;
+    mk_config->compression = MK_FALSE;
+    mk_config->compression_static = MK_FALSE;
+    mk_config->compression_cache = MK_COMPRESS_CACHE;
     mk_config->nhosts = 0;
     mk_list_init(&mk_config->hosts);
     mk_config->user = NULL;
@@ -0,0 +1,319 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_tls.h>
+
+#ifndef PTHREAD_TLS
+#include <monkey/mk_file_cache_tls.h>
+#endif
+
+/* This function is called when a worker thread is created */
+void mk_file_cache_worker_init()
+{
+    int i;
+    struct mk_file_cache *cache;
+
+    if (mk_config->file_cache <= 0) {
+        return;
+    }
+
+    cache = mk_mem_malloc_z(sizeof(struct mk_file_cache));
+    if (!cache) {
+        return;
+    }
+
+    cache->size = mk_config->file_cache;
+    mk_list_init(&cache->lru);
+    for (i = 0; i < MK_FILE_CACHE_BUCKETS; i++) {
+        mk_list_init(&cache->table[i]);
+    }
+
+    MK_TLS_SET(mk_tls_file_cache, cache);
+}
+
+static void mk_file_cache_entry_free(struct mk_file_cache_entry *fc)
+{
+    if (fc->fd >= 0) {
+        close(fc->fd);
+    }
+    if (fc->content) {
+        mk_mem_free(fc->content);
+    }
+    if (fc->rows.data) {
+        mk_mem_free(fc->rows.data);
+    }
+    mk_mem_free(fc);
+}
+
+/*
+ * Remove an entry from the table, if some request is still using it the
+ * memory is released later by mk_file_cache_put().
+ */
+static void mk_file_cache_unlink(struct mk_file_cache *cache,
+                                 struct mk_file_cache_entry *fc)
+{
+    mk_list_del(&fc->_head);
+    mk_list_del(&fc->_lru);
+    cache->count--;
+
+    if (fc->refs > 0) {
+        fc->stale = MK_TRUE;
+        return;
+    }
+    mk_file_cache_entry_free(fc);
+}
+
+void mk_file_cache_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_entry *fc;
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (!cache) {
+        return;
+    }
+
+    MK_TRACE("[file cache] entries=%i hits=%lu misses=%lu",
+             cache->count, cache->hits, cache->misses);
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        fc = mk_list_entry(head, struct mk_file_cache_entry, _lru);
+        mk_file_cache_unlink(cache, fc);
+    }
+
+    mk_mem_free(cache);
+    MK_TLS_SET(mk_tls_file_cache, NULL);
+}
+
+/* Check that a cached entry still describes the file on disk */
+static int mk_file_cache_revalidate(struct mk_file_cache_entry *fc)
+{
+    int ret;
+    struct file_info info;
+
+    ret = mk_file_get_info(fc->path, &info, MK_FILE_READ);
+    if (ret != 0 ||
+        info.size != fc->info.size ||
+        info.last_modification != fc->info.last_modification ||
+        info.read_access != fc->info.read_access ||
+        info.is_link != fc->info.is_link) {
+        return -1;
+    }
+
+    fc->expire = mk_clock_utime() + mk_config->file_cache_ttl;
+    fc->gz_static = -1;
+    return 0;
+}
+
+/*
+ * Lookup a file in the worker cache. On success the entry is referenced by
+ * the caller until it calls mk_file_cache_put().
+ */
+struct mk_file_cache_entry *mk_file_cache_get(mk_ptr_t *path)
+{
+    unsigned int hash;
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_entry *fc;
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (!cache) {
+        return NULL;
+    }
+
+    hash = mk_utils_gen_hash(path->data, path->len);
+    bucket = &cache->table[hash & (MK_FILE_CACHE_BUCKETS - 1)];
+
+    mk_list_foreach(head, bucket) {
+        fc = mk_list_entry(head, struct mk_file_cache_entry, _head);
+        if (fc->hash != hash || fc->path_len != (int) path->len ||
+            memcmp(fc->path, path->data, path->len) != 0) {
+            continue;
+        }
+
+        if (fc->expire <= mk_clock_utime() &&
+            mk_file_cache_revalidate(fc) != 0) {
+            MK_TRACE("[file cache] '%s' changed", fc->path);
+            mk_file_cache_unlink(cache, fc);
+            break;
+        }
+
+        /* Move it to the tail of the LRU list */
+        mk_list_del(&fc->_lru);
+        mk_list_add(&fc->_lru, &cache->lru);
+
+        fc->refs++;
+        cache->hits++;
+        return fc;
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+/* Read a small file into memory */
+static char *mk_file_cache_read(int fd, size_t size)
+{
+    ssize_t bytes;
+    size_t total = 0;
+    char *buf;
+
+    buf = mk_mem_malloc(size);
+    if (!buf) {
+        return NULL;
+    }
+
+    while (total < size) {
+        bytes = pread(fd, buf + total, size - total, total);
+        if (bytes <= 0) {
+            mk_mem_free(buf);
+            return NULL;
+        }
+        total += bytes;
+    }
+
+    return buf;
+}
+
+/*
+ * Serialize the header rows of a full 200 response, they only depend on
+ * the file itself so they are valid as long as the entry is.
+ */
+static void mk_file_cache_rows(struct mk_file_cache_entry *fc)
+{
+    unsigned long len;
+    char *buf = NULL;
+
+    mk_string_build(&buf, &len,
+                    "%s%.*s%.*s%.*sContent-Length: %zu\r\n\r\n",
+                    fc->lm_len > 0 ? "Last-Modified: " : "",
+                    fc->lm_len, fc->lm,
+                    (int) fc->mime->header_type.len,
+                    fc->mime->header_type.data,
+                    fc->etag_len, fc->etag,
+                    fc->info.size);
+    if (buf) {
+        fc->rows.data = buf;
+        fc->rows.len  = len;
+    }
+}
+
+/*
+ * Register a file that has been validated by the caller (regular file,
+ * readable and not empty). The file is opened here and the returned entry
+ * is referenced as in mk_file_cache_get().
+ */
+struct mk_file_cache_entry *mk_file_cache_add(mk_ptr_t *path,
+                                              struct file_info *info,
+                                              struct mimetype *mime)
+{
+    int fd;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_entry *fc;
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (!cache) {
+        return NULL;
+    }
+
+    fd = open(path->data, info->flags_read_only);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    fc = mk_mem_malloc(sizeof(struct mk_file_cache_entry) + path->len + 1);
+    if (!fc) {
+        close(fd);
+        return NULL;
+    }
+
+    fc->hash     = mk_utils_gen_hash(path->data, path->len);
+    fc->refs     = 1;
+    fc->stale    = MK_FALSE;
+    fc->fd       = fd;
+    fc->expire   = mk_clock_utime() + mk_config->file_cache_ttl;
+    fc->info     = *info;
+    fc->mime     = mime;
+    fc->content  = NULL;
+    mk_ptr_reset(&fc->rows);
+    fc->gz_static = -1;
+    fc->path_len = path->len;
+    memcpy(fc->path, path->data, path->len);
+    fc->path[path->len] = '\0';
+
+    fc->etag_len = snprintf(fc->etag, MK_HEADER_ETAG_SIZE,
+                            "ETag: \"%x-%zx\"\r\n",
+                            (unsigned int) info->last_modification,
+                            info->size);
+
+    fc->lm_len = 0;
+    if (info->last_modification > 0) {
+        char *p = fc->lm;
+        fc->lm_len = mk_utils_utime2gmt(&p, info->last_modification);
+        if (fc->lm_len < 0) {
+            fc->lm_len = 0;
+        }
+    }
+
+    /* Small files: keep the content and release the file descriptor */
+    if (info->size <= MK_FILE_CACHE_CONTENT_MAX) {
+        fc->content = mk_file_cache_read(fd, info->size);
+        if (fc->content) {
+            close(fd);
+            fc->fd = -1;
+            mk_file_cache_rows(fc);
+        }
+    }
+
+    /* Make room for the new entry */
+    if (cache->count >= cache->size) {
+        mk_file_cache_unlink(cache,
+                             mk_list_entry_first(&cache->lru,
+                                                 struct mk_file_cache_entry,
+                                                 _lru));
+    }
+
+    mk_list_add(&fc->_head,
+                &cache->table[fc->hash & (MK_FILE_CACHE_BUCKETS - 1)]);
+    mk_list_add(&fc->_lru, &cache->lru);
+    cache->count++;
+
+    return fc;
+}
+
+/* Release a reference obtained from mk_file_cache_get() or _add() */
+void mk_file_cache_put(struct mk_file_cache_entry *fc)
+{
+    fc->refs--;
+    if (fc->refs == 0 && fc->stale == MK_TRUE) {
+        mk_file_cache_entry_free(fc);
+    }
+}
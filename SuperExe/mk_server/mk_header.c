@@ -31,6 +31,10 @@
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_tls.h>
 
+#ifndef PTHREAD_TLS
+#include <monkey/mk_header_tls.h>
+#endif
+
 #define MK_HEADER_SHORT_DATE       "Date: "
 #define MK_HEADER_SHORT_LOCATION   "Location: "
 #define MK_HEADER_SHORT_CT         "Content-Type: "
@@ -42,6 +46,7 @@
 #define MK_HEADER_CONTENT_ENCODING "Content-Encoding: "
 #define MK_HEADER_TE_CHUNKED       "Transfer-Encoding: Chunked" MK_CRLF
 #define MK_HEADER_LAST_MODIFIED    "Last-Modified: "
+#define MK_HEADER_VARY_ENCODING    "Vary: Accept-Encoding" MK_CRLF
 
 const mk_ptr_t mk_header_short_date = mk_ptr_init(MK_HEADER_SHORT_DATE);
 const mk_ptr_t mk_header_short_location = mk_ptr_init(MK_HEADER_SHORT_LOCATION);
@@ -55,25 +60,19 @@ const mk_ptr_t mk_header_content_encoding = mk_ptr_init(MK_HEADER_CONTENT_ENCODI
 const mk_ptr_t mk_header_accept_ranges = mk_ptr_init(MK_HEADER_ACCEPT_RANGES);
 const mk_ptr_t mk_header_te_chunked = mk_ptr_init(MK_HEADER_TE_CHUNKED);
 const mk_ptr_t mk_header_last_modified = mk_ptr_init(MK_HEADER_LAST_MODIFIED);
+const mk_ptr_t mk_header_vary_encoding = mk_ptr_init(MK_HEADER_VARY_ENCODING);
 
-#define status_entry(num, str) {num, sizeof(str) - 1, str}
+#define status_entry(num, str) [num] = {num, sizeof(str) - 1, str}
 
+/* Indexed by the status code, unknown codes have a zero length */
 static const struct header_status_response status_response[] = {
 
-    /*
-     * The most used first:
-     *
-     *  - HTTP/1.1 200 OK
-     *  - HTTP/1.1 404 Not Found
-     */
-    status_entry(MK_HTTP_OK, MK_RH_HTTP_OK),
-    status_entry(MK_CLIENT_NOT_FOUND, MK_RH_CLIENT_NOT_FOUND),
-
     /* Informational */
     status_entry(MK_INFO_CONTINUE, MK_RH_INFO_CONTINUE),
     status_entry(MK_INFO_SWITCH_PROTOCOL, MK_RH_INFO_SWITCH_PROTOCOL),
 
     /* Successful */
+    status_entry(MK_HTTP_OK, MK_RH_HTTP_OK),
     status_entry(MK_HTTP_CREATED, MK_RH_HTTP_CREATED),
     status_entry(MK_HTTP_ACCEPTED, MK_RH_HTTP_ACCEPTED),
     status_entry(MK_HTTP_NON_AUTH_INFO, MK_RH_HTTP_NON_AUTH_INFO),
@@ -94,6 +93,7 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_CLIENT_UNAUTH, MK_RH_CLIENT_UNAUTH),
     status_entry(MK_CLIENT_PAYMENT_REQ, MK_RH_CLIENT_PAYMENT_REQ),
     status_entry(MK_CLIENT_FORBIDDEN, MK_RH_CLIENT_FORBIDDEN),
+    status_entry(MK_CLIENT_NOT_FOUND, MK_RH_CLIENT_NOT_FOUND),
     status_entry(MK_CLIENT_METHOD_NOT_ALLOWED, MK_RH_CLIENT_METHOD_NOT_ALLOWED),
     status_entry(MK_CLIENT_NOT_ACCEPTABLE, MK_RH_CLIENT_NOT_ACCEPTABLE),
     status_entry(MK_CLIENT_PROXY_AUTH, MK_RH_CLIENT_PROXY_AUTH),
@@ -149,45 +149,321 @@ static void mk_header_cb_finished(struct mk_stream *stream)
 #endif
 }
 
+/* Extra rows come from mk_stream_iov_create(), give the IOV back */
 static void cb_stream_iov_extended_free(struct mk_stream *stream)
 {
-    struct mk_iov *iov = stream->buffer;
-    mk_iov_free_marked(iov);
+    struct mk_http_request *sr = stream->data;
+
+    mk_iov_free(sr->headers._extra_rows);
+    sr->headers._extra_rows = NULL;
+}
+
+/* This function is called when a worker thread is created */
+void mk_header_worker_init()
+{
+    int i;
+    struct mk_header_tpl_cache *cache;
+
+    cache = mk_mem_malloc_z(sizeof(struct mk_header_tpl_cache));
+    if (!cache) {
+        return;
+    }
+
+    for (i = 0; i < MK_HEADER_TPL_BUCKETS; i++) {
+        mk_list_init(&cache->table[i]);
+    }
+
+    MK_TLS_SET(mk_tls_header_tpl, cache);
+}
+
+void mk_header_worker_exit()
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_header_tpl *tpl;
+    struct mk_header_tpl_cache *cache;
+
+    cache = MK_TLS_GET(mk_tls_header_tpl);
+    if (!cache) {
+        return;
+    }
+
+    for (i = 0; i < MK_HEADER_TPL_BUCKETS; i++) {
+        mk_list_foreach_safe(head, tmp, &cache->table[i]) {
+            tpl = mk_list_entry(head, struct mk_header_tpl, _head);
+            mk_list_del(&tpl->_head);
+            mk_mem_free(tpl);
+        }
+    }
+
+    mk_mem_free(cache);
+    MK_TLS_SET(mk_tls_header_tpl, NULL);
+}
+
+/* Template flags for the Connection header */
+static inline int mk_header_connection(struct mk_http_session *cs,
+                                       struct mk_http_request *sr)
+{
+    if (sr->headers.connection != 0) {
+        return 0;
+    }
+
+    if (cs->close_now == MK_TRUE) {
+        return MK_HEADER_TPL_CONN_CLOSE;
+    }
+
+    if (sr->connection.len > 0 && sr->protocol != MK_HTTP_PROTOCOL_11) {
+        return MK_HEADER_TPL_CONN_KA;
+    }
+
+    return 0;
+}
+
+static inline unsigned int mk_header_tpl_hash(int status, int flags,
+                                              mk_ptr_t *ct, mk_ptr_t *ce)
+{
+    unsigned int i;
+    unsigned int hash = 2166136261u;
+
+    hash = (hash ^ (unsigned int) status) * 16777619u;
+    hash = (hash ^ (unsigned int) flags) * 16777619u;
+    for (i = 0; i < ct->len; i++) {
+        hash = (hash ^ (unsigned char) ct->data[i]) * 16777619u;
+    }
+    for (i = 0; i < ce->len; i++) {
+        hash = (hash ^ (unsigned char) ce->data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Map the rows of a template in order, it returns the number of entries
+ * set in 'rows'. The content type and encoding positions are reported
+ * through 'ct_idx' and 'ce_idx' (-1 if not present).
+ */
+static int mk_header_tpl_rows(mk_ptr_t *status_line, int flags,
+                              mk_ptr_t *ct, mk_ptr_t *ce,
+                              mk_ptr_t *rows, int *ct_idx, int *ce_idx)
+{
+    int n = 0;
+
+    *ct_idx = -1;
+    *ce_idx = -1;
+
+    rows[n++] = *status_line;
+
+    if (flags & MK_HEADER_TPL_CONN_KA) {
+        rows[n++] = mk_header_conn_ka;
+    }
+    else if (flags & MK_HEADER_TPL_CONN_CLOSE) {
+        rows[n++] = mk_header_conn_close;
+    }
+
+    if (ct->len > 0) {
+        *ct_idx = n;
+        rows[n++] = *ct;
+    }
+
+    if (flags & MK_HEADER_TPL_CHUNKED) {
+        rows[n++] = mk_header_te_chunked;
+    }
+
+    if (ce->len > 0) {
+        rows[n++] = mk_header_content_encoding;
+        *ce_idx = n;
+        rows[n++] = *ce;
+    }
+
+    if (flags & MK_HEADER_TPL_VARY) {
+        rows[n++] = mk_header_vary_encoding;
+    }
+
+    if (flags & MK_HEADER_TPL_LENGTH) {
+        rows[n++] = mk_header_content_length;
+    }
+
+    return n;
+}
+
+/*
+ * Lookup or serialize the template for the response and add it to the
+ * headers IOV. A custom status line or a full table makes the block to be
+ * serialized just for this response.
+ */
+static void mk_header_tpl_add(struct response_headers *sh,
+                              struct mk_iov *iov, int flags,
+                              mk_ptr_t *ct, mk_ptr_t *ce)
+{
+    int i;
+    int n;
+    int ct_idx;
+    int ce_idx;
+    size_t len = 0;
+    char *buf;
+    unsigned int hash = 0;
+    mk_ptr_t status_line;
+    mk_ptr_t rows[8];
+    struct mk_list *head;
+    struct mk_list *bucket = NULL;
+    struct mk_header_tpl *tpl = NULL;
+    struct mk_header_tpl_cache *cache;
+
+    if (sh->status == MK_CUSTOM_STATUS) {
+        status_line = sh->custom_status;
+        cache = NULL;
+    }
+    else {
+        /* Invalid status set */
+        mk_bug(sh->status < 0 || sh->status >= status_response_len ||
+               status_response[sh->status].length == 0);
+
+        status_line.data = status_response[sh->status].response;
+        status_line.len  = status_response[sh->status].length;
+        cache = MK_TLS_GET(mk_tls_header_tpl);
+    }
+
+    if (cache) {
+        hash = mk_header_tpl_hash(sh->status, flags, ct, ce);
+        bucket = &cache->table[hash & (MK_HEADER_TPL_BUCKETS - 1)];
+        mk_list_foreach(head, bucket) {
+            tpl = mk_list_entry(head, struct mk_header_tpl, _head);
+            if (tpl->hash == hash && tpl->status == sh->status &&
+                tpl->flags == flags &&
+                tpl->content_type.len == ct->len &&
+                tpl->content_encoding.len == ce->len &&
+                (ct->len == 0 ||
+                 memcmp(tpl->content_type.data, ct->data, ct->len) == 0) &&
+                (ce->len == 0 ||
+                 memcmp(tpl->content_encoding.data, ce->data, ce->len) == 0)) {
+                mk_iov_add(iov, tpl->block.data, tpl->block.len, MK_FALSE);
+                return;
+            }
+        }
+
+        if (cache->count >= MK_HEADER_TPL_MAX) {
+            cache = NULL;
+        }
+    }
+
+    n = mk_header_tpl_rows(&status_line, flags, ct, ce,
+                           rows, &ct_idx, &ce_idx);
+    for (i = 0; i < n; i++) {
+        len += rows[i].len;
+    }
+
+    if (!cache) {
+        buf = mk_mem_malloc(len);
+        if (!buf) {
+            return;
+        }
+    }
+    else {
+        tpl = mk_mem_malloc(sizeof(struct mk_header_tpl) + len);
+        if (!tpl) {
+            return;
+        }
+        buf = tpl->buf;
+        mk_ptr_reset(&tpl->content_type);
+        mk_ptr_reset(&tpl->content_encoding);
+    }
+
+    len = 0;
+    for (i = 0; i < n; i++) {
+        memcpy(buf + len, rows[i].data, rows[i].len);
+        if (tpl && i == ct_idx) {
+            tpl->content_type.data = buf + len;
+            tpl->content_type.len  = rows[i].len;
+        }
+        else if (tpl && i == ce_idx) {
+            tpl->content_encoding.data = buf + len;
+            tpl->content_encoding.len  = rows[i].len;
+        }
+        len += rows[i].len;
+    }
+
+    if (!cache) {
+        mk_iov_add(iov, buf, len, MK_TRUE);
+        return;
+    }
+
+    tpl->hash   = hash;
+    tpl->status = sh->status;
+    tpl->flags  = flags;
+    tpl->block.data = buf;
+    tpl->block.len  = len;
+    mk_list_add(&tpl->_head, bucket);
+    cache->count++;
+
+    MK_TRACE("[header] new template status=%i flags=%i (%i)",
+             sh->status, flags, cache->count);
+
+    mk_iov_add(iov, tpl->block.data, tpl->block.len, MK_FALSE);
 }
 
 /* Send response headers */
 int mk_header_prepare(struct mk_http_session *cs,
                       struct mk_http_request *sr)
 {
-    int i = 0;
+    int flags;
     unsigned long len = 0;
     char *buffer = 0;
-    mk_ptr_t response;
+    mk_ptr_t none = {NULL, 0};
+    mk_ptr_t *preset;
     struct response_headers *sh;
     struct mk_iov *iov;
 
     sh = &sr->headers;
     iov = &sh->headers_iov;
+    preset = mk_clock_headers_preset();
 
-    /* HTTP Status Code */
-    if (sh->status == MK_CUSTOM_STATUS) {
-        response.data = sh->custom_status.data;
-        response.len = sh->custom_status.len;
+    flags = mk_header_connection(cs, sr);
+    if (sh->vary_encoding == MK_TRUE) {
+        flags |= MK_HEADER_TPL_VARY;
     }
-    else {
-        for (i=0; i < status_response_len; i++) {
-            if (status_response[i].status == sh->status) {
-                response.data = status_response[i].response;
-                response.len  = status_response[i].length;
-                break;
-            }
-        }
+
+    /*
+     * Prebuilt rows (mk_file_cache.c): everything else is fixed for the
+     * file, including the final CRLF.
+     */
+    if (sh->static_rows.len > 0) {
+        mk_header_tpl_add(sh, iov, flags, &none, &none);
+        mk_iov_add(iov,
+                   preset->data,
+                   preset->len,
+                   MK_FALSE);
+        mk_iov_add(iov,
+                   sh->static_rows.data,
+                   sh->static_rows.len,
+                   MK_FALSE);
+        goto stream;
     }
 
-    /* Invalid status set */
-    mk_bug(i == status_response_len);
+    /*
+     * Transfer Encoding: the transfer encoding header is just sent when
+     * the response has some content defined by the HTTP status response
+     */
+    if (sh->transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED) {
+        flags |= MK_HEADER_TPL_CHUNKED;
+    }
+    else if (sh->content_length >= 0) {
+        flags |= MK_HEADER_TPL_LENGTH;
+    }
 
-    mk_iov_add(iov, response.data, response.len, MK_FALSE);
+    /*
+     * Status line, Connection, Content-Type, Transfer-Encoding,
+     * Content-Encoding, Vary and the Content-Length prefix
+     */
+    mk_header_tpl_add(sh, iov, flags,
+                      &sh->content_type, &sh->content_encoding);
+
+    /* Content-Length value */
+    if (flags & MK_HEADER_TPL_LENGTH) {
+        mk_ptr_t cl = {sh->length_buf, 0};
+        mk_string_itop(sh->content_length, &cl);
+        mk_iov_add(iov, cl.data, cl.len, MK_FALSE);
+    }
 
     /*
      * Preset headers (mk_clock.c):
@@ -196,43 +472,33 @@ int mk_header_prepare(struct mk_http_session *cs,
      * - Date
      */
     mk_iov_add(iov,
-               headers_preset.data,
-               headers_preset.len,
+               preset->data,
+               preset->len,
                MK_FALSE);
 
     /* Last-Modified */
-    if (sh->last_modified > 0) {
-        mk_ptr_t *lm = MK_TLS_GET(mk_tls_cache_header_lm);
-        lm->len = mk_utils_utime2gmt(&lm->data, sh->last_modified);
-
+    if (sh->last_modified_str.len > 0) {
         mk_iov_add(iov,
                    mk_header_last_modified.data,
                    mk_header_last_modified.len,
                    MK_FALSE);
         mk_iov_add(iov,
-                   lm->data,
-                   lm->len,
+                   sh->last_modified_str.data,
+                   sh->last_modified_str.len,
                    MK_FALSE);
     }
+    else if (sh->last_modified > 0) {
+        mk_ptr_t lm = {sh->last_modified_buf, 0};
+        lm.len = mk_utils_utime2gmt(&lm.data, sh->last_modified);
 
-    /* Connection */
-    if (sh->connection == 0) {
-        if (cs->close_now == MK_FALSE) {
-            if (sr->connection.len > 0) {
-                if (sr->protocol != MK_HTTP_PROTOCOL_11) {
-                    mk_iov_add(iov,
-                               mk_header_conn_ka.data,
-                               mk_header_conn_ka.len,
-                               MK_FALSE);
-                }
-            }
-        }
-        else {
-            mk_iov_add(iov,
-                       mk_header_conn_close.data,
-                       mk_header_conn_close.len,
-                       MK_FALSE);
-        }
+        mk_iov_add(iov,
+                   mk_header_last_modified.data,
+                   mk_header_last_modified.len,
+                   MK_FALSE);
+        mk_iov_add(iov,
+                   lm.data,
+                   lm.len,
+                   MK_FALSE);
     }
 
     /* Location */
@@ -260,59 +526,11 @@ int mk_header_prepare(struct mk_http_session *cs,
                    MK_FALSE);
     }
 
-    /* Content type */
-    if (sh->content_type.len > 0) {
-        mk_iov_add(iov,
-                   sh->content_type.data,
-                   sh->content_type.len,
-                   MK_FALSE);
-    }
-
-    /*
-     * Transfer Encoding: the transfer encoding header is just sent when
-     * the response has some content defined by the HTTP status response
-     */
-    switch (sh->transfer_encoding) {
-    case MK_HEADER_TE_TYPE_CHUNKED:
-        mk_iov_add(iov,
-                   mk_header_te_chunked.data,
-                   mk_header_te_chunked.len,
-                   MK_FALSE);
-        break;
-    }
-
     /* E-Tag */
     if (sh->etag_len > 0) {
         mk_iov_add(iov, sh->etag_buf, sh->etag_len, MK_FALSE);
     }
 
-    /* Content-Encoding */
-    if (sh->content_encoding.len > 0) {
-        mk_iov_add(iov, mk_header_content_encoding.data,
-                   mk_header_content_encoding.len,
-                   MK_FALSE);
-        mk_iov_add(iov, sh->content_encoding.data,
-                   sh->content_encoding.len,
-                   MK_FALSE);
-    }
-
-    /* Content-Length */
-    if (sh->content_length >= 0 && sh->transfer_encoding != 0) {
-        /* Map content length to MK_POINTER */
-        mk_ptr_t *cl = MK_TLS_GET(mk_tls_cache_header_cl);
-        mk_string_itop(sh->content_length, cl);
-
-        /* Set headers */
-        mk_iov_add(iov,
-                   mk_header_content_length.data,
-                   mk_header_content_length.len,
-                   MK_FALSE);
-        mk_iov_add(iov,
-                   cl->data,
-                   cl->len,
-                   MK_FALSE);
-    }
-
     if ((sh->content_length != 0 && (sh->ranges[0] >= 0 || sh->ranges[1] >= 0)) &&
         mk_config->resume == MK_TRUE) {
         buffer = 0;
@@ -365,6 +583,7 @@ int mk_header_prepare(struct mk_http_session *cs,
     /*
      * Configure the Stream to dispatch the headers
      */
+ stream:
 
     /* Reset callbacks for headers stream */
     mk_stream_set(&sr->headers_stream,
@@ -378,7 +597,7 @@ int mk_header_prepare(struct mk_http_session *cs,
         mk_stream_set(&sr->headers_extra_stream,
                       MK_STREAM_IOV, cs->channel,
                       sr->headers._extra_rows, -1,
-                      NULL,
+                      sr,
                       cb_stream_iov_extended_free, NULL, NULL);
     }
 
@@ -407,9 +626,13 @@ void mk_header_response_reset(struct response_headers *header)
     header->connection = 0;
     header->transfer_encoding = -1;
     header->last_modified = -1;
+    mk_ptr_reset(&header->last_modified_str);
+    mk_ptr_reset(&header->static_rows);
     header->cgi = SH_NOCGI;
+    header->breakline = MK_FALSE;
     mk_ptr_reset(&header->content_type);
     mk_ptr_reset(&header->content_encoding);
+    header->vary_encoding = MK_FALSE;
     header->location = NULL;
     header->_extra_rows = NULL;
     header->allow_methods.len = 0;
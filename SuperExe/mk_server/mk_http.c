@@ -39,6 +39,8 @@
 #include <monkey/mk_header.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_compress.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
 
@@ -63,7 +65,14 @@ void mk_http_request_init(struct mk_http_session *session,
 
     request->port = 0;
     request->status = MK_TRUE;
+    request->init_msec = mk_clock_msec();
     request->uri.data = NULL;
+    request->data.data = NULL;
+    request->data.len = 0;
+    mk_list_init(&request->body_chain);
+    request->body_pending = MK_FALSE;
+    request->body_stream = MK_FALSE;
+    request->body_queued = 0;
     request->method = MK_METHOD_UNKNOWN;
     request->protocol = MK_HTTP_PROTOCOL_UNKNOWN;
     request->connection.len = -1;
@@ -72,11 +81,14 @@ void mk_http_request_init(struct mk_http_session *session,
     request->file_stream.bytes_total = -1;
     request->file_stream.bytes_offset = 0;
     request->file_stream.preserve = MK_FALSE;
-    request->vhost_fdt_id = 0;
-    request->vhost_fdt_hash = 0;
-    request->vhost_fdt_enabled = MK_FALSE;
+    request->vhost_fdt = NULL;
+    request->file_cache = NULL;
+    request->file_cache_gz = NULL;
+    request->compress = NULL;
     request->host.data = NULL;
     request->stage30_blocked = MK_FALSE;
+    request->stage30_handler = NULL;
+    request->stage30_pending = MK_FALSE;
     request->session = session;
     request->host_conf = mk_list_entry_first(host_list, struct host, _head);
     request->uri_processed.data = NULL;
@@ -151,6 +163,11 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     /* Header: Range */
     mk_http_point_header(&sr->range, &cs->parser, MK_HEADER_RANGE);
 
+    /* Header: Accept-Encoding */
+    mk_http_point_header(&sr->accept_encoding,
+                         &cs->parser,
+                         MK_HEADER_ACCEPT_ENCODING);
+
     /* Header: If-Modified-Since */
     mk_http_point_header(&sr->if_modified_since,
                          &cs->parser,
@@ -268,12 +285,98 @@ static void mk_request_premature_close(int http_status, struct mk_http_session *
     mk_http_session_remove(cs);
 }
 
+/* Set the initial request buffer of a session */
+static inline void mk_http_session_buffer(struct mk_http_session *cs)
+{
+    unsigned int size = cs->conn->net->buffer_size;
+
+    if (size > MK_REQUEST_CHUNK) {
+        cs->body = mk_http_buffer_get(&size);
+        cs->body_size = size;
+    }
+
+    if (size <= MK_REQUEST_CHUNK || !cs->body) {
+        /* Buffer size based in Chunk bytes */
+        cs->body = cs->body_fixed;
+        cs->body_size = MK_REQUEST_CHUNK;
+    }
+}
+
+/*
+ * The unparsed data of the current request has been moved, the fields set
+ * by the parser point to the previous location: parse it again.
+ */
+static inline void mk_http_request_reparse(struct mk_http_session *cs)
+{
+    struct mk_http_request *sr;
+
+    if (mk_list_is_empty(&cs->request_list) == 0) {
+        return;
+    }
+
+    sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+    mk_http_request_init(cs, sr);
+    mk_http_parser_init(&cs->parser);
+}
+
+/*
+ * Receive data of a chained request body into the last segment of the
+ * request, never reading beyond the body length so a pipelined request
+ * stays in the socket for the session buffer.
+ */
+static int mk_http_body_read(struct mk_sched_conn *conn,
+                             struct mk_http_session *cs)
+{
+    int bytes;
+    long pending;
+    unsigned int room;
+    struct mk_http_request *sr;
+    struct mk_http_body_segment *seg = NULL;
+
+    sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+    pending = cs->parser.header_content_length - sr->data.len;
+
+    if (mk_list_is_empty(&sr->body_chain) != 0) {
+        seg = mk_list_entry_last(&sr->body_chain,
+                                 struct mk_http_body_segment, _head);
+    }
+    if (!seg || seg->length == seg->size) {
+        seg = mk_http_body_segment_get();
+        if (!seg) {
+            mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs);
+            return -1;
+        }
+        mk_list_add(&seg->_head, &sr->body_chain);
+    }
+
+    room = seg->size - seg->length;
+    if (pending < room) {
+        room = pending;
+    }
+
+    bytes = mk_sched_conn_read(conn, seg->data + seg->length, room);
+    if (bytes == 0) {
+        MK_TRACE("[FD %i] broken pipe?", conn->event.fd);
+        errno = 0;
+        return -1;
+    }
+    else if (bytes == -1) {
+        return -1;
+    }
+
+    seg->length += bytes;
+    sr->data.len += bytes;
+    sr->body_queued += bytes;
+
+    return bytes;
+}
+
 int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs)
 {
     int bytes;
     int max_read;
     int available = 0;
-    int new_size;
+    unsigned int new_size;
     int total_bytes = 0;
     char *tmp = 0;
 
@@ -283,42 +386,55 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs)
 
     MK_TRACE("MAX REQUEST SIZE: %i", mk_config->max_request_size);
 
+    /* A chunked body goes through the session buffer to be decoded */
+    if (cs->body_chained == MK_TRUE && cs->parser.header_chunked == MK_FALSE) {
+        return mk_http_body_read(conn, cs);
+    }
+
  try_pending:
 
     available = cs->body_size - cs->body_length;
     if (available <= 0) {
-        /* Reallocate buffer size if pending data does not have space */
+        /*
+         * The buffer is full but its head holds requests already served:
+         * move the pending data to the start rather than growing it.
+         */
+        if (cs->body_offset > 0 &&
+            cs->status != MK_REQUEST_STATUS_COMPLETED) {
+            cs->body_length -= cs->body_offset;
+            memmove(cs->body, cs->body + cs->body_offset, cs->body_length);
+            cs->body_offset = 0;
+            mk_http_request_reparse(cs);
+            goto try_pending;
+        }
+
+        /* Get a bigger buffer if pending data does not have space */
         new_size = cs->body_size + conn->net->buffer_size;
-        if (new_size > mk_config->max_request_size) {
+        if (new_size > (unsigned int) mk_config->max_request_size ||
+            cs->body_chained == MK_TRUE) {
             MK_TRACE("Requested size is > mk_config->max_request_size");
             mk_request_premature_close(MK_CLIENT_REQUEST_ENTITY_TOO_LARGE, cs);
             return -1;
         }
 
-        /*
-         * Check if the body field still points to the initial body_fixed, if so,
-         * allow the new space required in body, otherwise perform a realloc over
-         * body.
-         */
-        if (cs->body == cs->body_fixed) {
-            cs->body = mk_mem_malloc(new_size + 1);
-            cs->body_size = new_size;
-            memcpy(cs->body, cs->body_fixed, cs->body_length);
-            MK_TRACE("[FD %i] New size: %i, length: %i",
-                     socket, new_size, cs->body_length);
+        tmp = mk_http_buffer_get(&new_size);
+        if (!tmp) {
+            mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs);
+            return -1;
         }
-        else {
-            MK_TRACE("[FD %i] Realloc from %i to %i",
-                     socket, cs->body_size, new_size);
-            tmp = mk_mem_realloc(cs->body, new_size + 1);
-            if (tmp) {
-                cs->body = tmp;
-                cs->body_size = new_size;
-            }
-            else {
-                mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs);
-                return -1;
-            }
+
+        MK_TRACE("[FD %i] New size: %i, length: %i",
+                 socket, new_size, cs->body_length);
+
+        memcpy(tmp, cs->body, cs->body_length);
+        if (cs->body != cs->body_fixed) {
+            mk_http_buffer_put(cs->body, cs->body_size);
+        }
+        cs->body = tmp;
+        cs->body_size = new_size;
+
+        if (cs->status != MK_REQUEST_STATUS_COMPLETED) {
+            mk_http_request_reparse(cs);
         }
     }
 
@@ -603,22 +719,174 @@ static inline void mk_http_cb_file_on_consume(struct mk_stream *stream, long byt
 }
 #endif
 
+/*
+ * Get the information of the requested file, if it's in the worker file
+ * cache no system call is made and the entry is associated to the request.
+ */
+static inline int mk_http_file_info(struct mk_http_request *sr)
+{
+    struct mk_file_cache_entry *fc;
+
+    fc = mk_file_cache_get(&sr->real_path);
+    if (fc) {
+        sr->file_cache = fc;
+        sr->file_info = fc->info;
+        return 0;
+    }
+
+    return mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
+}
+
+/* The representation of the file depends on the Accept-Encoding header */
+static inline int mk_http_encoding_varies(struct mk_http_request *sr,
+                                          struct mimetype *mime)
+{
+    if (mime->compress == MK_FALSE || sr->range.data ||
+        sr->file_info.size < MK_COMPRESS_MIN_SIZE) {
+        return MK_FALSE;
+    }
+
+    if (mk_config->compression == MK_FALSE &&
+        mk_config->compression_static == MK_FALSE) {
+        return MK_FALSE;
+    }
+
+    return MK_TRUE;
+}
+
+/*
+ * Content negotiation for compressible files: use the precompressed
+ * sidecar if there is one, otherwise the compressed copy kept by the
+ * worker. On success the file stream and the headers describe the encoded
+ * representation and 'body' points to it if it's in memory.
+ */
+static int mk_http_encoding(struct mk_http_request *sr,
+                            struct mk_file_cache_entry *fc,
+                            struct mimetype *mime, char **body)
+{
+    int encoding;
+    int accepted;
+    struct response_headers *sh = &sr->headers;
+    struct mk_file_cache_entry *gz = NULL;
+    struct mk_compress_entry *ce = NULL;
+
+    if (mk_http_encoding_varies(sr, mime) == MK_FALSE) {
+        return -1;
+    }
+
+    /* The response depends on the header from now on */
+    sh->vary_encoding = MK_TRUE;
+
+    if (!sr->accept_encoding.data) {
+        return -1;
+    }
+
+    accepted = mk_compress_accept(&sr->accept_encoding);
+    if (accepted & (1 << MK_COMPRESS_GZIP)) {
+        encoding = MK_COMPRESS_GZIP;
+    }
+    else if (accepted & (1 << MK_COMPRESS_DEFLATE)) {
+        encoding = MK_COMPRESS_DEFLATE;
+    }
+    else {
+        return -1;
+    }
+
+    if (fc && encoding == MK_COMPRESS_GZIP &&
+        mk_config->compression_static == MK_TRUE) {
+        gz = mk_compress_static(fc);
+    }
+
+    if (gz) {
+        sr->file_cache_gz = gz;
+        sr->file_stream.fd = gz->fd;
+        sh->content_length = gz->info.size;
+        *body = gz->content;
+    }
+    else if (mk_config->compression == MK_TRUE) {
+        ce = mk_compress_get(&sr->real_path, &sr->file_info, encoding);
+        if (!ce) {
+            ce = mk_compress_add(&sr->real_path, &sr->file_info, encoding,
+                                 fc ? fc->content : NULL);
+        }
+        if (!ce) {
+            return -1;
+        }
+
+        /* Known to not shrink */
+        if (!ce->data) {
+            mk_compress_put(ce);
+            return -1;
+        }
+
+        sr->compress = ce;
+        sh->content_length = ce->len;
+        *body = ce->data;
+    }
+    else {
+        return -1;
+    }
+
+    MK_TRACE("[FD %i] Content-Encoding %s", sr->session->socket,
+             mk_compress_names[encoding].data);
+
+    sh->content_encoding = mk_compress_names[encoding];
+    sh->etag_len = mk_compress_etag(sh->etag_buf, &sr->file_info, encoding);
+    sh->real_length = sh->content_length;
+    sr->file_stream.bytes_offset = 0;
+    sr->file_stream.bytes_total  = sh->content_length;
+
+    return 0;
+}
+
+/*
+ * A request can be served before its body is complete when the length is
+ * known and the stage30 handler matching it implements stage30_body.
+ */
+static inline int mk_http_body_streamable(struct mk_http_session *cs,
+                                          struct mk_http_request *sr)
+{
+    struct mk_host_handler *h_handler;
+
+    if (cs->parser.header_chunked == MK_TRUE ||
+        sr->stage30_blocked == MK_TRUE) {
+        return MK_FALSE;
+    }
+
+    sr->uri_processed.data[sr->uri_processed.len] = '\0';
+    h_handler = mk_vhost_handler_match(sr->host_conf,
+                                       sr->uri_processed.data,
+                                       sr->uri_processed.len,
+                                       NULL);
+    if (!h_handler || !h_handler->handler->stage->stage30_body) {
+        return MK_FALSE;
+    }
+
+    return MK_TRUE;
+}
+
 int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
 {
     int ret;
     int ret_file;
     struct mimetype *mime;
-    struct mk_list *head;
-    struct mk_list *handlers;
+    struct mk_file_cache_entry *fc;
     struct mk_plugin *plugin;
     struct mk_host_handler *h_handler;
     size_t index_length;
     size_t index_bytes;
     char *index_path = NULL;
+    char *body = NULL;
 
 
     MK_TRACE("[FD %i] HTTP Protocol Init, session %p", cs->socket, sr);
 
+    /* While the body arrives only a handler taking it as a stream can run */
+    if (sr->body_pending == MK_TRUE &&
+        mk_http_body_streamable(cs, sr) == MK_FALSE) {
+        return MK_EXIT_BODY_PENDING;
+    }
+
     /* Request to root path of the virtualhost in question */
     if (sr->uri_processed.len == 1 && sr->uri_processed.data[0] == '/') {
         sr->real_path.data = sr->host_conf->documentroot.data;
@@ -668,28 +936,27 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
         return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
     }
 
-    ret_file = mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
+    ret_file = mk_http_file_info(sr);
 
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
+        int uri_len;
         char *uri;
 
         if (!index_path) {
             sr->uri_processed.data[sr->uri_processed.len] = '\0';
             uri = sr->uri_processed.data;
+            uri_len = sr->uri_processed.len;
         }
         else {
             uri = sr->real_path.data + index_bytes;
+            uri_len = strlen(uri);
         }
 
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_host_handler, _head);
-            if (regexec(&h_handler->match,
-                        uri, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        h_handler = NULL;
+        while ((h_handler = mk_vhost_handler_match(sr->host_conf,
+                                                   uri, uri_len,
+                                                   h_handler))) {
             plugin = h_handler->handler;
             sr->stage30_handler = h_handler->handler;
             ret = plugin->stage->stage30(plugin, cs, sr,
@@ -711,6 +978,9 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
                 return MK_EXIT_OK;
             }
         }
+
+        /* No handler took the request */
+        sr->stage30_handler = NULL;
     }
 
     /* If there is no handler and the resource don't exists, raise a 404 */
@@ -749,8 +1019,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
             }
             sr->real_path.len  = index_length;
 
-            ret = mk_file_get_info(sr->real_path.data,
-                                   &sr->file_info, MK_FILE_READ);
+            ret = mk_http_file_info(sr);
             if (ret != 0) {
                 return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
             }
@@ -817,12 +1086,6 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
         return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
     }
 
-    /* Matching MimeType  */
-    mime = mk_mimetype_find(&sr->real_path);
-    if (!mime) {
-        mime = mimetype_default;
-    }
-
     if (sr->file_info.is_directory == MK_TRUE) {
         return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
     }
@@ -832,13 +1095,35 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
         return mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr);
     }
 
+    fc = sr->file_cache;
+    if (!fc) {
+        /* Matching MimeType  */
+        mime = mk_mimetype_find(&sr->real_path);
+        if (!mime) {
+            mime = mimetype_default;
+        }
+
+        /* Register the file, it opens the file descriptor */
+        fc = mk_file_cache_add(&sr->real_path, &sr->file_info, mime);
+        sr->file_cache = fc;
+    }
+
     /* Configure some headers */
     sr->headers.last_modified = sr->file_info.last_modification;
-    sr->headers.etag_len = snprintf(sr->headers.etag_buf,
-                                    MK_HEADER_ETAG_SIZE,
-                                    "ETag: \"%x-%zx\"\r\n",
-                                    (unsigned int) sr->file_info.last_modification,
-                                    sr->file_info.size);
+    if (fc) {
+        mime = fc->mime;
+        memcpy(sr->headers.etag_buf, fc->etag, fc->etag_len);
+        sr->headers.etag_len = fc->etag_len;
+        sr->headers.last_modified_str.data = fc->lm;
+        sr->headers.last_modified_str.len  = fc->lm_len;
+    }
+    else {
+        sr->headers.etag_len = snprintf(sr->headers.etag_buf,
+                                        MK_HEADER_ETAG_SIZE,
+                                        "ETag: \"%x-%zx\"\r\n",
+                                        (unsigned int) sr->file_info.last_modification,
+                                        sr->file_info.size);
+    }
 
     if (sr->if_modified_since.data && sr->method == MK_METHOD_GET) {
         time_t date_client;       /* Date sent by client */
@@ -850,6 +1135,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
         if (date_file_server <= date_client &&
             date_client > 0) {
             mk_header_set_http_status(sr, MK_NOT_MODIFIED);
+            sr->headers.vary_encoding = mk_http_encoding_varies(sr, mime);
             mk_header_prepare(cs, sr);
             return MK_EXIT_OK;
         }
@@ -862,19 +1148,30 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
 
     /* Open file */
     if (mk_likely(sr->file_info.size > 0)) {
-        sr->file_stream.fd = mk_vhost_open(sr);
-        if (sr->file_stream.fd == -1) {
+        if (fc) {
+            sr->file_stream.fd = fc->fd;
+        }
+        else {
+            sr->file_stream.fd = mk_vhost_open(sr);
+        }
+        if (sr->file_stream.fd == -1 && (!fc || !fc->content)) {
             MK_TRACE("open() failed");
             return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
         }
         sr->file_stream.bytes_offset = 0;
         sr->file_stream.bytes_total  = sr->file_info.size;
+        if (fc) {
+            body = fc->content;
+        }
     }
 
     /* Process methods */
     if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) {
         sr->headers.content_type = mime->header_type;
 
+        /* Content-Encoding */
+        mk_http_encoding(sr, fc, mime, &body);
+
         /* HTTP Ranges */
         if (sr->range.data != NULL && mk_config->resume == MK_TRUE) {
             if (mk_http_range_parse(sr) < 0) {
@@ -900,6 +1197,18 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
         mk_ptr_reset(&sr->headers.content_type);
     }
 
+    /*
+     * Small cached files answered with a plain 200 use the header rows
+     * serialized by the file cache, unless a plugin added its own rows.
+     */
+    if (fc && fc->rows.len > 0 &&
+        sr->headers.status == MK_HTTP_OK &&
+        (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) &&
+        !sr->headers._extra_rows &&
+        sr->headers.content_encoding.len == 0) {
+        sr->headers.static_rows = fc->rows;
+    }
+
     /* Send headers */
     mk_header_prepare(cs, sr);
     if (mk_unlikely(sr->headers.content_length == 0)) {
@@ -909,7 +1218,13 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
     /* Send file content */
     if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_POST) {
         /* Note: bytes and offsets are set after the Range check */
-        sr->file_stream.type = MK_STREAM_FILE;
+        if (body) {
+            sr->file_stream.type   = MK_STREAM_RAW;
+            sr->file_stream.buffer = body;
+        }
+        else {
+            sr->file_stream.type = MK_STREAM_FILE;
+        }
         mk_channel_append_stream(cs->channel, &sr->file_stream);
     }
 
@@ -977,47 +1292,366 @@ int mk_http_keepalive_check(struct mk_http_session *cs,
 static inline void mk_http_request_ka_next(struct mk_http_session *cs)
 {
     cs->body_length = 0;
+    cs->body_offset = 0;
     cs->counter_connections++;
 
+    /* Hand the buffer back, a grown one is not kept for the next request */
+    if (cs->body != cs->body_fixed) {
+        mk_http_buffer_put(cs->body, cs->body_size);
+        mk_http_session_buffer(cs);
+    }
+    cs->body_chained = MK_FALSE;
+    cs->body_paused = MK_FALSE;
+
     /* Update data for scheduler */
-    cs->init_time = log_current_utime;
+    cs->init_time = mk_clock_utime();
     cs->status = MK_REQUEST_STATUS_INCOMPLETE;
 
     /* Initialize parser */
     mk_http_parser_init(&cs->parser);
 }
 
+/*
+ * Parse and prepare the pipelined requests that are already complete in the
+ * body buffer. Their responses are appended to the channel after the current
+ * one, so the scheduler flushes all of them with the same write round. The
+ * batch stops at a request served by a plugin, the ones after it are
+ * processed once its response has been flushed.
+ */
+static void mk_http_request_pipeline(struct mk_http_session *cs)
+{
+    int ret;
+    int status;
+    struct mk_http_request *sr;
+
+    while (cs->body_offset < cs->body_length) {
+        sr = mk_list_entry_last(&cs->request_list,
+                                struct mk_http_request, _head);
+        if (sr->stage30_pending == MK_TRUE || cs->close_now == MK_TRUE) {
+            return;
+        }
+
+        /*
+         * A handler that ended the request may still link streams from
+         * its callbacks (e.g: dirlisting rows), the next response must
+         * wait until the channel is flushed.
+         */
+        if (sr->stage30_handler) {
+            return;
+        }
+
+        /* Our pipeline request limit is the same that our keepalive limit */
+        if (cs->counter_connections >= mk_config->max_keep_alive_request) {
+            return;
+        }
+
+        sr = mk_mem_malloc_z(sizeof(struct mk_http_request));
+        if (!sr) {
+            return;
+        }
+        mk_http_request_init(cs, sr);
+        mk_http_parser_init(&cs->parser);
+
+        status = mk_http_parser(sr, &cs->parser,
+                                cs->body + cs->body_offset,
+                                cs->body_length - cs->body_offset);
+        if (status == MK_HTTP_PARSER_PENDING) {
+            /* Incomplete, it will be parsed again once the batch ends */
+            mk_mem_free(sr);
+            return;
+        }
+
+        cs->counter_connections++;
+        mk_list_add(&sr->_head, &cs->request_list);
+
+        if (status == MK_HTTP_PARSER_ERROR) {
+            /* A response error may have been enqueued by the parser */
+            cs->close_now = MK_TRUE;
+            return;
+        }
+
+        MK_TRACE("[FD %i] Pipelined request at offset %u",
+                 cs->socket, cs->body_offset);
+
+        cs->body_offset += cs->parser.i + 1;
+        ret = mk_http_request_prepare(cs, sr);
+        if (ret == MK_PLUGIN_RET_CONTINUE) {
+            sr->stage30_pending = MK_TRUE;
+        }
+        else if (ret == MK_EXIT_ABORT) {
+            cs->close_now = MK_TRUE;
+        }
+    }
+}
+
+/* Stop reading the request body until the handler releases some data */
+static void mk_http_body_pause(struct mk_http_session *cs)
+{
+    struct mk_sched_conn *conn = cs->conn;
+
+    MK_TRACE("[FD %i] Request body paused", cs->socket);
+    cs->body_paused = MK_TRUE;
+    mk_event_add(mk_sched_loop(), conn->event.fd, MK_EVENT_CONNECTION,
+                 (conn->event.mask & MK_EVENT_WRITE) ?
+                 MK_EVENT_WRITE : MK_EVENT_SLEEP,
+                 conn);
+}
+
+static void mk_http_body_resume(struct mk_http_session *cs)
+{
+    struct mk_sched_conn *conn = cs->conn;
+
+    MK_TRACE("[FD %i] Request body resumed", cs->socket);
+    cs->body_paused = MK_FALSE;
+    mk_event_add(mk_sched_loop(), conn->event.fd, MK_EVENT_CONNECTION,
+                 MK_EVENT_READ | (conn->event.mask & MK_EVENT_WRITE),
+                 conn);
+}
+
+/* A stage30 handler is done with a segment of a streamed request body */
+void mk_http_body_release(struct mk_http_session *cs,
+                          struct mk_http_request *sr,
+                          struct mk_http_body_segment *seg)
+{
+    mk_list_del(&seg->_head);
+    sr->body_queued -= seg->length;
+    mk_http_body_segment_put(seg);
+
+    if (cs->body_paused == MK_TRUE && sr->body_queued < MK_HTTP_BODY_WINDOW) {
+        mk_http_body_resume(cs);
+    }
+}
+
+static inline int mk_http_body_complete(struct mk_http_session *cs,
+                                        struct mk_http_request *sr)
+{
+    if (cs->parser.header_chunked == MK_TRUE) {
+        return (cs->chunked.state == MK_HTTP_CHUNKED_DONE);
+    }
+
+    return (sr->data.len >= (unsigned long) cs->parser.header_content_length);
+}
+
+/*
+ * Decode the chunked body data in the session buffer, what follows the
+ * last chunk (a pipelined request) is kept at cs->body_offset. It returns
+ * zero or the HTTP status to close the session with.
+ */
+static int mk_http_body_decode(struct mk_http_session *cs,
+                               struct mk_http_request *sr)
+{
+    int n;
+    int len;
+    unsigned long bytes = 0;
+
+    len = cs->body_length - cs->body_offset;
+    n = mk_http_body_dechunk(&cs->chunked, cs->body + cs->body_offset, len,
+                             &sr->body_chain, &bytes);
+    if (n == -1) {
+        return MK_CLIENT_BAD_REQUEST;
+    }
+
+    sr->data.len += bytes;
+    sr->body_queued += bytes;
+    if (sr->data.len > (unsigned long) mk_config->max_request_size) {
+        return MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    if (n < len) {
+        memmove(cs->body + cs->body_offset, cs->body + cs->body_offset + n,
+                len - n);
+    }
+    cs->body_length -= n;
+
+    return 0;
+}
+
+/* Handle the result of preparing a request whose body was chained */
+static void mk_http_body_status(struct mk_http_session *cs,
+                                struct mk_http_request *sr, int ret)
+{
+    if (ret == MK_EXIT_BODY_PENDING) {
+        return;
+    }
+
+    if (ret == MK_PLUGIN_RET_CONTINUE) {
+        sr->stage30_pending = MK_TRUE;
+        if (sr->body_pending == MK_TRUE) {
+            sr->body_stream = MK_TRUE;
+        }
+    }
+    else if (ret == MK_EXIT_ABORT || sr->body_pending == MK_TRUE) {
+        /* Answered before the body was received */
+        cs->close_now = MK_TRUE;
+    }
+
+    if (sr->body_pending == MK_FALSE) {
+        mk_sched_conn_timeout_del(cs->conn);
+        mk_http_request_pipeline(cs);
+    }
+}
+
+/*
+ * The headers of a request with a large or chunked body have been parsed:
+ * from now on the body is received into the request body chain instead of
+ * growing the session buffer. The request is prepared right away so a
+ * stage30 handler can take the body as it arrives, otherwise the handler
+ * runs once the body is complete.
+ *
+ * It returns 1 if the request was prepared, 0 if this request does not
+ * use a body chain and -1 if the session was closed.
+ */
+static int mk_http_body_start(struct mk_http_session *cs,
+                              struct mk_http_request *sr)
+{
+    int ret;
+    int len;
+    struct mk_http_parser *p = &cs->parser;
+
+    if (p->level != REQ_LEVEL_BODY ||
+        sr->protocol == MK_HTTP_PROTOCOL_UNKNOWN) {
+        return 0;
+    }
+
+    if (p->header_chunked == MK_FALSE &&
+        p->header_content_length <= MK_HTTP_BODY_CHAIN) {
+        return 0;
+    }
+
+    if (p->header_content_length > mk_config->max_request_size) {
+        mk_request_premature_close(MK_CLIENT_REQUEST_ENTITY_TOO_LARGE, cs);
+        return -1;
+    }
+
+    /* Everything after the headers is body data */
+    cs->body_offset += p->start;
+    cs->body_chained = MK_TRUE;
+    sr->body_pending = MK_TRUE;
+
+    if (p->header_chunked == MK_TRUE) {
+        memset(&cs->chunked, 0, sizeof(struct mk_http_chunked));
+        ret = mk_http_body_decode(cs, sr);
+        if (ret != 0) {
+            mk_request_premature_close(ret, cs);
+            return -1;
+        }
+    }
+    else {
+        len = cs->body_length - cs->body_offset;
+        if (mk_http_body_append(&sr->body_chain,
+                                cs->body + cs->body_offset, len) != 0) {
+            mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs);
+            return -1;
+        }
+        sr->data.len += len;
+        sr->body_queued += len;
+        cs->body_length = cs->body_offset;
+    }
+
+    if (mk_http_body_complete(cs, sr)) {
+        sr->body_pending = MK_FALSE;
+        cs->body_chained = MK_FALSE;
+    }
+
+    if (mk_http_status_completed(cs, cs->conn) == -1) {
+        mk_http_session_remove(cs);
+        return -1;
+    }
+
+    ret = mk_http_request_prepare(cs, sr);
+    mk_http_body_status(cs, sr, ret);
+
+    return 1;
+}
+
+/* New data of a chained request body has been received */
+static int mk_http_body_received(struct mk_http_session *cs)
+{
+    int ret;
+    struct mk_plugin *handler;
+    struct mk_http_request *sr;
+
+    sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+
+    if (cs->parser.header_chunked == MK_TRUE) {
+        ret = mk_http_body_decode(cs, sr);
+        if (ret != 0) {
+            mk_request_premature_close(ret, cs);
+            return -1;
+        }
+    }
+
+    if (mk_http_body_complete(cs, sr)) {
+        sr->body_pending = MK_FALSE;
+        cs->body_chained = MK_FALSE;
+    }
+
+    if (sr->body_stream == MK_TRUE) {
+        handler = sr->stage30_handler;
+        handler->stage->stage30_body(handler, cs, sr);
+
+        if (sr->body_pending == MK_FALSE) {
+            mk_sched_conn_timeout_del(cs->conn);
+        }
+        else if (sr->body_queued >= MK_HTTP_BODY_WINDOW &&
+                 cs->body_paused == MK_FALSE) {
+            mk_http_body_pause(cs);
+        }
+    }
+    else if (sr->body_pending == MK_FALSE) {
+        /* The handler waited for the whole body */
+        ret = mk_http_init(cs, sr);
+        mk_http_body_status(cs, sr, ret);
+    }
+
+    return 0;
+}
+
 int mk_http_request_end(struct mk_http_session *cs)
 {
     int ret;
     int status;
     struct mk_http_request *sr;
 
+    /* The response was sent before the whole body was received */
+    if (mk_list_is_empty(&cs->request_list) != 0) {
+        sr = mk_list_entry_first(&cs->request_list,
+                                 struct mk_http_request, _head);
+        if (sr->body_pending == MK_TRUE) {
+            cs->close_now = MK_TRUE;
+        }
+    }
+
     if (mk_config->max_keep_alive_request <= cs->counter_connections) {
         cs->close_now = MK_TRUE;
         goto shutdown;
     }
 
     /* Check if we have some enqueued pipeline requests */
-    ret = mk_http_parser_more(&cs->parser, cs->body_length);
-    if (ret == MK_TRUE) {
+    if (cs->body_offset < cs->body_length && cs->close_now == MK_FALSE) {
 
         /* Our pipeline request limit is the same that our keepalive limit */
         cs->counter_connections++;
 
-        memmove(cs->body,
-                cs->body + cs->parser.i + 1,
-                abs(cs->body_length - cs->parser.i) -1);
-        cs->body_length = abs(cs->body_length - cs->parser.i) -1;
-
         /* Prepare for next one */
-        sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
-        mk_http_request_free(sr);
+        mk_http_request_free_list(cs);
+        sr = &cs->sr_fixed;
         mk_http_request_init(cs, sr);
+        mk_list_add(&sr->_head, &cs->request_list);
         mk_http_parser_init(&cs->parser);
-        status = mk_http_parser(sr, &cs->parser, cs->body, cs->body_length);
+
+        status = mk_http_parser(sr, &cs->parser,
+                                cs->body + cs->body_offset,
+                                cs->body_length - cs->body_offset);
         if (status == MK_HTTP_PARSER_OK) {
-            mk_http_request_prepare(cs, sr);
+            cs->status = MK_REQUEST_STATUS_COMPLETED;
+            cs->body_offset += cs->parser.i + 1;
+            ret = mk_http_request_prepare(cs, sr);
+            if (ret == MK_PLUGIN_RET_CONTINUE) {
+                sr->stage30_pending = MK_TRUE;
+            }
+            mk_http_request_pipeline(cs);
+
             /*
              * Return 1 means, we still have more data to send in a different
              * scheduler round.
@@ -1025,7 +1659,8 @@ int mk_http_request_end(struct mk_http_session *cs)
             return 1;
         }
         else if (status == MK_HTTP_PARSER_PENDING) {
-            return 0;
+            cs->status = MK_REQUEST_STATUS_INCOMPLETE;
+            return mk_http_body_start(cs, sr);
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
             cs->close_now = MK_TRUE;
@@ -1174,6 +1809,12 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
                                  mk_config->server_signature,
                                  &page.data, &page.len);
         break;
+    case MK_SERVER_SERVICE_UNAV:
+        ret = mk_http_error_page("Service Unavailable",
+                                 &sr->uri,
+                                 mk_config->server_signature,
+                                 &page.data, &page.len);
+        break;
     }
 
     if (page.len > 0 && sr->method != MK_METHOD_HEAD && sr->method != MK_METHOD_UNKNOWN) {
@@ -1250,7 +1891,7 @@ void mk_http_session_remove(struct mk_http_session *cs)
     }
 
     if (cs->body != cs->body_fixed) {
-        mk_mem_free(cs->body);
+        mk_http_buffer_put(cs->body, cs->body_size);
     }
     mk_http_request_free_list(cs);
     mk_list_del(&cs->request_list);
@@ -1302,18 +1943,13 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn)
     cs->init_time = conn->arrive_time;
 
     /* alloc space for body content */
-    if (conn->net->buffer_size > MK_REQUEST_CHUNK) {
-        cs->body = mk_mem_malloc(conn->net->buffer_size);
-        cs->body_size = conn->net->buffer_size;
-    }
-    else {
-        /* Buffer size based in Chunk bytes */
-        cs->body = cs->body_fixed;
-        cs->body_size = MK_REQUEST_CHUNK;
-    }
+    mk_http_session_buffer(cs);
 
     /* Current data length */
     cs->body_length = 0;
+    cs->body_offset = 0;
+    cs->body_chained = MK_FALSE;
+    cs->body_paused = MK_FALSE;
 
     /* Init session request list */
     mk_list_init(&cs->request_list);
@@ -1327,13 +1963,36 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn)
 
 void mk_http_request_free(struct mk_http_request *sr)
 {
-    /* Let the vhost interface to handle the session close */
-    mk_vhost_close(sr);
+    /* Files from the cache are not owned by the request */
+    if (sr->file_cache) {
+        mk_file_cache_put(sr->file_cache);
+        sr->file_cache = NULL;
+    }
+    else {
+        /* Let the vhost interface to handle the session close */
+        mk_vhost_close(sr);
+    }
+
+    if (sr->file_cache_gz) {
+        mk_file_cache_put(sr->file_cache_gz);
+        sr->file_cache_gz = NULL;
+    }
+
+    if (sr->compress) {
+        mk_compress_put(sr->compress);
+        sr->compress = NULL;
+    }
 
     if (sr->headers.location) {
         mk_mem_free(sr->headers.location);
     }
 
+    /* Extra header rows that were never sent */
+    if (sr->headers._extra_rows) {
+        mk_iov_free(sr->headers._extra_rows);
+        sr->headers._extra_rows = NULL;
+    }
+
     if (sr->uri_processed.data != sr->uri.data) {
         mk_ptr_free(&sr->uri_processed);
     }
@@ -1341,6 +2000,8 @@ void mk_http_request_free(struct mk_http_request *sr)
     if (sr->real_path.data != sr->real_path_static) {
         mk_ptr_free(&sr->real_path);
     }
+
+    mk_http_body_free(&sr->body_chain);
 }
 
 void mk_http_request_free_list(struct mk_http_session *cs)
@@ -1426,6 +2087,21 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
     /* Invoke the read handler, on this case we only support HTTP (for now :) */
     ret = mk_http_handler_read(conn, cs);
     if (ret > 0) {
+        if (cs->body_chained == MK_TRUE) {
+            if (mk_http_body_received(cs) == -1) {
+                return -1;
+            }
+            return ret;
+        }
+
+        /*
+         * Data received while a response is in progress belongs to a
+         * pipelined request, it's parsed once the current one ends.
+         */
+        if (cs->status == MK_REQUEST_STATUS_COMPLETED) {
+            return ret;
+        }
+
         if (mk_list_is_empty(&cs->request_list) == 0) {
             /* Add the first entry */
             sr = &cs->sr_fixed;
@@ -1436,7 +2112,9 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
             sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
         }
         status = mk_http_parser(sr, &cs->parser,
-                                cs->body, cs->body_length);
+                                cs->body + cs->body_offset,
+                                cs->body_length - cs->body_offset);
+
         if (status == MK_HTTP_PARSER_OK) {
             MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
             if (mk_http_status_completed(cs, conn) == -1) {
@@ -1444,7 +2122,12 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
                 return -1;
             }
             mk_sched_conn_timeout_del(conn);
-            mk_http_request_prepare(cs, sr);
+            cs->body_offset += cs->parser.i + 1;
+            status = mk_http_request_prepare(cs, sr);
+            if (status == MK_PLUGIN_RET_CONTINUE) {
+                sr->stage30_pending = MK_TRUE;
+            }
+            mk_http_request_pipeline(cs);
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
             /* The HTTP parser may enqueued some response error */
@@ -1457,6 +2140,9 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
         }
         else {
             MK_TRACE("[FD %i] HTTP_PARSER_PENDING", socket);
+            if (mk_http_body_start(cs, sr) == -1) {
+                return -1;
+            }
         }
     }
 
@@ -1483,19 +2169,49 @@ int mk_http_sched_close(struct mk_sched_conn *conn,
     return 0;
 }
 
+/*
+ * The channel has been flushed: finish the requests of the session and
+ * continue with the next pipelined ones, if any.
+ */
+int mk_http_request_done(struct mk_http_session *cs)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_request *sr;
+
+    /*
+     * Responses are flushed in the order of the requests, every request
+     * before one still served by a plugin is done. That one ends through
+     * mk_plugin_http_request_end(), a request still waiting for its body
+     * is prepared once the body arrives.
+     */
+    mk_list_foreach_safe(head, tmp, &cs->request_list) {
+        sr = mk_list_entry(head, struct mk_http_request, _head);
+        if (sr->stage30_pending == MK_TRUE || sr->body_pending == MK_TRUE) {
+            return 0;
+        }
+
+        mk_plugin_stage_run_40(cs, sr);
+        if (head->next != &cs->request_list) {
+            mk_list_del(&sr->_head);
+            mk_http_request_free(sr);
+            if (sr != &cs->sr_fixed) {
+                mk_mem_free(sr);
+            }
+        }
+    }
+
+    return mk_http_request_end(cs);
+}
+
 int mk_http_sched_done(struct mk_sched_conn *conn,
                        struct mk_sched_worker *worker)
 {
     (void) worker;
     struct mk_http_session *cs;
-    struct mk_http_request *sr;
 
     cs = mk_http_session_get(conn);
-    sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
-
-    mk_plugin_stage_run_40(cs, sr);
-
-    return mk_http_request_end(cs);
+    return mk_http_request_done(cs);
 }
 
 struct mk_sched_handler mk_http_handler = {
@@ -0,0 +1,321 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http_buffer.h>
+#include <monkey/mk_tls.h>
+
+#ifndef PTHREAD_TLS
+#include <monkey/mk_http_buffer_tls.h>
+#endif
+
+/* This function is called when a worker thread is created */
+void mk_http_buffer_worker_init()
+{
+    int i;
+    struct mk_http_buffer_pool *pool;
+
+    pool = mk_mem_malloc_z(sizeof(struct mk_http_buffer_pool));
+    for (i = 0; i < MK_HTTP_BUFFER_CLASSES; i++) {
+        mk_list_init(&pool->idle[i]);
+    }
+    MK_TLS_SET(mk_tls_http_buffers, pool);
+}
+
+void mk_http_buffer_worker_exit()
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_buffer_pool *pool;
+
+    pool = MK_TLS_GET(mk_tls_http_buffers);
+    if (!pool) {
+        return;
+    }
+
+    for (i = 0; i < MK_HTTP_BUFFER_CLASSES; i++) {
+        mk_list_foreach_safe(head, tmp, &pool->idle[i]) {
+            mk_list_del(head);
+            mk_mem_free(head);
+        }
+    }
+    mk_mem_free(pool);
+    MK_TLS_SET(mk_tls_http_buffers, NULL);
+}
+
+/* Size class able to hold 'bytes', -1 if it's bigger than the last one */
+static inline int mk_http_buffer_class(size_t bytes)
+{
+    int i;
+
+    for (i = 0; i < MK_HTTP_BUFFER_CLASSES; i++) {
+        if (bytes <= ((size_t) MK_HTTP_BUFFER_MIN << i)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Get a buffer with room for at least '*size' bytes plus a NULL byte, on
+ * return '*size' is set to the usable size of the buffer. Buffers must be
+ * released with mk_http_buffer_put() and the same size.
+ */
+char *mk_http_buffer_get(unsigned int *size)
+{
+    int c;
+    size_t bytes;
+    struct mk_list *head;
+    struct mk_http_buffer_pool *pool;
+
+    c = mk_http_buffer_class(*size + 1);
+    if (c == -1) {
+        /* Too big to be pooled */
+        return mk_mem_malloc(*size + 1);
+    }
+
+    bytes = (size_t) MK_HTTP_BUFFER_MIN << c;
+    *size = bytes - 1;
+
+    pool = MK_TLS_GET(mk_tls_http_buffers);
+    if (pool && pool->count[c] > 0) {
+        head = pool->idle[c].next;
+        mk_list_del(head);
+        pool->count[c]--;
+        return (char *) head;
+    }
+
+    return mk_mem_malloc(bytes);
+}
+
+/* Return a buffer to the worker pool or release it */
+void mk_http_buffer_put(char *buf, unsigned int size)
+{
+    int c;
+    struct mk_list *head;
+    struct mk_http_buffer_pool *pool;
+
+    c = mk_http_buffer_class(size + 1);
+    if (c >= 0 && ((size_t) MK_HTTP_BUFFER_MIN << c) == size + 1) {
+        pool = MK_TLS_GET(mk_tls_http_buffers);
+        if (pool && pool->count[c] < MK_HTTP_BUFFER_POOL) {
+            head = (struct mk_list *) buf;
+            mk_list_add(head, &pool->idle[c]);
+            pool->count[c]++;
+            return;
+        }
+    }
+
+    mk_mem_free(buf);
+}
+
+/* Get an empty segment for a chained request body */
+struct mk_http_body_segment *mk_http_body_segment_get()
+{
+    unsigned int size = MK_HTTP_BODY_SEGMENT - 1;
+    struct mk_http_body_segment *seg;
+
+    seg = (struct mk_http_body_segment *) mk_http_buffer_get(&size);
+    if (!seg) {
+        return NULL;
+    }
+
+    seg->size   = size + 1 - sizeof(struct mk_http_body_segment);
+    seg->length = 0;
+
+    return seg;
+}
+
+void mk_http_body_segment_put(struct mk_http_body_segment *seg)
+{
+    mk_http_buffer_put((char *) seg, MK_HTTP_BODY_SEGMENT - 1);
+}
+
+/*
+ * Append data to a chained request body, the last segment is filled
+ * before a new one is linked.
+ */
+int mk_http_body_append(struct mk_list *chain, char *data, int len)
+{
+    unsigned int copy;
+    struct mk_http_body_segment *seg = NULL;
+
+    if (mk_list_is_empty(chain) != 0) {
+        seg = mk_list_entry_last(chain, struct mk_http_body_segment, _head);
+    }
+
+    while (len > 0) {
+        if (!seg || seg->length == seg->size) {
+            seg = mk_http_body_segment_get();
+            if (!seg) {
+                return -1;
+            }
+            mk_list_add(&seg->_head, chain);
+        }
+
+        copy = seg->size - seg->length;
+        if ((unsigned int) len < copy) {
+            copy = len;
+        }
+        memcpy(seg->data + seg->length, data, copy);
+        seg->length += copy;
+        data += copy;
+        len  -= copy;
+    }
+
+    return 0;
+}
+
+/* Release every segment of a chained request body */
+void mk_http_body_free(struct mk_list *chain)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_body_segment *seg;
+
+    mk_list_foreach_safe(head, tmp, chain) {
+        seg = mk_list_entry(head, struct mk_http_body_segment, _head);
+        mk_list_del(&seg->_head);
+        mk_http_body_segment_put(seg);
+    }
+}
+
+static inline int mk_http_chunked_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * Decode 'len' bytes of a request body using the chunked transfer coding,
+ * the payload is appended to 'chain' and its size added to 'out'. It can
+ * be called as data arrives, the state is kept in 'ck'. It returns the
+ * number of bytes consumed, which is less than 'len' only once the last
+ * chunk and the trailer were decoded (ck->state is MK_HTTP_CHUNKED_DONE),
+ * or -1 if the framing is invalid.
+ */
+int mk_http_body_dechunk(struct mk_http_chunked *ck, char *buf, int len,
+                         struct mk_list *chain, unsigned long *out)
+{
+    int i = 0;
+    int v;
+    long copy;
+
+    while (i < len && ck->state != MK_HTTP_CHUNKED_DONE) {
+        switch (ck->state) {
+        case MK_HTTP_CHUNKED_SIZE:
+            v = mk_http_chunked_hex(buf[i]);
+            if (v >= 0) {
+                if (ck->left > (LONG_MAX >> 4)) {
+                    return -1;
+                }
+                ck->left = (ck->left << 4) | v;
+                ck->digits++;
+            }
+            else if (ck->digits == 0) {
+                return -1;
+            }
+            else if (buf[i] == '\n') {
+                ck->state = ck->left > 0 ? MK_HTTP_CHUNKED_DATA :
+                                           MK_HTTP_CHUNKED_TRAILER;
+            }
+            else {
+                ck->state = MK_HTTP_CHUNKED_EXT;
+            }
+            i++;
+            break;
+        case MK_HTTP_CHUNKED_EXT:
+            if (buf[i] == '\n') {
+                ck->state = ck->left > 0 ? MK_HTTP_CHUNKED_DATA :
+                                           MK_HTTP_CHUNKED_TRAILER;
+            }
+            i++;
+            break;
+        case MK_HTTP_CHUNKED_DATA:
+            copy = len - i;
+            if (copy > ck->left) {
+                copy = ck->left;
+            }
+            if (mk_http_body_append(chain, buf + i, copy) != 0) {
+                return -1;
+            }
+            *out += copy;
+            ck->left -= copy;
+            i += copy;
+            if (ck->left == 0) {
+                ck->state = MK_HTTP_CHUNKED_DATA_CR;
+            }
+            break;
+        case MK_HTTP_CHUNKED_DATA_CR:
+            if (buf[i] != '\r') {
+                return -1;
+            }
+            ck->state = MK_HTTP_CHUNKED_DATA_LF;
+            i++;
+            break;
+        case MK_HTTP_CHUNKED_DATA_LF:
+            if (buf[i] != '\n') {
+                return -1;
+            }
+            ck->state  = MK_HTTP_CHUNKED_SIZE;
+            ck->digits = 0;
+            i++;
+            break;
+        case MK_HTTP_CHUNKED_TRAILER:
+            if (buf[i] == '\r') {
+                ck->state = MK_HTTP_CHUNKED_END_LF;
+            }
+            else if (buf[i] == '\n') {
+                ck->state = MK_HTTP_CHUNKED_DONE;
+            }
+            else {
+                /* Trailer fields are not used */
+                ck->state = MK_HTTP_CHUNKED_TRAILER_LINE;
+            }
+            i++;
+            break;
+        case MK_HTTP_CHUNKED_TRAILER_LINE:
+            if (buf[i] == '\n') {
+                ck->state = MK_HTTP_CHUNKED_TRAILER;
+            }
+            i++;
+            break;
+        case MK_HTTP_CHUNKED_END_LF:
+            if (buf[i] != '\n') {
+                return -1;
+            }
+            ck->state = MK_HTTP_CHUNKED_DONE;
+            i++;
+            break;
+        }
+    }
+
+    return i;
+}
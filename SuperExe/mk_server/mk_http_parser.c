@@ -26,6 +26,10 @@
 #include <stdint.h>
 #include <limits.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include <monkey/mk_http.h>
 #include <monkey/mk_http_parser.h>
 #include <monkey/mk_http_status.h>
@@ -39,7 +43,6 @@
     continue
 
 #define field_len()   (p->end - p->start)
-#define header_scope_eq(p, x) p->header_min = p->header_max = x
 
 struct row_entry {
     int len;
@@ -73,35 +76,199 @@ struct row_entry mk_headers_table[] = {
     { 19, "last-modified-since" },
     {  5, "range"               },
     {  7, "referer"             },
+    { 17, "transfer-encoding"   },
     {  7, "upgrade"             },
     { 10, "user-agent"          }
 };
 
-static inline void char_lookup(char *buf, char c, int len, struct mk_http_parser *p)
+/*
+ * Perfect hash of the known header names: every entry of mk_headers_table
+ * gets its own slot using the name length and its first and last chars in
+ * lowercase. Adding a header requires to check it does not collide.
+ */
+#define MK_HEADER_HASH_SIZE   32
+#define header_hash(len, first, last)                                   \
+    (((len) + 7 * (first) + (last)) & (MK_HEADER_HASH_SIZE - 1))
+
+static const signed char mk_headers_hash[MK_HEADER_HASH_SIZE] = {
+    MK_HEADER_COOKIE,                /*  0 */
+    MK_HEADER_ACCEPT,                /*  1 */
+    MK_HEADER_AUTHORIZATION,         /*  2 */
+    -1,                              /*  3 */
+    MK_HEADER_TRANSFER_ENCODING,     /*  4 */
+    MK_HEADER_LAST_MODIFIED,         /*  5 */
+    MK_HEADER_CONTENT_TYPE,          /*  6 */
+    MK_HEADER_CONTENT_RANGE,         /*  7 */
+    MK_HEADER_RANGE,                 /*  8 */
+    MK_HEADER_ACCEPT_CHARSET,        /*  9 */
+    -1,                              /* 10 */
+    MK_HEADER_CONTENT_LENGTH,        /* 11 */
+    MK_HEADER_LAST_MODIFIED_SINCE,   /* 12 */
+    MK_HEADER_CONNECTION,            /* 13 */
+    MK_HEADER_CACHE_CONTROL,         /* 14 */
+    -1,                              /* 15 */
+    MK_HEADER_HOST,                  /* 16 */
+    MK_HEADER_USER_AGENT,            /* 17 */
+    -1, -1, -1,                      /* 18, 19, 20 */
+    MK_HEADER_IF_MODIFIED_SINCE,     /* 21 */
+    -1,                              /* 22 */
+    MK_HEADER_REFERER,               /* 23 */
+    -1, -1, -1,                      /* 24, 25, 26 */
+    MK_HEADER_ACCEPT_LANGUAGE,       /* 27 */
+    -1,                              /* 28 */
+    MK_HEADER_ACCEPT_ENCODING,       /* 29 */
+    -1,                              /* 30 */
+    MK_HEADER_UPGRADE                /* 31 */
+};
+
+/*
+ * Case insensitive compare of a value against a known lowercase name,
+ * eight bytes at a time. Only the letters of the value are folded (the
+ * 0x20 bit is taken from the 0x40 bit of the expected letters), other
+ * chars like '-' must be equal. The known names are stored in 32 bytes
+ * rows so reading whole words from them is safe.
+ */
+#define MK_WORD_LETTERS   0x4040404040404040ULL
+
+static inline int header_cmp_word(const char *expected, char *value, int len)
 {
-    int x = 0;
+    int i;
+    uint64_t e;
+    uint64_t v;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&e, expected + i, 8);
+        memcpy(&v, value + i, 8);
+        if ((v | ((e & MK_WORD_LETTERS) >> 1)) != e) {
+            return -1;
+        }
+    }
 
-    x = p->i;
-    do {
-        if (buf[x] == c) {
-            p->i = x;
-            return;
+    if (i < len) {
+        e = 0;
+        v = 0;
+        memcpy(&e, expected + i, len - i);
+        memcpy(&v, value + i, len - i);
+        if ((v | ((e & MK_WORD_LETTERS) >> 1)) != e) {
+            return -1;
         }
-        x++;
-    } while (x < len);
+    }
+
+    return 0;
 }
 
-static inline int str_searchr(char *buf, char c, int len)
+/* Map a header name to its MK_HEADER_ type, -1 if it's not a known one */
+static inline int header_type(char *key, int len)
 {
     int i;
+    struct row_entry *h;
 
-    for (i = len - 1; i >= 0; i--) {
-        if (buf[i] == c) {
+    if (len <= 0) {
+        return -1;
+    }
+
+    i = mk_headers_hash[header_hash(len, key[0] | 0x20, key[len - 1] | 0x20)];
+    if (i < 0) {
+        return -1;
+    }
+
+    h = &mk_headers_table[i];
+    if (h->len != len || header_cmp_word(h->name, key, len) != 0) {
+        return -1;
+    }
+
+    return i;
+}
+
+int mk_http_parser_header_type(char *key, int len)
+{
+    return header_type(key, len);
+}
+
+/*
+ * Find the first position starting from 'i' holding any of the four given
+ * delimiters, if none is found it returns 'len'. Blocks of 32 or 16 bytes
+ * are compared at once when the target supports AVX2 or SSE2, the tail is
+ * always done byte per byte so nothing is read after 'len'.
+ */
+static inline int delim_scan(char *buf, int i, int len,
+                             char a, char b, char c, char d)
+{
+#if defined(__AVX2__)
+    unsigned int bits;
+    __m256i v;
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    __m256i vc = _mm256_set1_epi8(c);
+    __m256i vd = _mm256_set1_epi8(d);
+
+    for (; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        bits = _mm256_movemask_epi8(
+                   _mm256_or_si256(
+                       _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                       _mm256_cmpeq_epi8(v, vb)),
+                       _mm256_or_si256(_mm256_cmpeq_epi8(v, vc),
+                                       _mm256_cmpeq_epi8(v, vd))));
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    unsigned int mask;
+    __m128i w;
+    __m128i wa = _mm_set1_epi8(a);
+    __m128i wb = _mm_set1_epi8(b);
+    __m128i wc = _mm_set1_epi8(c);
+    __m128i wd = _mm_set1_epi8(d);
+
+    for (; i + 16 <= len; i += 16) {
+        w = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = _mm_movemask_epi8(
+                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(w, wa),
+                                             _mm_cmpeq_epi8(w, wb)),
+                                _mm_or_si128(_mm_cmpeq_epi8(w, wc),
+                                             _mm_cmpeq_epi8(w, wd))));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (buf[i] == a || buf[i] == b || buf[i] == c || buf[i] == d) {
             return i;
         }
     }
 
-    return -1;
+    return len;
+}
+
+/*
+ * Move p->i to the next delimiter of the current field. When the buffer
+ * does not have it yet, everything received was consumed: leave p->i at
+ * the last byte so the main loop returns pending and the next call resumes
+ * the scan from the new data.
+ */
+#define delim_lookup(a, b, c, d)                                \
+    p->i = delim_scan(buffer, p->i, len, a, b, c, d);           \
+    if (p->i == len) {                                          \
+        p->i = len - 1;                                         \
+        continue;                                               \
+    }
+
+static inline int str_searchr(char *buf, char c, int len)
+{
+    char *r;
+
+    r = memrchr(buf, c, len);
+    if (!r) {
+        return -1;
+    }
+
+    return r - buf;
 }
 
 static inline int method_lookup(struct mk_http_request *req,
@@ -188,106 +355,106 @@ static inline int header_lookup(struct mk_http_parser *p, char *buffer)
 
     struct mk_http_header *header;
     struct mk_http_header *header_extra;
-    struct row_entry *h;
 
     len = (p->header_sep - p->header_key);
 
-    for (i = p->header_min; i <= p->header_max; i++) {
-        h = &mk_headers_table[i];
-
-        /* Check string length first */
-        if (h->len != len) {
-            continue;
-        }
-
-        if (header_cmp(h->name + 1, buffer + p->header_key + 1, len - 1) == 0) {
-            /* We got a header match, register the header index */
-            header = &p->headers[i];
-            header->type = i;
-            header->key.data = buffer + p->header_key;
-            header->key.len  = len;
-            header->val.data = buffer + p->header_val;
-            header->val.len  = p->end - p->header_val;
-            p->header_count++;
-            mk_list_add(&header->_head, &p->header_list);
-
-            if (i == MK_HEADER_HOST) {
-                /* Handle a possible port number in the Host header */
-                int sep = str_searchr(header->val.data, ':', header->val.len);
-                if (sep > 0) {
-                    int plen;
-                    short int port_size = 6;
-                    char port[port_size];
-
-                    plen = header->val.len - sep - 1;
-                    if (plen <= 0 || plen >= port_size) {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-                    memcpy(&port, header->val.data + sep + 1, plen);
-                    port[plen] = '\0';
-
-                    errno = 0;
-                    val = strtol(port, &endptr, 10);
-                    if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
-                        || (errno != 0 && val == 0)) {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-
-                    if (endptr == port || *endptr != '\0') {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
+    i = header_type(buffer + p->header_key, len);
+    if (i >= 0) {
+        /* We got a header match, register the header index */
+        header = &p->headers[i];
+        header->type = i;
+        header->key.data = buffer + p->header_key;
+        header->key.len  = len;
+        header->val.data = buffer + p->header_val;
+        header->val.len  = p->end - p->header_val;
+        p->header_count++;
+        mk_list_add(&header->_head, &p->header_list);
 
-                    p->header_host_port = val;
+        if (i == MK_HEADER_HOST) {
+            /* Handle a possible port number in the Host header */
+            int sep = str_searchr(header->val.data, ':', header->val.len);
+            if (sep > 0) {
+                int plen;
+                short int port_size = 6;
+                char port[port_size];
 
-                    /* Re-set the Host header value without port */
-                    header->val.len = sep;
+                plen = header->val.len - sep - 1;
+                if (plen <= 0 || plen >= port_size) {
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
-            }
-            else if (i == MK_HEADER_CONTENT_LENGTH) {
+                memcpy(&port, header->val.data + sep + 1, plen);
+                port[plen] = '\0';
+
                 errno = 0;
-                val = strtol(header->val.data, &endptr, 10);
+                val = strtol(port, &endptr, 10);
                 if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
                     || (errno != 0 && val == 0)) {
-                    return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
-                }
-                if (endptr == header->val.data) {
-                    return -1;
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
-                if (val < 0) {
-                    return -1;
+
+                if (endptr == port || *endptr != '\0') {
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
 
-                p->header_content_length = val;
+                p->header_host_port = val;
+
+                /* Re-set the Host header value without port */
+                header->val.len = sep;
             }
-            else if (i == MK_HEADER_CONNECTION) {
-                /* Check Connection: Keep-Alive */
-                if (header->val.len == sizeof(MK_CONN_KEEP_ALIVE) - 1) {
-                    if (header_cmp(MK_CONN_KEEP_ALIVE,
-                                   header->val.data,
-                                   header->val.len ) == 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_KA;
-                    }
-                }
-                /* Check Connection: Close */
-                else if (header->val.len == sizeof(MK_CONN_CLOSE) -1) {
-                    if (header_cmp(MK_CONN_CLOSE,
-                                   header->val.data, header->val.len) == 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_CLOSE;
-                    }
+        }
+        else if (i == MK_HEADER_CONTENT_LENGTH) {
+            errno = 0;
+            val = strtol(header->val.data, &endptr, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)) {
+                return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+            }
+            if (endptr == header->val.data) {
+                return -1;
+            }
+            if (val < 0) {
+                return -1;
+            }
+
+            p->header_content_length = val;
+        }
+        else if (i == MK_HEADER_CONNECTION) {
+            /* Check Connection: Keep-Alive */
+            if (header->val.len == sizeof(MK_CONN_KEEP_ALIVE) - 1) {
+                if (header_cmp(MK_CONN_KEEP_ALIVE,
+                               header->val.data,
+                               header->val.len ) == 0) {
+                    p->header_connection = MK_HTTP_PARSER_CONN_KA;
                 }
-                /* Check Connection: Upgrade */
-                else if (header->val.len == sizeof(MK_CONN_UPGRADE) -1) {
-                    if (header_cmp(MK_CONN_UPGRADE,
-                                   header->val.data, header->val.len) == 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_UPGRADE;
-                    }
+            }
+            /* Check Connection: Close */
+            else if (header->val.len == sizeof(MK_CONN_CLOSE) -1) {
+                if (header_cmp(MK_CONN_CLOSE,
+                               header->val.data, header->val.len) == 0) {
+                    p->header_connection = MK_HTTP_PARSER_CONN_CLOSE;
                 }
-                else {
-                    p->header_connection = MK_HTTP_PARSER_CONN_UNKNOWN;
+            }
+            /* Check Connection: Upgrade */
+            else if (header->val.len == sizeof(MK_CONN_UPGRADE) -1) {
+                if (header_cmp(MK_CONN_UPGRADE,
+                               header->val.data, header->val.len) == 0) {
+                    p->header_connection = MK_HTTP_PARSER_CONN_UPGRADE;
                 }
             }
-            return 0;
+            else {
+                p->header_connection = MK_HTTP_PARSER_CONN_UNKNOWN;
+            }
         }
+        else if (i == MK_HEADER_TRANSFER_ENCODING) {
+            /* Only the chunked coding is supported for request bodies */
+            if (header->val.len != sizeof(MK_TE_CHUNKED) - 1 ||
+                header_cmp(MK_TE_CHUNKED,
+                           header->val.data, header->val.len) != 0) {
+                return -MK_SERVER_NOT_IMPLEMENTED;
+            }
+            p->header_chunked = MK_TRUE;
+        }
+        return 0;
     }
 
     /*
@@ -335,7 +502,7 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
 
     /* POST checks */
     if (req->method == MK_METHOD_POST || req->method == MK_METHOD_PUT) {
-        /* validate Content-Length exists */
+        /* validate Content-Length exists, chunked bodies never get here */
         if (p->headers[MK_HEADER_CONTENT_LENGTH].type == 0) {
             mk_http_error(MK_CLIENT_LENGTH_REQUIRED, req->session, req);
             return MK_HTTP_PARSER_ERROR;
@@ -352,7 +519,6 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int buf_len)
 {
-    int s;
     int tmp;
     int ret;
     int len = p->i + buf_len;
@@ -419,6 +585,7 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 }
                 break;
             case MK_ST_REQ_URI:                         /* URI */
+                delim_lookup(' ', '?', '\r', '\n');
                 if (buffer[p->i] == ' ') {
                     mark_end();
                     p->status = MK_ST_REQ_PROT_VERSION;
@@ -440,7 +607,7 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 }
                 break;
             case MK_ST_REQ_QUERY_STRING:                /* Query string */
-                char_lookup(buffer, ' ', len, p);
+                delim_lookup(' ', '\r', '\n', ' ');
                 if (buffer[p->i] == ' ') {
                     mark_end();
                     request_set(&req->query_string, p, buffer);
@@ -535,54 +702,13 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 }
 
                 if (p->chars == 0) {
-                    /*
-                     * We reach the start of a Header row, lets catch the most
-                     * probable header.
-                     *
-                     * The goal of this 'first row character lookup', is to define a
-                     * small range set of probable headers comparison once we catch
-                     * a header end.
-                     */
-                    s = tolower(buffer[p->i]);
-                    switch (s) {
-                    case 'a':
-                        p->header_min = MK_HEADER_ACCEPT;
-                        p->header_max = MK_HEADER_AUTHORIZATION;
-                        break;
-                    case 'c':
-                        p->header_min = MK_HEADER_CACHE_CONTROL;
-                        p->header_max = MK_HEADER_CONTENT_TYPE;
-                        break;
-                    case 'h':
-                        header_scope_eq(p, MK_HEADER_HOST);
-                        break;
-                    case 'i':
-                        header_scope_eq(p, MK_HEADER_IF_MODIFIED_SINCE);
-                        break;
-                    case 'l':
-                        p->header_min = MK_HEADER_LAST_MODIFIED;
-                        p->header_max = MK_HEADER_LAST_MODIFIED_SINCE;
-                        break;
-                    case 'r':
-                        p->header_min = MK_HEADER_RANGE;
-                        p->header_max = MK_HEADER_REFERER;
-                        break;
-                    case 'u':
-                        p->header_min = MK_HEADER_UPGRADE;
-                        p->header_max = MK_HEADER_USER_AGENT;
-                        break;
-                    default:
-                        p->header_key = -1;
-                        p->header_sep = -1;
-                        p->header_min = -1;
-                        p->header_max = -1;
-                    };
+                    /* We reach the start of a Header row */
                     p->header_key = p->i;
                     continue;
                 }
 
                 /* Found key/value separator */
-                char_lookup(buffer, ':', len, p);
+                delim_lookup(':', ':', ':', ':');
                 if (buffer[p->i] == ':') {
                     /* Set the key/value middle point */
                     p->header_sep = p->i;
@@ -612,6 +738,8 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
             }
             /* New header row starts */
             else if (p->status == MK_ST_HEADER_VAL_STARTS) {
+                delim_lookup('\r', '\n', '\r', '\n');
+
                 /* Maybe there is no more headers and we reach the end ? */
                 if (buffer[p->i] == '\r') {
                     mark_end();
@@ -661,7 +789,19 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
         }
         else if (p->level == REQ_LEVEL_END) {
             if (buffer[p->i] == '\n') {
-                if (p->header_content_length > 0) {
+                if (p->header_chunked == MK_TRUE) {
+                    /* A length and a chunked body, refuse it */
+                    if (p->headers[MK_HEADER_CONTENT_LENGTH].type ==
+                        MK_HEADER_CONTENT_LENGTH) {
+                        mk_http_error(MK_CLIENT_BAD_REQUEST,
+                                      req->session, req);
+                        return MK_HTTP_PARSER_ERROR;
+                    }
+                    p->level = REQ_LEVEL_BODY;
+                    p->chars = -1;
+                    start_next();
+                }
+                else if (p->header_content_length > 0) {
                     p->level = REQ_LEVEL_BODY;
                     p->chars = -1;
                     start_next();
@@ -680,7 +820,13 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
              *
              * - A Pipeline Request
              * - A Body content (POST/PUT methods)
+             *
+             * A chunked body is decoded by the caller, mk_http.c.
              */
+            if (p->header_chunked == MK_TRUE) {
+                return MK_HTTP_PARSER_PENDING;
+            }
+
             if (p->header_content_length > 0) {
 
                 p->body_received = len - p->start;
@@ -688,8 +834,9 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                     return MK_HTTP_PARSER_PENDING;
                 }
 
-                /* Cut off */
-                p->i += p->body_received;
+                /* Cut off, a pipelined request may follow the body */
+                p->body_received = p->header_content_length;
+                p->i = p->start + p->body_received - 1;
                 req->data.len  = p->body_received;
                 req->data.data = (buffer + p->start);
             }
@@ -32,6 +32,7 @@
 #include <monkey/mk_config.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_http.h>
+#include <monkey/mk_compress.h>
 
 struct mimetype *mimetype_default;
 
@@ -78,6 +79,7 @@ int mk_mimetype_add(char *name, const char *type)
                                          len + 32,
                                          "Content-Type: %s\r\n",
                                          type);
+    new_mime->compress = mk_compress_mime(type);
     strcpy(new_mime->type.data, type);
     strcat(new_mime->type.data, MK_CRLF);
     new_mime->type.data[len-1] = '\0';
@@ -39,11 +39,75 @@ static struct plugin_stagemap *plg_stagemap;
 struct plugin_network_io *plg_netiomap;
 struct plugin_api *api;
 
+/*
+ * Plugin registry: once the set of plugins is final, they are indexed by
+ * shortname and by capability bit so the lookups done from the workers
+ * and from other plugins do not walk the plugins list.
+ */
+#define MK_PLUGIN_REGISTRY_SIZE    32   /* hash table size, power of 2 */
+#define MK_PLUGIN_CAP_BITS          8
+
+static struct mk_plugin *plg_registry[MK_PLUGIN_REGISTRY_SIZE];
+static struct mk_plugin *plg_capmap[MK_PLUGIN_CAP_BITS];
+static int plg_registry_ready = MK_FALSE;
+
+void mk_plugin_registry_init()
+{
+    int i;
+    int n = 0;
+    unsigned int slot;
+    struct mk_list *head;
+    struct mk_plugin *p;
+
+    memset(plg_registry, '\0', sizeof(plg_registry));
+    memset(plg_capmap, '\0', sizeof(plg_capmap));
+    plg_registry_ready = MK_FALSE;
+
+    mk_list_foreach(head, &mk_config->plugins) {
+        p = mk_list_entry(head, struct mk_plugin, _head);
+
+        /* Keep one free slot so a failed lookup always ends */
+        if (++n >= MK_PLUGIN_REGISTRY_SIZE) {
+            mk_warn("Plugin registry full, lookups will scan the list");
+            return;
+        }
+
+        slot = mk_utils_gen_hash(p->shortname, strlen(p->shortname));
+        slot &= (MK_PLUGIN_REGISTRY_SIZE - 1);
+        while (plg_registry[slot]) {
+            slot = (slot + 1) & (MK_PLUGIN_REGISTRY_SIZE - 1);
+        }
+        plg_registry[slot] = p;
+
+        /* The first plugin registered for a capability owns it */
+        for (i = 0; i < MK_PLUGIN_CAP_BITS; i++) {
+            if ((p->capabilities & (1 << i)) && !plg_capmap[i]) {
+                plg_capmap[i] = p;
+            }
+        }
+    }
+
+    plg_registry_ready = MK_TRUE;
+}
+
 struct mk_plugin *mk_plugin_lookup(char *shortname)
 {
+    unsigned int slot;
     struct mk_list *head;
     struct mk_plugin *p = NULL;
 
+    if (plg_registry_ready == MK_TRUE) {
+        slot = mk_utils_gen_hash(shortname, strlen(shortname));
+        slot &= (MK_PLUGIN_REGISTRY_SIZE - 1);
+        while ((p = plg_registry[slot])) {
+            if (strcmp(p->shortname, shortname) == 0) {
+                return p;
+            }
+            slot = (slot + 1) & (MK_PLUGIN_REGISTRY_SIZE - 1);
+        }
+        return NULL;
+    }
+
     mk_list_foreach(head, &mk_config->plugins) {
         p = mk_list_entry(head, struct mk_plugin, _head);
         if (strcmp(p->shortname, shortname) == 0){
@@ -226,6 +290,7 @@ struct mk_plugin *mk_plugin_load(int type, const char *shortname,
 
 void mk_plugin_unregister(struct mk_plugin *p)
 {
+    plg_registry_ready = MK_FALSE;
     mk_mem_free(p->path);
     mk_list_del(&p->_head);
     if (p->load_type == MK_PLUGIN_DYNAMIC) {
@@ -252,12 +317,24 @@ void mk_plugin_api_init()
     /* HTTP callbacks */
     api->http_request_end = mk_plugin_http_request_end;
     api->http_request_error = mk_http_error;
+    api->http_body_release = mk_http_body_release;
 
     /* Memory callbacks */
     api->pointer_set = mk_ptr_set;
     api->pointer_print = mk_ptr_print;
     api->pointer_to_buf = mk_ptr_to_buf;
+
+    /* object pools */
+    api->pool_create  = mk_pool_create;
+    api->pool_destroy = mk_pool_destroy;
+    api->pool_get     = mk_pool_get;
+    api->pool_alloc   = mk_pool_alloc;
+    api->pool_put     = mk_pool_put;
+    api->pool_stats   = mk_pool_stats;
+    api->worker_pool_stats = mk_stream_pool_stats;
     api->plugin_load_symbol = mk_plugin_load_symbol;
+    api->plugin_lookup = mk_plugin_lookup;
+    api->plugin_cap = mk_plugin_cap;
     api->mem_alloc = mk_mem_malloc;
     api->mem_alloc_z = mk_mem_malloc_z;
     api->mem_realloc = mk_mem_realloc;
@@ -286,14 +363,16 @@ void mk_plugin_api_init()
 
     /* Channels / Streams */
     api->stream_new    = mk_stream_new;
+    api->stream_free   = mk_stream_free;
     api->channel_new   = mk_channel_new;
+    api->channel_free  = mk_channel_free;
     api->channel_flush = mk_channel_flush;
     api->channel_write = mk_channel_write;
     api->channel_append_stream = mk_channel_append_stream;
     api->stream_set = mk_stream_set;
 
     /* IOV callbacks */
-    api->iov_create  = mk_iov_create;
+    api->iov_create  = mk_stream_iov_create;
     api->iov_realloc = mk_iov_realloc;
     api->iov_free = mk_iov_free;
     api->iov_free_marked = mk_iov_free_marked;
@@ -352,6 +431,7 @@ void mk_plugin_api_init()
     api->time_unix   = mk_plugin_time_now_unix;
     api->time_to_gmt = mk_utils_utime2gmt;
     api->time_human  = mk_plugin_time_now_human;
+    api->time_msec   = mk_clock_msec;
 
 #ifdef TRACE
     api->trace = mk_utils_trace;
@@ -501,6 +581,7 @@ void mk_plugin_exit_all()
             dlclose(node->handler);
         }
     }
+    plg_registry_ready = MK_FALSE;
     mk_mem_free(api);
     mk_mem_free(plg_stagemap);
 }
@@ -586,21 +667,51 @@ int mk_plugin_http_request_end(struct mk_http_session *cs, int close)
 
     MK_TRACE("[FD %i] PLUGIN HTTP REQUEST END", cs->socket);
 
-    cs->status = MK_REQUEST_STATUS_INCOMPLETE;
+    /*
+     * The session status is left as it is: while responses are queued it
+     * stays completed so new data is not parsed into a prepared request,
+     * mk_http_request_end() resets it once the connection is idle.
+     */
     if (mk_list_is_empty(&cs->request_list) == 0) {
         MK_TRACE("[FD %i] Tried to end non-existing request.", cs->socket);
         return -1;
     }
 
     sr = mk_list_entry_last(&cs->request_list, struct mk_http_request, _head);
-    mk_plugin_stage_run_40(cs, sr);
-
     if (close == MK_TRUE) {
         cs->close_now = MK_TRUE;
     }
 
-    /* Let's check if we should ask to finalize the connection or not */
-    ret = mk_http_request_end(cs);
+    if (sr != mk_list_entry_first(&cs->request_list,
+                                  struct mk_http_request, _head)) {
+        /* Pipelined responses enqueued before this one are not done yet */
+        sr->stage30_pending = MK_FALSE;
+        ret = 1;
+    }
+    else {
+        mk_plugin_stage_run_40(cs, sr);
+
+        /* Let's check if we should ask to finalize the connection or not */
+        ret = mk_http_request_end(cs);
+    }
+
+    /*
+     * The channel holds responses of pipelined requests, the requests are
+     * finished once it's flushed. If that cannot happen now, the scheduler
+     * does it from the write event.
+     */
+    while (ret == 1) {
+        ret = mk_channel_flush(cs->channel);
+        if (ret & MK_CHANNEL_ERROR) {
+            ret = -1;
+            break;
+        }
+        else if (ret & (MK_CHANNEL_FLUSH | MK_CHANNEL_BUSY)) {
+            return 0;
+        }
+        ret = mk_http_request_done(cs);
+    }
+
     MK_TRACE("[FD %i] HTTP session end = %i", cs->socket, ret);
     if (ret < 0) {
         con = mk_sched_event_close(cs->conn, mk_sched_get_thread_conf(),
@@ -633,12 +744,12 @@ void mk_plugin_event_bad_return(const char *hook, int ret)
 
 int mk_plugin_time_now_unix()
 {
-    return log_current_utime;
+    return mk_clock_utime();
 }
 
 mk_ptr_t *mk_plugin_time_now_human()
 {
-    return &log_current_time;
+    return mk_clock_log_time();
 }
 
 int mk_plugin_sched_remove_client(int socket)
@@ -669,7 +780,8 @@ int mk_plugin_header_add(struct mk_http_request *sr, char *row, int len)
          *
          *  we use (MK_PLUGIN_HEADER_EXTRA_ROWS * 2) thinking in an ending CRLF
          */
-        sr->headers._extra_rows = mk_iov_create(MK_PLUGIN_HEADER_EXTRA_ROWS * 2, 0);
+        sr->headers._extra_rows = mk_stream_iov_create(MK_PLUGIN_HEADER_EXTRA_ROWS * 2,
+                                                       0);
         mk_bug(!sr->headers._extra_rows);
     }
 
@@ -688,9 +800,16 @@ struct mk_sched_worker *mk_plugin_sched_get_thread_conf()
 
 struct mk_plugin *mk_plugin_cap(char cap, struct mk_server_config *config)
 {
+    unsigned char bits = cap;
     struct mk_list *head;
     struct mk_plugin *plugin;
 
+    /* A single capability bit resolves through the registry */
+    if (plg_registry_ready == MK_TRUE && config == mk_config &&
+        bits && (bits & (bits - 1)) == 0) {
+        return plg_capmap[__builtin_ctz(bits)];
+    }
+
     mk_list_foreach(head, &config->plugins) {
         plugin = mk_list_entry(head, struct mk_plugin, _head);
         if (plugin->capabilities & cap) {
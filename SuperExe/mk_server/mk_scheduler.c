@@ -116,6 +116,9 @@ void mk_sched_worker_free()
     mk_plugin_exit_worker();
     mk_vhost_fdt_worker_exit();
     mk_cache_worker_exit();
+    mk_stream_worker_exit();
+    mk_http_buffer_worker_exit();
+    mk_clock_worker_exit();
 
     /* Scheduler stuff */
     tid = pthread_self();
@@ -188,7 +191,7 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     event->type         = MK_EVENT_CONNECTION;
     event->mask         = MK_EVENT_EMPTY;
     event->status       = MK_EVENT_NONE;
-    conn->arrive_time   = log_current_utime;
+    conn->arrive_time   = mk_clock_utime();
     conn->protocol      = handler;
     conn->net           = listener->network->network;
     conn->is_timeout_on = MK_FALSE;
@@ -331,6 +334,9 @@ void *mk_sched_launch_worker_loop(void *thread_conf)
     /* Init specific thread cache */
     mk_sched_thread_lists_init();
     mk_cache_worker_init();
+    mk_stream_worker_init();
+    mk_http_buffer_worker_init();
+    mk_clock_worker_init();
 
     /* Register working thread */
     wid = mk_sched_register_thread();
@@ -542,7 +548,7 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched)
         client_timeout = conn->arrive_time + mk_config->timeout;
 
         /* Check timeout */
-        if (client_timeout <= log_current_utime) {
+        if (client_timeout <= mk_clock_utime()) {
             MK_TRACE("Scheduler, closing fd %i due TIMEOUT",
                      conn->event.fd);
             MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_PENDING");
@@ -69,10 +69,11 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
 {
     int ret;
     int client_fd = -1;
+    union mk_sockaddr addr;
     struct mk_sched_conn *conn;
     struct mk_server_listen *listener = data;
 
-    client_fd = mk_socket_accept(listener->server_fd);
+    client_fd = mk_socket_accept(listener->server_fd, &addr);
     if (mk_unlikely(client_fd == -1)) {
         MK_TRACE("[server] Accept connection failed: %s", strerror(errno));
         goto error;
@@ -82,6 +83,7 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
     if (mk_unlikely(!conn)) {
         goto error;
     }
+    conn->peer = addr;
 
     ret = mk_event_add(sched->loop, client_fd,
                        MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
@@ -349,6 +351,7 @@ void mk_server_worker_loop()
 {
     int ret = -1;
     int timeout_fd;
+    uint32_t mask;
     uint64_t val;
     struct mk_event *event;
     struct mk_event_loop *evl;
@@ -369,6 +372,7 @@ void mk_server_worker_loop()
      * signal MK_SERVER_SIGNAL_START.
      */
     mk_event_wait(evl);
+    mk_clock_update();
     mk_event_foreach(event, evl) {
         if ((event->mask & MK_EVENT_READ) &&
             event->type == MK_EVENT_NOTIFICATION) {
@@ -404,6 +408,7 @@ void mk_server_worker_loop()
 
     while (1) {
         mk_event_wait(evl);
+        mk_clock_update();
         mk_event_foreach(event, evl) {
             ret = 0;
             if (event->type & MK_EVENT_IDLE) {
@@ -413,6 +418,9 @@ void mk_server_worker_loop()
             if (event->type == MK_EVENT_CONNECTION) {
                 conn = (struct mk_sched_conn *) event;
 
+                /* Handlers may put the connection to sleep */
+                mask = event->mask;
+
                 if (event->mask & MK_EVENT_WRITE) {
                     MK_TRACE("[FD %i] Event WRITE", event->fd);
                     ret = mk_sched_event_write(conn, sched);
@@ -425,7 +433,7 @@ void mk_server_worker_loop()
                 }
 
 
-                if (event->mask & MK_EVENT_CLOSE && ret != -1) {
+                if (mask & MK_EVENT_CLOSE && ret != -1) {
                     MK_TRACE("[FD %i] Event CLOSE", event->fd);
                     ret = -1;
                 }
@@ -516,11 +524,16 @@ void mk_server_loop(void)
      * them so they can start processing connections.
      */
     if (mk_config->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
-        /* Hang here, basically do nothing as threads are doing the job  */
+        /*
+         * Hang here, basically do nothing as threads are doing the job. The
+         * exit signals never return, others (e.g: SIGUSR1 for the logger)
+         * must not stop the server.
+         */
         sigset_t mask;
         sigprocmask(0, NULL, &mask);
-        sigsuspend(&mask);
-        return;
+        while (1) {
+            sigsuspend(&mask);
+        }
     }
     else {
         mk_server_loop_balancer();
@@ -23,33 +23,423 @@
 #include <monkey/mk_stream.h>
 #include <monkey/mk_scheduler.h>
 
-/* Create a new stream instance */
+#ifndef PTHREAD_TLS
+#include <monkey/mk_stream_tls.h>
+#endif
+
+/* This function is called when a worker thread is created */
+void mk_stream_worker_init()
+{
+    struct mk_stream_pool *pool;
+
+    pool = mk_mem_malloc_z(sizeof(struct mk_stream_pool));
+    mk_list_init(&pool->segments);
+
+    pool->streams  = mk_pool_create(sizeof(struct mk_stream),
+                                    MK_STREAM_POOL_SLAB);
+    pool->channels = mk_pool_create(sizeof(struct mk_channel),
+                                    MK_STREAM_POOL_SLAB);
+    pool->iovs     = mk_pool_create(MK_IOV_SIZE(MK_STREAM_IOV_ENTRIES),
+                                    MK_STREAM_POOL_SLAB);
+    MK_TLS_SET(mk_tls_stream_pool, pool);
+}
+
+void mk_stream_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_stream_pool *pool;
+    struct mk_stream_segment *seg;
+
+    pool = MK_TLS_GET(mk_tls_stream_pool);
+    if (!pool) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &pool->segments) {
+        seg = mk_list_entry(head, struct mk_stream_segment, _head);
+        mk_list_del(&seg->_head);
+        mk_mem_free(seg);
+    }
+
+    mk_pool_destroy(pool->streams);
+    mk_pool_destroy(pool->channels);
+    mk_pool_destroy(pool->iovs);
+    mk_mem_free(pool);
+    MK_TLS_SET(mk_tls_stream_pool, NULL);
+}
+
+/* Return the worker pool for the given object type, if any */
+static inline struct mk_pool *mk_stream_pool_get(int type)
+{
+    struct mk_stream_pool *pool;
+
+    pool = MK_TLS_GET(mk_tls_stream_pool);
+    if (!pool) {
+        return NULL;
+    }
+
+    switch (type) {
+    case MK_STREAM_POOL_STREAM:
+        return pool->streams;
+    case MK_STREAM_POOL_CHANNEL:
+        return pool->channels;
+    case MK_STREAM_POOL_IOV:
+        return pool->iovs;
+    }
+
+    return NULL;
+}
+
+/*
+ * Allocate an object from the worker pool, threads that are not a worker
+ * get a heap object, in both cases it's released through mk_pool_put().
+ */
+static inline void *mk_stream_pool_alloc(int type, size_t size)
+{
+    struct mk_pool *pool;
+
+    pool = mk_stream_pool_get(type);
+    if (pool) {
+        return mk_pool_get(pool);
+    }
+
+    return mk_pool_alloc(size);
+}
+
+/* Get the hit counters of the calling worker pools */
+int mk_stream_pool_stats(int type, struct mk_pool_stats *stats)
+{
+    struct mk_pool *pool;
+
+    pool = mk_stream_pool_get(type);
+    if (!pool) {
+        return -1;
+    }
+
+    mk_pool_stats(pool, stats);
+    return 0;
+}
+
+/*
+ * Create an IOV, small ones are taken from the worker pool. The IOV must be
+ * released with mk_iov_free() from the same worker.
+ */
+struct mk_iov *mk_stream_iov_create(int n, int offset)
+{
+    struct mk_pool *pool;
+
+    if (n <= MK_STREAM_IOV_ENTRIES) {
+        pool = mk_stream_pool_get(MK_STREAM_POOL_IOV);
+        if (pool) {
+            return mk_iov_create_pool(pool, offset);
+        }
+    }
+
+    return mk_iov_create(n, offset);
+}
+
+/*
+ * Get a buffer segment with room for at least 'size' bytes. Small payloads
+ * are served from the worker pool, if the caller is not a worker thread or
+ * the pool is empty a new segment is allocated.
+ */
+static struct mk_stream_segment *mk_stream_segment_get(size_t size)
+{
+    struct mk_stream_pool *pool;
+    struct mk_stream_segment *seg;
+
+    if (size <= MK_STREAM_SEGMENT_SIZE) {
+        pool = MK_TLS_GET(mk_tls_stream_pool);
+        if (pool && pool->count > 0) {
+            seg = mk_list_entry_first(&pool->segments,
+                                      struct mk_stream_segment, _head);
+            mk_list_del(&seg->_head);
+            pool->count--;
+            seg->length = 0;
+            return seg;
+        }
+        size = MK_STREAM_SEGMENT_SIZE;
+    }
+
+    seg = mk_mem_malloc(sizeof(struct mk_stream_segment) + size);
+    if (!seg) {
+        return NULL;
+    }
+    seg->size   = size;
+    seg->length = 0;
+
+    return seg;
+}
+
+/* Return a segment to the worker pool or release it */
+static void mk_stream_segment_put(struct mk_stream_segment *seg)
+{
+    struct mk_stream_pool *pool;
+
+    if (seg->size == MK_STREAM_SEGMENT_SIZE) {
+        pool = MK_TLS_GET(mk_tls_stream_pool);
+        if (pool && pool->count < MK_STREAM_SEGMENT_POOL) {
+            mk_list_add(&seg->_head, &pool->segments);
+            pool->count++;
+            return;
+        }
+    }
+
+    mk_mem_free(seg);
+}
+
+/*
+ * Small COPYBUF writes are frequent on plugins that generate content
+ * (dirlisting, CGI, FastCGI), instead of creating a new stream for each one
+ * we append the data to the last COPYBUF stream of the channel if its
+ * segment still have room. Streams with callbacks or private data are
+ * never merged.
+ */
+static inline int mk_stream_copybuf_append(struct mk_channel *channel,
+                                           void *buffer, size_t size)
+{
+    struct mk_stream *last;
+    struct mk_stream_segment *seg;
+
+    if (mk_list_is_empty(&channel->streams) == 0) {
+        return -1;
+    }
+
+    last = mk_list_entry_last(&channel->streams, struct mk_stream, _head);
+    if (last->type != MK_STREAM_COPYBUF || last->dynamic == MK_FALSE ||
+        last->data || last->cb_finished || last->cb_bytes_consumed ||
+        last->cb_exception) {
+        return -1;
+    }
+
+    seg = last->buffer;
+    if (seg->size - seg->length < size) {
+        return -1;
+    }
+
+    memcpy(seg->data + seg->length, buffer, size);
+    seg->length += size;
+    last->bytes_total += size;
+
+    return 0;
+}
+
+/*
+ * Link a stream as a chunk: the size line and the CRLF trailer are small
+ * COPYBUF streams around it, consecutive chunks share a single segment for
+ * the trailer of one and the header of the next. The stream data itself is
+ * not copied, it's gathered on the same writev(2) call.
+ */
+static int mk_stream_set_chunked(struct mk_stream *stream, int type,
+                                 struct mk_channel *channel,
+                                 void *buffer, size_t size, void *data,
+                                 void (*cb_finished) (struct mk_stream *),
+                                 void (*cb_bytes_consumed) (struct mk_stream *, long),
+                                 void (*cb_exception) (struct mk_stream *, int))
+{
+    int len;
+    int ret;
+    char head[24];
+    struct mk_iov *iov;
+
+    if (type == MK_STREAM_IOV) {
+        iov = buffer;
+        size = iov->total_len;
+    }
+    else if (type == MK_STREAM_EOF) {
+        size = 0;
+    }
+
+    if (size == 0) {
+        ret = mk_stream_set(NULL, MK_STREAM_COPYBUF, channel,
+                            "0\r\n\r\n", 5, NULL, NULL, NULL, NULL);
+        if (ret != 0) {
+            return -1;
+        }
+
+        /* The caller may still wait for a callback */
+        if (stream || data || type == MK_STREAM_EOF ||
+            cb_finished || cb_bytes_consumed || cb_exception) {
+            return mk_stream_set(stream, type, channel, buffer, 0, data,
+                                 cb_finished, cb_bytes_consumed, cb_exception);
+        }
+        return 0;
+    }
+
+    len = snprintf(head, sizeof(head), "%lx\r\n", (unsigned long) size);
+    ret = mk_stream_set(NULL, MK_STREAM_COPYBUF, channel,
+                        head, len, NULL, NULL, NULL, NULL);
+    if (ret != 0) {
+        return -1;
+    }
+    ret = mk_stream_set(stream, type, channel, buffer, size, data,
+                        cb_finished, cb_bytes_consumed, cb_exception);
+    if (ret != 0) {
+        return -1;
+    }
+
+    ret = mk_stream_set(NULL, MK_STREAM_COPYBUF, channel,
+                        "\r\n", 2, NULL, NULL, NULL, NULL);
+    if (ret != 0) {
+        /*
+         * Unlink the data stream so the caller keeps the ownership of its
+         * buffer. Streams with callbacks or private data are never merged,
+         * so it's still the last one of the channel.
+         */
+        if (stream || data || cb_finished || cb_bytes_consumed ||
+            cb_exception) {
+            mk_stream_release(mk_list_entry_last(&channel->streams,
+                                                 struct mk_stream, _head));
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Configure a stream and link it to the channel. If 'stream' is NULL a new
+ * one is allocated and released by the channel once consumed.
+ *
+ * MK_STREAM_COPYBUF copies the data into a buffer segment so the caller can
+ * reuse its buffer right away. If the caller can guarantee the buffer stays
+ * valid until the stream is consumed (e.g: static strings or memory released
+ * from the cb_finished callback), MK_STREAM_RAW hands it over with no copy.
+ * A stream dropped before being consumed gets cb_exception instead.
+ *
+ * It returns 0 on success or -1 if the stream or its buffer segment could
+ * not be allocated, the data is not queued and the caller must fail the
+ * request.
+ */
+int mk_stream_set(struct mk_stream *stream, int type,
+                  struct mk_channel *channel,
+                  void *buffer, size_t size, void *data,
+                  void (*cb_finished) (struct mk_stream *),
+                  void (*cb_bytes_consumed) (struct mk_stream *, long),
+                  void (*cb_exception) (struct mk_stream *, int))
+{
+    struct mk_iov *iov;
+    struct mk_stream_segment *seg = NULL;
+
+    if (type & MK_STREAM_CHUNKED) {
+        return mk_stream_set_chunked(stream, type & ~MK_STREAM_CHUNKED,
+                                     channel, buffer, size, data,
+                                     cb_finished, cb_bytes_consumed,
+                                     cb_exception);
+    }
+
+    if (type == MK_STREAM_COPYBUF) {
+        if (!stream && !data &&
+            !cb_finished && !cb_bytes_consumed && !cb_exception) {
+            if (mk_stream_copybuf_append(channel, buffer, size) == 0) {
+                return 0;
+            }
+        }
+
+        seg = mk_stream_segment_get(size);
+        if (!seg) {
+            return -1;
+        }
+        memcpy(seg->data, buffer, size);
+        seg->length = size;
+    }
+
+    /*
+     * Streams set with a NULL reference are allocated dynamically and
+     * released by the channel once they are consumed.
+     */
+    if (!stream) {
+        stream = mk_stream_pool_alloc(MK_STREAM_POOL_STREAM,
+                                      sizeof(struct mk_stream));
+        if (!stream) {
+            if (seg) {
+                mk_stream_segment_put(seg);
+            }
+            return -1;
+        }
+        stream->dynamic = MK_TRUE;
+    }
+    else {
+        stream->dynamic = MK_FALSE;
+    }
+
+    stream->type         = type;
+    stream->channel      = channel;
+    stream->bytes_offset = 0;
+    stream->buffer       = buffer;
+    stream->data         = data;
+    stream->preserve     = MK_FALSE;
+
+    if (type == MK_STREAM_IOV) {
+        iov = buffer;
+        stream->bytes_total = iov->total_len;
+    }
+    else if (type == MK_STREAM_COPYBUF) {
+        stream->buffer = seg;
+        stream->bytes_total = size;
+    }
+    else {
+        stream->bytes_total = size;
+    }
+
+    /* callbacks */
+    stream->cb_finished       = cb_finished;
+    stream->cb_bytes_consumed = cb_bytes_consumed;
+    stream->cb_exception      = cb_exception;
+
+    mk_list_add(&stream->_head, &channel->streams);
+    return 0;
+}
+
+/*
+ * Create a new stream instance, the caller owns it and must release it
+ * with mk_stream_free().
+ */
 struct mk_stream *mk_stream_new(int type, struct mk_channel *channel,
                                 void *buffer, size_t size, void *data,
                                 void (*cb_finished) (struct mk_stream *),
                                 void (*cb_bytes_consumed) (struct mk_stream *, long),
                                 void (*cb_exception) (struct mk_stream *, int))
 {
+    int ret;
     struct mk_stream *stream;
 
-    stream = mk_mem_malloc(sizeof(struct mk_stream));
-    mk_stream_set(stream, type, channel,
-                  buffer, size,
-                  data,
-                  cb_finished,
-                  cb_bytes_consumed,
-                  cb_exception);
+    stream = mk_stream_pool_alloc(MK_STREAM_POOL_STREAM,
+                                  sizeof(struct mk_stream));
+    if (!stream) {
+        return NULL;
+    }
+
+    ret = mk_stream_set(stream, type, channel,
+                        buffer, size,
+                        data,
+                        cb_finished,
+                        cb_bytes_consumed,
+                        cb_exception);
+    if (ret != 0) {
+        mk_stream_free(stream);
+        return NULL;
+    }
 
     return stream;
 }
 
+void mk_stream_free(struct mk_stream *stream)
+{
+    mk_pool_put(stream);
+}
 
-/* Create a new channel */
+/* Create a new channel, it must be released with mk_channel_free() */
 struct mk_channel *mk_channel_new(int type, int fd)
 {
     struct mk_channel *channel;
 
-    channel = mk_mem_malloc(sizeof(struct mk_channel));
+    channel = mk_stream_pool_alloc(MK_STREAM_POOL_CHANNEL,
+                                   sizeof(struct mk_channel));
+    if (!channel) {
+        return NULL;
+    }
+
     channel->type = type;
     channel->fd   = fd;
 
@@ -58,6 +448,11 @@ struct mk_channel *mk_channel_new(int type, int fd)
     return channel;
 }
 
+void mk_channel_free(struct mk_channel *channel)
+{
+    mk_pool_put(channel);
+}
+
 static inline size_t channel_write_stream_file(struct mk_channel *channel,
                                                struct mk_stream *stream)
 {
@@ -78,28 +473,6 @@ static inline size_t channel_write_stream_file(struct mk_channel *channel,
     return bytes;
 }
 
-static inline void mk_copybuf_consume(struct mk_stream *stream, size_t bytes)
-{
-    /*
-     * Copybuf is a dynamic buffer allocated when the stream was configured,
-     * if the number of bytes consumed is equal to the total size, the buffer
-     * can be freed, otherwise we need to adjust the buffer for the next
-     * round of 'write'.
-     *
-     * Note: we don't touch the stream->bytes_total field as this is adjusted
-     * on the caller mk_channel_write().
-     */
-    if (bytes == stream->bytes_total) {
-        mk_mem_free(stream->buffer);
-        stream->buffer = NULL;
-    }
-    else {
-        memmove(stream->buffer,
-                stream->buffer + bytes,
-                stream->bytes_total - bytes);
-    }
-}
-
 /*
  * It 'intent' to write a few streams over the channel and alter the
  * channel notification side if required: READ -> WRITE.
@@ -149,28 +522,226 @@ int mk_stream_release(struct mk_stream *stream)
 {
     if (stream->type == MK_STREAM_COPYBUF) {
         if (stream->buffer) {
-            mk_mem_free(stream->buffer);
+            mk_stream_segment_put(stream->buffer);
+            stream->buffer = NULL;
         }
     }
 
     if (stream->preserve == MK_FALSE) {
         mk_stream_unlink(stream);
         if (stream->dynamic == MK_TRUE) {
-            mk_mem_free(stream);
+            mk_pool_put(stream);
         }
     }
 
     return 0;
 }
 
-/* It perform a direct stream I/O write through the network layer */
+/*
+ * Release a stream that will not be consumed, its owner is told through
+ * the exception callback, e.g: to drop a reference on the stream buffer.
+ */
+static inline void mk_stream_discard(struct mk_stream *stream, int err)
+{
+    if (stream->cb_exception) {
+        stream->cb_exception(stream, err);
+    }
+    mk_stream_release(stream);
+}
+
+/*
+ * An EOF stream do not carry data, it just notify the owner that every
+ * stream enqueued before it have been flushed. The stream is unlinked
+ * before invoking the callback as the owner may release the whole channel
+ * from there.
+ */
+static inline int channel_stream_eof(struct mk_stream *stream)
+{
+    mk_stream_unlink(stream);
+    if (stream->cb_finished) {
+        stream->cb_finished(stream);
+    }
+    if (stream->dynamic == MK_TRUE) {
+        mk_pool_put(stream);
+    }
+    return MK_CHANNEL_DONE;
+}
+
+/* Streams that can be gathered into a single writev(2) call */
+static inline int channel_stream_is_buffer(struct mk_stream *stream)
+{
+    return (stream->type == MK_STREAM_IOV ||
+            stream->type == MK_STREAM_RAW ||
+            stream->type == MK_STREAM_COPYBUF);
+}
+
+/*
+ * Walk the channel from the first stream and map the pending bytes of
+ * consecutive IOV, RAW and COPYBUF streams into 'io'. It returns the number
+ * of iovec entries used, 'n_streams' is set with the number of streams
+ * that were (totally or partially) mapped and 'total' with the number
+ * of bytes.
+ */
+static inline int channel_gather(struct mk_channel *channel,
+                                 struct iovec *io, int size,
+                                 int *n_streams, size_t *total)
+{
+    int i;
+    int n = 0;
+    size_t len;
+    size_t pending;
+    struct mk_iov *iov;
+    struct mk_list *head;
+    struct mk_stream *stream;
+    struct mk_stream_segment *seg;
+
+    *n_streams = 0;
+    *total = 0;
+
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (!channel_stream_is_buffer(stream) || n >= size) {
+            break;
+        }
+
+        if (stream->type == MK_STREAM_IOV) {
+            iov = stream->buffer;
+            pending = stream->bytes_total;
+
+            for (i = 0; i < iov->iov_idx && pending > 0 && n < size; i++) {
+                len = iov->io[i].iov_len;
+                if (len == 0) {
+                    continue;
+                }
+                if (len > pending) {
+                    len = pending;
+                }
+                io[n].iov_base = iov->io[i].iov_base;
+                io[n].iov_len  = len;
+                pending -= len;
+                *total  += len;
+                n++;
+            }
+        }
+        else if (stream->bytes_total > 0) {
+            /* RAW and COPYBUF keep their read position on bytes_offset */
+            if (stream->type == MK_STREAM_RAW) {
+                io[n].iov_base = (char *) stream->buffer + stream->bytes_offset;
+            }
+            else {
+                seg = stream->buffer;
+                io[n].iov_base = seg->data + stream->bytes_offset;
+            }
+            io[n].iov_len = stream->bytes_total;
+            *total += stream->bytes_total;
+            n++;
+        }
+
+        (*n_streams)++;
+    }
+
+    return n;
+}
+
+/*
+ * Once the buffered streams were written, distribute the number of bytes
+ * sent across them in order, invoking the consumption and finish callbacks
+ * for each one.
+ */
+static inline void channel_dispatch(struct mk_channel *channel,
+                                    int n_streams, size_t bytes)
+{
+    size_t used;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_stream *stream;
+
+    mk_list_foreach_safe(head, tmp, &channel->streams) {
+        if (n_streams-- <= 0) {
+            break;
+        }
+
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        used = bytes;
+        if (used > stream->bytes_total) {
+            used = stream->bytes_total;
+        }
+
+        if (used > 0) {
+            if (stream->type == MK_STREAM_IOV) {
+                mk_iov_consume(stream->buffer, used);
+            }
+            else {
+                /* RAW and COPYBUF: just move the read position */
+                stream->bytes_offset += used;
+            }
+
+            bytes -= used;
+            mk_stream_bytes_consumed(stream, used);
+
+            /* notification callback, optional */
+            if (stream->cb_bytes_consumed) {
+                stream->cb_bytes_consumed(stream, used);
+            }
+        }
+
+        if (stream->bytes_total > 0) {
+            /* partial write, the remaining streams were not touched */
+            break;
+        }
+
+        MK_TRACE("Stream done, unlinking (channel=%p)", channel);
+        if (stream->cb_finished) {
+            stream->cb_finished(stream);
+        }
+        mk_stream_release(stream);
+    }
+}
+
+/*
+ * After a successful write, report the channel status. If everything that
+ * was mapped got flushed and an EOF stream is next, notify it right away
+ * instead of waiting for another write event.
+ */
+static inline int channel_write_status(struct mk_channel *channel,
+                                       int flushed)
+{
+    struct mk_stream *stream;
+
+    if (mk_list_is_empty(&channel->streams) == 0) {
+        MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
+        return MK_CHANNEL_DONE;
+    }
+
+    if (flushed == MK_TRUE) {
+        stream = mk_list_entry_first(&channel->streams,
+                                     struct mk_stream, _head);
+        if (stream->type == MK_STREAM_EOF) {
+            return channel_stream_eof(stream);
+        }
+    }
+
+    MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
+    return MK_CHANNEL_FLUSH;
+}
+
+/*
+ * It perform a direct stream I/O write through the network layer. Consecutive
+ * IOV, RAW and COPYBUF streams are flushed together with a single writev(2)
+ * call, e.g: response headers, a small body and an EOF marker.
+ */
 int mk_channel_write(struct mk_channel *channel, size_t *count)
 {
+    int n;
+    int n_streams = 0;
+    size_t total = 0;
     ssize_t bytes = -1;
-    struct mk_iov *iov;
+    struct mk_iov iov;
+    struct iovec io[MK_CHANNEL_IOV_MAX];
     struct mk_stream *stream = NULL;
 
     errno = 0;
+    *count = 0;
 
     if (mk_list_is_empty(&channel->streams) == 0) {
         MK_TRACE("[CH %i] CHANNEL_EMPTY", channel->fd);
@@ -185,73 +756,70 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
      * requires to read from buffer, e.g: Static File, Pipes.
      */
     if (channel->type == MK_CHANNEL_SOCKET) {
-        if (stream->type == MK_STREAM_FILE) {
+        if (stream->type == MK_STREAM_EOF) {
+            return channel_stream_eof(stream);
+        }
+        else if (stream->type == MK_STREAM_FILE) {
             bytes = channel_write_stream_file(channel, stream);
+            total = stream->bytes_total;
         }
-        else if (stream->type == MK_STREAM_IOV) {
-            iov   = stream->buffer;
+        else if (channel_stream_is_buffer(stream)) {
+            n = channel_gather(channel, io, MK_CHANNEL_IOV_MAX,
+                               &n_streams, &total);
+            if (n == 0) {
+                /* Only empty streams, nothing to write */
+                channel_dispatch(channel, n_streams, 0);
+                return channel_write_status(channel, MK_TRUE);
+            }
 
-            bytes = mk_sched_conn_writev(channel, iov);
+            iov.iov_idx     = n;
+            iov.buf_idx     = 0;
+            iov.size        = n;
+            iov.total_len   = total;
+            iov.io          = io;
+            iov.buf_to_free = NULL;
 
-            MK_TRACE("[CH %i] STREAM_IOV, wrote %d bytes",
-                     channel->fd, bytes);
-            if (bytes > 0) {
-                /* Perform the adjustment on mk_iov */
-                mk_iov_consume(iov, bytes);
-            }
-        }
-        else if (stream->type == MK_STREAM_COPYBUF) {
-            bytes = mk_sched_conn_write(channel,
-                                        stream->buffer, stream->bytes_total);
-            MK_TRACE("[CH %i] STREAM_COPYBUF, bytes=%zd/%lu",
-                     channel->fd, bytes, stream->bytes_total);
-            if (bytes > 0) {
-                mk_copybuf_consume(stream, bytes);
-            }
-        }
-        else if (stream->type == MK_STREAM_EOF) {
-            if (stream->cb_finished) {
-                stream->cb_finished(stream);
-            }
-            return MK_CHANNEL_DONE;
+            bytes = mk_sched_conn_writev(channel, &iov);
+            MK_TRACE("[CH %i] STREAMS=%i IOV=%i, wrote %zd/%zu bytes",
+                     channel->fd, n_streams, n, bytes, total);
         }
 
         if (bytes > 0) {
             *count = bytes;
-            mk_stream_bytes_consumed(stream, bytes);
 
-            /* notification callback, optional */
-            if (stream->cb_bytes_consumed) {
-                stream->cb_bytes_consumed(stream, bytes);
-            }
+            if (stream->type == MK_STREAM_FILE) {
+                mk_stream_bytes_consumed(stream, bytes);
 
-            if (stream->bytes_total == 0) {
-                MK_TRACE("Stream done, unlinking (channel=%p)", channel);
+                /* notification callback, optional */
+                if (stream->cb_bytes_consumed) {
+                    stream->cb_bytes_consumed(stream, bytes);
+                }
 
-                if (stream->cb_finished) {
-                    stream->cb_finished(stream);
+                if (stream->bytes_total == 0) {
+                    MK_TRACE("Stream done, unlinking (channel=%p)", channel);
+
+                    if (stream->cb_finished) {
+                        stream->cb_finished(stream);
+                    }
+                    mk_stream_release(stream);
                 }
-                mk_stream_release(stream);
             }
-
-            if (mk_list_is_empty(&channel->streams) == 0) {
-                MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
-                return MK_CHANNEL_DONE;
+            else {
+                channel_dispatch(channel, n_streams, bytes);
             }
 
-            MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
-            return MK_CHANNEL_FLUSH;
+            return channel_write_status(channel, (size_t) bytes == total);
         }
         else if (bytes < 0) {
             if (errno == EAGAIN) {
                 return MK_CHANNEL_BUSY;
             }
 
-            mk_stream_release(stream);
+            mk_stream_discard(stream, errno);
             return MK_CHANNEL_ERROR;
         }
         else if (bytes == 0) {
-            mk_stream_release(stream);
+            mk_stream_discard(stream, errno);
             return MK_CHANNEL_ERROR;
         }
     }
@@ -268,7 +836,7 @@ int mk_channel_clean(struct mk_channel *channel)
 
     mk_list_foreach_safe(head, tmp, &channel->streams) {
         stream = mk_list_entry(head, struct mk_stream, _head);
-        mk_stream_release(stream);
+        mk_stream_discard(stream, 0);
     }
 
     return 0;
@@ -17,6 +17,8 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <monkey/monkey.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_vhost.h>
@@ -25,6 +27,7 @@
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_info.h>
 
+#include <ctype.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -32,6 +35,9 @@
 /* Initialize Virtual Host FDT mutex */
 pthread_mutex_t mk_vhost_fdt_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Server names index, read only once the hosts are loaded */
+static struct mk_vhost_index *vhost_index = NULL;
+
 static int str_to_regex(char *str, regex_t *reg)
 {
     int ret;
@@ -53,6 +59,93 @@ static int str_to_regex(char *str, regex_t *reg)
     return 0;
 }
 
+/*
+ * Try to compile a Match pattern as a literal one: '[^]head[.*tail][$]'
+ * where head and tail have no regex operators other than escaped chars.
+ */
+static int mk_vhost_handler_literal(struct mk_host_handler *h, char *str)
+{
+    int len = 0;
+    char *p = str;
+    char *buf;
+    char *head;
+
+    buf = mk_mem_malloc(strlen(str) + 1);
+    if (!buf) {
+        return -1;
+    }
+
+    h->anchor_start = MK_FALSE;
+    h->anchor_end = MK_FALSE;
+    h->gap = MK_FALSE;
+    head = buf;
+
+    if (*p == '^') {
+        h->anchor_start = MK_TRUE;
+        p++;
+    }
+
+    while (*p) {
+        if (*p == '\\' && p[1] && strchr(".[]()*+?{}|^$\\/-", p[1])) {
+            buf[len++] = p[1];
+            p += 2;
+            continue;
+        }
+        else if (*p == '.' && p[1] == '*' && h->gap == MK_FALSE) {
+            buf[len++] = '\0';
+            h->gap = MK_TRUE;
+            h->head.data = head;
+            h->head.len = strlen(head);
+            head = buf + len;
+            p += 2;
+            continue;
+        }
+        else if (*p == '$' && p[1] == '\0') {
+            h->anchor_end = MK_TRUE;
+            p++;
+            continue;
+        }
+        else if (strchr(".[]()*+?{}|^$\\", *p)) {
+            mk_mem_free(buf);
+            return -1;
+        }
+        buf[len++] = *p++;
+    }
+    buf[len] = '\0';
+
+    if (h->gap == MK_TRUE) {
+        h->tail.data = head;
+        h->tail.len = strlen(head);
+    }
+    else {
+        h->head.data = head;
+        h->head.len = len;
+        mk_ptr_reset(&h->tail);
+    }
+
+    /* A trailing '.*' does not change the match */
+    if (h->gap == MK_TRUE && h->tail.len == 0 && h->anchor_end == MK_FALSE) {
+        h->gap = MK_FALSE;
+    }
+
+    h->type = MK_HANDLER_LITERAL;
+    return 0;
+}
+
+static int mk_vhost_handler_compile(struct mk_host_handler *h, char *str)
+{
+    if (mk_vhost_handler_literal(h, str) == 0) {
+        MK_TRACE("[vhost] handler '%s' is literal: head='%s' tail='%s'",
+                 str, h->head.data, h->tail.data ? h->tail.data : "");
+        return 0;
+    }
+
+    h->type = MK_HANDLER_REGEX;
+    mk_ptr_reset(&h->head);
+    mk_ptr_reset(&h->tail);
+    return str_to_regex(str, &h->match);
+}
+
 /*
  * This function is triggered upon thread creation (inside the thread
  * context), here we configure per-thread data.
@@ -61,12 +154,10 @@ int mk_vhost_fdt_worker_init()
 {
     int i;
     int j;
+    int n;
     struct host *h;
-    struct mk_list *list;
     struct mk_list *head;
-    struct vhost_fdt_host *fdt;
-    struct vhost_fdt_hash_table *ht;
-    struct vhost_fdt_hash_chain *hc;
+    struct vhost_fdt *fdt;
 
     if (mk_config->fdt == MK_FALSE) {
         return -1;
@@ -86,220 +177,259 @@ int mk_vhost_fdt_worker_init()
      */
     pthread_mutex_lock(&mk_vhost_fdt_mutex);
 
-    /*
-     * Initialize the thread FDT/Hosts list and create an entry per
-     * existent virtual host
-     */
-    list = mk_mem_malloc_z(sizeof(struct mk_list));
-    mk_list_init(list);
-
+    /* Host tables are indexed by the virtual host id */
+    n = 0;
     mk_list_foreach(head, &mk_config->hosts) {
         h = mk_list_entry(head, struct host, _head);
+        if (h->id >= n) {
+            n = h->id + 1;
+        }
+    }
 
-        fdt = mk_mem_malloc(sizeof(struct vhost_fdt_host));
-        fdt->host = h;
-
-        /* Initialize hash table */
-        for (i = 0; i < VHOST_FDT_HASHTABLE_SIZE; i++) {
-            ht = &fdt->hash_table[i];
-            ht->av_slots = VHOST_FDT_HASHTABLE_CHAINS;
+    fdt = mk_mem_malloc_z(sizeof(struct vhost_fdt) +
+                          (sizeof(struct vhost_fdt_host) * n));
+    fdt->capacity = mk_config->fdt_capacity;
+    fdt->n_hosts  = n;
+    mk_list_init(&fdt->idle);
 
-            /* for each chain under the hash table, set the fd */
-            for (j = 0; j < VHOST_FDT_HASHTABLE_CHAINS; j++) {
-                hc = &ht->chain[j];
-                hc->fd      = -1;
-                hc->hash    =  0;
-                hc->readers =  0;
-            }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < VHOST_FDT_HASHTABLE_SIZE; j++) {
+            mk_list_init(&fdt->hosts[i].table[j]);
         }
-        mk_list_add(&fdt->_head, list);
     }
 
-    MK_TLS_SET(mk_tls_vhost_fdt, list);
+    mk_list_foreach(head, &mk_config->hosts) {
+        h = mk_list_entry(head, struct host, _head);
+        fdt->hosts[h->id].host = h;
+    }
+
+    MK_TLS_SET(mk_tls_vhost_fdt, fdt);
     pthread_mutex_unlock(&mk_vhost_fdt_mutex);
 
     return 0;
 }
 
+static void mk_vhost_fdt_file_free(struct vhost_fdt *fdt,
+                                   struct vhost_fdt_file *ff)
+{
+    /* Stale files are already unlinked and never reach the idle list */
+    if (ff->stale == MK_FALSE) {
+        mk_list_del(&ff->_head);
+        if (ff->readers == 0) {
+            mk_list_del(&ff->_lru);
+        }
+    }
+    close(ff->fd);
+    mk_mem_free(ff->path);
+    mk_mem_free(ff);
+    fdt->count--;
+}
+
 int mk_vhost_fdt_worker_exit()
 {
-    struct mk_list *list;
+    int i;
+    int j;
     struct mk_list *head;
     struct mk_list *tmp;
-    struct vhost_fdt_host *fdt;
+    struct vhost_fdt *fdt;
+    struct vhost_fdt_file *ff;
 
     if (mk_config->fdt == MK_FALSE) {
         return -1;
     }
 
-    list = MK_TLS_GET(mk_tls_vhost_fdt);
-    mk_list_foreach_safe(head, tmp, list) {
-        fdt = mk_list_entry(head, struct vhost_fdt_host, _head);
-        mk_list_del(&fdt->_head);
-        mk_mem_free(fdt);
+    fdt = MK_TLS_GET(mk_tls_vhost_fdt);
+    if (!fdt) {
+        return -1;
+    }
+
+    MK_TRACE("[vhost fdt] files=%i hits=%lu misses=%lu",
+             fdt->count, fdt->hits, fdt->misses);
+
+    for (i = 0; i < fdt->n_hosts; i++) {
+        for (j = 0; j < VHOST_FDT_HASHTABLE_SIZE; j++) {
+            mk_list_foreach_safe(head, tmp, &fdt->hosts[i].table[j]) {
+                ff = mk_list_entry(head, struct vhost_fdt_file, _head);
+                mk_vhost_fdt_file_free(fdt, ff);
+            }
+        }
     }
 
-    mk_mem_free(list);
+    mk_mem_free(fdt);
+    MK_TLS_SET(mk_tls_vhost_fdt, NULL);
     return 0;
 }
 
-
+/*
+ * Lookup a registered file, the hash only selects the chain: the path is
+ * always compared. If the file changed on disk since it was opened (the
+ * request carries a fresh stat), the entry is unlinked and released once
+ * its current readers are done.
+ */
 static inline
-struct vhost_fdt_hash_table *mk_vhost_fdt_table_lookup(int id, struct host *host)
+struct vhost_fdt_file *mk_vhost_fdt_lookup(struct vhost_fdt *fdt,
+                                           struct mk_list *chain,
+                                           unsigned int hash,
+                                           struct mk_http_request *sr)
 {
     struct mk_list *head;
-    struct mk_list *list;
-    struct vhost_fdt_host *fdt_host;
-    struct vhost_fdt_hash_table *ht = NULL;
+    struct vhost_fdt_file *ff;
 
-    list = MK_TLS_GET(mk_tls_vhost_fdt);
-    mk_list_foreach(head, list) {
-        fdt_host = mk_list_entry(head, struct vhost_fdt_host, _head);
-        if (fdt_host->host == host) {
-            ht = &fdt_host->hash_table[id];
-            return ht;
+    mk_list_foreach(head, chain) {
+        ff = mk_list_entry(head, struct vhost_fdt_file, _head);
+        if (ff->hash != hash || ff->path_len != (int) sr->real_path.len ||
+            memcmp(ff->path, sr->real_path.data, ff->path_len) != 0) {
+            continue;
         }
+
+        if (ff->size != sr->file_info.size ||
+            ff->mtime != sr->file_info.last_modification) {
+            if (ff->readers == 0) {
+                mk_vhost_fdt_file_free(fdt, ff);
+            }
+            else {
+                mk_list_del(&ff->_head);
+                ff->stale = MK_TRUE;
+            }
+            return NULL;
+        }
+        return ff;
     }
 
-    return ht;
+    return NULL;
 }
 
-static inline
-struct vhost_fdt_hash_chain
-*mk_vhost_fdt_chain_lookup(unsigned int hash, struct vhost_fdt_hash_table *ht)
+/* Get a slot for a new file, reusing the least recently used idle one */
+static inline struct vhost_fdt_file *mk_vhost_fdt_slot(struct vhost_fdt *fdt)
 {
-    int i;
-    struct vhost_fdt_hash_chain *hc = NULL;
+    struct vhost_fdt_file *ff;
 
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->hash == hash) {
-            return hc;
+    if (fdt->count < fdt->capacity) {
+        ff = mk_mem_malloc(sizeof(struct vhost_fdt_file));
+        if (ff) {
+            fdt->count++;
         }
+        return ff;
     }
 
-    return NULL;
-}
+    if (mk_list_is_empty(&fdt->idle) == 0) {
+        return NULL;
+    }
 
+    ff = mk_list_entry_first(&fdt->idle, struct vhost_fdt_file, _lru);
+    mk_list_del(&ff->_lru);
+    mk_list_del(&ff->_head);
+    close(ff->fd);
+    mk_mem_free(ff->path);
 
-static inline int mk_vhost_fdt_open(int id, unsigned int hash,
-                                    struct mk_http_request *sr)
+    return ff;
+}
+
+static inline int mk_vhost_fdt_open(struct mk_http_request *sr)
 {
-    int i;
-    int fd = -1;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
+    int fd;
+    unsigned int hash;
+    struct mk_list *chain;
+    struct vhost_fdt *fdt;
+    struct vhost_fdt_file *ff;
 
     if (mk_config->fdt == MK_FALSE) {
         return open(sr->real_path.data, sr->file_info.flags_read_only);
     }
 
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
+    fdt = MK_TLS_GET(mk_tls_vhost_fdt);
+    if (mk_unlikely(!fdt || sr->host_conf->id >= fdt->n_hosts)) {
         return open(sr->real_path.data, sr->file_info.flags_read_only);
     }
 
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
+    hash  = mk_utils_gen_hash(sr->real_path.data, sr->real_path.len);
+    chain = &fdt->hosts[sr->host_conf->id].table[hash % VHOST_FDT_HASHTABLE_SIZE];
+
+    ff = mk_vhost_fdt_lookup(fdt, chain, hash, sr);
+    if (ff) {
         /* Increment the readers and return the shared FD */
-        hc->readers++;
-        sr->vhost_fdt_id      = id;
-        sr->vhost_fdt_hash    = hash;
-        sr->vhost_fdt_enabled = MK_TRUE;
-        return hc->fd;
+        if (ff->readers == 0) {
+            mk_list_del(&ff->_lru);
+        }
+        ff->readers++;
+        fdt->hits++;
+        sr->vhost_fdt = ff;
+        return ff->fd;
     }
+    fdt->misses++;
 
     /*
-     * Get here means that no entry exists in the hash table for the
-     * requested file descriptor and hash, we must try to open the file
-     * and register the entry in the table.
+     * Get here means that no entry exists in the table for the requested
+     * file, we must try to open the file and register it.
      */
     fd = open(sr->real_path.data, sr->file_info.flags_read_only);
     if (fd == -1) {
         return -1;
     }
 
-    /* If chains are full, just return the new FD, bad luck... */
-    if (ht->av_slots <= 0) {
+    /* If the table is full and no file is idle, just return the new FD */
+    ff = mk_vhost_fdt_slot(fdt);
+    if (!ff) {
         return fd;
     }
 
-    /* Register the new entry in an available slot */
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->fd == -1) {
-            hc->fd   = fd;
-            hc->hash = hash;
-            hc->readers++;
-            ht->av_slots--;
-
-            sr->vhost_fdt_id      = id;
-            sr->vhost_fdt_hash    = hash;
-            sr->vhost_fdt_enabled = MK_TRUE;
-
-            return fd;
-        }
+    ff->path = mk_mem_malloc(sr->real_path.len);
+    if (!ff->path) {
+        mk_mem_free(ff);
+        fdt->count--;
+        return fd;
     }
-
+    memcpy(ff->path, sr->real_path.data, sr->real_path.len);
+
+    ff->fd       = fd;
+    ff->hash     = hash;
+    ff->readers  = 1;
+    ff->stale    = MK_FALSE;
+    ff->path_len = sr->real_path.len;
+    ff->size     = sr->file_info.size;
+    ff->mtime    = sr->file_info.last_modification;
+    mk_list_add(&ff->_head, chain);
+
+    sr->vhost_fdt = ff;
     return fd;
 }
 
 static inline int mk_vhost_fdt_close(struct mk_http_request *sr)
 {
-    int id;
-    unsigned int hash;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
+    struct vhost_fdt *fdt;
+    struct vhost_fdt_file *ff;
 
-    if (mk_config->fdt == MK_FALSE || sr->vhost_fdt_enabled == MK_FALSE) {
+    if (mk_config->fdt == MK_FALSE || !sr->vhost_fdt) {
         if (sr->file_stream.fd > 0) {
             return close(sr->file_stream.fd);
         }
         return -1;
     }
 
-    id   = sr->vhost_fdt_id;
-    hash = sr->vhost_fdt_hash;
-
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
-        return close(sr->file_stream.fd);
-    }
-
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
-        /* Increment the readers and check if we should close */
-        hc->readers--;
-        sr->vhost_fdt_enabled = MK_FALSE;
-
-        if (hc->readers == 0) {
-            hc->fd   = -1;
-            hc->hash = 0;
-            ht->av_slots++;
-            return close(sr->file_stream.fd);
+    /*
+     * The file is kept open when its last reader is gone, it goes to the
+     * idle list where it can be shared again or reused for another file.
+     */
+    ff = sr->vhost_fdt;
+    sr->vhost_fdt = NULL;
+
+    ff->readers--;
+    if (ff->readers == 0) {
+        fdt = MK_TLS_GET(mk_tls_vhost_fdt);
+        if (ff->stale == MK_TRUE) {
+            mk_vhost_fdt_file_free(fdt, ff);
         }
         else {
-            return 0;
+            mk_list_add(&ff->_lru, &fdt->idle);
         }
     }
-    return close(sr->file_stream.fd);
-}
 
+    return 0;
+}
 
 int mk_vhost_open(struct mk_http_request *sr)
 {
-    int id;
-    int off;
-    unsigned int hash;
-
-    off = sr->host_conf->documentroot.len;
-    hash = mk_utils_gen_hash(sr->real_path.data + off,
-                             sr->real_path.len - off);
-    id   = (hash % VHOST_FDT_HASHTABLE_SIZE);
-
-    return mk_vhost_fdt_open(id, hash, sr);
+    return mk_vhost_fdt_open(sr);
 }
 
 int mk_vhost_close(struct mk_http_request *sr)
@@ -491,7 +621,7 @@ struct host *mk_vhost_read(char *path)
                 entry = mk_list_entry(head_line, struct mk_string_line, _head);
                 switch (i) {
                 case 0:
-                    ret = str_to_regex(entry->val, &h_handler->match);
+                    ret = mk_vhost_handler_compile(h_handler, entry->val);
                     if (ret == -1) {
                         exit(EXIT_FAILURE);
                     }
@@ -515,6 +645,7 @@ struct host *mk_vhost_read(char *path)
                 mk_err("[Host Handlers] invalid Match value\n");
                 exit(EXIT_FAILURE);
             }
+            h_handler->index = host->n_handlers++;
             mk_list_add(&h_handler->_head, &host->handlers);
         }
     }
@@ -534,6 +665,14 @@ int mk_vhost_map_handlers()
 
     mk_list_foreach(head, &mk_config->hosts) {
         host = mk_list_entry(head, struct host, _head);
+        if (host->n_handlers > 0) {
+            host->handler_table = mk_mem_malloc(sizeof(struct mk_host_handler *) *
+                                                host->n_handlers);
+            if (!host->handler_table) {
+                exit(EXIT_FAILURE);
+            }
+        }
+
         mk_list_foreach(head_handler, &host->handlers) {
             h_handler = mk_list_entry(head_handler, struct mk_host_handler, _head);
 
@@ -550,6 +689,7 @@ int mk_vhost_map_handlers()
             }
 
             h_handler->handler = p;
+            host->handler_table[h_handler->index] = h_handler;
             n++;
         }
     }
@@ -557,6 +697,153 @@ int mk_vhost_map_handlers()
     return n;
 }
 
+/* This function is called when a worker thread is created */
+void mk_vhost_handler_worker_init()
+{
+    struct mk_handler_cache *cache;
+
+    cache = mk_mem_malloc_z(sizeof(struct mk_handler_cache));
+    MK_TLS_SET(mk_tls_vhost_handlers, cache);
+}
+
+void mk_vhost_handler_worker_exit()
+{
+    struct mk_handler_cache *cache;
+
+    cache = MK_TLS_GET(mk_tls_vhost_handlers);
+    if (!cache) {
+        return;
+    }
+
+    MK_TRACE("[vhost] handler cache hits=%lu misses=%lu",
+             cache->hits, cache->misses);
+
+    mk_mem_free(cache);
+    MK_TLS_SET(mk_tls_vhost_handlers, NULL);
+}
+
+/* Test a handler pattern against a NULL terminated URI */
+static inline int mk_vhost_handler_test(struct mk_host_handler *h,
+                                        char *uri, int len)
+{
+    int pos = 0;
+    int hlen = h->head.len;
+    int tlen = h->tail.len;
+    char *p;
+
+    if (h->type == MK_HANDLER_REGEX) {
+        return (regexec(&h->match, uri, 0, NULL, 0) == 0);
+    }
+
+    if (h->gap == MK_FALSE) {
+        if (len < hlen) {
+            return MK_FALSE;
+        }
+        if (h->anchor_start == MK_TRUE && h->anchor_end == MK_TRUE) {
+            return (len == hlen &&
+                    strncasecmp(uri, h->head.data, len) == 0);
+        }
+        else if (h->anchor_start == MK_TRUE) {
+            return (strncasecmp(uri, h->head.data, hlen) == 0);
+        }
+        else if (h->anchor_end == MK_TRUE) {
+            return (strncasecmp(uri + len - hlen, h->head.data,
+                                hlen) == 0);
+        }
+        return (strcasestr(uri, h->head.data) != NULL);
+    }
+
+    /* head.*tail: find the first head, then a tail after it */
+    if (hlen > 0) {
+        if (h->anchor_start == MK_TRUE) {
+            if (len < hlen ||
+                strncasecmp(uri, h->head.data, hlen) != 0) {
+                return MK_FALSE;
+            }
+            pos = hlen;
+        }
+        else {
+            p = strcasestr(uri, h->head.data);
+            if (!p) {
+                return MK_FALSE;
+            }
+            pos = (p - uri) + hlen;
+        }
+    }
+
+    if (h->anchor_end == MK_TRUE) {
+        return (len - tlen >= pos &&
+                strncasecmp(uri + len - tlen, h->tail.data,
+                            tlen) == 0);
+    }
+
+    return (strcasestr(uri + pos, h->tail.data) != NULL);
+}
+
+/*
+ * Find the handler for a URI. If 'prev' is set the lookup continues with
+ * the handlers that follow it, this happens when the previous one was not
+ * interested in the request. First lookups are cached per worker.
+ */
+struct mk_host_handler *mk_vhost_handler_match(struct host *host,
+                                               char *uri, int len,
+                                               struct mk_host_handler *prev)
+{
+    int i;
+    unsigned int hash = 0;
+    struct mk_handler_cache *cache = NULL;
+    struct mk_handler_cache_slot *slot = NULL;
+
+    if (host->n_handlers == 0) {
+        return NULL;
+    }
+
+    if (prev) {
+        i = prev->index + 1;
+    }
+    else {
+        i = 0;
+        cache = MK_TLS_GET(mk_tls_vhost_handlers);
+    }
+
+    if (cache && len < MK_HANDLER_CACHE_URI) {
+        hash = mk_utils_gen_hash(uri, len);
+        slot = &cache->slots[hash & (MK_HANDLER_CACHE_SIZE - 1)];
+        if (slot->host == host && slot->hash == hash && slot->len == len &&
+            memcmp(slot->uri, uri, len) == 0) {
+            cache->hits++;
+            if (slot->index < 0) {
+                return NULL;
+            }
+            return host->handler_table[slot->index];
+        }
+        cache->misses++;
+    }
+
+    for (; i < host->n_handlers; i++) {
+        if (mk_vhost_handler_test(host->handler_table[i], uri, len)) {
+            break;
+        }
+    }
+
+    if (i == host->n_handlers) {
+        i = -1;
+    }
+
+    if (slot) {
+        slot->host  = host;
+        slot->hash  = hash;
+        slot->index = i;
+        slot->len   = len;
+        memcpy(slot->uri, uri, len);
+    }
+
+    if (i < 0) {
+        return NULL;
+    }
+    return host->handler_table[i];
+}
+
 void mk_vhost_set_single(char *path)
 {
     struct host *host;
@@ -571,6 +858,7 @@ void mk_vhost_set_single(char *path)
     /* Prepare the unique alias */
     halias = mk_mem_malloc_z(sizeof(struct host_alias));
     halias->name = mk_string_dup("127.0.0.1");
+    halias->len = strlen(halias->name);
     mk_list_add(&halias->_head, &host->server_names);
 
     host->documentroot.data = mk_string_dup(path);
@@ -586,8 +874,11 @@ void mk_vhost_set_single(char *path)
         mk_err("DocumentRoot variable in %s has an invalid directory path", path);
         exit(EXIT_FAILURE);
     }
+    host->id = mk_config->nhosts++;
     mk_list_add(&host->_head, &mk_config->hosts);
     mk_list_init(&host->handlers);
+
+    mk_vhost_index_build();
 }
 
 /* Given a configuration directory, start reading the virtual host entries */
@@ -617,8 +908,8 @@ void mk_vhost_init(char *path)
     if (!p_host) {
         mk_err("Error parsing main configuration file 'default'");
     }
+    p_host->id = mk_config->nhosts++;
     mk_list_add(&p_host->_head, &mk_config->hosts);
-    mk_config->nhosts++;
     mk_mem_free(buf);
     buf = NULL;
 
@@ -653,36 +944,176 @@ void mk_vhost_init(char *path)
             continue;
         }
         else {
+            p_host->id = mk_config->nhosts++;
             mk_list_add(&p_host->_head, &mk_config->hosts);
-            mk_config->nhosts++;
         }
     }
     closedir(dir);
     mk_mem_free(sites);
+
+    /* Index server names */
+    mk_vhost_index_build();
 }
 
 
 /* Lookup a registered virtual host based on the given 'host' input */
-int mk_vhost_get(mk_ptr_t host, struct host **vhost, struct host_alias **alias)
+static void mk_vhost_index_free()
 {
-    struct host *entry_host;
-    struct host_alias *entry_alias;
-    struct mk_list *head_vhost, *head_alias;
+    if (!vhost_index) {
+        return;
+    }
+
+    mk_mem_free(vhost_index->table);
+    mk_mem_free(vhost_index->wild);
+    mk_mem_free(vhost_index);
+    vhost_index = NULL;
+}
+
+/* Case insensitive FNV-1a, names are stored in lowercase */
+static inline unsigned int mk_vhost_hash(const char *name, int len)
+{
+    int i;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) tolower(name[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct host_alias *mk_vhost_index_find(struct mk_list *table,
+                                              unsigned int hash,
+                                              const char *name, int len)
+{
+    int skip;
+    struct mk_list *head;
+    struct host_alias *alias;
+
+    /* Wildcard names are indexed without the '*.' prefix */
+    skip = (table == vhost_index->wild) ? 2 : 0;
+
+    mk_list_foreach(head, &table[hash & (vhost_index->size - 1)]) {
+        alias = mk_list_entry(head, struct host_alias, _index);
+        if (alias->hash == hash && alias->len - skip == (unsigned int) len &&
+            strncasecmp(alias->name + skip, name, len) == 0) {
+            return alias;
+        }
+    }
+
+    return NULL;
+}
 
+/* Index the server names of all virtual hosts */
+void mk_vhost_index_build()
+{
+    int i;
+    int len;
+    int count = 0;
+    char *name;
+    struct mk_list *head_vhost;
+    struct mk_list *head_alias;
+    struct mk_list *table;
+    struct host *host;
+    struct host_alias *alias;
+    struct mk_vhost_index *index;
+
+    mk_vhost_index_free();
+
+    mk_list_foreach(head_vhost, &mk_config->hosts) {
+        host = mk_list_entry(head_vhost, struct host, _head);
+        mk_list_foreach(head_alias, &host->server_names) {
+            count++;
+        }
+    }
+
+    index = mk_mem_malloc_z(sizeof(struct mk_vhost_index));
+    index->size = 16;
+    while (index->size < count * 2) {
+        index->size <<= 1;
+    }
+    index->table = mk_mem_malloc(sizeof(struct mk_list) * index->size);
+    index->wild  = mk_mem_malloc(sizeof(struct mk_list) * index->size);
+    for (i = 0; i < index->size; i++) {
+        mk_list_init(&index->table[i]);
+        mk_list_init(&index->wild[i]);
+    }
+    vhost_index = index;
+
+    /* The first host defining a name owns it, as in the config order */
     mk_list_foreach(head_vhost, &mk_config->hosts) {
-        entry_host = mk_list_entry(head_vhost, struct host, _head);
-        mk_list_foreach(head_alias, &entry_host->server_names) {
-            entry_alias = mk_list_entry(head_alias, struct host_alias, _head);
-            if (entry_alias->len == host.len &&
-                strncmp(entry_alias->name, host.data, host.len) == 0) {
-                *vhost = entry_host;
-                *alias = entry_alias;
-                return 0;
+        host = mk_list_entry(head_vhost, struct host, _head);
+        mk_list_foreach(head_alias, &host->server_names) {
+            alias = mk_list_entry(head_alias, struct host_alias, _head);
+            alias->host = host;
+
+            name  = alias->name;
+            len   = alias->len;
+            table = index->table;
+            if (len > 2 && name[0] == '*' && name[1] == '.') {
+                name += 2;
+                len  -= 2;
+                table = index->wild;
+            }
+
+            alias->hash = mk_vhost_hash(name, len);
+            if (mk_vhost_index_find(table, alias->hash, name, len)) {
+                continue;
+            }
+
+            if (table == index->wild) {
+                index->wildcards++;
             }
+            mk_list_add(&alias->_index,
+                        &table[alias->hash & (index->size - 1)]);
         }
     }
 
-    return -1;
+    MK_TRACE("[vhost] index: %i names, %i buckets, %i wildcards",
+             count, index->size, index->wildcards);
+}
+
+int mk_vhost_get(mk_ptr_t host, struct host **vhost, struct host_alias **alias)
+{
+    int i;
+    int len;
+    char *name;
+    struct host_alias *entry_alias;
+
+    if (!vhost_index) {
+        return -1;
+    }
+
+    name = host.data;
+    len  = host.len;
+
+    /* Fully qualified name: 'example.com.' */
+    if (len > 1 && name[len - 1] == '.') {
+        len--;
+    }
+
+    entry_alias = mk_vhost_index_find(vhost_index->table,
+                                      mk_vhost_hash(name, len), name, len);
+
+    /* Wildcards, longest suffix first */
+    for (i = 0; !entry_alias && vhost_index->wildcards > 0 && i < len; i++) {
+        if (name[i] != '.') {
+            continue;
+        }
+        entry_alias = mk_vhost_index_find(vhost_index->wild,
+                                          mk_vhost_hash(name + i + 1,
+                                                        len - i - 1),
+                                          name + i + 1, len - i - 1);
+    }
+
+    if (!entry_alias) {
+        return -1;
+    }
+
+    *vhost = entry_alias->host;
+    *alias = entry_alias;
+    return 0;
 }
 
 void mk_vhost_free_all()
@@ -695,6 +1126,8 @@ void mk_vhost_free_all()
     struct mk_list *head_error;
     struct mk_list *tmp1, *tmp2;
 
+    mk_vhost_index_free();
+
     mk_list_foreach_safe(head_host, tmp1, &mk_config->hosts) {
         host = mk_list_entry(head_host, struct host, _head);
         mk_list_del(&host->_head);
@@ -720,6 +1153,11 @@ void mk_vhost_free_all()
 
         mk_ptr_free(&host->documentroot);
 
+        /* Handlers are referenced by the table */
+        if (host->handler_table) {
+            mk_mem_free(host->handler_table);
+        }
+
         /* Free source configuration */
         if (host->config) mk_rconf_free(host->config);
         mk_mem_free(host);
@@ -99,9 +99,7 @@ int mk_server_setup()
     /* Load plugins */
     mk_plugin_api_init();
     mk_plugin_load_all();
-
-    /* Workers: logger and clock */
-    mk_utils_worker_spawn((void *) mk_clock_worker_init, NULL);
+    mk_plugin_registry_init();
 
     /* Init thread keys */
     mk_thread_keys_init();
@@ -150,5 +148,4 @@ void mk_exit_all()
     mk_plugin_exit_all();
     mk_config_free_all();
     mk_mem_free(sched_list);
-    mk_clock_exit();
 }
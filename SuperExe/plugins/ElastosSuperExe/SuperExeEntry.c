@@ -662,8 +662,8 @@ void mk_dirhtml_cb_error(struct mk_stream *stream, int status)
 
 void mk_dirhtml_cb_body_rows(struct mk_stream *stream)
 {
-    int len;
-    char tmp[16];
+    int ret;
+    int type;
     struct mk_dirhtml_request *req = stream->data;
     struct mk_channel *channel = stream->channel;
     void (*cb_ok)(struct mk_stream* ) = NULL;
@@ -675,34 +675,36 @@ void mk_dirhtml_cb_body_rows(struct mk_stream *stream)
 
     if (req->toc_idx >= req->toc_len) {
         if (req->chunked) {
-            len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                           (int) req->iov_footer->total_len);
-            mk_api->stream_set(NULL,
-                               MK_STREAM_COPYBUF,
-                               channel,
-                               tmp, len, req, NULL, NULL, mk_dirhtml_cb_error);
-            cb_ok  = NULL;
+            type  = MK_STREAM_IOV | MK_STREAM_CHUNKED;
+            cb_ok = NULL;
         }
         else {
-            cb_ok  = mk_dirhtml_cb_complete;
+            type  = MK_STREAM_IOV;
+            cb_ok = mk_dirhtml_cb_complete;
         }
 
         /* No more rows to add, just link the page footer */
-        mk_api->stream_set(NULL,                   /* stream            */
-                           MK_STREAM_IOV,          /* type              */
-                           channel,                /* channel           */
-                           req->iov_footer,        /* buffer            */
-                           -1,                     /* buffer size       */
-                           req,                    /* custom data       */
-                           cb_ok,                  /* on_finish         */
-                           NULL,                   /* on_bytes_consumed */
-                           mk_dirhtml_cb_error);   /* on_error          */
+        ret = mk_api->stream_set(NULL,                 /* stream            */
+                                 type,                 /* type              */
+                                 channel,              /* channel           */
+                                 req->iov_footer,      /* buffer            */
+                                 -1,                   /* buffer size       */
+                                 req,                  /* custom data       */
+                                 cb_ok,                /* on_finish         */
+                                 NULL,                 /* on_bytes_consumed */
+                                 mk_dirhtml_cb_error); /* on_error          */
+        if (ret != 0) {
+            /* Out of memory, stop the listing */
+            mk_dirhtml_cleanup(req);
+            return;
+        }
 
+        /* The last chunk */
         if (req->chunked) {
             mk_api->stream_set(NULL,
-                               MK_STREAM_COPYBUF,
+                               MK_STREAM_RAW | MK_STREAM_CHUNKED,
                                channel,
-                               "\r\n0\r\n\r\n", 7, req,
+                               NULL, 0, req,
                                mk_dirhtml_cb_complete, NULL, mk_dirhtml_cb_error);
         }
 
@@ -711,34 +713,24 @@ void mk_dirhtml_cb_body_rows(struct mk_stream *stream)
 
     req->iov_entry = enqueue_row(req->toc_idx, req);
     if (req->chunked) {
-        len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                       (int) req->iov_entry->total_len);
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           channel,
-                           tmp, len, req, NULL, NULL, mk_dirhtml_cb_error);
-        cb_ok = NULL;
+        type = MK_STREAM_IOV | MK_STREAM_CHUNKED;
     }
     else {
-        cb_ok = mk_dirhtml_cb_body_rows;
-    }
-
-    mk_api->stream_set(NULL,
-                       MK_STREAM_IOV,
-                       channel,
-                       req->iov_entry,
-                       -1,
-                       req,
-                       cb_ok,
-                       NULL,
-                       mk_dirhtml_cb_error);
-
-    if (req->chunked) {
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           channel,
-                           "\r\n", 2, (void *) req,
-                           mk_dirhtml_cb_body_rows, NULL, mk_dirhtml_cb_error);
+        type = MK_STREAM_IOV;
+    }
+
+    ret = mk_api->stream_set(NULL,
+                             type,
+                             channel,
+                             req->iov_entry,
+                             -1,
+                             req,
+                             mk_dirhtml_cb_body_rows,
+                             NULL,
+                             mk_dirhtml_cb_error);
+    if (ret != 0) {
+        mk_dirhtml_cleanup(req);
+        return;
     }
     req->toc_idx++;
 }
@@ -762,8 +754,8 @@ void cb_header_finish(struct mk_stream *stream)
 int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr)
 {
     DIR *dir;
-    int len;
-    char tmp[16];
+    int ret;
+    int type;
     unsigned int i = 0;
     struct mk_list *head;
     struct mk_list list;
@@ -848,29 +840,27 @@ int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr)
     mk_api->header_prepare(cs, sr);
 
     if (request->chunked) {
-        len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                       (int) request->iov_header->total_len);
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           cs->channel,
-                           tmp, len, request, NULL, NULL, mk_dirhtml_cb_error);
-    }
-
-    mk_api->stream_set(NULL,                 /* stream            */
-                       MK_STREAM_IOV,        /* type              */
-                       cs->channel,          /* channel           */
-                       request->iov_header,  /* buffer            */
-                       -1,                   /* buffer size       */
-                       request,              /* custom data       */
-                       cb_header_finish,     /* on_finish         */
-                       NULL,                 /* on_bytes_consumed */
-                       mk_dirhtml_cb_error); /* on_error          */
-
-    if (request->chunked) {
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           cs->channel,
-                           "\r\n", 2, request, NULL, NULL, mk_dirhtml_cb_error);
+        type = MK_STREAM_IOV | MK_STREAM_CHUNKED;
+    }
+    else {
+        type = MK_STREAM_IOV;
+    }
+
+    ret = mk_api->stream_set(NULL,                 /* stream            */
+                             type,                 /* type              */
+                             cs->channel,          /* channel           */
+                             request->iov_header,  /* buffer            */
+                             -1,                   /* buffer size       */
+                             request,              /* custom data       */
+                             cb_header_finish,     /* on_finish         */
+                             NULL,                 /* on_bytes_consumed */
+                             mk_dirhtml_cb_error); /* on_error          */
+    if (ret != 0) {
+        /*
+         * The response headers are already queued so it's too late for
+         * an error page, just release the context.
+         */
+        mk_dirhtml_cleanup(request);
     }
     return 0;
 }
@@ -20,14 +20,32 @@
 
 #include "cgi.h"
 
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 
+/* Stop writing the request body, the child gets EOF on its stdin */
+void cgi_post_finish(struct cgi_request *r)
+{
+    struct cgi_post *p = r->post;
+
+    if (!p) {
+        return;
+    }
+
+    mk_api->ev_del(mk_api->sched_loop(), &p->event);
+    close(p->fd);
+    mk_api->sched_event_free(&p->event);
+    r->post = NULL;
+}
+
 void cgi_finish(struct cgi_request *r)
 {
+    cgi_post_finish(r);
+
     /*
      * Unregister & close the CGI child process pipe reader fd from the
      * thread event loop, otherwise we may get unexpected notifications.
@@ -36,10 +54,11 @@ void cgi_finish(struct cgi_request *r)
     close(r->fd);
     if (r->chunked && r->active == MK_TRUE) {
         PLUGIN_TRACE("CGI sending Chunked EOF");
-        channel_write(r->sr->session, "0\r\n\r\n", 5);
+        channel_write_chunk(r->sr->session, NULL, 0);
     }
 
     /* Try to kill any child process */
+    cgi_spawn_release(r);
     if (r->child > 0) {
         kill(r->child, SIGKILL);
         r->child = 0;
@@ -71,24 +90,42 @@ int swrite(const int fd, const void *buf, const size_t count)
 
 int channel_write(struct mk_http_session *session, void *buf, size_t count)
 {
+    int ret;
+
     PLUGIN_TRACE("Channel write: %d bytes", count);
 
-    mk_stream_set(NULL,
-                  MK_STREAM_COPYBUF,
-                  session->channel,
-                  buf,
-                  count,
-                  NULL, NULL, NULL, NULL);
+    ret = mk_api->stream_set(NULL,
+                             MK_STREAM_COPYBUF,
+                             session->channel,
+                             buf,
+                             count,
+                             NULL, NULL, NULL, NULL);
+    if (ret != 0) {
+        return -1;
+    }
     mk_api->channel_flush(session->channel);
     return 0;
 }
 
-static void cgi_write_post(void *p)
+/* Write a chunk of the response body, no data means the last chunk */
+int channel_write_chunk(struct mk_http_session *session, void *buf,
+                        size_t count)
 {
-    const struct post_t * const in = p;
+    int ret;
+
+    PLUGIN_TRACE("Channel write chunk: %d bytes", count);
 
-    swrite(in->fd, in->buf, in->len);
-    close(in->fd);
+    ret = mk_api->stream_set(NULL,
+                             MK_STREAM_COPYBUF | MK_STREAM_CHUNKED,
+                             session->channel,
+                             buf,
+                             count,
+                             NULL, NULL, NULL, NULL);
+    if (ret != 0) {
+        return -1;
+    }
+    mk_api->channel_flush(session->channel);
+    return 0;
 }
 
 static int do_cgi(const char *const __restrict__ file,
@@ -100,12 +137,14 @@ static int do_cgi(const char *const __restrict__ file,
                   char *mimetype)
 {
     int ret;
-    int devnull;
+    pid_t pid;
     const int socket = cs->socket;
     struct file_info finfo;
     struct cgi_request *r = NULL;
+    struct cgi_spawn *spawn;
+    struct cgi_post *p;
     struct mk_event *event;
-    char *env[30];
+    char *env[ENVLEN];
     int writepipe[2], readpipe[2];
     (void) plugin;
 
@@ -212,100 +251,79 @@ static int do_cgi(const char *const __restrict__ file,
     /* Must be NULL-terminated */
     env[envpos] = NULL;
 
-    /* pipes, from monkey's POV */
-    if (pipe(writepipe) || pipe(readpipe)) {
+    /* pipes, from monkey's POV, the child gets its ends as stdin/stdout */
+    if (pipe2(writepipe, O_CLOEXEC)) {
         mk_err("Failed to create pipe");
         return 403;
     }
-
-    pid_t pid = vfork();
-    if (pid < 0) {
-        mk_err("Failed to fork");
+    if (pipe2(readpipe, O_CLOEXEC)) {
+        mk_err("Failed to create pipe");
+        close(writepipe[0]);
+        close(writepipe[1]);
         return 403;
     }
 
-    /* Child */
-    if (pid == 0) {
-        setreuid(EUID, EUID);
-        setregid(EGID, EGID);
-
-        close(writepipe[1]);
-        close(readpipe[0]);
-        /* Our stdin is the read end of monkey's writing */
-        if (dup2(writepipe[0], 0) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(writepipe[0]);
-
-        /* Our stdout is the write end of monkey's reading */
-        if (dup2(readpipe[1], 1) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(readpipe[1]);
-
-        /* Our stderr goes to /dev/null */
-        devnull = open("/dev/null", O_WRONLY);
-        if (devnull == -1) {
-            perror("open");
-            _exit(1);
-        }
-
-        if (dup2(devnull, 2) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(devnull);
-
-        char *argv[3] = { NULL };
-
-        char *tmp = mk_api->str_dup(file);
-        if (chdir(dirname(tmp)))
-            _exit(1);
-
-        char *tmp2 = mk_api->str_dup(file);
-        argv[0] = basename(tmp2);
-
-        /* Restore signals for the child */
-        signal(SIGPIPE, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
-
-        if (!interpreter) {
-            execve(file, argv, env);
-        }
-        else {
-            argv[0] = basename(interpreter);
-            argv[1] = (char *) file;
-            execve(interpreter, argv, env);
-        }
-        /* Exec failed, return */
-        _exit(1);
-    }
+    pid = cgi_spawn(file, interpreter, env, writepipe[0], readpipe[1],
+                    &spawn);
 
     /* Yay me */
     close(writepipe[0]);
     close(readpipe[1]);
 
-    /* If we have POST data to write, spawn a thread to do that */
-    if (sr->data.len) {
-        struct post_t p;
-        p.fd = writepipe[1];
-        p.buf = sr->data.data;
-        p.len = sr->data.len;
-
-        mk_api->worker_spawn(cgi_write_post, &p);
-    }
-    else {
+    if (pid < 0) {
         close(writepipe[1]);
+        close(readpipe[0]);
+        return 403;
     }
 
     r = cgi_req_create(readpipe[0], socket, sr, cs);
     if (!r) {
+        close(writepipe[1]);
+        close(readpipe[0]);
         return 403;
     }
     r->child = pid;
 
+    /*
+     * POST data is written to the child from this worker event loop as
+     * the pipe drains, the request body stays owned by the request.
+     */
+    if (sr->data.len) {
+        p = mk_api->mem_alloc_z(sizeof(struct cgi_post));
+        if (!p) {
+            close(writepipe[1]);
+            close(readpipe[0]);
+            mk_api->mem_free(r);
+            return 403;
+        }
+        p->fd  = writepipe[1];
+        p->r   = r;
+        p->buf = sr->data.data;
+        p->len = sr->data.len;
+        if (!p->buf && mk_list_is_empty(&sr->body_chain) != 0) {
+            p->seg = mk_list_entry_first(&sr->body_chain,
+                                         struct mk_http_body_segment, _head);
+        }
+        fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) | O_NONBLOCK);
+
+        event = &p->event;
+        event->fd      = p->fd;
+        event->type    = MK_EVENT_CUSTOM;
+        event->mask    = MK_EVENT_EMPTY;
+        event->status  = MK_EVENT_NONE;
+        event->data    = p;
+        event->handler = cb_cgi_write;
+        r->post = p;
+    }
+    else {
+        close(writepipe[1]);
+    }
+    if (spawn) {
+        /* The spawn helper tells the process ID later */
+        spawn->r = r;
+        r->spawn = spawn;
+    }
+
     /*
      * Hang up?: by default Monkey assumes the CGI scripts generate
      * content dynamically (no Content-Length header), so for such HTTP/1.0
@@ -344,6 +362,15 @@ static int do_cgi(const char *const __restrict__ file,
         return 403;
     }
 
+    /* Register the POST data writer */
+    if (r->post) {
+        ret = mk_api->ev_add(mk_api->sched_loop(), r->post->fd,
+                             MK_EVENT_CUSTOM, MK_EVENT_WRITE, r->post);
+        if (ret != 0) {
+            return 403;
+        }
+    }
+
 
     /* XXX Fixme: this needs to be atomic */
     requests_by_socket[socket] = r;
@@ -353,7 +380,6 @@ static int do_cgi(const char *const __restrict__ file,
 int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
 {
     struct rlimit lim;
-    (void) confdir;
 
     mk_api = *api;
     mk_list_init(&cgi_global_matches);
@@ -371,6 +397,11 @@ int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
 
+    /* Spawn helpers, before the workers exist */
+    if (cgi_spawn_init(confdir) == -1) {
+        mk_warn("[cgi] could not initialize the spawn helpers");
+    }
+
     return 0;
 }
 
@@ -378,6 +409,7 @@ int mk_cgi_plugin_exit()
 {
     regfree(&match_regex);
     mk_api->mem_free(requests_by_socket);
+    cgi_spawn_exit();
 
     return 0;
 }
@@ -461,6 +493,8 @@ void mk_cgi_worker_init()
 
     mk_list_init(list);
     pthread_setspecific(cgi_request_list, (void *) list);
+
+    cgi_spawn_worker_init();
 }
 
 
@@ -31,17 +31,26 @@
 enum {
     BUFLEN  = 4096,
     PATHLEN = 1024,
-    SHORTLEN = 64
+    SHORTLEN = 64,
+    ENVLEN  = 30,
+    SPAWNLEN = 16384
 };
 
 regex_t match_regex;
 
 struct cgi_request **requests_by_socket;
 
-struct post_t {
-    int fd;
-    void *buf;
+/* Writes the request body to the CGI process stdin from the worker loop */
+struct cgi_post {
+    /* Built-in reference for the event loop */
+    struct mk_event event;
+
+    int fd;                     /* pipe to the child stdin */
+    struct cgi_request *r;
+    char *buf;                  /* contiguous body, NULL if chained */
     unsigned long len;
+    unsigned long offset;       /* written from buf or the segment */
+    struct mk_http_body_segment *seg;   /* large bodies come in segments */
 };
 
 struct cgi_match_t {
@@ -58,6 +67,22 @@ struct cgi_vhost_t {
 };
 
 struct cgi_vhost_t *cgi_vhosts;
+
+/* A script sent to the spawn helper, waiting for its process ID */
+struct cgi_spawn {
+    struct cgi_request *r;      /* NULL once the request is gone */
+    struct mk_list _head;
+};
+
+/* Spawn helper process owned by a worker */
+struct cgi_helper {
+    /* Built-in reference for the event loop */
+    struct mk_event event;
+
+    int   fd;                   /* socket to the helper */
+    pid_t pid;
+    struct mk_list pending;     /* struct cgi_spawn, in request order */
+};
 struct mk_list cgi_global_matches;
 
 
@@ -79,6 +104,8 @@ struct cgi_request {
     int   hangup;       /* Should close connection when done ? */
     int   active;       /* Active session ?  */
     pid_t child;        /* child process ID  */
+    struct cgi_spawn *spawn;    /* child process ID not known yet */
+    struct cgi_post *post;      /* body still being written */
     unsigned char status_done;
     unsigned char all_headers_done;
     unsigned char chunked;
@@ -90,9 +117,12 @@ pthread_key_t cgi_request_list;
 extern struct cgi_request **requests_by_socket;
 
 void cgi_finish(struct cgi_request *r);
+void cgi_post_finish(struct cgi_request *r);
 
 int swrite(const int fd, const void *buf, const size_t count);
 int channel_write(struct mk_http_session *session, void *buf, size_t count);
+int channel_write_chunk(struct mk_http_session *session, void *buf,
+                        size_t count);
 
 struct cgi_request *cgi_req_create(int fd, int socket,
                                    struct mk_http_request *sr,
@@ -127,5 +157,13 @@ static inline struct cgi_request *cgi_req_get_by_fd(int fd)
 }
 
 int cb_cgi_read(void *data);
+int cb_cgi_write(void *data);
+
+int cgi_spawn_init(char *confdir);
+void cgi_spawn_exit();
+void cgi_spawn_worker_init();
+pid_t cgi_spawn(const char *file, char *interpreter, char **env,
+                int fd_in, int fd_out, struct cgi_spawn **pending);
+void cgi_spawn_release(struct cgi_request *r);
 
 #endif
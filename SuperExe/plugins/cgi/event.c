@@ -112,7 +112,10 @@ int process_cgi_data(struct cgi_request *r)
         }
         end += advance;
         len = end - outptr;
-        channel_write(r->cs, outptr, len);
+        ret = channel_write(r->cs, outptr, len);
+        if (ret < 0) {
+            return MK_PLUGIN_RET_EVENT_CLOSE;
+        }
         outptr += len;
         r->in_len -= len;
 
@@ -123,22 +126,16 @@ int process_cgi_data(struct cgi_request *r)
     }
 
     if (r->chunked) {
-        char tmp[16];
-        len = snprintf(tmp, 16, "%x\r\n", r->in_len);
-        ret = channel_write(r->cs, tmp, len);
-        if (ret < 0)
-            return MK_PLUGIN_RET_EVENT_CLOSE;
+        ret = channel_write_chunk(r->cs, outptr, r->in_len);
+    }
+    else {
+        ret = channel_write(r->cs, outptr, r->in_len);
     }
-
-    ret = channel_write(r->cs, outptr, r->in_len);
     if (ret < 0) {
         return MK_PLUGIN_RET_EVENT_CLOSE;
     }
 
     r->in_len = 0;
-    if (r->chunked) {
-        channel_write(r->sr->session, MK_CRLF, 2);
-    }
     return MK_PLUGIN_RET_EVENT_OWNED;
 }
 
@@ -165,6 +162,60 @@ int cb_cgi_read(void *data)
         return MK_PLUGIN_RET_EVENT_CLOSE;
     }
     r->in_len += n;
-    process_cgi_data(r);
+    if (process_cgi_data(r) == MK_PLUGIN_RET_EVENT_CLOSE) {
+        /* The response could not be queued, drop the connection */
+        r->hangup = MK_TRUE;
+        cgi_finish(r);
+        return MK_PLUGIN_RET_EVENT_CLOSE;
+    }
+    return 0;
+}
+
+/* The child stdin can take more data, write what is left of the body */
+int cb_cgi_write(void *data)
+{
+    ssize_t n;
+    size_t len;
+    char *buf;
+    struct cgi_post *p = data;
+    struct mk_list *chain = &p->r->sr->body_chain;
+
+    while (1) {
+        if (p->buf) {
+            buf = p->buf + p->offset;
+            len = p->len - p->offset;
+        }
+        else if (p->seg) {
+            buf = p->seg->data + p->offset;
+            len = p->seg->length - p->offset;
+        }
+        else {
+            break;
+        }
+
+        if (len == 0) {
+            /* Move to the next segment of a chained body */
+            if (p->buf || p->seg->_head.next == chain) {
+                break;
+            }
+            p->seg = mk_list_entry(p->seg->_head.next,
+                                   struct mk_http_body_segment, _head);
+            p->offset = 0;
+            continue;
+        }
+
+        n = write(p->fd, buf, len);
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            /* The child does not read its stdin */
+            PLUGIN_TRACE("FD=%i CGI WRITE error", p->fd);
+            break;
+        }
+        p->offset += n;
+    }
+
+    cgi_post_finish(p->r);
     return 0;
 }
@@ -0,0 +1,588 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * CGI process creation. With 'Prefork' enabled every worker owns a helper
+ * process created at startup, before any thread exists. The worker sends
+ * the script, its environment and the pipe ends over a Unix socket and the
+ * helper starts the script, replying the child process ID later. Without
+ * a helper, scripts are started with posix_spawn(3).
+ */
+
+#include "cgi.h"
+
+#include <pwd.h>
+#include <grp.h>
+#include <spawn.h>
+#include <sys/socket.h>
+
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define CGI_HAVE_SPAWN_CHDIR
+#endif
+
+static int cgi_prefork = MK_FALSE;
+static int cgi_n_helpers;
+static int cgi_next_helper;
+static struct cgi_helper *cgi_helpers;
+static pthread_key_t cgi_helper_key;
+
+/* Split a script path in the directory to run on and the argv[0] name */
+static void cgi_split_path(const char *file, char *dir, char *name)
+{
+    char tmp[PATHLEN];
+
+    snprintf(tmp, PATHLEN, "%s", file);
+    snprintf(dir, PATHLEN, "%s", dirname(tmp));
+    snprintf(tmp, PATHLEN, "%s", file);
+    snprintf(name, PATHLEN, "%s", basename(tmp));
+}
+
+/*
+ * Runs in the new child: set up the standard streams and execute the
+ * script. It only touches the stack so it is safe after vfork().
+ */
+static void cgi_child_exec(const char *file, char *interpreter, char **env,
+                           int fd_in, int fd_out)
+{
+    int devnull;
+    char dir[PATHLEN];
+    char name[PATHLEN];
+    char iname[PATHLEN];
+    char *argv[3] = { NULL };
+
+    /* Our stdin is the read end of monkey's writing */
+    if (dup2(fd_in, 0) < 0) {
+        _exit(1);
+    }
+
+    /* Our stdout is the write end of monkey's reading */
+    if (dup2(fd_out, 1) < 0) {
+        _exit(1);
+    }
+
+    /* Our stderr goes to /dev/null */
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull == -1 || dup2(devnull, 2) < 0) {
+        _exit(1);
+    }
+    close(devnull);
+
+    cgi_split_path(file, dir, name);
+    if (chdir(dir)) {
+        _exit(1);
+    }
+
+    /* Restore signals for the child */
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    if (!interpreter) {
+        argv[0] = name;
+        execve(file, argv, env);
+    }
+    else {
+        cgi_split_path(interpreter, dir, iname);
+        argv[0] = iname;
+        argv[1] = (char *) file;
+        execve(interpreter, argv, env);
+    }
+
+    /* Exec failed, return */
+    _exit(1);
+}
+
+#ifdef CGI_HAVE_SPAWN_CHDIR
+static pid_t cgi_spawn_posix(const char *file, char *interpreter, char **env,
+                             int fd_in, int fd_out)
+{
+    int ret;
+    short flags;
+    pid_t pid;
+    sigset_t mask;
+    char dir[PATHLEN];
+    char name[PATHLEN];
+    char iname[PATHLEN];
+    char *argv[3] = { NULL };
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+
+    cgi_split_path(file, dir, name);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd_in, 0);
+    posix_spawn_file_actions_adddup2(&actions, fd_out, 1);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addchdir_np(&actions, dir);
+
+    /* Restore the ignored signals and the signal mask for the child */
+    flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, flags);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+
+    if (!interpreter) {
+        argv[0] = name;
+        ret = posix_spawn(&pid, file, &actions, &attr, argv, env);
+    }
+    else {
+        cgi_split_path(interpreter, dir, iname);
+        argv[0] = iname;
+        argv[1] = (char *) file;
+        ret = posix_spawn(&pid, interpreter, &actions, &attr, argv, env);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (ret != 0) {
+        mk_err("Failed to spawn %s: %s", file, strerror(ret));
+        return -1;
+    }
+    return pid;
+}
+#endif
+
+/* Start the script from the worker itself */
+static pid_t cgi_spawn_local(const char *file, char *interpreter, char **env,
+                             int fd_in, int fd_out)
+{
+    pid_t pid;
+
+#ifdef CGI_HAVE_SPAWN_CHDIR
+    /*
+     * posix_spawn() can not make the child drop the real IDs kept when
+     * Monkey is launched by root, only use it when there is nothing to drop.
+     */
+    if (getuid() == geteuid() && getgid() == getegid()) {
+        return cgi_spawn_posix(file, interpreter, env, fd_in, fd_out);
+    }
+#endif
+
+    pid = vfork();
+    if (pid < 0) {
+        mk_err("Failed to fork");
+        return -1;
+    }
+
+    /* Child */
+    if (pid == 0) {
+        setregid(EGID, EGID);
+        setreuid(EUID, EUID);
+        cgi_child_exec(file, interpreter, env, fd_in, fd_out);
+    }
+
+    return pid;
+}
+
+/* The helper process: fork and execute every script the worker sends */
+static void cgi_helper_main(int fd)
+{
+    int i;
+    int fds[2];
+    int n_env;
+    ssize_t n;
+    pid_t pid;
+    char *p;
+    char *end;
+    char *file;
+    char *interpreter;
+    char *env[ENVLEN + 1];
+    char buf[SPAWNLEN];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct passwd *usr;
+
+    /* Monkey handlers do not belong here */
+    signal(SIGSEGV, SIG_DFL);
+    signal(SIGBUS,  SIG_DFL);
+    signal(SIGHUP,  SIG_DFL);
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+
+    /* Launched by root ? the scripts run as the configured user */
+    if (getuid() == 0 && mk_api->config->user) {
+        usr = getpwnam(mk_api->config->user);
+        if (!usr ||
+            initgroups(mk_api->config->user, usr->pw_gid) != 0 ||
+            setgid(usr->pw_gid) != 0 ||
+            setuid(usr->pw_uid) != 0) {
+            _exit(1);
+        }
+    }
+
+    while (1) {
+        memset(&msg, '\0', sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (n <= 0) {
+            /* Monkey is gone */
+            _exit(0);
+        }
+
+        fds[0] = fds[1] = -1;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+
+        /*
+         * Interpreter, script and environment, each one NUL terminated,
+         * the list ends with an empty string.
+         */
+        pid = -1;
+        end = buf + n;
+        if (fds[0] != -1 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) &&
+            n > 2 && buf[n - 1] == '\0') {
+            interpreter = buf;
+            file = interpreter + strlen(interpreter) + 1;
+            p = file + strlen(file) + 1;
+            n_env = 0;
+            while (p < end && *p && n_env < ENVLEN) {
+                env[n_env++] = p;
+                p += strlen(p) + 1;
+            }
+            env[n_env] = NULL;
+
+            /* The IDs are dropped already, nothing to copy but the stack */
+            if (p < end && *file) {
+                pid = cgi_spawn_local(file, *interpreter ? interpreter : NULL,
+                                      env, fds[0], fds[1]);
+            }
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+
+        /* The reply tells the worker who to kill when the client is gone */
+        do {
+            n = send(fd, &pid, sizeof(pid), MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+    }
+}
+
+/* Read the configuration and create one helper per worker */
+int cgi_spawn_init(char *confdir)
+{
+    int i;
+    int ret;
+    int fd[2];
+    char *file = NULL;
+    unsigned long len;
+    pid_t pid;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+
+    ret = pthread_key_create(&cgi_helper_key, NULL);
+    if (ret != 0) {
+        return -1;
+    }
+
+    mk_api->str_build(&file, &len, "%scgi.conf", confdir);
+    conf = mk_api->config_create(file);
+    mk_api->mem_free(file);
+    if (!conf) {
+        return 0;
+    }
+
+    section = mk_api->config_section_get(conf, "CGI");
+    if (section) {
+        cgi_prefork = (size_t) mk_api->config_section_get_key(section,
+                                                              "Prefork",
+                                                              MK_RCONF_BOOL);
+        if (cgi_prefork != MK_TRUE) {
+            cgi_prefork = MK_FALSE;
+        }
+    }
+    mk_api->config_free(conf);
+
+    if (cgi_prefork == MK_FALSE) {
+        return 0;
+    }
+
+    cgi_helpers = mk_api->mem_alloc_z(sizeof(struct cgi_helper) *
+                                      mk_api->config->workers);
+    if (!cgi_helpers) {
+        return -1;
+    }
+
+    for (i = 0; i < mk_api->config->workers; i++) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fd) == -1) {
+            mk_warn("[cgi] could not create the spawn helper socket");
+            break;
+        }
+
+        pid = fork();
+        if (pid == -1) {
+            mk_warn("[cgi] could not create the spawn helper");
+            close(fd[0]);
+            close(fd[1]);
+            break;
+        }
+        else if (pid == 0) {
+            /* The helper keeps its own end only */
+            while (i-- > 0) {
+                close(cgi_helpers[i].fd);
+            }
+            close(fd[0]);
+            cgi_helper_main(fd[1]);
+        }
+
+        close(fd[1]);
+        cgi_helpers[i].fd = fd[0];
+        cgi_helpers[i].pid = pid;
+        mk_list_init(&cgi_helpers[i].pending);
+        cgi_n_helpers++;
+    }
+
+    return 0;
+}
+
+void cgi_spawn_exit()
+{
+    int i;
+
+    /* Helpers exit once their socket is closed */
+    for (i = 0; i < cgi_n_helpers; i++) {
+        if (cgi_helpers[i].fd != -1) {
+            close(cgi_helpers[i].fd);
+        }
+    }
+    mk_api->mem_free(cgi_helpers);
+}
+
+/* A helper has been closed or died, the pending requests are left alone */
+static void cgi_helper_close(struct cgi_helper *h)
+{
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct cgi_spawn *s;
+
+    mk_warn("[cgi] spawn helper %i is gone", h->pid);
+    mk_api->ev_del(mk_api->sched_loop(), &h->event);
+    close(h->fd);
+    h->fd = -1;
+
+    mk_list_foreach_safe(head, tmp, &h->pending) {
+        s = mk_list_entry(head, struct cgi_spawn, _head);
+        if (s->r) {
+            s->r->spawn = NULL;
+        }
+        mk_list_del(&s->_head);
+        mk_api->mem_free(s);
+    }
+}
+
+/* The helper replied the process IDs of the scripts, in request order */
+static int cb_cgi_helper(void *data)
+{
+    ssize_t n;
+    pid_t pid;
+    struct cgi_spawn *s;
+    struct cgi_helper *h = data;
+
+    while (1) {
+        n = recv(h->fd, &pid, sizeof(pid), MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        else if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (n != sizeof(pid) || mk_list_is_empty(&h->pending) == 0) {
+            cgi_helper_close(h);
+            break;
+        }
+
+        s = mk_list_entry_first(&h->pending, struct cgi_spawn, _head);
+        if (s->r) {
+            s->r->child = pid;
+            s->r->spawn = NULL;
+        }
+        else if (pid > 0) {
+            /* The request finished before the script started */
+            kill(pid, SIGKILL);
+        }
+        mk_list_del(&s->_head);
+        mk_api->mem_free(s);
+    }
+
+    return 0;
+}
+
+void cgi_spawn_worker_init()
+{
+    int i;
+    int ret;
+    struct cgi_helper *h;
+
+    if (cgi_n_helpers == 0) {
+        return;
+    }
+
+    i = __sync_fetch_and_add(&cgi_next_helper, 1);
+    if (i >= cgi_n_helpers) {
+        return;
+    }
+
+    h = &cgi_helpers[i];
+    h->event.fd      = h->fd;
+    h->event.type    = MK_EVENT_CUSTOM;
+    h->event.mask    = MK_EVENT_EMPTY;
+    h->event.status  = MK_EVENT_NONE;
+    h->event.data    = h;
+    h->event.handler = cb_cgi_helper;
+
+    ret = mk_api->ev_add(mk_api->sched_loop(), h->fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, h);
+    if (ret != 0) {
+        mk_warn("[cgi] could not register the spawn helper");
+        return;
+    }
+    pthread_setspecific(cgi_helper_key, h);
+}
+
+static int cgi_helper_msg_add(char *buf, size_t *size, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    if (*size + len >= SPAWNLEN) {
+        return -1;
+    }
+    memcpy(buf + *size, str, len);
+    *size += len;
+    return 0;
+}
+
+/* Hand the script to the helper, the process ID arrives later */
+static int cgi_helper_send(struct cgi_helper *h,
+                           const char *file, char *interpreter, char **env,
+                           int fd_in, int fd_out)
+{
+    int i;
+    int fds[2];
+    size_t size = 0;
+    ssize_t n;
+    char buf[SPAWNLEN];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    if (cgi_helper_msg_add(buf, &size, interpreter ? interpreter : "") ||
+        cgi_helper_msg_add(buf, &size, file)) {
+        return -1;
+    }
+    for (i = 0; env[i]; i++) {
+        if (cgi_helper_msg_add(buf, &size, env[i])) {
+            return -1;
+        }
+    }
+    buf[size++] = '\0';
+
+    fds[0] = fd_in;
+    fds[1] = fd_out;
+
+    memset(&msg, '\0', sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    do {
+        n = sendmsg(h->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+
+    return n == (ssize_t) size ? 0 : -1;
+}
+
+/*
+ * Start a script reading from fd_in and writing to fd_out. Returns the
+ * child process ID, or 0 when the helper took it and the ID is set on
+ * the request of the 'pending' entry later.
+ */
+pid_t cgi_spawn(const char *file, char *interpreter, char **env,
+                int fd_in, int fd_out, struct cgi_spawn **pending)
+{
+    int ret;
+    struct cgi_spawn *s;
+    struct cgi_helper *h;
+
+    *pending = NULL;
+    h = pthread_getspecific(cgi_helper_key);
+    if (h && h->fd != -1) {
+        s = mk_api->mem_alloc_z(sizeof(struct cgi_spawn));
+        if (s) {
+            ret = cgi_helper_send(h, file, interpreter, env, fd_in, fd_out);
+            if (ret == 0) {
+                mk_list_add(&s->_head, &h->pending);
+                *pending = s;
+                return 0;
+            }
+            mk_api->mem_free(s);
+        }
+
+        /* A busy or gone helper is not a reason to fail the request */
+        PLUGIN_TRACE("spawn helper not available, spawn locally");
+    }
+
+    return cgi_spawn_local(file, interpreter, env, fd_in, fd_out);
+}
+
+/* The request is done, a process ID arriving later kills the script */
+void cgi_spawn_release(struct cgi_request *r)
+{
+    if (r->spawn) {
+        r->spawn->r = NULL;
+        r->spawn = NULL;
+    }
+}
@@ -21,30 +21,42 @@
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_pool.h"
 
-static int mk_fastcgi_config(char *path)
+/* Read a numeric key, it returns the default value if the key is missing */
+static int mk_fastcgi_config_num(struct mk_rconf_section *section,
+                                 char *key, int def)
+{
+    int num;
+    char *val;
+
+    val = mk_api->config_section_get_key(section, key, MK_RCONF_STR);
+    if (!val) {
+        return def;
+    }
+
+    num = atoi(val);
+    mk_api->mem_free(val);
+    return num;
+}
+
+/* Read a [FASTCGI_SERVER] section */
+static struct fcgi_server *mk_fastcgi_config_server(struct mk_rconf_section *section)
 {
     int ret;
     int sep;
-    char *file = NULL;
+    int weight;
+    int keep_alive;
+    int multiplex;
+    int pool_size;
+    int pool_timeout;
+    int retry_timeout;
     char *cnf_srv_name = NULL;
     char *cnf_srv_addr = NULL;
     char *cnf_srv_port = NULL;
     char *cnf_srv_path = NULL;
-    unsigned long len;
     struct file_info finfo;
-    struct mk_rconf *conf;
-    struct mk_rconf_section *section;
-
-    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
-    conf = mk_api->config_create(file);
-    if (!conf) {
-        return -1;
-    }
-    section = mk_api->config_section_get(conf, "FASTCGI_SERVER");
-    if (!section) {
-        return -1;
-    }
+    struct fcgi_server *server;
 
     /* Get section values */
     cnf_srv_name = mk_api->config_section_get_key(section,
@@ -56,11 +68,22 @@ static int mk_fastcgi_config(char *path)
     cnf_srv_path = mk_api->config_section_get_key(section,
                                                   "ServerPath",
                                                   MK_RCONF_STR);
+    keep_alive = (size_t) mk_api->config_section_get_key(section,
+                                                         "KeepAlive",
+                                                         MK_RCONF_BOOL);
+    weight = mk_fastcgi_config_num(section, "Weight", FCGI_WEIGHT_DEFAULT);
+    multiplex = mk_fastcgi_config_num(section, "Multiplex", 1);
+    pool_size = mk_fastcgi_config_num(section, "PoolSize",
+                                      FCGI_POOL_SIZE_DEFAULT);
+    pool_timeout = mk_fastcgi_config_num(section, "PoolTimeout",
+                                         FCGI_POOL_TIMEOUT_DEFAULT);
+    retry_timeout = mk_fastcgi_config_num(section, "RetryTimeout",
+                                          FCGI_RETRY_MAX_DEFAULT);
 
     /* Validations */
     if (!cnf_srv_name) {
         mk_warn("[fastcgi] Invalid ServerName in configuration.");
-        return -1;
+        return NULL;
     }
 
     /* Split the address, try to lookup the TCP port */
@@ -68,17 +91,51 @@ static int mk_fastcgi_config(char *path)
         sep = mk_api->str_char_search(cnf_srv_addr, ':', strlen(cnf_srv_addr));
         if (sep <= 0) {
             mk_warn("[fastcgi] Missing TCP port con ServerAddress key");
-            return -1;
+            return NULL;
         }
 
         cnf_srv_port = mk_api->str_dup(cnf_srv_addr + sep + 1);
         cnf_srv_addr[sep] = '\0';
     }
 
+    if (keep_alive == -1) {
+        mk_warn("[fastcgi] Invalid KeepAlive value, use On or Off");
+        return NULL;
+    }
+
+    if (weight <= 0) {
+        mk_warn("[fastcgi] Invalid Weight on server %s", cnf_srv_name);
+        return NULL;
+    }
+
+    if (multiplex <= 0 || multiplex > FCGI_MULTIPLEX_MAX) {
+        mk_warn("[fastcgi] Multiplex must be between 1 and %i",
+                FCGI_MULTIPLEX_MAX);
+        return NULL;
+    }
+
+    /* Requests can only share a connection that is kept open */
+    if (multiplex > 1 && keep_alive == MK_FALSE) {
+        mk_warn("[fastcgi] Multiplex on server %s requires KeepAlive",
+                cnf_srv_name);
+        multiplex = 1;
+    }
+
+    if (pool_size <= 0 || pool_timeout <= 0 || retry_timeout < 0) {
+        mk_warn("[fastcgi] Invalid PoolSize, PoolTimeout or RetryTimeout");
+        return NULL;
+    }
+
     /* Just one mode can exist (for now) */
     if (cnf_srv_path && cnf_srv_addr) {
         mk_warn("[fastcgi] Use ServerAddr or ServerPath, not both");
-        return -1;
+        return NULL;
+    }
+
+    if (!cnf_srv_path && !cnf_srv_addr) {
+        mk_warn("[fastcgi] Missing ServerAddr or ServerPath on server %s",
+                cnf_srv_name);
+        return NULL;
     }
 
     /* Unix socket path */
@@ -86,25 +143,113 @@ static int mk_fastcgi_config(char *path)
         ret = mk_api->file_get_info(cnf_srv_path, &finfo, MK_FILE_READ);
         if (ret == -1) {
             mk_warn("[fastcgi] Cannot open unix socket: %s", cnf_srv_path);
+            return NULL;
+        }
+    }
+
+    server = mk_api->mem_alloc_z(sizeof(struct fcgi_server));
+    if (!server) {
+        return NULL;
+    }
+
+    server->name = cnf_srv_name;
+    server->addr = cnf_srv_addr;
+    server->port = cnf_srv_port;
+    server->path = cnf_srv_path;
+    server->weight = weight;
+    server->keep_alive = keep_alive;
+    server->multiplex = multiplex;
+    server->pool_size = pool_size;
+    server->pool_timeout = pool_timeout;
+    server->retry_timeout = retry_timeout;
+
+    return server;
+}
+
+static int mk_fastcgi_config(char *path)
+{
+    char *file = NULL;
+    char *balance;
+    unsigned long len;
+    struct mk_list *head;
+    struct mk_list *head_srv;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+    struct fcgi_server *server;
+    struct fcgi_server *entry;
+
+    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
+    conf = mk_api->config_create(file);
+    if (!conf) {
+        return -1;
+    }
+
+    fcgi_conf.balance = FCGI_BALANCE_ROUND_ROBIN;
+    fcgi_conf.n_servers = 0;
+    mk_list_init(&fcgi_conf.servers);
+
+    /* Global options */
+    section = mk_api->config_section_get(conf, "FASTCGI");
+    if (section) {
+        balance = mk_api->config_section_get_key(section, "Balance",
+                                                 MK_RCONF_STR);
+        if (balance) {
+            if (strcasecmp(balance, "LeastOutstanding") == 0) {
+                fcgi_conf.balance = FCGI_BALANCE_LEAST_OUTSTANDING;
+            }
+            else if (strcasecmp(balance, "RoundRobin") != 0) {
+                mk_warn("[fastcgi] Invalid Balance value, use RoundRobin "
+                        "or LeastOutstanding");
+                mk_api->mem_free(balance);
+                return -1;
+            }
+            mk_api->mem_free(balance);
+        }
+    }
+
+    /*
+     * We don't use mk_config_section_get() because we can have multiple
+     * [FASTCGI_SERVER] sections.
+     */
+    mk_list_foreach(head, &conf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FASTCGI_SERVER") != 0) {
+            continue;
+        }
+
+        server = mk_fastcgi_config_server(section);
+        if (!server) {
             return -1;
         }
+
+        /* Handlers refer to the servers by name */
+        mk_list_foreach(head_srv, &fcgi_conf.servers) {
+            entry = mk_list_entry(head_srv, struct fcgi_server, _head);
+            if (strcmp(entry->name, server->name) == 0) {
+                mk_warn("[fastcgi] Duplicated ServerName %s", server->name);
+                return -1;
+            }
+        }
+
+        server->id = fcgi_conf.n_servers++;
+        mk_list_add(&server->_head, &fcgi_conf.servers);
     }
 
-    /* Set the global configuration */
-    fcgi_conf.server_name = cnf_srv_name;
-    fcgi_conf.server_addr = cnf_srv_addr;
-    fcgi_conf.server_port = cnf_srv_port;
-    fcgi_conf.server_path = cnf_srv_path;
+    if (fcgi_conf.n_servers == 0) {
+        return -1;
+    }
 
     return 0;
 }
 
 static int mk_fastcgi_start_processing(struct mk_http_session *cs,
-                                       struct mk_http_request *sr)
+                                       struct mk_http_request *sr,
+                                       int n_params,
+                                       struct mk_list *params)
 {
     struct fcgi_handler *handler;
 
-    handler = fcgi_handler_new(cs, sr);
+    handler = fcgi_handler_new(cs, sr, n_params, params);
     if (!handler) {
         return -1;
     }
@@ -122,14 +267,17 @@ int mk_fastcgi_stage30(struct mk_plugin *plugin,
 {
     int ret;
     (void) plugin;
-    (void) n_params;
-    (void) params;
 
-    ret = mk_fastcgi_start_processing(cs, sr);
+    ret = mk_fastcgi_start_processing(cs, sr, n_params, params);
     if (ret == 0) {
         return MK_PLUGIN_RET_CONTINUE;
     }
 
+    /* The server could not be reached, reply with the error status */
+    if (sr->headers.status > 0) {
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
     return MK_PLUGIN_RET_NOT_ME;
 }
 
@@ -156,12 +304,32 @@ int mk_fastcgi_stage30_hangup(struct mk_plugin *plugin,
     return 0;
 }
 
+/* More data of a streamed request body was received */
+int mk_fastcgi_stage30_body(struct mk_plugin *plugin,
+                            struct mk_http_session *cs,
+                            struct mk_http_request *sr)
+{
+    (void) plugin;
+    (void) cs;
+    struct fcgi_handler *handler;
+
+    handler = sr->handler_data;
+    if (!handler || handler->active == MK_FALSE || !handler->conn) {
+        return 0;
+    }
+
+    return fcgi_stdin_resume(handler);
+}
+
 int mk_fastcgi_plugin_init(struct plugin_api **api, char *confdir)
 {
     int ret;
 
     mk_api = *api;
 
+    /* Per worker backend connections */
+    fcgi_pool_init();
+
     /* read global configuration */
     ret = mk_fastcgi_config(confdir);
     if (ret == -1) {
@@ -183,11 +351,15 @@ int mk_fastcgi_master_init(struct mk_server_config *config)
 
 void mk_fastcgi_worker_init()
 {
+    if (fcgi_pool_worker_init() == -1) {
+        mk_warn("[fastcgi] could not initialize the connections pool");
+    }
 }
 
 struct mk_plugin_stage mk_plugin_stage_fastcgi = {
     .stage30        = &mk_fastcgi_stage30,
-    .stage30_hangup = &mk_fastcgi_stage30_hangup
+    .stage30_hangup = &mk_fastcgi_stage30_hangup,
+    .stage30_body   = &mk_fastcgi_stage30_body
 };
 
 struct mk_plugin mk_plugin_fastcgi = {
@@ -20,15 +20,40 @@
 #ifndef MK_FASTCGI_H
 #define MK_FASTCGI_H
 
-struct mk_fcgi_conf {
-    char *server_name;
+#include <monkey/mk_api.h>
+
+/* Balancing of the requests across the servers of a handler */
+#define FCGI_BALANCE_ROUND_ROBIN         0   /* weighted round-robin   */
+#define FCGI_BALANCE_LEAST_OUTSTANDING   1   /* fewest requests/weight */
+
+/* A [FASTCGI_SERVER] section */
+struct fcgi_server {
+    int id;                  /* index in the servers list             */
+    char *name;
 
     /* Unix Socket */
-    char *server_path;
+    char *path;
 
     /* TCP Server */
-    char *server_addr;
-    char *server_port;
+    char *addr;
+    char *port;
+
+    int weight;              /* share of the requests                 */
+
+    /* Backend connections */
+    int keep_alive;          /* reuse connections with FCGI_KEEP_CONN */
+    int multiplex;           /* requests in flight per connection     */
+    int pool_size;           /* idle connections kept per worker      */
+    int pool_timeout;        /* seconds an idle connection is kept    */
+    int retry_timeout;       /* max seconds between connect retries   */
+
+    struct mk_list _head;
+};
+
+struct mk_fcgi_conf {
+    int balance;
+    int n_servers;
+    struct mk_list servers;
 };
 
 struct mk_fcgi_conf fcgi_conf;
@@ -21,6 +21,7 @@
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_pool.h"
 
 #define FCGI_BUF(h)           (char *) h->buf_data + h->buf_len
 #define FCGI_PARAM_DYN(str)   str, strlen(str), MK_FALSE
@@ -42,10 +43,15 @@ static inline void fcgi_build_header(struct fcgi_record_header *rec,
     rec->reserved        = 0;
 }
 
-static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body)
+static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body,
+                                           int keep_alive)
 {
     fcgi_encode16(&body->role, FCGI_RESPONDER);
     body->flags       = 0;
+    if (keep_alive == MK_TRUE) {
+        /* The server must not close the connection once done */
+        body->flags = FCGI_KEEP_CONN;
+    }
     memset(body->reserved, '\0', sizeof(body->reserved));
 }
 
@@ -69,7 +75,8 @@ static inline int fcgi_add_param_empty(struct fcgi_handler *handler)
     char *p;
 
     p = FCGI_BUF(handler);
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, 0);
+    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS,
+                      handler->request_id, 0);
     mk_api->iov_add(handler->iov, p,
                     sizeof(struct fcgi_record_header), MK_FALSE);
     handler->buf_len += sizeof(struct fcgi_record_header);
@@ -94,7 +101,8 @@ static inline int fcgi_add_param(struct fcgi_handler *handler,
 	len += key_len > 127 ? 4 : 1;
 	len += val_len > 127 ? 4 : 1;
 
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, len);
+    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS,
+                      handler->request_id, len);
     padding = ~(len - 1) & 7;
     if (padding) {
         h = (struct fcgi_record_header *) p;
@@ -285,9 +293,23 @@ static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
     uint64_t total;
     char *p;
     char *eof;
+    char *src;
     struct fcgi_record_header *h;
+    struct mk_http_body_segment *seg;
 
     total = handler->stdin_length - handler->stdin_offset;
+    src = handler->stdin_buffer + handler->stdin_offset;
+
+    /* A chained body is sent from its first segment */
+    if (!handler->stdin_buffer) {
+        seg = mk_list_entry_first(&handler->sr->body_chain,
+                                  struct mk_http_body_segment, _head);
+        src = seg->data + handler->stdin_segment_offset;
+        if (total > seg->length - handler->stdin_segment_offset) {
+            total = seg->length - handler->stdin_segment_offset;
+        }
+    }
+
     if (total > max) {
         chunk = max;
     }
@@ -297,7 +319,7 @@ static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
 
     p = FCGI_BUF(handler);
     h = (struct fcgi_record_header *) p;
-    fcgi_build_header(h, FCGI_STDIN, 1, chunk);
+    fcgi_build_header(h, FCGI_STDIN, handler->request_id, chunk);
     h->padding_length = ~(chunk - 1) & 7;
 
     MK_TRACE("[fastcgi] STDIN: length=%i", chunk);
@@ -307,10 +329,7 @@ static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
 
 
     if (chunk > 0) {
-        mk_api->iov_add(handler->iov,
-                        handler->stdin_buffer + handler->stdin_offset,
-                        chunk,
-                        MK_FALSE);
+        mk_api->iov_add(handler->iov, src, chunk, MK_FALSE);
     }
 
     if (h->padding_length > 0) {
@@ -321,19 +340,67 @@ static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
 
     if (handler->stdin_offset + chunk == handler->stdin_length) {
         eof = FCGI_BUF(handler);
-        fcgi_build_header((struct fcgi_record_header *) eof, FCGI_STDIN, 1, 0);
+        fcgi_build_header((struct fcgi_record_header *) eof, FCGI_STDIN,
+                          handler->request_id, 0);
         mk_api->iov_add(handler->iov, eof, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
         handler->buf_len += FCGI_RECORD_HEADER_SIZE + padding;
     }
 
     handler->stdin_offset += chunk;
+    handler->stdin_segment_offset += chunk;
     return 0;
 }
 
+/* Bytes of a chained body received and not yet sent to the backend */
+static inline uint64_t fcgi_stdin_ready(struct fcgi_handler *handler)
+{
+    struct mk_http_body_segment *seg;
+
+    if (handler->stdin_buffer) {
+        return handler->stdin_length - handler->stdin_offset;
+    }
+
+    if (mk_list_is_empty(&handler->sr->body_chain) == 0) {
+        return 0;
+    }
+
+    seg = mk_list_entry_first(&handler->sr->body_chain,
+                              struct mk_http_body_segment, _head);
+    return seg->length - handler->stdin_segment_offset;
+}
+
+/*
+ * Give back the first segment of a chained body once it was sent, so a
+ * streamed body keeps a bounded amount of memory.
+ */
+static inline void fcgi_stdin_release(struct fcgi_handler *handler)
+{
+    struct mk_http_body_segment *seg;
+
+    if (handler->stdin_buffer ||
+        mk_list_is_empty(&handler->sr->body_chain) == 0) {
+        return;
+    }
+
+    seg = mk_list_entry_first(&handler->sr->body_chain,
+                              struct mk_http_body_segment, _head);
+    if (handler->stdin_segment_offset == seg->size ||
+        (handler->stdin_segment_offset == seg->length &&
+         handler->sr->body_pending == MK_FALSE)) {
+        mk_api->http_body_release(handler->cs, handler->sr, seg);
+        handler->stdin_segment_offset = 0;
+    }
+}
+
 static inline int fcgi_add_stdin(struct fcgi_handler *handler)
 {
     uint64_t bytes = handler->sr->data.len;
 
+    /* A streamed body is still being received */
+    if (handler->sr->body_pending == MK_TRUE) {
+        bytes = handler->cs->parser.header_content_length;
+    }
+
     if (bytes <= 0) {
         return -1;
     }
@@ -341,24 +408,83 @@ static inline int fcgi_add_stdin(struct fcgi_handler *handler)
     handler->stdin_length = bytes;
     handler->stdin_offset = 0;
     handler->stdin_buffer = handler->sr->data.data;
-    fcgi_stdin_chunk(handler);
+    handler->stdin_segment_offset = 0;
+
+    if (fcgi_stdin_ready(handler) > 0) {
+        fcgi_stdin_chunk(handler);
+    }
 
     return 0;
 }
 
+/* Stream callback: the data queued was written to the server */
+static void fcgi_stream_flushed(struct mk_stream *stream)
+{
+    struct fcgi_handler *handler = stream->data;
+
+    /* The stream is still linked, the handler continues after the write */
+    handler->stream_busy = MK_FALSE;
+    handler->flushed = MK_TRUE;
+    handler->sent = MK_TRUE;
+    handler->conn->flushed = MK_TRUE;
+}
+
+/* Queue the handler iov on the server connection */
+static void fcgi_stream_queue(struct fcgi_handler *handler)
+{
+    mk_api->stream_set(&handler->fcgi_stream,
+                       MK_STREAM_IOV,
+                       &handler->conn->channel,
+                       handler->iov,
+                       -1,
+                       handler,
+                       fcgi_stream_flushed, NULL, NULL);
+    handler->stream_busy = MK_TRUE;
+    handler->stream_bytes = handler->fcgi_stream.bytes_total;
+}
+
+/* Send the next STDIN record, it returns -1 if no body data is ready */
+static int fcgi_stdin_next(struct fcgi_handler *handler)
+{
+    if (fcgi_stdin_ready(handler) == 0) {
+        return -1;
+    }
+
+    mk_api->iov_free(handler->iov);
+    handler->iov = mk_api->iov_create(64, 0);
+    handler->buf_len = 0;
+    fcgi_stdin_chunk(handler);
+    fcgi_stream_queue(handler);
+    return 0;
+}
+
+/* More data of a streamed request body is available */
+int fcgi_stdin_resume(struct fcgi_handler *handler)
+{
+    if (handler->stdin_wait == MK_FALSE ||
+        fcgi_stdin_next(handler) == -1) {
+        return 0;
+    }
+
+    handler->stdin_wait = MK_FALSE;
+    return fcgi_pool_flush(handler->conn);
+}
+
 static int fcgi_encode_request(struct fcgi_handler *handler)
 {
     int ret;
+    char buffer[32];
     struct mk_http_header *header;
     struct fcgi_begin_request_record *request;
 
     MK_TRACE("ENCODE REQUEST");
 
     request = &handler->header_request;
-    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST, 1,
-                      FCGI_BEGIN_REQUEST_BODY_SIZE);
+    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST,
+                      handler->request_id, FCGI_BEGIN_REQUEST_BODY_SIZE);
 
-    fcgi_build_request_body(&request->body);
+    fcgi_build_request_body(&request->body,
+                            handler->conn->backend->server->keep_alive);
 
     /* BEGIN_REQUEST */
     mk_api->iov_add(handler->iov,
@@ -445,6 +571,13 @@ static int fcgi_encode_request(struct fcgi_handler *handler)
                        FCGI_PARAM_CONST("CONTENT_LENGTH"),
                        FCGI_PARAM_PTR(handler->sr->_content_length));
     }
+    else if (handler->sr->data.len > 0) {
+        /* A chunked body was decoded, its length is known now */
+        snprintf(buffer, sizeof(buffer), "%lu", handler->sr->data.len);
+        fcgi_add_param(handler,
+                       FCGI_PARAM_CONST("CONTENT_LENGTH"),
+                       FCGI_PARAM_DUP(buffer));
+    }
 
     /* Content Length */
     header = &handler->cs->parser.headers[MK_HEADER_CONTENT_TYPE];
@@ -481,19 +614,6 @@ size_t fcgi_read_header(void *p, struct fcgi_record_header *h)
 	return sizeof(*h);
 }
 
-static inline int fcgi_buffer_consume(struct fcgi_handler *handler, size_t bytes)
-{
-    if (bytes >= handler->buf_len) {
-        handler->buf_len = 0;
-        return 0;
-    }
-
-    memmove(handler->buf_data, handler->buf_data + bytes,
-            handler->buf_len - bytes);
-    handler->buf_len -= bytes;
-    return 0;
-}
-
 static char *getearliestbreak(const char buf[], const unsigned bufsize,
                               unsigned char * const advance)
 {
@@ -522,20 +642,57 @@ static char *getearliestbreak(const char buf[], const unsigned bufsize,
     return crend;
 }
 
-static int fcgi_write(struct fcgi_handler *handler, char *buf, size_t len)
+/* Stream callbacks: the client channel is done with a receive buffer */
+static void cb_fcgi_buffer_done(struct mk_stream *stream)
 {
-    mk_stream_set(NULL,
-                  MK_STREAM_COPYBUF,
-                  handler->cs->channel,
-                  buf, len,
-                  NULL, NULL, NULL, NULL);
+    fcgi_buffer_release(stream->data);
+}
 
-    if (handler->headers_set == MK_TRUE) {
-        mk_stream_set(NULL,
-                      MK_STREAM_COPYBUF,
-                      handler->cs->channel,
-                      "\r\n", 2,
-                      NULL, NULL, NULL, NULL);
+static void cb_fcgi_buffer_drop(struct mk_stream *stream, int err)
+{
+    (void) err;
+    fcgi_buffer_release(stream->data);
+}
+
+/*
+ * Send response data to the client. Large bodies are linked from the
+ * receive buffer 'rbuf' with no copy, the rest is copied.
+ */
+static int fcgi_write(struct fcgi_handler *handler, struct fcgi_buffer *rbuf,
+                      char *buf, size_t len)
+{
+    int ret;
+    int chunked = 0;
+
+    /* Once the headers are sent the body goes in chunks */
+    if (handler->chunked == MK_TRUE && handler->headers_set == MK_TRUE) {
+        chunked = MK_STREAM_CHUNKED;
+    }
+
+    if (rbuf && len >= FCGI_ZEROCOPY_MIN) {
+        rbuf->refs++;
+        ret = mk_api->stream_set(NULL,
+                                 MK_STREAM_RAW | chunked,
+                                 handler->cs->channel,
+                                 buf, len,
+                                 rbuf,
+                                 cb_fcgi_buffer_done, NULL,
+                                 cb_fcgi_buffer_drop);
+        if (ret != 0) {
+            /* The stream was not linked, take our reference back */
+            fcgi_buffer_release(rbuf);
+            return -1;
+        }
+        return 0;
+    }
+
+    ret = mk_api->stream_set(NULL,
+                             MK_STREAM_COPYBUF | chunked,
+                             handler->cs->channel,
+                             buf, len,
+                             NULL, NULL, NULL, NULL);
+    if (ret != 0) {
+        return -1;
     }
     return 0;
 }
@@ -552,11 +709,9 @@ void fcgi_stream_eof(struct mk_stream *stream)
 
 int fcgi_exit(struct fcgi_handler *handler)
 {
-    /* Always disable any backend notification first */
-    if (handler->server_fd > 0) {
-        mk_api->ev_del(mk_api->sched_loop(), &handler->event);
-        close(handler->server_fd);
-        handler->server_fd = -1;
+    /* Always release the backend connection first */
+    if (handler->conn) {
+        fcgi_pool_detach(handler);
     }
 
     /*
@@ -569,20 +724,25 @@ int fcgi_exit(struct fcgi_handler *handler)
         handler->eof == MK_FALSE) {
 
         MK_TRACE("[fastcgi=%i] deferring exit, EOF stream",
-                 handler->server_fd);
+                 handler->cs->socket);
 
         /* Now set an EOF stream/callback to resume the exiting process */
-        mk_stream_set(NULL,
-                      MK_STREAM_EOF,
-                      handler->cs->channel,
-                      NULL, 0, handler,
-                      fcgi_stream_eof, NULL, NULL);
+        mk_api->stream_set(NULL,
+                           MK_STREAM_EOF,
+                           handler->cs->channel,
+                           NULL, 0, handler,
+                           fcgi_stream_eof, NULL, NULL);
         handler->eof = MK_TRUE;
         return 1;
     }
 
     MK_TRACE("[fastcgi] exiting");
 
+    if (handler->headers_buf) {
+        mk_api->mem_free(handler->headers_buf);
+        handler->headers_buf = NULL;
+    }
+
     if (handler->iov) {
         mk_api->iov_free(handler->iov);
         mk_api->sched_event_free((struct mk_event *) handler);
@@ -600,46 +760,83 @@ int fcgi_exit(struct fcgi_handler *handler)
 
 int fcgi_error(struct fcgi_handler *handler)
 {
-    fcgi_exit(handler);
+    /* The error response goes out before the request is finished */
     mk_api->http_request_error(500, handler->cs, handler->sr);
+    fcgi_exit(handler);
     return 0;
 }
 
-static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
+/* Keep the response headers received so far, it returns -1 if too big */
+static int fcgi_headers_append(struct fcgi_handler *handler,
+                               char *buf, size_t len)
+{
+    char *tmp;
+
+    if (handler->headers_len + len > FCGI_HEADERS_MAX) {
+        mk_warn("[fastcgi] response headers too large");
+        return -1;
+    }
+
+    tmp = mk_api->mem_realloc(handler->headers_buf,
+                              handler->headers_len + len);
+    if (!tmp) {
+        return -1;
+    }
+
+    memcpy(tmp + handler->headers_len, buf, len);
+    handler->headers_buf = tmp;
+    handler->headers_len += len;
+    return 0;
+}
+
+static int fcgi_response(struct fcgi_handler *handler,
+                         struct fcgi_buffer *rbuf, char *buf, size_t len)
 {
     int status;
     int diff;
-    int xlen;
-    char tmp[16];
     char *p;
     char *end;
     size_t p_len;
     unsigned char advance;
 
     MK_TRACE("[fastcgi=%i] process response len=%lu",
-             handler->server_fd, len);
+             handler->request_id, len);
 
     p = buf;
     p_len = len;
 
-    if (len == 0 && handler->chunked && handler->headers_set == MK_TRUE) {
-        MK_TRACE("[fastcgi=%i] sending EOF", handler->server_fd);
-        mk_stream_set(NULL,
-                      MK_STREAM_COPYBUF,
-                      handler->cs->channel,
-                      "0\r\n\r\n", 5,
-                      handler,
-                      NULL, NULL, NULL);
+    if (len == 0 && handler->headers_set == MK_TRUE) {
+        MK_TRACE("[fastcgi=%i] sending EOF", handler->request_id);
+        if (handler->chunked == MK_TRUE) {
+            mk_api->stream_set(NULL,
+                               MK_STREAM_RAW | MK_STREAM_CHUNKED,
+                               handler->cs->channel,
+                               NULL, 0,
+                               NULL, NULL, NULL, NULL);
+        }
         mk_api->channel_flush(handler->cs->channel);
         return 0;
     }
 
     if (handler->headers_set == MK_FALSE) {
+        /* Headers split across records are put together first */
+        if (handler->headers_buf) {
+            if (fcgi_headers_append(handler, buf, len) == -1) {
+                return -1;
+            }
+            buf = p = handler->headers_buf;
+            len = p_len = handler->headers_len;
+            rbuf = NULL;
+        }
+
         advance = 4;
         end = getearliestbreak(buf, len, &advance);
         if (!end) {
             /* we need more data */
-            return -1;
+            if (!handler->headers_buf) {
+                return fcgi_headers_append(handler, buf, len);
+            }
+            return 0;
         }
 
         handler->sr->headers.cgi = MK_TRUE;
@@ -661,7 +858,11 @@ static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
         mk_api->header_prepare(handler->cs, handler->sr);
 
         diff = (end - buf) + advance;
-        fcgi_write(handler, buf, diff);
+        if (fcgi_write(handler, NULL, buf, diff) == -1) {
+            /* The headers are queued, too late for an error page */
+            handler->headers_set = MK_TRUE;
+            return -1;
+        }
 
         p = buf + diff;
         p_len -= diff;
@@ -670,237 +871,153 @@ static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
     }
 
     if (p_len > 0) {
-        xlen = snprintf(tmp, 16, "%x\r\n", (unsigned int) p_len);
-        mk_stream_set(NULL,
-                      MK_STREAM_COPYBUF,
-                      handler->cs->channel,
-                      tmp, xlen,
-                      NULL, NULL, NULL, NULL);
-        fcgi_write(handler, p, p_len);
+        if (fcgi_write(handler, rbuf, p, p_len) == -1) {
+            return -1;
+        }
+    }
+
+    /* The stream took a copy */
+    if (handler->headers_buf) {
+        mk_api->mem_free(handler->headers_buf);
+        handler->headers_buf = NULL;
+        handler->headers_len = 0;
     }
 
     return 0;
 }
 
-int cb_fastcgi_on_read(void *data)
+/*
+ * The connection to the server is ready: encode the request, a request
+ * moved to another connection is encoded again.
+ */
+int fcgi_handler_start(struct fcgi_handler *handler)
 {
-    int n;
-    int ret = 0;
-    int avail;
-    char *body;
-    size_t offset;
-    struct fcgi_handler *handler = data;
-    struct fcgi_record_header header;
+    int entries;
+    struct mk_iov *iov;
 
-    if (handler->active == MK_FALSE) {
-        fcgi_exit(handler);
-        return -1;
+    if (handler->iov->iov_idx > 0) {
+        entries = 128 + (handler->cs->parser.header_count * 3);
+        iov = mk_api->iov_create(entries, 0);
+        if (!iov) {
+            return -1;
+        }
+        mk_api->iov_free(handler->iov);
+        handler->iov = iov;
     }
 
-    avail = FCGI_BUF_SIZE - handler->buf_len;
-    n = read(handler->server_fd, handler->buf_data + handler->buf_len, avail);
-    MK_TRACE("[fastcgi=%i] read()=%i", handler->server_fd, n);
-    if (n <= 0) {
-        fcgi_exit(handler);
-        return -1;
-    }
-    else {
-        handler->buf_len += n;
-    }
+    /* Params buffer set an offset to include the header */
+    handler->buf_len = FCGI_RECORD_HEADER_SIZE;
+    handler->stdin_wait = MK_FALSE;
 
-    if ((unsigned) handler->buf_len < FCGI_RECORD_HEADER_SIZE) {
-        /* wait for more data */
-        return n;
+    /* Convert the original request to FCGI format */
+    if (fcgi_encode_request(handler) == -1) {
+        return -1;
     }
 
-    while (1) {
-        /* decode the header */
-        fcgi_read_header(&handler->buf_data, &header);
-
-        if (header.type != FCGI_STDOUT && header.type != FCGI_STDERR &&
-            header.type != FCGI_END_REQUEST) {
-            fcgi_exit(handler);
-            return -1;
-        }
+    fcgi_stream_queue(handler);
+    handler->started = MK_TRUE;
 
-        /* Check if the package is complete */
-        if (handler->buf_len < (FCGI_RECORD_HEADER_SIZE + header.content_length)) {
-            /* we need more data */
-            return n;
-        }
-
-        body = handler->buf_data + FCGI_RECORD_HEADER_SIZE;
-        switch (header.type) {
-        case FCGI_STDOUT:
-            MK_TRACE("[fastcgi=%i] FCGI_STDOUT content_length=%i",
-                     handler->server_fd, header.content_length);
-            /*
-             * Issue seen with Chrome & Firefox browsers:
-             * Sometimes content length is coming as ZERO and we are encoding a
-             * HTTP response packet with ZERO size data. This makes Chrome & Firefox
-             * browsers fail to proceed furhter and subsequent content loading fails.
-             * However, IE/Safari discards the packets with ZERO size data.
-             */
-            if (0 != header.content_length) {
-                ret = fcgi_response(handler, body, header.content_length);
-            }
-            else {
-                MK_TRACE("[fastcgi=%i] ZERO byte content length in FCGI_STDOUT, discard!!",
-                         handler->server_fd);
-                ret = 0;
-            }
-            break;
-        case FCGI_STDERR:
-            MK_TRACE("[fastcgi=%i] FCGI_STDERR content_length=%i",
-                     handler->server_fd, header.content_length);
-            break;
-        case FCGI_END_REQUEST:
-            MK_TRACE("[fastcgi=%i] FCGI_END_REQUEST content_length=%i",
-                     handler->server_fd, header.content_length);
-            ret = fcgi_response(handler, NULL, 0);
-        default:
-            //fcgi_exit(handler);
-            return -1;
-        }
-
-        if (ret == -1) {
-            /* Missing header breaklines ? */
-            return n;
-        }
+    return fcgi_pool_flush(handler->conn);
+}
 
-        /* adjust buffer content */
-        offset = FCGI_RECORD_HEADER_SIZE +
-            header.content_length + header.padding_length;
+/* The data queued by the handler was written to the server */
+void fcgi_handler_flushed(struct fcgi_handler *handler)
+{
+    fcgi_stdin_release(handler);
 
-        fcgi_buffer_consume(handler, offset);
+    /* Do we have more data for the stdin ? */
+    if (handler->stdin_length - handler->stdin_offset > 0 &&
+        fcgi_stdin_next(handler) == -1) {
+        /* Wait for the client to send more of the body */
+        handler->stdin_wait = MK_TRUE;
     }
-    return n;
 }
 
-int cb_fastcgi_request_flush(void *data)
+/* A record for this request was received from the server */
+void fcgi_handler_record(struct fcgi_handler *handler, int type,
+                         struct fcgi_buffer *buf, char *body, size_t len)
 {
-    int ret;
-    size_t count = 0;
-    struct fcgi_handler *handler = data;
-
-    ret = mk_api->channel_write(&handler->fcgi_channel, &count);
-
-    MK_TRACE("[fastcgi=%i] %lu bytes, ret=%i",
-             handler->server_fd, count, ret);
-
-    if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
-        /* Do we have more data for the stdin ? */
-        if (handler->stdin_length - handler->stdin_offset > 0) {
-            mk_api->iov_free(handler->iov);
-            handler->iov = mk_api->iov_create(64, 0);
-            fcgi_stdin_chunk(handler);
-
-            mk_api->stream_set(&handler->fcgi_stream,
-                               MK_STREAM_IOV,
-                               &handler->fcgi_channel,
-                               handler->iov,
-                               -1,
-                               handler,
-                               NULL, NULL, NULL);
-            return MK_CHANNEL_FLUSH;
+    switch (type) {
+    case FCGI_STDOUT:
+        MK_TRACE("[fastcgi=%i] FCGI_STDOUT content_length=%lu",
+                 handler->request_id, len);
+        /*
+         * Issue seen with Chrome & Firefox browsers:
+         * Sometimes content length is coming as ZERO and we are encoding a
+         * HTTP response packet with ZERO size data. This makes Chrome & Firefox
+         * browsers fail to proceed furhter and subsequent content loading fails.
+         * However, IE/Safari discards the packets with ZERO size data.
+         */
+        if (len == 0) {
+            MK_TRACE("[fastcgi=%i] ZERO byte content length in FCGI_STDOUT, discard!!",
+                     handler->request_id);
+            break;
         }
 
-        /* Request done, switch the event side to receive the FCGI response */
-        handler->buf_len = 0;
-        handler->event.handler = cb_fastcgi_on_read;
-        ret = mk_api->ev_add(mk_api->sched_loop(),
-                             handler->server_fd,
-                             MK_EVENT_CUSTOM, MK_EVENT_READ, handler);
-        if (ret == -1) {
-            goto error;
+        if (fcgi_response(handler, buf, body, len) == -1) {
+            fcgi_handler_fail(handler, MK_FALSE);
         }
-    }
-    else if (ret == MK_CHANNEL_ERROR) {
+        break;
+    case FCGI_STDERR:
+        MK_TRACE("[fastcgi=%i] FCGI_STDERR content_length=%lu",
+                 handler->request_id, len);
+        break;
+    case FCGI_END_REQUEST:
+        MK_TRACE("[fastcgi=%i] FCGI_END_REQUEST content_length=%lu",
+                 handler->request_id, len);
+        handler->ended = MK_TRUE;
+
+        /* The server did not send a complete response */
+        if (handler->headers_set == MK_FALSE) {
+            fcgi_handler_fail(handler, MK_FALSE);
+            break;
+        }
+
+        fcgi_response(handler, NULL, NULL, 0);
         fcgi_exit(handler);
+        break;
     }
-    else if (ret == MK_CHANNEL_BUSY) {
-        return -1;
-    }
-
-    return ret;
-
- error:
-    return -1;
 }
 
-/* Callback: on connect to the backend server */
-int cb_fastcgi_on_connect(void *data)
+/*
+ * The request cannot continue on its connection. If nothing was sent yet
+ * it's tried on another connection, otherwise the client gets an error.
+ */
+void fcgi_handler_fail(struct fcgi_handler *handler, int retry)
 {
-    int ret;
-    int s_err;
+    int status = MK_SERVER_INTERNAL_ERROR;
     size_t count;
-    socklen_t s_len = sizeof(s_err);
-    struct mk_list *head;
-    struct mk_plugin *pio;
-    struct fcgi_handler *handler = data;
-    struct mk_channel *channel;
-
-    if (handler->active == MK_FALSE) {
-        return -1;
-    }
-
-    /* We connect in async mode, we need to check if the connection was OK */
-    ret = getsockopt(handler->server_fd, SOL_SOCKET, SO_ERROR, &s_err, &s_len);
-    if (ret == -1) {
-        goto error;
-    }
-
-    if (s_err) {
-        /* FastCGI server unavailable */
-        goto error;
-    }
 
-    /* Convert the original request to FCGI format */
-    ret = fcgi_encode_request(handler);
-    if (ret == -1) {
-        goto error;
-    }
-
-    /* Prepare the channel */
-    channel = &handler->fcgi_channel;
-    channel->type = MK_CHANNEL_SOCKET;
-    channel->fd   = handler->server_fd;
-
-    /* FIXME: Discovery process needs to be fast */
-    mk_list_foreach(head, &mk_api->config->plugins) {
-        pio = mk_list_entry(head, struct mk_plugin, _head);
-        if (strncmp(pio->shortname, "liana", 5) == 0) {
-            break;
+    if (retry == MK_TRUE && handler->retries < handler->upstream->n) {
+        handler->retries++;
+        status = fcgi_pool_attach(handler);
+        if (status == 0) {
+            return;
         }
-        pio = NULL;
     }
-    channel->io   = pio->network;
-
-    mk_list_init(&channel->streams);
-    mk_api->stream_set(&handler->fcgi_stream,
-                       MK_STREAM_IOV,
-                       &handler->fcgi_channel,
-                       handler->iov,
-                       -1,
-                       handler,
-                       NULL, NULL, NULL);
 
-    handler->event.handler = cb_fastcgi_request_flush;
-    handler->event.data = handler;
-
-    return 0;
+    /*
+     * Too late for an error page and the response is cut, close the
+     * connection instead of keeping it alive after a partial body.
+     */
+    if (handler->headers_set == MK_TRUE) {
+        handler->hangup = MK_TRUE;
+        handler->eof = MK_TRUE;
+        fcgi_exit(handler);
+        return;
+    }
 
- error:
-    fcgi_error(handler);
+    mk_api->http_request_error(status, handler->cs, handler->sr);
+    fcgi_exit(handler);
     mk_api->channel_write(handler->cs->channel, &count);
-    return 0;
 }
 
 struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
-                                      struct mk_http_request *sr)
+                                      struct mk_http_request *sr,
+                                      int n_params, struct mk_list *params)
 {
-    int ret;
     int entries;
+    int status;
     struct fcgi_handler *h;
 
     /* Allocate handler instance and set fields */
@@ -913,11 +1030,11 @@ struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
     h->sr = sr;
     h->write_rounds = 0;
     h->active = MK_TRUE;
-    h->server_fd = -1;
     h->eof = MK_FALSE;
     h->stdin_length = 0;
     h->stdin_offset = 0;
     h->stdin_buffer = NULL;
+    h->stdin_wait = MK_FALSE;
 
     /* Allocate enough space for our data */
     entries = 128 + (cs->parser.header_count * 3);
@@ -933,35 +1050,10 @@ struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
         h->hangup = MK_TRUE;
     }
 
-    /* Params buffer set an offset to include the header */
-    h->buf_len = FCGI_RECORD_HEADER_SIZE;
-
-    /* Request and async connection to the server */
-    if (fcgi_conf.server_addr) {
-        h->server_fd = mk_api->socket_connect(fcgi_conf.server_addr,
-                                              atoi(fcgi_conf.server_port),
-                                              MK_TRUE);
-    }
-    else if (fcgi_conf.server_path) {
-        h->server_fd = mk_api->socket_open(fcgi_conf.server_path, MK_TRUE);
-    }
-
-    if (h->server_fd == -1) {
-        goto error;
-    }
-
-    /* Prepare the built-in event structure */
-    MK_EVENT_INIT(&h->event, h->server_fd, h, cb_fastcgi_on_connect);
-
-    /*
-     * Let the event loop notify us when we can flush data to
-     * the FastCGI server.
-     */
-    ret = mk_api->ev_add(mk_api->sched_loop(),
-                         h->server_fd,
-                         MK_EVENT_CUSTOM, MK_EVENT_WRITE, h);
-    if (ret == -1) {
-        close(h->server_fd);
+    /* Pick a server and a connection, the request goes once connected */
+    h->upstream = fcgi_pool_upstream(n_params, params);
+    status = fcgi_pool_attach(h);
+    if (status != 0) {
         goto error;
     }
 
@@ -971,7 +1063,8 @@ struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
     mk_api->iov_free(h->iov);
     mk_api->mem_free(h);
     sr->handler_data = NULL;
-    mk_api->http_request_error(500, cs, sr);
 
+    /* The caller answers with this status */
+    mk_api->header_set_http_status(sr, status);
     return NULL;
 }
@@ -53,10 +53,16 @@ struct fcgi_begin_request_record {
 #define FCGI_RECORD_HEADER_SIZE      sizeof(struct fcgi_record_header)
 #define FCGI_BUF_SIZE                FCGI_RECORD_MAX_SIZE + FCGI_RECORD_HEADER_SIZE
 #define FCGI_BEGIN_REQUEST_BODY_SIZE sizeof(struct fcgi_begin_request_body)
+#define FCGI_HEADERS_MAX             65536  /* response headers buffered */
 #define FCGI_RESPONDER  1
 #define FCGI_AUTHORIZER 2
 #define FCGI_FILTER     3
 
+/*
+ * Values for flags component of FCGI_BeginRequestBody
+ */
+#define FCGI_KEEP_CONN  1
+
 /*
  * Values for type component of FCGI_Header
  */
@@ -71,6 +77,10 @@ struct fcgi_begin_request_record {
 #define FCGI_GET_VALUES          9
 #define FCGI_GET_VALUES_RESULT  10
 
+struct fcgi_conn;
+struct fcgi_buffer;
+struct fcgi_upstream;
+
 /*
  * FastCGI Handler context, it keeps information of states and other
  * request/response references.
@@ -78,7 +88,6 @@ struct fcgi_begin_request_record {
 struct fcgi_handler {
     struct mk_event event;       /* built-in event-loop data */
 
-    int server_fd;               /* backend FastCGI server         */
     int chunked;                 /* chunked response ?             */
     int active;                  /* is this handler active ?       */
     int hangup;                  /* hangup connection once ready ? */
@@ -89,10 +98,22 @@ struct fcgi_handler {
     uint64_t stdin_length;
     uint64_t stdin_offset;
     char *stdin_buffer;
+    uint64_t stdin_segment_offset;  /* sent from the first body segment */
+    int stdin_wait;                 /* waiting for more body data ?     */
 
     struct mk_http_session *cs;  /* HTTP session context           */
     struct mk_http_request *sr;  /* HTTP request context           */
 
+    /* Backend */
+    struct fcgi_upstream *upstream;
+    struct fcgi_conn *conn;      /* connection serving the request */
+    uint16_t request_id;
+    int retries;                 /* moved to another connection    */
+    int started;                 /* request queued on the conn ?   */
+    int sent;                    /* some request data was sent ?   */
+    int ended;                   /* FCGI_END_REQUEST received ?    */
+    int flushed;                 /* the last stream was consumed ? */
+
     /* FastCGI */
     struct fcgi_begin_request_record header_request;
 
@@ -100,9 +121,14 @@ struct fcgi_handler {
     unsigned int buf_len;
     char buf_data[FCGI_BUF_SIZE];
 
-    /* Channel to stream request to the FCGI server */
-    struct mk_channel fcgi_channel;
-    struct mk_stream  fcgi_stream;
+    /* Response headers split across records */
+    char *headers_buf;
+    size_t headers_len;
+
+    /* Stream to send the request to the FCGI server */
+    struct mk_stream fcgi_stream;
+    int stream_busy;             /* linked to the conn channel ?   */
+    size_t stream_bytes;         /* stream size when it was set    */
 
     struct mk_iov *iov;
     struct mk_list _head;
@@ -117,8 +143,19 @@ static inline void fcgi_encode16(void *a, unsigned b)
 }
 
 struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
-                                      struct mk_http_request *sr);
+                                      struct mk_http_request *sr,
+                                      int n_params, struct mk_list *params);
 
+size_t fcgi_read_header(void *p, struct fcgi_record_header *h);
 int fcgi_exit(struct fcgi_handler *handler);
+int fcgi_error(struct fcgi_handler *handler);
+int fcgi_stdin_resume(struct fcgi_handler *handler);
+
+/* Backend connection events */
+int fcgi_handler_start(struct fcgi_handler *handler);
+void fcgi_handler_record(struct fcgi_handler *handler, int type,
+                         struct fcgi_buffer *buf, char *body, size_t len);
+void fcgi_handler_flushed(struct fcgi_handler *handler);
+void fcgi_handler_fail(struct fcgi_handler *handler, int retry);
 
 #endif
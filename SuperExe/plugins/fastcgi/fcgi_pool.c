@@ -0,0 +1,867 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+#include "fcgi_pool.h"
+
+static pthread_key_t fcgi_worker_key;
+static struct mk_plugin_network *fcgi_network;
+
+static int cb_fcgi_conn_event(void *data);
+
+static inline struct fcgi_worker *fcgi_worker_local()
+{
+    return pthread_getspecific(fcgi_worker_key);
+}
+
+static inline int fcgi_backend_available(struct fcgi_backend *backend,
+                                         uint64_t now)
+{
+    return (backend->retry_delay == 0 || now >= backend->retry_at);
+}
+
+static struct fcgi_buffer *fcgi_buffer_get()
+{
+    struct fcgi_buffer *buf;
+    struct fcgi_worker *worker = fcgi_worker_local();
+
+    if (worker->n_buffers > 0) {
+        buf = mk_list_entry_first(&worker->buffers, struct fcgi_buffer, _head);
+        mk_list_del(&buf->_head);
+        worker->n_buffers--;
+    }
+    else {
+        buf = mk_api->mem_alloc(sizeof(struct fcgi_buffer));
+        if (!buf) {
+            return NULL;
+        }
+    }
+
+    buf->refs = 1;
+    return buf;
+}
+
+/* Drop a reference, the last one returns the buffer to the worker pool */
+void fcgi_buffer_release(struct fcgi_buffer *buf)
+{
+    struct fcgi_worker *worker;
+
+    if (--buf->refs > 0) {
+        return;
+    }
+
+    worker = fcgi_worker_local();
+    if (worker && worker->n_buffers < FCGI_BUFFER_POOL) {
+        mk_list_add(&buf->_head, &worker->buffers);
+        worker->n_buffers++;
+        return;
+    }
+
+    mk_api->mem_free(buf);
+}
+
+/* Double the delay before the next attempt, up to RetryTimeout */
+static void fcgi_backend_failed(struct fcgi_backend *backend)
+{
+    uint64_t max;
+
+    max = (uint64_t) backend->server->retry_timeout * 1000;
+    if (max == 0) {
+        return;
+    }
+
+    if (backend->retry_delay == 0) {
+        backend->retry_delay = FCGI_RETRY_MIN_MSEC;
+    }
+    else {
+        backend->retry_delay *= 2;
+    }
+
+    if (backend->retry_delay > max) {
+        backend->retry_delay = max;
+    }
+
+    backend->retry_at = mk_api->time_msec() + backend->retry_delay;
+    mk_warn("[fastcgi] server %s unavailable, retry in %lu ms",
+            backend->server->name, backend->retry_delay);
+}
+
+/*
+ * A healthy idle connection has nothing to read: the server answered
+ * everything we asked for. A closed or reset socket reads as EOF or
+ * error and unsolicited data means the record stream is out of sync.
+ */
+static int fcgi_pool_alive(int fd)
+{
+    int n;
+    char c;
+
+    n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/* Register the events the connection is waiting for */
+static int fcgi_conn_events(struct fcgi_conn *conn)
+{
+    int ret;
+    uint32_t mask;
+
+    if (conn->connected == MK_FALSE) {
+        mask = MK_EVENT_WRITE;
+    }
+    else {
+        mask = MK_EVENT_READ;
+        if (mk_channel_is_empty(&conn->channel) != 0) {
+            mask |= MK_EVENT_WRITE;
+        }
+    }
+
+    if (conn->event.mask == mask) {
+        return 0;
+    }
+
+    ret = mk_api->ev_add(mk_api->sched_loop(), conn->fd,
+                         MK_EVENT_CUSTOM, mask, conn);
+    return ret;
+}
+
+/*
+ * Close the connection: the requests still attached are failed, the ones
+ * that did not send anything yet may go to another server.
+ */
+static void fcgi_conn_close(struct fcgi_conn *conn, int retry)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_stream *stream;
+    struct fcgi_handler *handler;
+    struct fcgi_backend *backend = conn->backend;
+
+    if (conn->fd == -1) {
+        return;
+    }
+
+    MK_TRACE("[fastcgi=%i] closing connection", conn->fd);
+
+    mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+    close(conn->fd);
+    conn->fd = -1;
+
+    mk_list_del(&conn->_head);
+    if (conn->idle == MK_TRUE) {
+        backend->idle--;
+    }
+
+    /* Streams are owned by the handlers and the slots */
+    mk_list_foreach_safe(head, tmp, &conn->channel.streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        mk_stream_unlink(stream);
+    }
+
+    for (i = 0; i < backend->server->multiplex; i++) {
+        handler = conn->slots[i].handler;
+        conn->slots[i].handler = NULL;
+        conn->slots[i].aborted = MK_FALSE;
+        if (!handler) {
+            continue;
+        }
+
+        backend->outstanding--;
+        handler->conn = NULL;
+        handler->stream_busy = MK_FALSE;
+        fcgi_handler_fail(handler,
+                          retry == MK_TRUE && handler->sent == MK_FALSE);
+    }
+    conn->requests = 0;
+
+    fcgi_buffer_release(conn->buf);
+    conn->buf = NULL;
+
+    mk_api->sched_event_free(&conn->event);
+}
+
+/* Close the idle connections not used for PoolTimeout seconds */
+static void fcgi_backend_expire(struct fcgi_backend *backend, uint64_t now)
+{
+    uint64_t timeout;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct fcgi_conn *conn;
+
+    timeout = (uint64_t) backend->server->pool_timeout * 1000;
+    mk_list_foreach_safe(head, tmp, &backend->conns) {
+        conn = mk_list_entry(head, struct fcgi_conn, _head);
+        if (conn->idle == MK_TRUE && now - conn->idle_since >= timeout) {
+            MK_TRACE("[fastcgi=%i] idle connection expired", conn->fd);
+            fcgi_conn_close(conn, MK_FALSE);
+        }
+    }
+}
+
+/* The last request of the connection is gone */
+static void fcgi_conn_release(struct fcgi_conn *conn)
+{
+    uint64_t now;
+    struct fcgi_backend *backend = conn->backend;
+    struct fcgi_server *server = backend->server;
+
+    now = mk_api->time_msec();
+    fcgi_backend_expire(backend, now);
+
+    if (server->keep_alive == MK_FALSE || backend->idle >= server->pool_size) {
+        fcgi_conn_close(conn, MK_FALSE);
+        return;
+    }
+
+    conn->idle = MK_TRUE;
+    conn->idle_since = now;
+    backend->idle++;
+}
+
+static struct fcgi_conn *fcgi_conn_new(struct fcgi_backend *backend)
+{
+    int fd = -1;
+    int ret;
+    struct fcgi_conn *conn;
+    struct fcgi_server *server = backend->server;
+
+    /* Request and async connection to the server */
+    if (server->addr) {
+        fd = mk_api->socket_connect(server->addr, atoi(server->port), MK_TRUE);
+    }
+    else if (server->path) {
+        fd = mk_api->socket_open(server->path, MK_TRUE);
+    }
+
+    if (fd == -1) {
+        fcgi_backend_failed(backend);
+        return NULL;
+    }
+
+    conn = mk_api->mem_alloc_z(sizeof(struct fcgi_conn) +
+                               sizeof(struct fcgi_conn_slot) *
+                               server->multiplex);
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+
+    conn->buf = fcgi_buffer_get();
+    if (!conn->buf) {
+        close(fd);
+        mk_api->mem_free(conn);
+        return NULL;
+    }
+
+    conn->fd = fd;
+    conn->connected = MK_FALSE;
+    conn->idle = MK_FALSE;
+    conn->backend = backend;
+
+    /* Prepare the channel */
+    conn->channel.type = MK_CHANNEL_SOCKET;
+    conn->channel.fd   = fd;
+    conn->channel.io   = fcgi_network;
+    mk_list_init(&conn->channel.streams);
+
+    /* Prepare the built-in event structure */
+    MK_EVENT_INIT(&conn->event, fd, conn, cb_fcgi_conn_event);
+
+    /*
+     * Let the event loop notify us when the connection is done, then
+     * the requests attached meanwhile are sent.
+     */
+    ret = fcgi_conn_events(conn);
+    if (ret == -1) {
+        close(fd);
+        fcgi_buffer_release(conn->buf);
+        mk_api->mem_free(conn);
+        return NULL;
+    }
+
+    mk_list_add(&conn->_head, &backend->conns);
+    return conn;
+}
+
+/*
+ * Pick a connection with a free request id, the busiest one first so the
+ * requests share as few connections as possible. Idle connections are
+ * checked before being reused.
+ */
+static struct fcgi_conn *fcgi_backend_conn(struct fcgi_backend *backend)
+{
+    struct mk_list *head;
+    struct fcgi_conn *conn;
+    struct fcgi_conn *best;
+
+    while (1) {
+        best = NULL;
+        mk_list_foreach(head, &backend->conns) {
+            conn = mk_list_entry(head, struct fcgi_conn, _head);
+            if (conn->requests >= backend->server->multiplex) {
+                continue;
+            }
+            if (!best || conn->requests > best->requests) {
+                best = conn;
+            }
+        }
+
+        if (!best) {
+            return fcgi_conn_new(backend);
+        }
+
+        if (best->idle == MK_FALSE || fcgi_pool_alive(best->fd) == MK_TRUE) {
+            return best;
+        }
+
+        MK_TRACE("[fastcgi=%i] stale connection", best->fd);
+        fcgi_conn_close(best, MK_FALSE);
+    }
+}
+
+/* Choose the server for a new request */
+static struct fcgi_backend *fcgi_upstream_pick(struct fcgi_upstream *up,
+                                               uint64_t now)
+{
+    int i;
+    int best = -1;
+    int total = 0;
+    struct fcgi_backend *b;
+    struct fcgi_backend *cur;
+
+    if (fcgi_conf.balance == FCGI_BALANCE_LEAST_OUTSTANDING) {
+        for (i = 0; i < up->n; i++) {
+            b = up->backends[i];
+            if (fcgi_backend_available(b, now) == MK_FALSE) {
+                continue;
+            }
+            if (best == -1) {
+                best = i;
+                continue;
+            }
+
+            /* (outstanding + 1) / weight, compared without divisions */
+            cur = up->backends[best];
+            if ((uint64_t) (b->outstanding + 1) * cur->server->weight <
+                (uint64_t) (cur->outstanding + 1) * b->server->weight) {
+                best = i;
+            }
+        }
+    }
+    else {
+        /* Smooth weighted round-robin */
+        for (i = 0; i < up->n; i++) {
+            b = up->backends[i];
+            if (fcgi_backend_available(b, now) == MK_FALSE) {
+                continue;
+            }
+            up->current[i] += b->server->weight;
+            total += b->server->weight;
+            if (best == -1 || up->current[i] > up->current[best]) {
+                best = i;
+            }
+        }
+
+        if (best != -1) {
+            up->current[best] -= total;
+        }
+    }
+
+    if (best == -1) {
+        return NULL;
+    }
+
+    return up->backends[best];
+}
+
+static struct fcgi_server *fcgi_server_get(char *name, int len)
+{
+    struct mk_list *head;
+    struct fcgi_server *server;
+
+    mk_list_foreach(head, &fcgi_conf.servers) {
+        server = mk_list_entry(head, struct fcgi_server, _head);
+        if ((int) strlen(server->name) == len &&
+            strncmp(server->name, name, len) == 0) {
+            return server;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Servers of a handler: the handler parameters are the names of the
+ * servers, all of them are used if none is given. It's resolved once
+ * per worker.
+ */
+struct fcgi_upstream *fcgi_pool_upstream(int n_params, struct mk_list *params)
+{
+    int i;
+    int size;
+    struct mk_list *head;
+    struct fcgi_server *server;
+    struct fcgi_worker *worker = fcgi_worker_local();
+    struct fcgi_upstream *up;
+    struct mk_handler_param *param;
+
+    if (!worker) {
+        return NULL;
+    }
+
+    mk_list_foreach(head, &worker->upstreams) {
+        up = mk_list_entry(head, struct fcgi_upstream, _head);
+        if (up->params == params) {
+            return up;
+        }
+    }
+
+    size = n_params > 0 ? n_params : fcgi_conf.n_servers;
+    up = mk_api->mem_alloc_z(sizeof(struct fcgi_upstream) +
+                             (sizeof(int) + sizeof(struct fcgi_backend *)) *
+                             size);
+    if (!up) {
+        return NULL;
+    }
+    up->params = params;
+    up->backends = (struct fcgi_backend **) (up + 1);
+    up->current = (int *) (up->backends + size);
+
+    if (n_params == 0) {
+        for (i = 0; i < fcgi_conf.n_servers; i++) {
+            up->backends[up->n++] = &worker->backends[i];
+        }
+    }
+    else {
+        for (i = 0; i < n_params; i++) {
+            param = mk_api->handler_param_get(i, params);
+            server = fcgi_server_get(param->p.data, param->p.len);
+            if (!server) {
+                mk_warn("[fastcgi] unknown server '%.*s' in handler",
+                        (int) param->p.len, param->p.data);
+                continue;
+            }
+            up->backends[up->n++] = &worker->backends[server->id];
+        }
+    }
+
+    mk_list_add(&up->_head, &worker->upstreams);
+    return up;
+}
+
+/*
+ * Assign a server connection and a request id to the handler. It returns
+ * zero or the HTTP status to reply with.
+ */
+int fcgi_pool_attach(struct fcgi_handler *handler)
+{
+    int i;
+    int tries;
+    uint64_t now;
+    struct fcgi_conn *conn = NULL;
+    struct fcgi_backend *backend;
+    struct fcgi_upstream *up = handler->upstream;
+
+    if (!up || up->n == 0) {
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+
+    /* A failed connect puts the server in backoff, try the next one */
+    now = mk_api->time_msec();
+    for (tries = 0; tries < up->n && !conn; tries++) {
+        backend = fcgi_upstream_pick(up, now);
+        if (!backend) {
+            return MK_SERVER_SERVICE_UNAV;
+        }
+        conn = fcgi_backend_conn(backend);
+    }
+
+    if (!conn) {
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+
+    for (i = 0; i < backend->server->multiplex; i++) {
+        if (!conn->slots[i].handler && conn->slots[i].aborted == MK_FALSE) {
+            break;
+        }
+    }
+
+    if (conn->idle == MK_TRUE) {
+        conn->idle = MK_FALSE;
+        backend->idle--;
+    }
+
+    conn->slots[i].handler = handler;
+    conn->requests++;
+    backend->outstanding++;
+
+    handler->conn = conn;
+    handler->request_id = i + 1;
+    handler->started = MK_FALSE;
+    handler->sent = MK_FALSE;
+    handler->ended = MK_FALSE;
+
+    MK_TRACE("[fastcgi=%i] %s request id=%i", conn->fd,
+             backend->server->name, handler->request_id);
+
+    /* Connected already, the request goes out now */
+    if (conn->connected == MK_TRUE && fcgi_handler_start(handler) == -1) {
+        fcgi_pool_detach(handler);
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+
+    return 0;
+}
+
+/*
+ * The handler is done with its connection. A request that did not end
+ * yet is aborted, if its data cannot be taken back from the channel the
+ * connection is not usable anymore.
+ */
+void fcgi_pool_detach(struct fcgi_handler *handler)
+{
+    int broken = MK_FALSE;
+    struct fcgi_conn *conn = handler->conn;
+    struct fcgi_backend *backend = conn->backend;
+    struct fcgi_conn_slot *slot;
+
+    slot = &conn->slots[handler->request_id - 1];
+    slot->handler = NULL;
+    handler->conn = NULL;
+    backend->outstanding--;
+
+    if (handler->stream_busy == MK_TRUE) {
+        if (handler->fcgi_stream.bytes_total == handler->stream_bytes) {
+            mk_stream_unlink(&handler->fcgi_stream);
+        }
+        else {
+            handler->sent = MK_TRUE;
+            broken = MK_TRUE;
+        }
+        handler->stream_busy = MK_FALSE;
+    }
+
+    if (handler->ended == MK_FALSE && handler->sent == MK_TRUE) {
+        if (broken == MK_TRUE || backend->server->multiplex == 1) {
+            fcgi_conn_close(conn, MK_FALSE);
+            return;
+        }
+
+        /* Keep the request id until the server ends the request */
+        MK_TRACE("[fastcgi=%i] abort request id=%i",
+                 conn->fd, handler->request_id);
+        slot->aborted = MK_TRUE;
+        slot->abort.version        = FCGI_VERSION_1;
+        slot->abort.type           = FCGI_ABORT_REQUEST;
+        fcgi_encode16(&slot->abort.request_id, handler->request_id);
+        slot->abort.content_length = 0;
+        slot->abort.padding_length = 0;
+        slot->abort.reserved       = 0;
+        mk_api->stream_set(&slot->abort_stream, MK_STREAM_RAW,
+                           &conn->channel,
+                           &slot->abort, FCGI_RECORD_HEADER_SIZE,
+                           NULL, NULL, NULL, NULL);
+        fcgi_pool_flush(conn);
+        return;
+    }
+
+    conn->requests--;
+    if (conn->requests == 0) {
+        fcgi_conn_release(conn);
+    }
+}
+
+/* Data was queued on the connection channel */
+int fcgi_pool_flush(struct fcgi_conn *conn)
+{
+    if (conn->connected == MK_FALSE) {
+        return 0;
+    }
+
+    return fcgi_conn_events(conn);
+}
+
+static int fcgi_conn_connected(struct fcgi_conn *conn)
+{
+    int i;
+    int ret;
+    int s_err;
+    socklen_t s_len = sizeof(s_err);
+    struct fcgi_backend *backend = conn->backend;
+    struct fcgi_handler *handler;
+
+    /* We connect in async mode, we need to check if the connection was OK */
+    ret = getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &s_err, &s_len);
+    if (ret == -1 || s_err) {
+        /* FastCGI server unavailable */
+        fcgi_backend_failed(backend);
+        fcgi_conn_close(conn, MK_TRUE);
+        return -1;
+    }
+
+    conn->connected = MK_TRUE;
+    backend->retry_delay = 0;
+
+    for (i = 0; i < backend->server->multiplex; i++) {
+        handler = conn->slots[i].handler;
+        if (handler && handler->started == MK_FALSE &&
+            fcgi_handler_start(handler) == -1) {
+            fcgi_pool_detach(handler);
+            fcgi_handler_fail(handler, MK_FALSE);
+        }
+    }
+
+    if (conn->fd == -1) {
+        return -1;
+    }
+
+    if (fcgi_pool_flush(conn) == -1) {
+        fcgi_conn_close(conn, MK_FALSE);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int fcgi_conn_write(struct fcgi_conn *conn)
+{
+    int i;
+    int ret;
+    size_t count = 0;
+    struct fcgi_handler *handler;
+
+    ret = mk_api->channel_write(&conn->channel, &count);
+
+    MK_TRACE("[fastcgi=%i] %lu bytes, ret=%i", conn->fd, count, ret);
+
+    if (ret == MK_CHANNEL_ERROR) {
+        fcgi_conn_close(conn, MK_TRUE);
+        return -1;
+    }
+
+    /* Continue the requests whose data was sent */
+    if (conn->flushed == MK_TRUE) {
+        conn->flushed = MK_FALSE;
+        for (i = 0; i < conn->backend->server->multiplex; i++) {
+            handler = conn->slots[i].handler;
+            if (handler && handler->flushed == MK_TRUE) {
+                handler->flushed = MK_FALSE;
+                fcgi_handler_flushed(handler);
+            }
+        }
+    }
+
+    if (conn->fd == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read the records available and hand them to their handlers */
+static int fcgi_conn_read(struct fcgi_conn *conn)
+{
+    int n;
+    size_t size;
+    size_t left;
+    size_t offset = 0;
+    struct fcgi_buffer *buf;
+    struct fcgi_record_header header;
+    struct fcgi_conn_slot *slot;
+
+    n = read(conn->fd, conn->buf->data + conn->buf_len,
+             FCGI_CONN_BUF_SIZE - conn->buf_len);
+    MK_TRACE("[fastcgi=%i] read()=%i", conn->fd, n);
+    if (n == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    else if (n <= 0) {
+        fcgi_conn_close(conn, MK_TRUE);
+        return -1;
+    }
+    conn->buf_len += n;
+
+    while (conn->buf_len - offset >= FCGI_RECORD_HEADER_SIZE) {
+        fcgi_read_header(conn->buf->data + offset, &header);
+
+        /* Check if the record is complete */
+        size = FCGI_RECORD_HEADER_SIZE +
+            header.content_length + header.padding_length;
+        if (conn->buf_len - offset < size) {
+            break;
+        }
+
+        if (header.type != FCGI_STDOUT && header.type != FCGI_STDERR &&
+            header.type != FCGI_END_REQUEST) {
+            /* Management records use the request id zero */
+            if (header.request_id != 0) {
+                fcgi_conn_close(conn, MK_FALSE);
+                return -1;
+            }
+            offset += size;
+            continue;
+        }
+
+        /* Request records must belong to one of our slots */
+        if (header.request_id == 0 ||
+            header.request_id > conn->backend->server->multiplex) {
+            fcgi_conn_close(conn, MK_FALSE);
+            return -1;
+        }
+
+        slot = &conn->slots[header.request_id - 1];
+        if (slot->aborted == MK_TRUE) {
+            if (header.type == FCGI_END_REQUEST) {
+                /* Ended before reading the abort, take it back */
+                if (slot->abort_stream.bytes_total > 0) {
+                    if (slot->abort_stream.bytes_total <
+                        FCGI_RECORD_HEADER_SIZE) {
+                        fcgi_conn_close(conn, MK_FALSE);
+                        return -1;
+                    }
+                    mk_stream_unlink(&slot->abort_stream);
+                }
+                slot->aborted = MK_FALSE;
+                conn->requests--;
+                if (conn->requests == 0) {
+                    fcgi_conn_release(conn);
+                }
+            }
+        }
+        else if (slot->handler) {
+            fcgi_handler_record(slot->handler, header.type, conn->buf,
+                                conn->buf->data + offset +
+                                FCGI_RECORD_HEADER_SIZE,
+                                header.content_length);
+        }
+
+        if (conn->fd == -1) {
+            return -1;
+        }
+        offset += size;
+    }
+
+    if (offset > 0) {
+        left = conn->buf_len - offset;
+
+        /* Client streams reference the records, keep the partial one aside */
+        if (conn->buf->refs > 1) {
+            buf = fcgi_buffer_get();
+            if (!buf) {
+                fcgi_conn_close(conn, MK_FALSE);
+                return -1;
+            }
+            memcpy(buf->data, conn->buf->data + offset, left);
+            fcgi_buffer_release(conn->buf);
+            conn->buf = buf;
+        }
+        else {
+            memmove(conn->buf->data, conn->buf->data + offset, left);
+        }
+        conn->buf_len = left;
+    }
+
+    /* Nothing should come once every request ended */
+    if (conn->requests == 0 && conn->buf_len > 0) {
+        fcgi_conn_close(conn, MK_FALSE);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cb_fcgi_conn_event(void *data)
+{
+    struct fcgi_conn *conn = data;
+
+    if (conn->connected == MK_FALSE) {
+        return fcgi_conn_connected(conn);
+    }
+
+    if (mk_channel_is_empty(&conn->channel) != 0) {
+        if (fcgi_conn_write(conn) == -1) {
+            return -1;
+        }
+    }
+
+    if (fcgi_conn_read(conn) == -1) {
+        return -1;
+    }
+
+    if (fcgi_pool_flush(conn) == -1) {
+        fcgi_conn_close(conn, MK_FALSE);
+        return -1;
+    }
+
+    return 0;
+}
+
+int fcgi_pool_init()
+{
+    return pthread_key_create(&fcgi_worker_key, NULL);
+}
+
+int fcgi_pool_worker_init()
+{
+    int i = 0;
+    struct mk_list *head;
+    struct mk_plugin *pio;
+    struct fcgi_server *server;
+    struct fcgi_worker *worker;
+
+    /* Backend connections use the plain network layer */
+    pio = mk_api->plugin_cap(MK_CAP_SOCK_PLAIN, mk_api->config);
+    if (!pio || !pio->network) {
+        mk_warn("[fastcgi] no plain socket plugin loaded");
+        return -1;
+    }
+    fcgi_network = pio->network;
+
+    worker = mk_api->mem_alloc_z(sizeof(struct fcgi_worker));
+    if (!worker) {
+        return -1;
+    }
+
+    worker->backends = mk_api->mem_alloc_z(sizeof(struct fcgi_backend) *
+                                           fcgi_conf.n_servers);
+    if (!worker->backends) {
+        mk_api->mem_free(worker);
+        return -1;
+    }
+
+    mk_list_foreach(head, &fcgi_conf.servers) {
+        server = mk_list_entry(head, struct fcgi_server, _head);
+        worker->backends[i].server = server;
+        mk_list_init(&worker->backends[i].conns);
+        i++;
+    }
+    mk_list_init(&worker->upstreams);
+    mk_list_init(&worker->buffers);
+
+    pthread_setspecific(fcgi_worker_key, worker);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FASTCGI_POOL_H
+#define MK_FASTCGI_POOL_H
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+
+#define FCGI_WEIGHT_DEFAULT         1
+#define FCGI_MULTIPLEX_MAX          256  /* request ids per connection   */
+#define FCGI_POOL_SIZE_DEFAULT      16   /* idle connections per worker  */
+#define FCGI_POOL_TIMEOUT_DEFAULT   30   /* seconds a connection may idle */
+#define FCGI_RETRY_MAX_DEFAULT      5    /* max seconds between retries  */
+#define FCGI_RETRY_MIN_MSEC         100  /* first connect retry delay    */
+
+/* Largest record: header, content and padding */
+#define FCGI_CONN_BUF_SIZE  (FCGI_RECORD_HEADER_SIZE + FCGI_RECORD_MAX_SIZE + 255)
+
+#define FCGI_BUFFER_POOL    8    /* idle receive buffers per worker  */
+#define FCGI_ZEROCOPY_MIN   MK_STREAM_SEGMENT_SIZE  /* smaller bodies are copied */
+
+/*
+ * Records are read into reference counted buffers. Response bodies of
+ * FCGI_ZEROCOPY_MIN bytes or more are linked to the client channel from
+ * the buffer itself, the connection moves to another buffer while the
+ * client streams still reference the previous one.
+ */
+struct fcgi_buffer {
+    int refs;
+    struct mk_list _head;           /* link to the worker pool */
+    char data[FCGI_CONN_BUF_SIZE];
+};
+
+/* A request id of a connection */
+struct fcgi_conn_slot {
+    struct fcgi_handler *handler;   /* request owner                    */
+    int aborted;                    /* aborted, waiting FCGI_END_REQUEST */
+
+    /* FCGI_ABORT_REQUEST record */
+    struct fcgi_record_header abort;
+    struct mk_stream abort_stream;
+};
+
+/*
+ * A connection to a FastCGI server. Requests of different handlers are
+ * written to the same channel as whole records and the records received
+ * are dispatched by their request id.
+ */
+struct fcgi_conn {
+    struct mk_event event;          /* built-in event-loop data */
+
+    int fd;
+    int connected;                  /* connect(2) completed ?          */
+    int idle;                       /* counted as idle by the backend ? */
+    int requests;                   /* request ids in use              */
+    int flushed;                    /* handler streams were consumed   */
+    uint64_t idle_since;            /* msec, worker clock              */
+    struct fcgi_backend *backend;
+
+    /* Records received */
+    unsigned int buf_len;
+    struct fcgi_buffer *buf;
+
+    /* Channel to stream the requests to the server */
+    struct mk_channel channel;
+
+    struct mk_list _head;
+    struct fcgi_conn_slot slots[];  /* request id = index + 1 */
+};
+
+/* Per worker state of a server */
+struct fcgi_backend {
+    struct fcgi_server *server;
+    int outstanding;                /* requests in flight              */
+    int idle;                       /* connections with no request     */
+    uint64_t retry_at;              /* no new connections before (msec) */
+    uint64_t retry_delay;           /* current backoff delay (msec)    */
+    struct mk_list conns;
+};
+
+/* The servers of a handler, taken from the handler parameters */
+struct fcgi_upstream {
+    struct mk_list *params;
+    int n;
+    int *current;                   /* weighted round-robin state      */
+    struct fcgi_backend **backends;
+    struct mk_list _head;
+};
+
+struct fcgi_worker {
+    struct fcgi_backend *backends;  /* one per server */
+    struct mk_list upstreams;
+
+    /* Idle receive buffers */
+    int n_buffers;
+    struct mk_list buffers;
+};
+
+int fcgi_pool_init();
+int fcgi_pool_worker_init();
+struct fcgi_upstream *fcgi_pool_upstream(int n_params, struct mk_list *params);
+int fcgi_pool_attach(struct fcgi_handler *handler);
+void fcgi_pool_detach(struct fcgi_handler *handler);
+int fcgi_pool_flush(struct fcgi_conn *conn);
+void fcgi_buffer_release(struct fcgi_buffer *buf);
+
+#endif
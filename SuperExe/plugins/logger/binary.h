@@ -0,0 +1,66 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Binary log format
+ * -----------------
+ * With 'Format binary' the workers send a fixed size record per request
+ * instead of a formatted line, the text is produced later by mklogcat. A
+ * log file starts with a header, followed by the name of each virtual
+ * host and then the records. Integers are written in host byte order.
+ */
+#ifndef MK_LOGGER_BINARY_H
+#define MK_LOGGER_BINARY_H
+
+#include <stdint.h>
+
+#define MK_LOGGER_BIN_MAGIC  "MKLOGv1"
+
+struct mk_logger_bin_header
+{
+    char     magic[8];
+    uint64_t wall_ms;           /* wall clock when the file was created */
+    uint64_t mono_ms;           /* monotonic clock at the same moment   */
+    uint32_t hosts;             /* number of host names that follow     */
+    uint32_t reserved;
+};
+
+/* Each host name is stored as a length followed by the characters */
+struct mk_logger_bin_host
+{
+    uint16_t len;
+};
+
+struct mk_logger_bin_record
+{
+    uint32_t size;              /* record size, method and URI included */
+    uint16_t status;
+    uint16_t host;              /* virtual host id                      */
+    uint64_t mono_ms;           /* request arrival, monotonic clock     */
+    uint64_t bytes;             /* response body length                 */
+    uint32_t latency_ms;
+    uint16_t method_len;
+    uint16_t uri_len;
+    uint16_t port;              /* remote port, network byte order      */
+    uint8_t  family;            /* AF_INET or AF_INET6                  */
+    uint8_t  protocol;          /* 10: HTTP/1.0, 11: HTTP/1.1           */
+    uint8_t  addr[16];          /* remote address, network byte order   */
+};
+
+#endif
@@ -23,13 +23,16 @@
 
 /* System Headers */
 #include <time.h>
-#include <sys/ioctl.h>
+#include <signal.h>
+#include <limits.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 /* Local Headers */
 #include "logger.h"
 #include "pointers.h"
+#include "binary.h"
 
 struct status_response {
     int   i_status;
@@ -53,6 +56,21 @@ static struct status_response response_codes[] = {
     {505, "505"},
 };
 
+/* Flush timer and reopen signal of the logger loop */
+static struct mk_event mk_logger_timer;
+static struct mk_event mk_logger_signal;
+static int mk_logger_signal_fd = -1;
+
+/* Worker rings, the notification pipe wakes up the logger */
+static struct mk_list mk_logger_rings;
+static pthread_mutex_t mk_logger_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mk_event mk_logger_ring_event;
+static int mk_logger_ring_notify[2] = {-1, -1};
+
+/* Header of binary log files, clocks are set when a file is created */
+static char *mk_logger_bin_head;
+static size_t mk_logger_bin_head_len;
+
 static struct log_target *mk_logger_match_by_host(struct host *host, int is_ok)
 {
     struct mk_list *head;
@@ -73,80 +91,345 @@ static struct iov *mk_logger_get_cache()
     return pthread_getspecific(cache_iov);
 }
 
-static ssize_t _mk_logger_append(int pipe_fd_in,
-        int file_fd_out,
-        size_t bytes)
+/* Write the header of a new binary log file */
+static int mk_logger_bin_header_write(int fd)
 {
     ssize_t ret;
-#ifdef HAVE_SPLICE
-    ret = splice(pipe_fd_in, NULL, file_fd_out,
-            NULL, bytes, SPLICE_F_MOVE);
-    return ret;
-#else
-    unsigned char buffer[4096];
-    ssize_t buffer_used;
-    size_t bytes_written = 0;
-
-    while (bytes_written < bytes) {
-        ret = read(pipe_fd_in, buffer, sizeof(buffer));
-        if (ret < 0) {
-            break;
+    struct timespec ts;
+    struct mk_logger_bin_header *header;
+
+    header = (struct mk_logger_bin_header *) mk_logger_bin_head;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->wall_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    header->mono_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    ret = write(fd, mk_logger_bin_head, mk_logger_bin_head_len);
+    if (ret != (ssize_t) mk_logger_bin_head_len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Open the log file of a target, it stays open until it's rotated */
+static int mk_logger_open(struct log_target *entry)
+{
+    struct stat st;
+
+    entry->fd = open(entry->file,
+                     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (mk_unlikely(entry->fd == -1)) {
+        mk_warn("Could not open logfile '%s' (%s)", entry->file, strerror(errno));
+        return -1;
+    }
+
+    entry->size = 0;
+    if (fstat(entry->fd, &st) == 0) {
+        entry->size = st.st_size;
+    }
+
+    if (mk_logger_format == MK_LOGGER_FORMAT_BINARY && entry->size == 0) {
+        if (mk_logger_bin_header_write(entry->fd) == -1) {
+            mk_warn("Could not write header of logfile '%s'", entry->file);
         }
-        buffer_used = ret;
-        ret = write(file_fd_out, buffer, buffer_used);
-        if (ret < 0) {
+        entry->size = mk_logger_bin_head_len;
+    }
+
+    return 0;
+}
+
+static void mk_logger_close(struct log_target *entry)
+{
+    if (entry->fd != -1) {
+        close(entry->fd);
+        entry->fd = -1;
+    }
+}
+
+/*
+ * Move the current log file to 'file.YYYYMMDD-HHMMSS', a new one is
+ * created on the next flush.
+ */
+static void mk_logger_rotate(struct log_target *entry)
+{
+    time_t now;
+    char stamp[32];
+    char *path = NULL;
+    unsigned long len;
+    struct tm result;
+
+    now = mk_api->time_unix();
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S",
+             localtime_r(&now, &result));
+
+    mk_api->str_build(&path, &len, "%s.%s", entry->file, stamp);
+    if (rename(entry->file, path) == -1) {
+        mk_warn("Could not rotate logfile '%s' (%s)", entry->file, strerror(errno));
+    }
+    mk_api->mem_free(path);
+
+    mk_logger_close(entry);
+}
+
+/* Write the buffered entries of a target to its log file */
+static void mk_logger_flush(struct log_target *entry)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    if (entry->len == 0) {
+        return;
+    }
+
+    /* If the file cannot be opened the entries are discarded */
+    if (entry->fd == -1 && mk_logger_open(entry) == -1) {
+        entry->len = 0;
+        return;
+    }
+
+    while (off < entry->len) {
+        ret = write(entry->fd, entry->buf + off, entry->len - off);
+        if (mk_unlikely(ret == -1)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            mk_warn("Could not write to log file '%s' (%s)",
+                    entry->file, strerror(errno));
             break;
         }
-        bytes_written += ret;
+        off += ret;
+    }
+
+    MK_TRACE("written %lu bytes", off);
+    entry->size += off;
+    entry->len = 0;
+
+    if (mk_logger_rotate_size > 0 && entry->size >= mk_logger_rotate_size) {
+        mk_logger_rotate(entry);
     }
-    if (ret < 0 && bytes_written == 0)
+}
+
+static void mk_logger_flush_all(int reopen)
+{
+    struct mk_list *head;
+    struct log_target *entry;
+
+    mk_list_foreach(head, &targets_list) {
+        entry = mk_list_entry(head, struct log_target, _head);
+        mk_logger_flush(entry);
+        if (reopen == MK_TRUE) {
+            mk_logger_close(entry);
+        }
+    }
+}
+
+/* Move the entries written by the workers to the target buffer */
+static void mk_logger_read(struct log_target *entry)
+{
+    ssize_t bytes;
+
+    bytes = read(entry->pipe[0],
+                 entry->buf + entry->len,
+                 MK_LOGGER_BUFFER_SIZE - entry->len);
+    if (bytes <= 0) {
+        return;
+    }
+
+    entry->len += bytes;
+    if (entry->len >= MK_LOGGER_BUFFER_SIZE * MK_LOGGER_BUFFER_LIMIT) {
+        mk_logger_flush(entry);
+    }
+}
+
+/*
+ * Worker rings
+ * ------------
+ * When RingSize is set, each worker copies its log entries into its own
+ * ring buffer instead of writing them to the target pipes. A worker is
+ * the only producer of its ring and the logger thread the only consumer,
+ * so the positions are plain counters published with release/acquire
+ * semantics. A full ring never blocks the worker: the entry is dropped
+ * and counted.
+ */
+static void mk_logger_ring_copy_in(struct log_ring *ring, uint64_t pos,
+                                   const void *data, size_t len)
+{
+    size_t off = pos & (ring->size - 1);
+    size_t n = ring->size - off;
+
+    if (n > len) {
+        n = len;
+    }
+    memcpy(ring->buf + off, data, n);
+    memcpy(ring->buf, (const char *) data + n, len - n);
+}
+
+static void mk_logger_ring_copy_out(struct log_ring *ring, uint64_t pos,
+                                    void *data, size_t len)
+{
+    size_t off = pos & (ring->size - 1);
+    size_t n = ring->size - off;
+
+    if (n > len) {
+        n = len;
+    }
+    memcpy(data, ring->buf + off, n);
+    memcpy((char *) data + n, ring->buf, len - n);
+}
+
+static int mk_logger_ring_write(struct log_target *target, struct mk_iov *iov)
+{
+    int i;
+    ssize_t ret;
+    size_t need;
+    uint64_t head;
+    uint64_t used;
+    struct log_ring *ring;
+    struct log_record rec;
+
+    ring = pthread_getspecific(cache_ring);
+
+    rec.target = target;
+    rec.len = iov->total_len;
+    need = sizeof(rec) + rec.len;
+
+    head = ring->head;
+    used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (mk_unlikely(used + need > ring->size)) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
         return -1;
-    else
-        return bytes_written;
-#endif
+    }
+
+    mk_logger_ring_copy_in(ring, head, &rec, sizeof(rec));
+    head += sizeof(rec);
+    for (i = 0; i < iov->iov_idx; i++) {
+        mk_logger_ring_copy_in(ring, head,
+                               iov->io[i].iov_base, iov->io[i].iov_len);
+        head += iov->io[i].iov_len;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+    /* Wake up the logger once the ring gets half full */
+    if (used < ring->size / 2 && used + need >= ring->size / 2) {
+        ret = write(mk_logger_ring_notify[1], "", 1);
+        (void) ret;
+    }
+
+    return 0;
+}
+
+/* Copy an entry from the ring to the target buffer */
+static void mk_logger_ring_append(struct log_target *target,
+                                  struct log_ring *ring,
+                                  uint64_t pos, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+        n = MK_LOGGER_BUFFER_SIZE - target->len;
+        if (n > len) {
+            n = len;
+        }
+        mk_logger_ring_copy_out(ring, pos, target->buf + target->len, n);
+        target->len += n;
+        pos += n;
+        len -= n;
+
+        if (target->len == MK_LOGGER_BUFFER_SIZE) {
+            mk_logger_flush(target);
+        }
+    }
+}
+
+static void mk_logger_ring_drain(struct log_ring *ring)
+{
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    struct log_record rec;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+
+    while (tail < head) {
+        mk_logger_ring_copy_out(ring, tail, &rec, sizeof(rec));
+        tail += sizeof(rec);
+        mk_logger_ring_append(rec.target, ring, tail, rec.len);
+        tail += rec.len;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+        mk_warn("[logger] worker ring is full, %lu entries dropped",
+                (unsigned long) (dropped - ring->reported));
+        ring->reported = dropped;
+    }
+}
+
+static void mk_logger_ring_drain_all()
+{
+    struct mk_list *head;
+    struct log_ring *ring;
+    struct log_target *entry;
+
+    pthread_mutex_lock(&mk_logger_rings_mutex);
+    mk_list_foreach(head, &mk_logger_rings) {
+        ring = mk_list_entry(head, struct log_ring, _head);
+        mk_logger_ring_drain(ring);
+    }
+    pthread_mutex_unlock(&mk_logger_rings_mutex);
+
+    mk_list_foreach(head, &targets_list) {
+        entry = mk_list_entry(head, struct log_target, _head);
+        if (entry->len >= MK_LOGGER_BUFFER_SIZE * MK_LOGGER_BUFFER_LIMIT) {
+            mk_logger_flush(entry);
+        }
+    }
+}
+
+/* Send an entry to the logger thread */
+static void mk_logger_write(struct log_target *target, struct mk_iov *iov)
+{
+    if (mk_logger_ring_size > 0) {
+        mk_logger_ring_write(target, iov);
+    }
+    else {
+        mk_api->iov_send(target->pipe[1], iov);
+    }
+}
+
+/*
+ * SIGUSR1 asks the logger to reopen the log files (e.g: after they were
+ * moved by an external tool). The handler just wakes up the logger loop.
+ */
+static void mk_logger_signal_handler(int signo)
+{
+    uint64_t val = signo;
+    ssize_t ret;
+
+    ret = write(mk_logger_signal_fd, &val, sizeof(val));
+    (void) ret;
 }
 
 static void mk_logger_start_worker(void *args)
 {
-    int fd;
-    int bytes, err;
-    int max_events = mk_api->config->nhosts;
-    int flog;
-    int clk;
-    long slen;
-    int timeout;
-    char *target;
+    int ret;
+    int max_events = (mk_api->config->nhosts * 2) + 2;
+    int signal_r;
+    uint64_t val;
+    char notify[64];
     (void) args;
     struct mk_list *head;
     struct log_target *entry;
     struct mk_event *event;
     struct mk_event_loop *evl;
-
-    /* pipe_size:
-     * ----------
-     * Linux set a pipe size usingto the PAGE_SIZE,
-     * check linux/include/pipe_fs_i.h for details:
-     *
-     *       #define PIPE_SIZE               PAGE_SIZE
-     *
-     * In the same header file we can found that every
-     * pipe has 16 pages, so our real memory allocation
-     * is: (PAGE_SIZE*PIPE_BUFFERS)
-     */
-    long pipe_size;
-
-    /* buffer_limit:
-     * -------------
-     * it means the maximum data that a monkey log pipe can contain.
-     */
-    long buffer_limit;
+    struct sigaction act;
 
     mk_api->worker_rename("monkey: logger");
 
-    /* Monkey allow just 75% of a pipe capacity */
-    pipe_size = sysconf(_SC_PAGESIZE) * 16;
-    buffer_limit = (pipe_size * MK_LOGGER_PIPE_LIMIT);
-
     /* Creating poll */
     evl = mk_api->ev_loop_create(max_events);
 
@@ -167,63 +450,58 @@ static void mk_logger_start_worker(void *args)
         }
     }
 
-    /* Set initial timeout */
-    timeout = time(NULL) + mk_logger_timeout;
-
-    /* Reading pipe buffer */
-    while (1) {
-        usleep(1200);
+    /* Buffered entries are written at least every FlushTimeout seconds */
+    mk_logger_timer.mask = MK_EVENT_EMPTY;
+    ret = mk_api->ev_timeout_create(evl, mk_logger_timeout, &mk_logger_timer);
+    if (ret == -1) {
+        mk_err("[logger] could not create flush timer");
+        exit(EXIT_FAILURE);
+    }
 
-        /* wait for events */
-        mk_api->ev_wait(evl);
+    /* Worker rings */
+    if (mk_logger_ring_size > 0) {
+        mk_logger_ring_event.mask = MK_EVENT_EMPTY;
+        mk_logger_ring_event.status = MK_EVENT_NONE;
+        mk_api->ev_add(evl, mk_logger_ring_notify[0],
+                       MK_EVENT_NOTIFICATION, MK_EVENT_READ,
+                       &mk_logger_ring_event);
+    }
 
-        /* get current time */
-        clk = mk_api->time_unix();
+    /* Reopen request */
+    mk_logger_signal.mask = MK_EVENT_EMPTY;
+    ret = mk_api->ev_channel_create(evl, &signal_r, &mk_logger_signal_fd,
+                                    &mk_logger_signal);
+    if (ret == 0) {
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = mk_logger_signal_handler;
+        act.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &act, NULL);
+    }
 
-        /* translate the backend events triggered */
+    while (1) {
+        mk_api->ev_wait(evl);
         mk_event_foreach(event, evl) {
-            entry = (struct log_target *) event;
-            target = entry->file;
-            fd = entry->pipe[0];
-
-            err = ioctl(fd, FIONREAD, &bytes);
-            if (mk_unlikely(err == -1)){
-                perror("ioctl");
-            }
-
-            if (bytes < buffer_limit && clk <= timeout) {
+            if (event == &mk_logger_timer) {
+                ret = read(event->fd, &val, sizeof(val));
+                mk_logger_ring_drain_all();
+                mk_logger_flush_all(MK_FALSE);
                 continue;
             }
-
-            timeout = clk + mk_logger_timeout;
-
-            flog = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
-            if (mk_unlikely(flog == -1)) {
-                mk_warn("Could not open logfile '%s' (%s)", target, strerror(errno));
-
-                int consumed = 0;
-                char buf[255];
-                do {
-                    slen = read(fd, buf, 255);
-                    if (slen > 0) {
-                        consumed += slen;
-                    }
-                    else {
-                        break;
-                    }
-                } while (consumed < bytes);
-
+            else if (event == &mk_logger_signal) {
+                ret = read(event->fd, &val, sizeof(val));
+                MK_TRACE("reopen log files");
+                mk_logger_ring_drain_all();
+                mk_logger_flush_all(MK_TRUE);
                 continue;
             }
-
-            lseek(flog, 0, SEEK_END);
-            slen = _mk_logger_append(fd, flog, bytes);
-            if (mk_unlikely(slen == -1)) {
-                mk_warn("Could not write to log file: splice() = %ld", slen);
+            else if (event == &mk_logger_ring_event) {
+                ret = read(event->fd, notify, sizeof(notify));
+                mk_logger_ring_drain_all();
+                continue;
             }
 
-            MK_TRACE("written %i bytes", bytes);
-            close(flog);
+            entry = (struct log_target *) event;
+            mk_logger_read(entry);
         }
     }
 }
@@ -231,6 +509,9 @@ static void mk_logger_start_worker(void *args)
 static int mk_logger_read_config(char *path)
 {
     int timeout;
+    int rotate;
+    int ring;
+    char *format;
     char *logfilename = NULL;
     unsigned long len;
     char *default_file = NULL;
@@ -268,6 +549,48 @@ static int mk_logger_read_config(char *path)
 
         mk_logger_master_path = logfilename;
         MK_TRACE("MasterLog '%s'", mk_logger_master_path);
+
+        /* RotateSize */
+        rotate = (size_t) mk_api->config_section_get_key(section,
+                                                         "RotateSize",
+                                                         MK_RCONF_NUM);
+        if (rotate < 0) {
+            mk_err("RotateSize does not have a proper value");
+            exit(EXIT_FAILURE);
+        }
+        mk_logger_rotate_size = (off_t) rotate * 1024 * 1024;
+        MK_TRACE("RotateSize %i MB", rotate);
+
+        /* RingSize */
+        ring = (size_t) mk_api->config_section_get_key(section,
+                                                       "RingSize",
+                                                       MK_RCONF_NUM);
+        if (ring < 0) {
+            mk_err("RingSize does not have a proper value");
+            exit(EXIT_FAILURE);
+        }
+        if (ring > 0) {
+            /* Round up to a power of two */
+            mk_logger_ring_size = 4096;
+            while (mk_logger_ring_size < (size_t) ring * 1024) {
+                mk_logger_ring_size <<= 1;
+            }
+        }
+        MK_TRACE("RingSize %lu bytes", mk_logger_ring_size);
+
+        /* Format */
+        format = mk_api->config_section_get_key(section, "Format",
+                                                MK_RCONF_STR);
+        if (format) {
+            if (strcasecmp(format, "binary") == 0) {
+                mk_logger_format = MK_LOGGER_FORMAT_BINARY;
+            }
+            else if (strcasecmp(format, "text") != 0) {
+                mk_err("Format does not have a proper value");
+                exit(EXIT_FAILURE);
+            }
+            mk_api->mem_free(format);
+        }
     }
 
     mk_api->mem_free(default_file);
@@ -319,9 +642,14 @@ int mk_logger_plugin_init(struct plugin_api **api, char *confdir)
     pthread_key_create(&cache_content_length, NULL);
     pthread_key_create(&cache_status, NULL);
     pthread_key_create(&cache_ip_str, NULL);
+    pthread_key_create(&cache_ring, NULL);
 
     /* Global configuration */
     mk_logger_timeout = MK_LOGGER_TIMEOUT_DEFAULT;
+    mk_logger_rotate_size = 0;
+    mk_logger_ring_size = 0;
+    mk_logger_format = MK_LOGGER_FORMAT_TEXT;
+    mk_list_init(&mk_logger_rings);
     mk_logger_master_path = NULL;
     mk_logger_read_config(confdir);
 
@@ -346,21 +674,83 @@ int mk_logger_plugin_exit()
 {
     struct mk_list *head, *tmp;
     struct log_target *entry;
+    struct log_ring *ring;
 
     mk_list_foreach_safe(head, tmp, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
         mk_list_del(&entry->_head);
         if (entry->pipe[0] > 0) close(entry->pipe[0]);
         if (entry->pipe[1] > 0) close(entry->pipe[1]);
+        if (entry->fd != -1) close(entry->fd);
+        mk_api->mem_free(entry->buf);
         mk_api->mem_free(entry->file);
         mk_api->mem_free(entry);
     }
 
+    mk_list_foreach_safe(head, tmp, &mk_logger_rings) {
+        ring = mk_list_entry(head, struct log_ring, _head);
+        mk_list_del(&ring->_head);
+        mk_api->mem_free(ring->buf);
+        mk_api->mem_free(ring);
+    }
+
+    if (mk_logger_ring_notify[0] != -1) {
+        close(mk_logger_ring_notify[0]);
+        close(mk_logger_ring_notify[1]);
+    }
+
+    mk_api->mem_free(mk_logger_bin_head);
     mk_api->mem_free(mk_logger_master_path);
 
     return 0;
 }
 
+/* Build the binary header: magic, clocks and the name of each host */
+static void mk_logger_bin_header_init()
+{
+    int n;
+    size_t len;
+    char *p;
+    struct mk_list *head;
+    struct host *entry_host;
+    struct host_alias *alias;
+    struct mk_logger_bin_host name;
+    struct mk_logger_bin_header *header;
+    struct host_alias **names;
+
+    n = mk_api->config->nhosts;
+    names = mk_api->mem_alloc_z(sizeof(struct host_alias *) * (n + 1));
+
+    len = sizeof(struct mk_logger_bin_header);
+    mk_list_foreach(head, &mk_api->config->hosts) {
+        entry_host = mk_list_entry(head, struct host, _head);
+        alias = mk_list_entry_first(&entry_host->server_names,
+                                    struct host_alias, _head);
+        names[entry_host->id] = alias;
+        len += sizeof(name) + alias->len;
+    }
+
+    mk_logger_bin_head = mk_api->mem_alloc_z(len);
+    mk_logger_bin_head_len = len;
+
+    header = (struct mk_logger_bin_header *) mk_logger_bin_head;
+    memcpy(header->magic, MK_LOGGER_BIN_MAGIC, sizeof(header->magic));
+    header->hosts = n;
+
+    p = mk_logger_bin_head + sizeof(struct mk_logger_bin_header);
+    for (n = 0; n < (int) header->hosts; n++) {
+        name.len = names[n] ? names[n]->len : 0;
+        memcpy(p, &name, sizeof(name));
+        p += sizeof(name);
+        if (name.len > 0) {
+            memcpy(p, names[n]->name, name.len);
+            p += name.len;
+        }
+    }
+
+    mk_api->mem_free(names);
+}
+
 int mk_logger_master_init(struct mk_server_config *config)
 {
     (void) config;
@@ -417,6 +807,9 @@ int mk_logger_master_init(struct mk_server_config *config)
                 }
                 new->file = access_file_name;
                 new->host = entry_host;
+                new->fd   = -1;
+                new->len  = 0;
+                new->buf  = mk_api->mem_alloc(MK_LOGGER_BUFFER_SIZE);
                 mk_list_add(&new->_head, &targets_list);
             }
 
@@ -440,12 +833,36 @@ int mk_logger_master_init(struct mk_server_config *config)
                 }
                 new->file = error_file_name;
                 new->host = entry_host;
+                new->fd   = -1;
+                new->len  = 0;
+                new->buf  = mk_api->mem_alloc(MK_LOGGER_BUFFER_SIZE);
                 mk_list_add(&new->_head, &targets_list);
 
             }
         }
     }
 
+    if (mk_logger_format == MK_LOGGER_FORMAT_BINARY) {
+        mk_logger_bin_header_init();
+    }
+
+    /* Notification pipe for the worker rings */
+    if (mk_logger_ring_size > 0) {
+        if (pipe(mk_logger_ring_notify) < 0) {
+            mk_err("Could not create pipe");
+            exit(EXIT_FAILURE);
+        }
+        if (fcntl(mk_logger_ring_notify[1], F_SETFL, O_NONBLOCK) == -1) {
+            perror("fcntl");
+        }
+        if (fcntl(mk_logger_ring_notify[0], F_SETFD, FD_CLOEXEC) == -1) {
+            perror("fcntl");
+        }
+        if (fcntl(mk_logger_ring_notify[1], F_SETFD, FD_CLOEXEC) == -1) {
+            perror("fcntl");
+        }
+    }
+
     mk_api->worker_spawn((void *) mk_logger_start_worker, NULL);
     return 0;
 }
@@ -456,10 +873,22 @@ void mk_logger_worker_init()
     mk_ptr_t *content_length;
     mk_ptr_t *status;
     mk_ptr_t *ip_str;
-
+    struct log_ring *ring;
 
     MK_TRACE("Creating thread cache");
 
+    /* Log ring */
+    if (mk_logger_ring_size > 0) {
+        ring = mk_api->mem_alloc_z(sizeof(struct log_ring));
+        ring->buf  = mk_api->mem_alloc(mk_logger_ring_size);
+        ring->size = mk_logger_ring_size;
+        pthread_setspecific(cache_ring, (void *) ring);
+
+        pthread_mutex_lock(&mk_logger_rings_mutex);
+        mk_list_add(&ring->_head, &mk_logger_rings);
+        pthread_mutex_unlock(&mk_logger_rings_mutex);
+    }
+
     /* Cache iov log struct */
     iov_log = mk_api->iov_create(15, 0);
     pthread_setspecific(cache_iov, (void *) iov_log);
@@ -483,6 +912,85 @@ void mk_logger_worker_init()
     pthread_setspecific(cache_ip_str, (void *) ip_str);
 }
 
+/*
+ * Binary record: nothing is formatted on the worker, the remote address
+ * comes from accept(2) and the clocks are the ones cached by the worker.
+ */
+static int mk_logger_stage40_binary(struct mk_http_session *cs,
+                                    struct mk_http_request *sr,
+                                    struct log_target *target)
+{
+    uint64_t now;
+    struct mk_iov *iov;
+    union mk_sockaddr *peer;
+    struct mk_logger_bin_record rec;
+
+    if (!target->file) {
+        return 0;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+
+    now = mk_api->time_msec();
+    rec.status     = sr->headers.status;
+    rec.host       = sr->host_conf->id;
+    rec.mono_ms    = sr->init_msec;
+    rec.latency_ms = now - sr->init_msec;
+    rec.protocol   = sr->protocol;
+    if (sr->headers.content_length > 0) {
+        rec.bytes = sr->headers.content_length;
+    }
+    if (sr->method_p.data) {
+        rec.method_len = sr->method_p.len;
+    }
+    if (sr->uri.data) {
+        rec.uri_len = sr->uri.len > UINT16_MAX ? UINT16_MAX : sr->uri.len;
+    }
+
+    /*
+     * Without worker rings the record goes through the target pipe, which
+     * the workers share: only writes up to PIPE_BUF are atomic, so a long
+     * URI is truncated to keep records from interleaving.
+     */
+    if (mk_logger_ring_size == 0) {
+        if (rec.method_len > PIPE_BUF - sizeof(rec)) {
+            rec.method_len = PIPE_BUF - sizeof(rec);
+        }
+        if (rec.uri_len > PIPE_BUF - sizeof(rec) - rec.method_len) {
+            rec.uri_len = PIPE_BUF - sizeof(rec) - rec.method_len;
+        }
+    }
+
+    peer = &cs->conn->peer;
+    rec.family = peer->sa.sa_family;
+    if (rec.family == AF_INET) {
+        rec.port = peer->in4.sin_port;
+        memcpy(rec.addr, &peer->in4.sin_addr, sizeof(peer->in4.sin_addr));
+    }
+    else if (rec.family == AF_INET6) {
+        rec.port = peer->in6.sin6_port;
+        memcpy(rec.addr, &peer->in6.sin6_addr, sizeof(peer->in6.sin6_addr));
+    }
+
+    rec.size = sizeof(rec) + rec.method_len + rec.uri_len;
+
+    iov = (struct mk_iov *) mk_logger_get_cache();
+    iov->iov_idx = 0;
+    iov->buf_idx = 0;
+    iov->total_len = 0;
+
+    mk_api->iov_add(iov, &rec, sizeof(rec), MK_FALSE);
+    if (rec.method_len > 0) {
+        mk_api->iov_add(iov, sr->method_p.data, rec.method_len, MK_FALSE);
+    }
+    if (rec.uri_len > 0) {
+        mk_api->iov_add(iov, sr->uri.data, rec.uri_len, MK_FALSE);
+    }
+
+    mk_logger_write(target, iov);
+    return 0;
+}
+
 int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
 {
     int i, http_status, ret, tmp;
@@ -512,6 +1020,10 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
         return 0;
     }
 
+    if (mk_logger_format == MK_LOGGER_FORMAT_BINARY) {
+        return mk_logger_stage40_binary(cs, sr, target);
+    }
+
     /* Get iov cache struct and reset indexes */
     iov = (struct mk_iov *) mk_logger_get_cache();
     iov->iov_idx = 0;
@@ -642,7 +1154,7 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
         }
 
         /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+        mk_logger_write(target, iov);
     }
     else {
         if (mk_unlikely(!target->file)) {
@@ -816,7 +1328,7 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
 
 
         /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+        mk_logger_write(target, iov);
     }
 
     return 0;
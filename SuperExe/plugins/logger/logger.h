@@ -24,10 +24,19 @@
 #include <stdio.h>
 #include <monkey/mk_api.h>
 
-#define MK_LOGGER_PIPE_LIMIT 0.75
+/* Entries are written once the buffer of a target reaches the limit */
+#define MK_LOGGER_BUFFER_SIZE  65536
+#define MK_LOGGER_BUFFER_LIMIT 0.75
 #define MK_LOGGER_TIMEOUT_DEFAULT 3
 
+/* Log format */
+#define MK_LOGGER_FORMAT_TEXT   0
+#define MK_LOGGER_FORMAT_BINARY 1
+
 int mk_logger_timeout;
+off_t mk_logger_rotate_size;
+size_t mk_logger_ring_size;
+int mk_logger_format;
 
 /* MasterLog variables */
 char *mk_logger_master_path;
@@ -38,6 +47,7 @@ pthread_key_t cache_content_length;
 pthread_key_t cache_status;
 pthread_key_t cache_ip_str;
 pthread_key_t cache_iov;
+pthread_key_t cache_ring;
 
 struct log_target
 {
@@ -48,11 +58,41 @@ struct log_target
     int pipe[2];
     char *file;
 
+    /* Log file, it stays open while the logger runs */
+    int fd;
+    off_t size;
+
+    /* Entries pending to be written */
+    size_t len;
+    char *buf;
+
     struct host *host;
     struct mk_list _head;
 };
 
 struct mk_list targets_list;
 
+/* Log entries of a worker, consumed by the logger thread */
+struct log_ring
+{
+    char *buf;
+    size_t size;
+
+    uint64_t head;              /* written by the worker */
+    uint64_t tail;              /* written by the logger */
+
+    uint64_t dropped;           /* entries discarded, the ring was full */
+    uint64_t reported;
+
+    struct mk_list _head;
+};
+
+/* Header of each entry in a ring */
+struct log_record
+{
+    struct log_target *target;
+    size_t len;
+};
+
 
 #endif